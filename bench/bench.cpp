@@ -0,0 +1,355 @@
+/**
+ * Name: bench.cpp
+ * Desc: Microbenchmarks of the Modbus byte order helpers, the Modbus command
+ *       builders and checks, the sample conversion and the ways of building
+ *       and pushing LSL chunks, for 1 to 128 channels. No device is needed.
+ *       Build with -DLSLPUB_BUILD_BENCH=ON and run lslpub_bench [seconds].
+**/
+
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <lsl_cpp.h>
+
+#include "budget.h"
+#include "calibration.h"
+#include "codec.h"
+#include "latency.h"
+#include "modbus.h"
+#include "publisher.h"
+#include "stream.h"
+
+//Not in modbus.h, used by the byte order helpers.
+void correctEndian(void *data, int numBytes);
+
+//Samples in one full stream packet.
+#define BENCH_PACKET_SAMPLES STREAM_MAX_SAMPLES_PER_PACKET_TCP
+
+static const unsigned int CHANNEL_COUNTS[] = {1, 2, 4, 8, 16, 32, 64, 128};
+static const int NUM_CHANNEL_COUNTS = sizeof(CHANNEL_COUNTS)/sizeof(CHANNEL_COUNTS[0]);
+
+static double gBenchSec = 0.2; //Time spent in each benchmark
+static volatile unsigned int gSink = 0; //Keeps the results alive
+
+static unsigned char gRaw[BENCH_PACKET_SAMPLES*STREAM_BYTES_PER_SAMPLE];
+static float gVolts[BENCH_PACKET_SAMPLES + MAX_NUM_STREAM_ADDR];
+static DeviceCalibration gDevCal;
+
+typedef void (*BenchFunc)(unsigned int channels);
+
+//Runs func until gBenchSec elapsed and prints ns per item and items per
+//second. Each call of func processes itemsPerCall items.
+static void runBench(const char *name, const char *item, BenchFunc func, unsigned int channels, unsigned int itemsPerCall)
+{
+	unsigned long long start = 0;
+	unsigned long long elapsed = 0;
+	unsigned long long calls = 0;
+	unsigned long long batch = 1;
+	unsigned long long i = 0;
+	double ns = 0;
+
+	func(channels); //Warm up
+	start = monotonicNs();
+	while(elapsed < (unsigned long long)(gBenchSec*1e9))
+	{
+		for(i = 0; i < batch; i++)
+			func(channels);
+		calls += batch;
+		if(batch < 1024)
+			batch *= 2;
+		elapsed = monotonicNs() - start;
+	}
+	ns = (double)elapsed/(calls*itemsPerCall);
+	printf("%-34s %8u %12.3f ns/%-7s %14.0f %s/s\n", name, channels, ns, item, 1e9/ns, item);
+}
+
+static void fillRawPacket()
+{
+	unsigned int j = 0;
+	for(j = 0; j < BENCH_PACKET_SAMPLES; j++)
+		uint16ToBytes((unsigned short)((j*37) % 0xFFFF), &gRaw[j*STREAM_BYTES_PER_SAMPLE]);
+}
+
+/* Byte order helpers, over a full packet. */
+
+static void benchBytesToUint16(unsigned int)
+{
+	unsigned short value = 0;
+	unsigned int sum = 0;
+	unsigned int j = 0;
+	for(j = 0; j < BENCH_PACKET_SAMPLES; j++)
+	{
+		bytesToUint16(&gRaw[j*STREAM_BYTES_PER_SAMPLE], &value);
+		sum += value;
+	}
+	gSink += sum;
+}
+
+static void benchBytesToFloat(unsigned int)
+{
+	float value = 0;
+	float sum = 0;
+	unsigned int j = 0;
+	for(j = 0; j < BENCH_PACKET_SAMPLES/2; j++)
+	{
+		bytesToFloat(&gRaw[j*4], &value);
+		sum += value;
+	}
+	gSink += (unsigned int)sum;
+}
+
+//Swaps a copy in place, gRaw is the input of the other benchmarks.
+static void benchCorrectEndian(unsigned int)
+{
+	static unsigned char values[sizeof(gRaw)];
+	static int copied = 0;
+	unsigned int j = 0;
+
+	if(!copied)
+	{
+		memcpy(values, gRaw, sizeof(gRaw));
+		copied = 1;
+	}
+	for(j = 0; j < BENCH_PACKET_SAMPLES/2; j++)
+		correctEndian(&values[j*4], 4);
+	gSink += values[0];
+}
+
+/* Modbus commands and checks. */
+
+static void benchSetupReadMultRegsCom(unsigned int)
+{
+	unsigned char com[READ_MULT_REGS_COM_SIZE];
+	int resSize = 0;
+	setupReadMultRegsCom(1, 0, 4100, 2, com, &resSize);
+	gSink += com[7] + resSize;
+}
+
+static void benchSetupWriteMultRegsCom(unsigned int)
+{
+	unsigned char com[WRITE_MULT_REGS_COM_DATA_INDEX + 255];
+	int comSize = 0;
+	setupWriteMultRegsCom(1, 0, 4002, 2, gRaw, com, &comSize);
+	gSink += com[7] + comSize;
+}
+
+static void benchCheckModbusResponse(unsigned int)
+{
+	//Response to a write of 2 registers at 4002, transaction ID 1.
+	static unsigned char res[WRITE_MULT_REGS_RESP_SIZE];
+	if(res[7] == 0)
+	{
+		setModbusPacketHeader(res, 1, 6, 0);
+		res[7] = WRITE_MULT_REGS_COM_FUNCTION_CODE;
+		uint16ToBytes(4002, &res[8]);
+		uint16ToBytes(2, &res[10]);
+	}
+	gSink += checkModbusResponse(res, WRITE_MULT_REGS_RESP_SIZE, 1, WRITE_MULT_REGS_COM_FUNCTION_CODE);
+}
+
+static void benchParseStreamPacket(unsigned int)
+{
+	static unsigned char packet[STREAM_HEADER_BYTES + BENCH_PACKET_SAMPLES*STREAM_BYTES_PER_SAMPLE];
+	unsigned short backlog = 0, status = 0, additionalInfo = 0;
+
+	resetStreamTransactionID();
+	buildStreamPacket(0, 0, 0, 0, gRaw, BENCH_PACKET_SAMPLES, packet);
+	gSink += parseStreamPacket(packet, sizeof(packet), &backlog, &status, &additionalInfo);
+}
+
+/* Conversion of a full packet, gain of each channel from its scan position. */
+
+static void benchAinBinToVolts(unsigned int channels)
+{
+	static const unsigned int GAINS[4] = {0, 1, 2, 3};
+	unsigned int addr = 0;
+	unsigned int j = 0;
+	for(j = 0; j < BENCH_PACKET_SAMPLES; j++)
+	{
+		ainBinToVolts(&gDevCal, &gRaw[j*STREAM_BYTES_PER_SAMPLE], GAINS[addr & 3], &gVolts[j]);
+		if(++addr >= channels)
+			addr = 0;
+	}
+	gSink += (unsigned int)gVolts[BENCH_PACKET_SAMPLES-1];
+}
+
+/* Chunk construction and push variants. */
+
+static lsl::stream_outlet *gOutlets[MAX_NUM_STREAM_ADDR + 1];
+
+static lsl::stream_outlet *benchOutlet(unsigned int channels)
+{
+	if(gOutlets[channels] == NULL)
+	{
+		lsl::stream_info info("LabJackBench", "labJackSamples", channels, lsl::IRREGULAR_RATE, lsl::cf_float32);
+		gOutlets[channels] = new lsl::stream_outlet(info, 0, 1);
+	}
+	return gOutlets[channels];
+}
+
+//Complete scans in a packet of that many channels.
+static unsigned int packetScans(unsigned int channels)
+{
+	return BENCH_PACKET_SAMPLES/channels;
+}
+
+//The chunk of the original stream loop: one vector per scan.
+static void benchVectorChunk(unsigned int channels)
+{
+	std::vector<std::vector<float> > chunk;
+	unsigned int numScans = packetScans(channels);
+	unsigned int s = 0, c = 0;
+
+	for(s = 0; s < numScans; s++)
+	{
+		std::vector<float> scan;
+		for(c = 0; c < channels; c++)
+			scan.push_back(gVolts[s*channels + c]);
+		chunk.push_back(scan);
+	}
+	benchOutlet(channels)->push_chunk(chunk);
+}
+
+static void benchPushChunkMultiplexed(unsigned int channels)
+{
+	benchOutlet(channels)->push_chunk_multiplexed(gVolts, packetScans(channels)*channels);
+}
+
+static void benchPushSample(unsigned int channels)
+{
+	lsl::stream_outlet *outlet = benchOutlet(channels);
+	unsigned int numScans = packetScans(channels);
+	unsigned int s = 0;
+	for(s = 0; s < numScans; s++)
+		outlet->push_sample(&gVolts[s*channels]);
+}
+
+/* The whole publish path: status, conversion, scan assembly and push. */
+
+static StreamPublisher *gPublishers[MAX_NUM_STREAM_ADDR + 1];
+static unsigned short gTransID = 0;
+
+static void benchPublishPacket(unsigned int channels)
+{
+	StreamPublisher *publisher = gPublishers[channels];
+	unsigned short backlog = 0, status = 0, additionalInfo = 0;
+
+	if(publisher == NULL)
+	{
+		MemoryBudget budget;
+		unsigned int gainList[MAX_NUM_STREAM_ADDR] = {0};
+
+		publisher = new StreamPublisher();
+		if(planMemoryBudget(64ULL*1024*1024, 1000.0f, channels, BENCH_PACKET_SAMPLES, &budget) != 0 ||
+		   publisher->init(&gDevCal, 1000.0f, channels, BENCH_PACKET_SAMPLES, gainList, &budget) != 0)
+			exit(1);
+		gPublishers[channels] = publisher;
+		resetStreamTransactionID();
+		gTransID = 0;
+	}
+
+	BlockHandle packet = publisher->acquirePacket();
+	buildStreamPacket(gTransID++, 0, 0, 0, gRaw, BENCH_PACKET_SAMPLES, packet.data());
+	parseStreamPacket(packet.data(), STREAM_HEADER_BYTES + BENCH_PACKET_SAMPLES*STREAM_BYTES_PER_SAMPLE, &backlog, &status, &additionalInfo);
+	packet.setLength(STREAM_HEADER_BYTES + BENCH_PACKET_SAMPLES*STREAM_BYTES_PER_SAMPLE);
+	publisher->publishPacket(packet, backlog, status, additionalInfo);
+}
+
+/* Lossless codec of the recorder, on one chunk of raw samples. */
+
+//Scans in the codec chunk, and the raw, encoded and decoded samples.
+#define BENCH_CODEC_SCANS 4096
+static std::vector<unsigned char> gCodecRaw;
+static std::vector<unsigned char> gCodecEncoded;
+static std::vector<unsigned char> gCodecDecoded;
+static unsigned int gCodecBytes = 0;
+
+//Slow sine per channel plus a few LSB of noise, like an ADC input.
+static void fillCodecChunk(unsigned int channels)
+{
+	unsigned int scan = 0;
+	unsigned int addr = 0;
+	unsigned short value = 0;
+
+	gCodecRaw.resize(BENCH_CODEC_SCANS*channels*STREAM_BYTES_PER_SAMPLE);
+	gCodecEncoded.resize(codecMaxEncodedBytes(BENCH_CODEC_SCANS, channels));
+	gCodecDecoded.resize(gCodecRaw.size());
+	srand(channels);
+	for(scan = 0; scan < BENCH_CODEC_SCANS; scan++)
+	{
+		for(addr = 0; addr < channels; addr++)
+		{
+			value = (unsigned short)(32768 + 8000*sin(scan*0.002*(addr + 1)) + rand()%8);
+			uint16ToBytes(value, &gCodecRaw[(scan*channels + addr)*STREAM_BYTES_PER_SAMPLE]);
+		}
+	}
+	gCodecBytes = encodeSamples(&gCodecRaw[0], BENCH_CODEC_SCANS, channels, &gCodecEncoded[0]);
+}
+
+static void benchEncodeSamples(unsigned int channels)
+{
+	gSink += encodeSamples(&gCodecRaw[0], BENCH_CODEC_SCANS, channels, &gCodecEncoded[0]);
+}
+
+static void benchDecodeSamples(unsigned int channels)
+{
+	gSink += decodeSamples(&gCodecEncoded[0], gCodecBytes, BENCH_CODEC_SCANS, channels, &gCodecDecoded[0]);
+	gSink += gCodecDecoded[channels];
+}
+
+int main(int argc, const char *argv[])
+{
+	int i = 0;
+
+	if(argc > 1)
+		gBenchSec = atof(argv[1]);
+	if(gBenchSec <= 0)
+	{
+		printf("Usage: lslpub_bench [seconds per benchmark]\n");
+		return 1;
+	}
+	getNominalCalibration(&gDevCal);
+	fillRawPacket();
+
+	printf("%-34s %8s %22s %20s\n", "benchmark", "channels", "time", "throughput");
+	runBench("bytesToUint16", "sample", benchBytesToUint16, 1, BENCH_PACKET_SAMPLES);
+	runBench("bytesToFloat", "value", benchBytesToFloat, 1, BENCH_PACKET_SAMPLES/2);
+	runBench("correctEndian (4 bytes)", "value", benchCorrectEndian, 1, BENCH_PACKET_SAMPLES/2);
+	runBench("setupReadMultRegsCom", "call", benchSetupReadMultRegsCom, 1, 1);
+	runBench("setupWriteMultRegsCom", "call", benchSetupWriteMultRegsCom, 1, 1);
+	runBench("checkModbusResponse", "call", benchCheckModbusResponse, 1, 1);
+	runBench("buildStreamPacket+parseStreamPacket", "sample", benchParseStreamPacket, 1, BENCH_PACKET_SAMPLES);
+
+	for(i = 0; i < NUM_CHANNEL_COUNTS; i++)
+		runBench("ainBinToVolts (512-sample packet)", "sample", benchAinBinToVolts, CHANNEL_COUNTS[i], BENCH_PACKET_SAMPLES);
+	for(i = 0; i < NUM_CHANNEL_COUNTS; i++)
+		runBench("vector<vector> chunk + push_chunk", "sample", benchVectorChunk, CHANNEL_COUNTS[i], packetScans(CHANNEL_COUNTS[i])*CHANNEL_COUNTS[i]);
+	for(i = 0; i < NUM_CHANNEL_COUNTS; i++)
+		runBench("push_chunk_multiplexed", "sample", benchPushChunkMultiplexed, CHANNEL_COUNTS[i], packetScans(CHANNEL_COUNTS[i])*CHANNEL_COUNTS[i]);
+	for(i = 0; i < NUM_CHANNEL_COUNTS; i++)
+		runBench("push_sample per scan", "sample", benchPushSample, CHANNEL_COUNTS[i], packetScans(CHANNEL_COUNTS[i])*CHANNEL_COUNTS[i]);
+	for(i = 0; i < NUM_CHANNEL_COUNTS; i++)
+		runBench("StreamPublisher::publishPacket", "sample", benchPublishPacket, CHANNEL_COUNTS[i], BENCH_PACKET_SAMPLES);
+	for(i = 0; i < NUM_CHANNEL_COUNTS; i++)
+	{
+		fillCodecChunk(CHANNEL_COUNTS[i]);
+		runBench("encodeSamples (4096 scans)", "sample", benchEncodeSamples, CHANNEL_COUNTS[i], BENCH_CODEC_SCANS*CHANNEL_COUNTS[i]);
+		runBench("decodeSamples (4096 scans)", "sample", benchDecodeSamples, CHANNEL_COUNTS[i], BENCH_CODEC_SCANS*CHANNEL_COUNTS[i]);
+		if(gCodecDecoded != gCodecRaw)
+		{
+			printf("decodeSamples error: The decoded samples differ.\n");
+			return 1;
+		}
+		printf("%-34s %8u %12.3f raw/encoded\n", "delta codec ratio", CHANNEL_COUNTS[i], (double)gCodecRaw.size()/gCodecBytes);
+	}
+
+	for(i = 0; i <= MAX_NUM_STREAM_ADDR; i++)
+	{
+		delete gPublishers[i];
+		delete gOutlets[i];
+	}
+	printf("checksum %u\n", gSink);
+	return 0;
+}
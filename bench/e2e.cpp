@@ -0,0 +1,200 @@
+/**
+ * Name: e2e.cpp
+ * Desc: End-to-end harness. Runs the publisher against a local stand-in T7,
+ *       subscribes with an LSL inlet and ramps the scan rate (doubling) for
+ *       1 to 128 channels until scans are skipped or lost, or the p99
+ *       latency from the stand-in to the inlet exceeds a threshold. Prints
+ *       the latency distribution of each configuration and the maximum
+ *       sustained rate of each channel count. Build with
+ *       -DLSLPUB_BUILD_BENCH=ON and run lslpub_e2e from the build directory.
+**/
+
+#include <chrono>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lsl_cpp.h>
+
+#include "harness.h"
+#include "latency.h"
+#include "stream.h"
+#include "t7sim.h"
+
+static const unsigned int CHANNEL_COUNTS[] = {1, 2, 4, 8, 16, 32, 64, 128};
+static const int NUM_CHANNEL_COUNTS = sizeof(CHANNEL_COUNTS)/sizeof(CHANNEL_COUNTS[0]);
+
+typedef struct
+{
+	const char *publisher; //Publisher executable
+	double runSec; //Measured time of each configuration
+	double maxLatencyMs; //p99 threshold
+	unsigned int samplesPerPacket;
+	unsigned int bufferBytes; //Stand-in stream buffer
+	float startRate; //First scan rate of each channel count
+	double maxSampleRate; //Last sample rate tried
+	unsigned int channels; //Only this channel count, 0 = all
+} E2EConfig;
+
+typedef struct
+{
+	int error; //The run did not complete
+	unsigned long long produced; //Scans produced by the stand-in
+	unsigned long long received;
+	unsigned long long lost; //Missing from the channel 0 sequence
+	unsigned long long skipped; //Skipped by the stand-in auto recovery
+	double behindMs; //Scans produced but not received at the end, in ms
+	double p50Ms, p99Ms, p999Ms, maxMs;
+	int sustained;
+} E2EResult;
+
+static void usage()
+{
+	printf("Usage: lslpub_e2e [-pub path] [-sec s] [-maxlat ms] [-spp n] [-buffer bytes]\n"
+	       "                  [-startrate Hz] [-maxsamplerate Hz] [-chan n]\n");
+}
+
+static int parseArgs(int argc, const char *argv[], E2EConfig *cfg)
+{
+	int i = 0;
+
+	cfg->publisher = "./lslpub_LabJack";
+	cfg->runSec = 2.0;
+	cfg->maxLatencyMs = 100.0;
+	cfg->samplesPerPacket = STREAM_MAX_SAMPLES_PER_PACKET_TCP;
+	cfg->bufferBytes = T7SIM_DEFAULT_BUFFER_BYTES;
+	cfg->startRate = 1000.0f;
+	cfg->maxSampleRate = 4000000.0;
+	cfg->channels = 0;
+	for(i = 1; i + 1 < argc; i += 2)
+	{
+		if(strcmp(argv[i], "-pub") == 0)
+			cfg->publisher = argv[i + 1];
+		else if(strcmp(argv[i], "-sec") == 0)
+			cfg->runSec = atof(argv[i + 1]);
+		else if(strcmp(argv[i], "-maxlat") == 0)
+			cfg->maxLatencyMs = atof(argv[i + 1]);
+		else if(strcmp(argv[i], "-spp") == 0)
+			cfg->samplesPerPacket = (unsigned int)strtoul(argv[i + 1], NULL, 10);
+		else if(strcmp(argv[i], "-buffer") == 0)
+			cfg->bufferBytes = (unsigned int)strtoul(argv[i + 1], NULL, 10);
+		else if(strcmp(argv[i], "-startrate") == 0)
+			cfg->startRate = (float)atof(argv[i + 1]);
+		else if(strcmp(argv[i], "-maxsamplerate") == 0)
+			cfg->maxSampleRate = atof(argv[i + 1]);
+		else if(strcmp(argv[i], "-chan") == 0)
+			cfg->channels = (unsigned int)strtoul(argv[i + 1], NULL, 10);
+		else
+			break;
+	}
+	if(i != argc || cfg->runSec <= 0 || cfg->startRate <= 0 || cfg->samplesPerPacket == 0 ||
+	   cfg->samplesPerPacket > STREAM_MAX_SAMPLES_PER_PACKET_TCP || cfg->channels > MAX_NUM_STREAM_ADDR)
+	{
+		usage();
+		return -1;
+	}
+	return 0;
+}
+
+//Streams one configuration for cfg->runSec.
+static void runConfig(const E2EConfig *cfg, unsigned int channels, float scanRate, E2EResult *res)
+{
+	T7Simulator sim;
+	PublisherProcess pub;
+	ScanChecker checker;
+	const LatencyHistogram *lat = checker.latency();
+	double end = 0;
+	int i = 0;
+
+	memset(res, 0, sizeof(E2EResult));
+	res->error = 1;
+	if(sim.start(0, 0, cfg->bufferBytes) != 0)
+		return;
+	if(pub.start(cfg->publisher, sim.crPort(), sim.spPort(), scanRate, channels, cfg->samplesPerPacket, NULL) != 0)
+		return;
+	//Subscribe before the first scan so that scan 0 is the first expected
+	if(checker.open(channels) != 0 || pub.startStreaming() != 0)
+		return;
+	for(i = 0; i < 500 && !sim.streaming() && pub.running(); i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	if(!sim.streaming())
+	{
+		printf("runConfig error: The publisher did not start the stream\n");
+		return;
+	}
+
+	end = lsl::local_clock() + cfg->runSec;
+	while(lsl::local_clock() < end && pub.running())
+	{
+		if(checker.poll(&sim, 0.05) < 0)
+			break;
+	}
+	res->error = !pub.running() || lsl::local_clock() < end;
+	res->produced = sim.scansProduced();
+	res->skipped = sim.scansSkipped();
+	checker.close();
+	pub.stop();
+	sim.stop();
+
+	res->received = checker.scans();
+	res->lost = checker.lostScans();
+	if(res->produced > res->received + res->lost)
+		res->behindMs = (res->produced - res->received - res->lost)*1000.0/scanRate;
+	res->p50Ms = latencyPercentile(lat, 50.0)/1e6;
+	res->p99Ms = latencyPercentile(lat, 99.0)/1e6;
+	res->p999Ms = latencyPercentile(lat, 99.9)/1e6;
+	res->maxMs = lat->max.load()/1e6;
+	//The scans still in flight at the end are up to a packet plus maxlat
+	res->sustained = !res->error && res->received > 0 && res->lost == 0 && res->skipped == 0 &&
+		res->p99Ms <= cfg->maxLatencyMs &&
+		res->behindMs <= cfg->maxLatencyMs + cfg->samplesPerPacket*1000.0/(channels*(double)scanRate);
+}
+
+int main(int argc, const char *argv[])
+{
+	E2EConfig cfg;
+	E2EResult res;
+	float best[NUM_CHANNEL_COUNTS];
+	float rate = 0;
+	unsigned int channels = 0;
+	int c = 0;
+
+	if(parseArgs(argc, argv, &cfg) != 0)
+		return 1;
+
+	printf("End-to-end, %.1f s per configuration, p99 limit %.1f ms, %u samples per packet, %u byte device buffer\n\n",
+	       cfg.runSec, cfg.maxLatencyMs, cfg.samplesPerPacket, cfg.bufferBytes);
+	printf("%8s %12s %12s %10s %8s %8s %9s %9s %9s %9s %9s  %s\n", "channels", "scan rate", "sample rate",
+	       "scans", "lost", "skipped", "behind ms", "p50 ms", "p99 ms", "p99.9 ms", "max ms", "result");
+	for(c = 0; c < NUM_CHANNEL_COUNTS; c++)
+	{
+		channels = CHANNEL_COUNTS[c];
+		best[c] = 0;
+		if(cfg.channels != 0 && channels != cfg.channels)
+			continue;
+		for(rate = cfg.startRate; rate*channels <= cfg.maxSampleRate; rate *= 2)
+		{
+			runConfig(&cfg, channels, rate, &res);
+			printf("%8u %12.1f %12.1f %10llu %8llu %8llu %9.1f %9.3f %9.3f %9.3f %9.3f  %s\n", channels, rate,
+			       rate*channels, res.received, res.lost, res.skipped, res.behindMs, res.p50Ms, res.p99Ms, res.p999Ms,
+			       res.maxMs, res.error ? "error" : (res.sustained ? "ok" : "not sustained"));
+			fflush(stdout);
+			if(!res.sustained)
+				break;
+			best[c] = rate;
+		}
+	}
+
+	printf("\nMaximum sustained rate:\n");
+	printf("%8s %12s %12s\n", "channels", "scan rate", "sample rate");
+	for(c = 0; c < NUM_CHANNEL_COUNTS; c++)
+	{
+		if(cfg.channels != 0 && CHANNEL_COUNTS[c] != cfg.channels)
+			continue;
+		if(best[c] > 0)
+			printf("%8u %12.1f %12.1f\n", CHANNEL_COUNTS[c], best[c], best[c]*CHANNEL_COUNTS[c]);
+		else
+			printf("%8u %12s %12s\n", CHANNEL_COUNTS[c], "-", "-");
+	}
+	return 0;
+}
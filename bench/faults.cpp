@@ -0,0 +1,307 @@
+/**
+ * Name: faults.cpp
+ * Desc: Fault injection regression suite. Runs the publisher against a
+ *       local stand-in T7 that injects one fault per scenario at a fixed
+ *       packet: stream status codes (auto recovery, auto recovery overflow,
+ *       scan overlap, burst complete), a dummy 0xFFFF scan, a dropped
+ *       packet, a delayed packet, packets split over several segments, a
+ *       connection reset and a Modbus exception. Checks the outcome, the
+ *       data continuity at an LSL inlet and the recovery time of each
+ *       scenario against its expectation. Exits with 1 if a scenario
+ *       fails. Build with -DLSLPUB_BUILD_BENCH=ON and run lslpub_faults
+ *       from the build directory.
+**/
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lsl_cpp.h>
+
+#include "harness.h"
+#include "stream.h"
+#include "t7sim.h"
+
+//Stream configuration of every scenario: 8 packets per 64 scans at 1 kHz.
+#define FAULT_CHANNELS 8
+#define FAULT_SCAN_RATE 1000.0f
+#define FAULT_SAMPLES_PER_PACKET 64
+
+//Packet with the fault, about 0.8 s into the stream.
+#define FAULT_PACKET 100
+
+//Recovery allowed on top of the injected delay.
+#define FAULT_RECOVERY_MARGIN_SEC 1.0
+
+//Scans expected to be missing at the inlet.
+#define FAULT_LOST_NONE 0
+#define FAULT_LOST_ONE_SCAN 1 //The dummy scan
+#define FAULT_LOST_SKIPPED 2 //As many as the stand-in skipped, at least one
+
+//Expected outcome of the publisher.
+#define FAULT_CONTINUES 0 //Keeps streaming
+#define FAULT_STOPS 1 //Stops the stream and exits by itself
+#define FAULT_NO_STREAM 2 //Never streams and exits by itself
+
+typedef struct
+{
+	const char *name;
+	unsigned short status; //Status of FAULT_PACKET, 0 = unchanged
+	unsigned short recoverEndStatus; //Replaces STREAM_STATUS_AUTO_RECOVER_END, 0 = unchanged
+	unsigned int delayMs; //Delay before sending FAULT_PACKET
+	int dummyScan; //Replaces a scan of FAULT_PACKET with 0xFFFF samples
+	int drop; //Drops FAULT_PACKET
+	int split; //Sends FAULT_PACKET and the next ones in 3 segments
+	int reset; //Resets the connection instead of sending FAULT_PACKET
+	int modbusException; //Exception code of the STREAM_ENABLE writes
+	unsigned int bufferBytes; //Stand-in stream buffer
+	int outcome; //FAULT_CONTINUES, FAULT_STOPS or FAULT_NO_STREAM
+	int lost; //FAULT_LOST_X
+} FaultScenario;
+
+static const FaultScenario SCENARIOS[] =
+{
+	//name                     status                              recoverEndStatus                         delay dummy drop split reset exc buffer  outcome          lost
+	{"baseline",               0,                                  0,                                       0,    0,    0,   0,    0,    0,  32768,  FAULT_CONTINUES, FAULT_LOST_NONE},
+	{"auto-recover",           0,                                  0,                                       500,  0,    0,   0,    0,    0,  2048,   FAULT_CONTINUES, FAULT_LOST_SKIPPED},
+	{"auto-recover-overflow",  0,                                  STREAM_STATUS_AUTO_RECOVER_END_OVERFLOW, 500,  0,    0,   0,    0,    0,  2048,   FAULT_STOPS,     FAULT_LOST_NONE},
+	{"auto-recover-status",    STREAM_STATUS_AUTO_RECOVER_ACTIVE,  0,                                       0,    0,    0,   0,    0,    0,  32768,  FAULT_CONTINUES, FAULT_LOST_NONE},
+	{"scan-overlap",           STREAM_STATUS_SCAN_OVERLAP,         0,                                       0,    0,    0,   0,    0,    0,  32768,  FAULT_STOPS,     FAULT_LOST_NONE},
+	{"burst-complete",         STREAM_STATUS_BURST_COMPLETE,       0,                                       0,    0,    0,   0,    0,    0,  32768,  FAULT_STOPS,     FAULT_LOST_NONE},
+	{"dummy-scan",             0,                                  0,                                       0,    1,    0,   0,    0,    0,  32768,  FAULT_CONTINUES, FAULT_LOST_ONE_SCAN},
+	{"dropped-packet",         0,                                  0,                                       0,    0,    1,   0,    0,    0,  32768,  FAULT_STOPS,     FAULT_LOST_NONE},
+	{"delayed-packet",         0,                                  0,                                       200,  0,    0,   0,    0,    0,  32768,  FAULT_CONTINUES, FAULT_LOST_NONE},
+	{"short-reads",            0,                                  0,                                       0,    0,    0,   1,    0,    0,  32768,  FAULT_CONTINUES, FAULT_LOST_NONE},
+	{"connection-reset",       0,                                  0,                                       0,    0,    0,   0,    1,    0,  32768,  FAULT_STOPS,     FAULT_LOST_NONE},
+	{"modbus-exception",       0,                                  0,                                       0,    0,    0,   0,    0,    2,  32768,  FAULT_NO_STREAM, FAULT_LOST_NONE},
+};
+static const int NUM_SCENARIOS = sizeof(SCENARIOS)/sizeof(SCENARIOS[0]);
+
+//Stand-in T7 that injects the fault of a scenario.
+class FaultSimulator : public T7Simulator
+{
+public:
+	FaultSimulator(const FaultScenario *scenario) : mScenario(scenario), mPacket(0), mFaultTime(0), mFaultScan(0) {}
+
+	//Time the fault was injected (lsl::local_clock), 0 if not yet.
+	double faultTime() const { return mFaultTime.load(); }
+
+	//Scans produced when the fault was injected.
+	unsigned long long faultScan() const { return mFaultScan.load(); }
+
+protected:
+	virtual int beforePacket(unsigned long long packetIndex, unsigned short *status, unsigned short *additionalInfo,
+	                         unsigned char *rawData)
+	{
+		const T7SimStream s = streamConfig();
+		unsigned int first = 0;
+
+		mPacket = packetIndex;
+		if(mScenario->recoverEndStatus && *status == STREAM_STATUS_AUTO_RECOVER_END)
+		{
+			*status = mScenario->recoverEndStatus;
+			*additionalInfo = 0xFFFF;
+		}
+		if(packetIndex != FAULT_PACKET)
+			return 0;
+		if(mScenario->status || mScenario->dummyScan || mScenario->drop)
+			recordFault();
+		if(mScenario->status)
+			*status = mScenario->status;
+		if(mScenario->dummyScan)
+		{
+			//First scan starting in this packet
+			first = (unsigned int)((s.numAddresses - packetIndex*s.samplesPerPacket % s.numAddresses) % s.numAddresses);
+			if(first + s.numAddresses <= s.samplesPerPacket)
+				memset(&rawData[first*STREAM_BYTES_PER_SAMPLE], 0xFF, s.numAddresses*STREAM_BYTES_PER_SAMPLE);
+		}
+		return mScenario->drop;
+	}
+
+	virtual int sendPacket(int sock, const unsigned char *packet, int size)
+	{
+		int third = size/3;
+
+		if(mPacket == FAULT_PACKET && (mScenario->delayMs || mScenario->reset || mScenario->split))
+			recordFault();
+		if(mPacket == FAULT_PACKET && mScenario->delayMs)
+			std::this_thread::sleep_for(std::chrono::milliseconds(mScenario->delayMs));
+		if(mPacket == FAULT_PACKET && mScenario->reset)
+		{
+			resetStreamConnection();
+			return -1;
+		}
+		if(mPacket >= FAULT_PACKET && mScenario->split)
+		{
+			if(T7Simulator::sendPacket(sock, packet, third) != 0)
+				return -1;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			if(T7Simulator::sendPacket(sock, &packet[third], third) != 0)
+				return -1;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			return T7Simulator::sendPacket(sock, &packet[2*third], size - 2*third);
+		}
+		return T7Simulator::sendPacket(sock, packet, size);
+	}
+
+	virtual int beforeCommand(unsigned char function, unsigned short address)
+	{
+		if(mScenario->modbusException && function == 16 && address == 4990)
+		{
+			recordFault();
+			return mScenario->modbusException;
+		}
+		return 0;
+	}
+
+private:
+	void recordFault()
+	{
+		if(mFaultTime.load() != 0)
+			return;
+		mFaultScan.store(scansProduced());
+		mFaultTime.store(lsl::local_clock());
+	}
+
+	const FaultScenario *mScenario;
+	unsigned long long mPacket; //Index of the packet being sent
+	std::atomic<double> mFaultTime;
+	std::atomic<unsigned long long> mFaultScan;
+};
+
+typedef struct
+{
+	int pass;
+	const char *reason; //Why it failed
+	const char *outcome; //What the publisher did
+	unsigned long long received;
+	unsigned long long lost;
+	unsigned long long gaps;
+	unsigned long long skipped;
+	double recoveryMs; //Fault to first new scan, or to the publisher exit
+	double maxStallMs;
+} FaultResult;
+
+static void runScenario(const char *publisher, double runSec, const FaultScenario *scenario, FaultResult *res)
+{
+	FaultSimulator sim(scenario);
+	PublisherProcess pub;
+	ScanChecker checker;
+	double end = 0;
+	double exitTime = 0;
+	double allowedSec = scenario->delayMs/1000.0 + FAULT_RECOVERY_MARGIN_SEC;
+	int marked = 0;
+
+	memset(res, 0, sizeof(FaultResult));
+	res->reason = "could not start";
+	res->outcome = "-";
+	if(sim.start(0, 0, scenario->bufferBytes) != 0 ||
+	   pub.start(publisher, sim.crPort(), sim.spPort(), FAULT_SCAN_RATE, FAULT_CHANNELS, FAULT_SAMPLES_PER_PACKET, NULL) != 0)
+		return;
+	if(checker.open(FAULT_CHANNELS) != 0 || pub.startStreaming() != 0)
+		return;
+
+	end = lsl::local_clock() + runSec;
+	while(lsl::local_clock() < end)
+	{
+		if(!marked && sim.faultTime() > 0)
+		{
+			checker.markScan(sim.faultScan());
+			marked = 1;
+		}
+		if(exitTime == 0 && !pub.running())
+			exitTime = lsl::local_clock();
+		//Keep watching for the exit once the outlet is gone
+		if(checker.poll(&sim, 0.01) < 0)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	res->skipped = sim.scansSkipped();
+	checker.close();
+	pub.stop();
+	sim.stop();
+
+	res->received = checker.scans();
+	res->lost = checker.lostScans();
+	res->gaps = checker.gaps();
+	res->maxStallMs = checker.maxStallSec()*1000.0;
+	res->outcome = exitTime > 0 ? (res->received > 0 ? "stopped" : "no stream") : "continued";
+	if(scenario->outcome == FAULT_CONTINUES && checker.markArrival() > 0 && sim.faultTime() > 0)
+		res->recoveryMs = (checker.markArrival() - sim.faultTime())*1000.0;
+	else if(scenario->outcome != FAULT_CONTINUES && exitTime > 0)
+		res->recoveryMs = ((sim.faultTime() > 0 ? exitTime - sim.faultTime() : 0))*1000.0;
+
+	res->pass = 0;
+	if(sim.faultTime() == 0 && scenario->name != SCENARIOS[0].name)
+		res->reason = "fault not injected";
+	else if(scenario->outcome == FAULT_CONTINUES && exitTime > 0)
+		res->reason = "publisher stopped";
+	else if(scenario->outcome != FAULT_CONTINUES && exitTime == 0)
+		res->reason = "publisher did not stop";
+	else if(scenario->outcome == FAULT_NO_STREAM && res->received > 0)
+		res->reason = "publisher streamed";
+	else if(scenario->outcome != FAULT_NO_STREAM && res->received == 0)
+		res->reason = "no scans";
+	else if(scenario->lost == FAULT_LOST_NONE && res->lost != 0)
+		res->reason = "scans lost";
+	else if(scenario->lost == FAULT_LOST_ONE_SCAN && (res->lost != 1 || res->gaps != 1))
+		res->reason = "not exactly one scan lost";
+	else if(scenario->lost == FAULT_LOST_SKIPPED && (res->lost == 0 || res->lost != res->skipped))
+		res->reason = "lost scans differ from skipped scans";
+	else if(sim.faultTime() > 0 && scenario->outcome == FAULT_CONTINUES && res->recoveryMs <= 0)
+		res->reason = "no scans after the fault";
+	else if(res->recoveryMs > allowedSec*1000.0)
+		res->reason = "recovery too slow";
+	else
+	{
+		res->pass = 1;
+		res->reason = "";
+	}
+}
+
+int main(int argc, const char *argv[])
+{
+	const char *publisher = "./lslpub_LabJack";
+	const char *only = NULL;
+	double runSec = 3.0;
+	FaultResult res;
+	int failed = 0;
+	int ran = 0;
+	int i = 0;
+
+	for(i = 1; i + 1 < argc; i += 2)
+	{
+		if(strcmp(argv[i], "-pub") == 0)
+			publisher = argv[i + 1];
+		else if(strcmp(argv[i], "-sec") == 0)
+			runSec = atof(argv[i + 1]);
+		else if(strcmp(argv[i], "-scenario") == 0)
+			only = argv[i + 1];
+		else
+			break;
+	}
+	if(i != argc || runSec <= 1.0)
+	{
+		printf("Usage: lslpub_faults [-pub path] [-sec s] [-scenario name]\n");
+		return 1;
+	}
+
+	printf("Fault injection, %u channels at %.0f Hz, %u samples per packet, fault at packet %u, %.1f s per scenario\n\n",
+	       FAULT_CHANNELS, FAULT_SCAN_RATE, FAULT_SAMPLES_PER_PACKET, FAULT_PACKET, runSec);
+	printf("%-22s %-6s %-10s %8s %6s %5s %8s %12s %10s  %s\n", "scenario", "result", "outcome", "scans", "lost", "gaps",
+	       "skipped", "recovery ms", "stall ms", "reason");
+	for(i = 0; i < NUM_SCENARIOS; i++)
+	{
+		if(only && strcmp(only, SCENARIOS[i].name) != 0)
+			continue;
+		runScenario(publisher, runSec, &SCENARIOS[i], &res);
+		printf("%-22s %-6s %-10s %8llu %6llu %5llu %8llu %12.1f %10.1f  %s\n", SCENARIOS[i].name, res.pass ? "PASS" : "FAIL",
+		       res.outcome, res.received, res.lost, res.gaps, res.skipped, res.recoveryMs, res.maxStallMs, res.reason);
+		fflush(stdout);
+		failed += !res.pass;
+		ran++;
+	}
+	printf("\n%d of %d scenarios passed\n", ran - failed, ran);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,396 @@
+#include "harness.h"
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+//Scans pulled at once by the checker.
+#define HARNESS_CHUNK_SCANS 4096
+
+//Largest metrics page read by scrapeMetric.
+#define HARNESS_METRICS_BYTES 65536
+
+int findFreeLocalPort()
+{
+	struct sockaddr_in address;
+	socklen_t size = sizeof(address);
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	int port = -1;
+
+	if(sock < 0)
+		return -1;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(sock, (struct sockaddr *)&address, sizeof(address)) == 0 &&
+	   getsockname(sock, (struct sockaddr *)&address, &size) == 0)
+		port = ntohs(address.sin_port);
+	close(sock);
+	return port;
+}
+
+int scrapeMetric(int port, const char *name, double *value)
+{
+	static const char REQUEST[] = "GET /metrics HTTP/1.0\r\n\r\n";
+	std::vector<char> page(HARNESS_METRICS_BYTES + 1);
+	struct sockaddr_in address;
+	struct timeval tv;
+	size_t nameLen = strlen(name);
+	const char *line = NULL;
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	int size = 0;
+	int ret = 0;
+
+	if(sock < 0)
+		return -1;
+	tv.tv_sec = 2;
+	tv.tv_usec = 0;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(connect(sock, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+	   send(sock, REQUEST, sizeof(REQUEST) - 1, MSG_NOSIGNAL) != (int)sizeof(REQUEST) - 1)
+	{
+		close(sock);
+		return -1;
+	}
+	while(size < HARNESS_METRICS_BYTES && (ret = recv(sock, &page[size], HARNESS_METRICS_BYTES - size, 0)) > 0)
+		size += ret;
+	close(sock);
+	page[size] = '\0';
+
+	//"\nname value"
+	for(line = strstr(&page[0], name); line != NULL; line = strstr(line + 1, name))
+	{
+		if(line > &page[0] && line[-1] == '\n' && line[nameLen] == ' ')
+		{
+			*value = atof(&line[nameLen + 1]);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+PublisherProcess::PublisherProcess() : mPid(-1), mStdin(-1), mStatus(0)
+{
+}
+
+PublisherProcess::~PublisherProcess()
+{
+	stop();
+}
+
+int PublisherProcess::start(const char *path, int crPort, int spPort, float scanRate, unsigned int numAddresses,
+                            unsigned int samplesPerPacket, const char *const *extraArgs)
+{
+	char crPortStr[16], spPortStr[16], rateStr[32], chanStr[16], sppStr[16];
+	std::vector<const char *> args;
+	int fds[2];
+	int devNull = -1;
+
+	if(mPid > 0)
+		return -1;
+	snprintf(crPortStr, sizeof(crPortStr), "%d", crPort);
+	snprintf(spPortStr, sizeof(spPortStr), "%d", spPort);
+	snprintf(rateStr, sizeof(rateStr), "%.3f", scanRate);
+	snprintf(chanStr, sizeof(chanStr), "%u", numAddresses);
+	snprintf(sppStr, sizeof(sppStr), "%u", samplesPerPacket);
+	args.push_back(path);
+	args.push_back("-ip");
+	args.push_back("127.0.0.1");
+	args.push_back("-crport");
+	args.push_back(crPortStr);
+	args.push_back("-spport");
+	args.push_back(spPortStr);
+	args.push_back("-rate");
+	args.push_back(rateStr);
+	args.push_back("-chan");
+	args.push_back(chanStr);
+	args.push_back("-spp");
+	args.push_back(sppStr);
+	while(extraArgs && *extraArgs)
+		args.push_back(*extraArgs++);
+	args.push_back(NULL);
+
+	if(pipe(fds) != 0)
+		return -1;
+	mPid = fork();
+	if(mPid < 0)
+	{
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if(mPid == 0)
+	{
+		dup2(fds[0], STDIN_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		devNull = open("/dev/null", O_WRONLY);
+		if(devNull >= 0)
+			dup2(devNull, STDOUT_FILENO);
+		execv(path, (char *const *)&args[0]);
+		fprintf(stderr, "PublisherProcess::start error: Could not run %s\n", path);
+		_exit(127);
+	}
+	close(fds[0]);
+	mStdin = fds[1];
+	return 0;
+}
+
+int PublisherProcess::startStreaming()
+{
+	//One for the start prompt, one for the exit prompt
+	if(mStdin < 0 || write(mStdin, "\n\n", 2) != 2)
+		return -1;
+	return 0;
+}
+
+int PublisherProcess::running()
+{
+	if(mPid <= 0)
+		return 0;
+	if(waitpid(mPid, &mStatus, WNOHANG) == mPid)
+	{
+		mPid = -1;
+		return 0;
+	}
+	return 1;
+}
+
+int PublisherProcess::readUsage(ProcessUsage *usage)
+{
+	char path[64];
+	char line[256];
+	const char *fields = NULL;
+	unsigned long long utime = 0, stime = 0;
+	unsigned long long rssKB = 0;
+	FILE *file = NULL;
+	int i = 0;
+	int found = 0;
+
+	if(mPid <= 0)
+		return -1;
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)mPid);
+	if((file = fopen(path, "r")) == NULL)
+		return -1;
+	while(fgets(line, sizeof(line), file))
+	{
+		if(sscanf(line, "VmRSS: %llu kB", &rssKB) == 1)
+		{
+			found = 1;
+			break;
+		}
+	}
+	fclose(file);
+
+	//utime and stime are fields 14 and 15, after the parenthesized name
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)mPid);
+	if(!found || (file = fopen(path, "r")) == NULL)
+		return -1;
+	if(fgets(line, sizeof(line), file) == NULL || (fields = strrchr(line, ')')) == NULL)
+	{
+		fclose(file);
+		return -1;
+	}
+	fclose(file);
+	for(i = 0; i < 12 && fields; i++)
+		fields = strchr(fields + 1, ' ');
+	if(fields == NULL || sscanf(fields, " %llu %llu", &utime, &stime) != 2)
+		return -1;
+	usage->rssBytes = rssKB*1024ULL;
+	usage->cpuSec = (double)(utime + stime)/sysconf(_SC_CLK_TCK);
+	return 0;
+}
+
+int PublisherProcess::stop()
+{
+	const unsigned long long deadline = monotonicNs() + (unsigned long long)(HARNESS_EXIT_SEC*1e9);
+	int killed = 0;
+
+	if(mPid > 0)
+	{
+		kill(mPid, SIGINT);
+		while(running() && monotonicNs() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		if(mPid > 0)
+		{
+			kill(mPid, SIGKILL);
+			waitpid(mPid, &mStatus, 0);
+			mPid = -1;
+			killed = 1;
+		}
+	}
+	if(mStdin >= 0)
+		close(mStdin);
+	mStdin = -1;
+	if(killed || !WIFEXITED(mStatus))
+		return -1;
+	return WEXITSTATUS(mStatus);
+}
+
+ScanChecker::ScanChecker() : mInlet(0), mNumAddresses(0), mChunk(0), mTimestamps(0), mScans(0), mLostScans(0), mGaps(0),
+	mNextIndex(0), mMaxStall(0), mLastArrival(0), mDriftOrigin(0), mDriftSum(0), mDriftCount(0), mDriftMax(0),
+	mMarkIndex(0), mMarkSet(0), mMarkArrival(0),
+	mLatency(new LatencyHistogram)
+{
+	getNominalCalibration(&mDevCal);
+	latencyClear(mLatency);
+}
+
+ScanChecker::~ScanChecker()
+{
+	close();
+	delete[] mChunk;
+	delete[] mTimestamps;
+	delete mLatency;
+}
+
+int ScanChecker::open(unsigned int numAddresses)
+{
+	std::vector<lsl::stream_info> results;
+	int newest = -1;
+	size_t i = 0;
+
+	if(mInlet != 0)
+		return -1;
+	try
+	{
+		results = lsl::resolve_stream("name", "LabJack", 1, HARNESS_RESOLVE_SEC);
+		for(i = 0; i < results.size(); i++)
+		{
+			if((unsigned int)results[i].channel_count() == numAddresses &&
+			   (newest < 0 || results[i].created_at() > results[newest].created_at()))
+				newest = (int)i;
+		}
+		if(newest < 0)
+		{
+			printf("ScanChecker::open error: No LabJack outlet with %u channels\n", numAddresses);
+			return -1;
+		}
+		mInlet = new lsl::stream_inlet(results[newest], 360);
+		mInlet->open_stream(HARNESS_RESOLVE_SEC);
+	}
+	catch(std::exception &e)
+	{
+		printf("ScanChecker::open error: %s\n", e.what());
+		return -1;
+	}
+	mNumAddresses = numAddresses;
+	mChunk = new float[HARNESS_CHUNK_SCANS*numAddresses];
+	mTimestamps = new double[HARNESS_CHUNK_SCANS];
+	return 0;
+}
+
+void ScanChecker::markScan(unsigned long long scanIndex)
+{
+	mMarkIndex = scanIndex;
+	mMarkSet = 1;
+	mMarkArrival = 0;
+}
+
+void ScanChecker::resetInterval()
+{
+	latencyReset(mLatency);
+	mDriftSum = 0;
+	mDriftCount = 0;
+	mDriftMax = 0;
+	mMaxStall = 0;
+}
+
+void ScanChecker::close()
+{
+	delete mInlet;
+	mInlet = 0;
+}
+
+int ScanChecker::poll(const T7Simulator *sim, double timeout)
+{
+	size_t elements = 0;
+	size_t i = 0;
+	double now = 0;
+	double ready = 0;
+	double deadline = lsl::local_clock() + timeout;
+	double rate = sim->streamConfig().scanRate;
+	double drift = 0;
+	long raw = 0;
+	unsigned long long expected = 0;
+	unsigned long long skipped = 0;
+
+	if(mInlet == 0)
+		return -1;
+	try
+	{
+		//With a timeout the pull waits for a full buffer, so poll instead
+		while((elements = mInlet->pull_chunk_multiplexed(mChunk, mTimestamps, HARNESS_CHUNK_SCANS*mNumAddresses,
+		                                                 HARNESS_CHUNK_SCANS, 0.0)) == 0 && lsl::local_clock() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	catch(lsl::lost_error &)
+	{
+		//The publisher exited
+		close();
+		return -1;
+	}
+	catch(lsl::timeout_error &)
+	{
+		//This liblsl reports a lost stream as a timeout
+		close();
+		return -1;
+	}
+	catch(std::exception &e)
+	{
+		printf("ScanChecker::poll error: %s\n", e.what());
+		return -1;
+	}
+	if(elements == 0)
+		return 0;
+	now = lsl::local_clock();
+	if(mLastArrival > 0 && now - mLastArrival > mMaxStall)
+		mMaxStall = now - mLastArrival;
+	mLastArrival = now;
+
+	for(i = 0; i < elements; i += mNumAddresses)
+	{
+		//Back to the raw value. ainBinToVolts takes the NSlope branch for
+		//these values.
+		raw = lround(mDevCal.HS[0].Center - mChunk[i]/mDevCal.HS[0].NSlope);
+		expected = mNextIndex % T7SIM_INDEX_MODULO;
+		skipped = ((unsigned long long)raw + T7SIM_INDEX_MODULO - expected) % T7SIM_INDEX_MODULO;
+		if(skipped > 0)
+		{
+			mGaps++;
+			mLostScans += skipped;
+		}
+		if(rate > 0)
+		{
+			if(mDriftOrigin == 0)
+				mDriftOrigin = mTimestamps[i/mNumAddresses] - (mNextIndex + skipped)/rate;
+			drift = mTimestamps[i/mNumAddresses] - (mNextIndex + skipped)/rate - mDriftOrigin;
+			mDriftSum += drift;
+			mDriftCount++;
+			if(fabs(drift) > mDriftMax)
+				mDriftMax = fabs(drift);
+		}
+		ready = sim->scanReadyTime(mNextIndex + skipped);
+		if(ready > 0 && now > ready)
+			latencyRecord(mLatency, (unsigned long long)((now - ready)*1e9));
+		if(mMarkSet && mMarkArrival == 0 && mNextIndex + skipped >= mMarkIndex)
+			mMarkArrival = now;
+		mNextIndex += skipped + 1;
+		mScans++;
+	}
+	return (int)(elements/mNumAddresses);
+}
@@ -0,0 +1,154 @@
+/**
+ * Name: harness.h
+ * Desc: Provides the pieces shared by the end-to-end harnesses: the
+ *       publisher run as a child process against a T7Simulator, and an LSL
+ *       inlet that checks the scan index in channel 0 for continuity and
+ *       times each scan from the moment the stand-in could send it. Unix
+ *       only.
+**/
+
+#ifndef HARNESS_H_
+#define HARNESS_H_
+
+#include <sys/types.h>
+#include <lsl_cpp.h>
+
+#include "calibration.h"
+#include "latency.h"
+#include "stream.h"
+#include "t7sim.h"
+
+//Seconds to wait for the publisher outlet, and for the publisher to exit.
+#define HARNESS_RESOLVE_SEC 5.0
+#define HARNESS_EXIT_SEC 5.0
+
+//Resource usage of a process.
+typedef struct
+{
+	unsigned long long rssBytes; //Resident set size
+	double cpuSec; //User + system CPU time
+} ProcessUsage;
+
+//Returns a free TCP port on 127.0.0.1, -1 on error.
+int findFreeLocalPort();
+
+//Reads one unlabeled metric from the publisher Prometheus endpoint
+//(-metricsport). Returns -1 on error or if the metric is missing, 0 on
+//success.
+//name: The metric name, as lslpub_heap_allocations_total.
+int scrapeMetric(int port, const char *name, double *value);
+
+//The publisher (lslpub_LabJack) in a child process, stdout discarded.
+class PublisherProcess
+{
+public:
+	PublisherProcess();
+	~PublisherProcess();
+
+	//Starts the publisher. It stops at its "Press Enter" prompt until
+	//startStreaming. Returns -1 on error, 0 on success.
+	//path: The publisher executable.
+	//extraArgs: More arguments, NULL terminated. Can be NULL.
+	int start(const char *path, int crPort, int spPort, float scanRate, unsigned int numAddresses,
+	          unsigned int samplesPerPacket, const char *const *extraArgs);
+
+	//Answers the "Press Enter" prompts, which starts the stream.
+	int startStreaming();
+
+	//Returns 1 while the child runs.
+	int running();
+
+	//Reads the resource usage of the child from /proc. Linux only. Returns
+	//-1 on error, 0 on success.
+	int readUsage(ProcessUsage *usage);
+
+	//Stops the stream with SIGINT, then kills the child if it did not exit
+	//in HARNESS_EXIT_SEC. Returns the exit status, -1 if it was killed.
+	int stop();
+
+	pid_t pid() const { return mPid; }
+
+private:
+	PublisherProcess(const PublisherProcess &);
+	PublisherProcess &operator=(const PublisherProcess &);
+
+	pid_t mPid;
+	int mStdin;
+	int mStatus;
+};
+
+//Subscribes to the "LabJack" outlet and checks the scans.
+class ScanChecker
+{
+public:
+	ScanChecker();
+	~ScanChecker();
+
+	//Resolves the newest "LabJack" outlet with numAddresses channels and
+	//opens it. Returns -1 on error, 0 on success.
+	int open(unsigned int numAddresses);
+
+	//Pulls the available scans and checks them. Waits up to timeout
+	//seconds, in 1 ms steps, if none is available. sim gives the time each
+	//scan was ready. Returns the scans pulled, -1 on error or once the
+	//outlet is gone.
+	int poll(const T7Simulator *sim, double timeout);
+
+	//Closes the inlet. Call it before stopping the publisher.
+	void close();
+
+	//Scans received, scans missing from the channel 0 sequence and number
+	//of gaps in it.
+	unsigned long long scans() const { return mScans; }
+	unsigned long long lostScans() const { return mLostScans; }
+	unsigned long long gaps() const { return mGaps; }
+
+	//Largest time between two consecutive scans at the inlet, and the time
+	//of the last scan (lsl::local_clock).
+	double maxStallSec() const { return mMaxStall; }
+	double lastArrival() const { return mLastArrival; }
+
+	//Records the arrival of the first scan with an index >= scanIndex, for
+	//the recovery time after a fault. markArrival is 0 until then.
+	void markScan(unsigned long long scanIndex);
+	double markArrival() const { return mMarkArrival; }
+
+	//Stand-in ready time to inlet pull time of each scan.
+	const LatencyHistogram *latency() const { return mLatency; }
+
+	//Drift of the LSL timestamps from the nominal scan rate, relative to
+	//the first scan: mean and largest absolute value in seconds.
+	double driftMeanSec() const { return mDriftCount ? mDriftSum/mDriftCount : 0.0; }
+	double driftMaxSec() const { return mDriftMax; }
+
+	//Clears the latencies, the drift statistics and the largest stall, to
+	//report them per interval.
+	void resetInterval();
+
+private:
+	ScanChecker(const ScanChecker &);
+	ScanChecker &operator=(const ScanChecker &);
+
+	lsl::stream_inlet *mInlet;
+	unsigned int mNumAddresses;
+	DeviceCalibration mDevCal;
+	float *mChunk;
+	double *mTimestamps;
+
+	unsigned long long mScans;
+	unsigned long long mLostScans;
+	unsigned long long mGaps;
+	unsigned long long mNextIndex; //Expected scan index
+	double mMaxStall;
+	double mLastArrival;
+	double mDriftOrigin; //LSL timestamp of scan 0 at the nominal rate, 0 = not set
+	double mDriftSum;
+	unsigned long long mDriftCount;
+	double mDriftMax;
+	unsigned long long mMarkIndex;
+	int mMarkSet;
+	double mMarkArrival;
+	LatencyHistogram *mLatency;
+};
+
+#endif
@@ -0,0 +1,228 @@
+/**
+ * Name: soak.cpp
+ * Desc: Soak test. Runs the publisher against a local stand-in T7 at a
+ *       production rate for a long time and, every interval (default one
+ *       minute), samples the publisher RSS, its heap allocations (from the
+ *       metrics endpoint), the inlet latency percentiles, the drift of the
+ *       LSL timestamps from the nominal scan rate and the CPU time per
+ *       sample. Fails and exits with 1 as soon as one of them goes past its
+ *       bound. Build with -DLSLPUB_BUILD_BENCH=ON and run lslpub_soak from
+ *       the build directory. Linux only.
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lsl_cpp.h>
+
+#include "harness.h"
+#include "latency.h"
+#include "stream.h"
+#include "t7sim.h"
+
+//Seconds to wait for the first scan.
+#define SOAK_START_TIMEOUT_SEC 30.0
+
+typedef struct
+{
+	const char *publisher;
+	double runSec; //Duration of the soak
+	double intervalSec; //Time between two samples
+	float scanRate;
+	unsigned int numAddresses;
+	unsigned int samplesPerPacket;
+
+	//Bounds, checked from the second interval on. Growth is measured from
+	//the end of the first interval.
+	double maxRssGrowthMB;
+	double maxAllocsPerSec; //Publisher heap allocations per second, LSL included. Fixed, not a growth
+	double maxLatencyMs; //p99 of each interval
+	double maxDriftMs; //Mean timestamp drift of each interval
+	double maxCpuGrowth; //CPU time per sample, ratio to the first interval
+} SoakConfig;
+
+static void usage()
+{
+	printf("Usage: lslpub_soak [-pub path] [-sec s] [-interval s] [-rate Hz] [-chan n] [-spp n]\n"
+	       "                   [-maxrss MB] [-maxallocs n] [-maxlat ms] [-maxdrift ms] [-maxcpu ratio]\n");
+}
+
+static int parseArgs(int argc, const char *argv[], SoakConfig *cfg)
+{
+	int i = 0;
+
+	cfg->publisher = "./lslpub_LabJack";
+	cfg->runSec = 3600.0;
+	cfg->intervalSec = 60.0;
+	cfg->scanRate = 10000.0f;
+	cfg->numAddresses = 8;
+	cfg->samplesPerPacket = STREAM_MAX_SAMPLES_PER_PACKET_TCP;
+	cfg->maxRssGrowthMB = 16.0;
+	cfg->maxAllocsPerSec = 1000.0;
+	cfg->maxLatencyMs = 100.0;
+	cfg->maxDriftMs = 50.0;
+	cfg->maxCpuGrowth = 1.5;
+	for(i = 1; i + 1 < argc; i += 2)
+	{
+		if(strcmp(argv[i], "-pub") == 0)
+			cfg->publisher = argv[i + 1];
+		else if(strcmp(argv[i], "-sec") == 0)
+			cfg->runSec = atof(argv[i + 1]);
+		else if(strcmp(argv[i], "-interval") == 0)
+			cfg->intervalSec = atof(argv[i + 1]);
+		else if(strcmp(argv[i], "-rate") == 0)
+			cfg->scanRate = (float)atof(argv[i + 1]);
+		else if(strcmp(argv[i], "-chan") == 0)
+			cfg->numAddresses = (unsigned int)strtoul(argv[i + 1], NULL, 10);
+		else if(strcmp(argv[i], "-spp") == 0)
+			cfg->samplesPerPacket = (unsigned int)strtoul(argv[i + 1], NULL, 10);
+		else if(strcmp(argv[i], "-maxrss") == 0)
+			cfg->maxRssGrowthMB = atof(argv[i + 1]);
+		else if(strcmp(argv[i], "-maxallocs") == 0)
+			cfg->maxAllocsPerSec = atof(argv[i + 1]);
+		else if(strcmp(argv[i], "-maxlat") == 0)
+			cfg->maxLatencyMs = atof(argv[i + 1]);
+		else if(strcmp(argv[i], "-maxdrift") == 0)
+			cfg->maxDriftMs = atof(argv[i + 1]);
+		else if(strcmp(argv[i], "-maxcpu") == 0)
+			cfg->maxCpuGrowth = atof(argv[i + 1]);
+		else
+			break;
+	}
+	if(i != argc || cfg->intervalSec <= 0 || cfg->runSec < cfg->intervalSec || cfg->scanRate <= 0 ||
+	   cfg->numAddresses == 0 || cfg->numAddresses > MAX_NUM_STREAM_ADDR || cfg->samplesPerPacket == 0 ||
+	   cfg->samplesPerPacket > STREAM_MAX_SAMPLES_PER_PACKET_TCP)
+	{
+		usage();
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, const char *argv[])
+{
+	SoakConfig cfg;
+	T7Simulator sim;
+	PublisherProcess pub;
+	ScanChecker checker;
+	ProcessUsage usage;
+	const LatencyHistogram *lat = checker.latency();
+	const char *failure = NULL;
+	char portStr[16];
+	const char *extraArgs[3] = {"-metricsport", portStr, NULL};
+	double start = 0, nextSample = 0, now = 0;
+	double allocs = 0, lastAllocs = 0;
+	double lastCpu = 0, cpuPerSample = 0, baseCpuPerSample = 0;
+	double rssMB = 0, baseRssMB = 0;
+	double p99Ms = 0, driftMs = 0;
+	unsigned long long lastScans = 0, samples = 0;
+	int metricsPort = 0;
+	int interval = 0;
+
+	if(parseArgs(argc, argv, &cfg) != 0)
+		return 1;
+	metricsPort = findFreeLocalPort();
+	snprintf(portStr, sizeof(portStr), "%d", metricsPort);
+	if(metricsPort <= 0 || sim.start(0, 0, T7SIM_DEFAULT_BUFFER_BYTES) != 0 ||
+	   pub.start(cfg.publisher, sim.crPort(), sim.spPort(), cfg.scanRate, cfg.numAddresses, cfg.samplesPerPacket, extraArgs) != 0 ||
+	   checker.open(cfg.numAddresses) != 0 || pub.startStreaming() != 0)
+	{
+		printf("Soak FAILED: could not start the publisher\n");
+		return 1;
+	}
+
+	//The intervals start at the first scan, the CPU time and allocations of
+	//the startup are not part of the first one
+	start = lsl::local_clock();
+	while(checker.scans() == 0 && pub.running() && lsl::local_clock() < start + SOAK_START_TIMEOUT_SEC)
+	{
+		if(checker.poll(&sim, 0.01) < 0)
+			break;
+	}
+	if(checker.scans() == 0 || pub.readUsage(&usage) != 0 ||
+	   scrapeMetric(metricsPort, "lslpub_heap_allocations_total", &lastAllocs) != 0)
+	{
+		printf("Soak FAILED: the stream did not start\n");
+		return 1;
+	}
+	lastCpu = usage.cpuSec;
+	lastScans = checker.scans();
+	checker.resetInterval();
+
+	printf("Soak, %u channels at %.1f Hz, %u samples per packet, %.0f s, sampled every %.0f s\n", cfg.numAddresses,
+	       cfg.scanRate, cfg.samplesPerPacket, cfg.runSec, cfg.intervalSec);
+	printf("Bounds: RSS growth %.1f MB, %.0f allocations/s, p99 %.1f ms, drift %.1f ms, CPU per sample x%.2f\n\n",
+	       cfg.maxRssGrowthMB, cfg.maxAllocsPerSec, cfg.maxLatencyMs, cfg.maxDriftMs, cfg.maxCpuGrowth);
+	printf("%8s %10s %10s %12s %9s %9s %9s %10s %10s %12s\n", "time s", "samples", "RSS MB", "allocs/s", "p50 ms",
+	       "p99 ms", "max ms", "drift ms", "|drift| ms", "CPU us/smp");
+
+	start = lsl::local_clock();
+	nextSample = start + cfg.intervalSec;
+	while(failure == NULL && (now = lsl::local_clock()) < start + cfg.runSec)
+	{
+		if(!pub.running())
+		{
+			failure = "the publisher stopped";
+			break;
+		}
+		if(checker.poll(&sim, 0.01) < 0)
+		{
+			failure = "the LSL stream was lost";
+			break;
+		}
+		if(now < nextSample)
+			continue;
+
+		nextSample += cfg.intervalSec;
+		interval++;
+		samples = (checker.scans() - lastScans)*cfg.numAddresses;
+		lastScans = checker.scans();
+		if(pub.readUsage(&usage) != 0 || scrapeMetric(metricsPort, "lslpub_heap_allocations_total", &allocs) != 0)
+		{
+			failure = "could not read the publisher usage";
+			break;
+		}
+		rssMB = usage.rssBytes/(1024.0*1024.0);
+		cpuPerSample = samples ? (usage.cpuSec - lastCpu)/samples : 0.0;
+		p99Ms = latencyPercentile(lat, 99.0)/1e6;
+		driftMs = checker.driftMeanSec()*1000.0;
+		printf("%8.0f %10llu %10.2f %12.0f %9.3f %9.3f %9.3f %10.3f %10.3f %12.3f\n", now - start, samples, rssMB,
+		       (allocs - lastAllocs)/cfg.intervalSec, latencyPercentile(lat, 50.0)/1e6, p99Ms, lat->max.load()/1e6, driftMs,
+		       checker.driftMaxSec()*1000.0, cpuPerSample*1e6);
+		fflush(stdout);
+
+		if(samples == 0)
+			failure = "no samples in the interval";
+		else if(checker.lostScans() > 0)
+			failure = "scans lost";
+		else if(p99Ms > cfg.maxLatencyMs)
+			failure = "p99 latency above the bound";
+		else if(driftMs > cfg.maxDriftMs || driftMs < -cfg.maxDriftMs)
+			failure = "timestamp drift above the bound";
+		else if(interval == 1)
+		{
+			baseRssMB = rssMB;
+			baseCpuPerSample = cpuPerSample;
+		}
+		else if(rssMB - baseRssMB > cfg.maxRssGrowthMB)
+			failure = "RSS grew above the bound";
+		else if((allocs - lastAllocs)/cfg.intervalSec > cfg.maxAllocsPerSec)
+			failure = "heap allocations above the bound";
+		else if(cpuPerSample > baseCpuPerSample*cfg.maxCpuGrowth)
+			failure = "CPU time per sample grew above the bound";
+		lastAllocs = allocs;
+		lastCpu = usage.cpuSec;
+		checker.resetInterval();
+	}
+	checker.close();
+	pub.stop();
+	sim.stop();
+
+	if(failure)
+	{
+		printf("\nSoak FAILED after %.0f s: %s\n", lsl::local_clock() - start, failure);
+		return 1;
+	}
+	printf("\nSoak passed: %u intervals, %llu scans, RSS growth %.2f MB\n", interval, checker.scans(), rssMB - baseRssMB);
+	return 0;
+}
@@ -0,0 +1,508 @@
+#include "t7sim.h"
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <lsl_cpp.h>
+
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "calibration.h"
+#include "modbus.h"
+#include "stream.h"
+
+//T7 registers used by the publisher.
+#define REG_STREAM_SCANRATE_HZ 4002
+#define REG_STREAM_NUM_ADDRESSES 4004
+#define REG_STREAM_SAMPLES_PER_PACKET 4006
+#define REG_STREAM_NUM_SCANS 4020
+#define REG_STREAM_ENABLE 4990
+#define REG_FLASH_PTR 61810
+#define REG_FLASH_READ 61812
+#define FLASH_CAL_ADDRESS 0x3C4000
+
+//Longest wait of the server threads before checking if they need to stop.
+#define T7SIM_POLL_MS 5
+
+static int listenLocal(int port, int *boundPort)
+{
+	struct sockaddr_in address;
+	socklen_t size = sizeof(address);
+	int reuse = 1;
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+	if(sock < 0)
+		return -1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(sock, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(sock, 1) < 0 ||
+	   getsockname(sock, (struct sockaddr *)&address, &size) < 0)
+	{
+		close(sock);
+		return -1;
+	}
+	*boundPort = ntohs(address.sin_port);
+	return sock;
+}
+
+//Waits up to T7SIM_POLL_MS for a socket to be readable. Returns > 0 if
+//readable.
+static int waitReadable(int sock)
+{
+	fd_set fds;
+	struct timeval tv;
+
+	FD_ZERO(&fds);
+	FD_SET(sock, &fds);
+	tv.tv_sec = 0;
+	tv.tv_usec = T7SIM_POLL_MS*1000;
+	return select(sock + 1, &fds, NULL, NULL, &tv);
+}
+
+//Reads exactly size bytes. Returns -1 on error or when the peer closed.
+static int readExact(int sock, unsigned char *data, int size, const std::atomic<int> &running)
+{
+	int done = 0;
+	int ret = 0;
+
+	while(done < size)
+	{
+		if(!running.load())
+			return -1;
+		ret = waitReadable(sock);
+		if(ret < 0)
+			return -1;
+		if(ret == 0)
+			continue;
+		ret = recv(sock, &data[done], size - done, 0);
+		if(ret <= 0)
+			return -1;
+		done += ret;
+	}
+	return 0;
+}
+
+static int sendAll(int sock, const unsigned char *data, int size)
+{
+	int done = 0;
+	int ret = 0;
+
+	while(done < size)
+	{
+		ret = send(sock, &data[done], size - done, MSG_NOSIGNAL);
+		if(ret <= 0)
+			return -1;
+		done += ret;
+	}
+	return 0;
+}
+
+T7Simulator::T7Simulator() : mCrListen(-1), mSpListen(-1), mCrPort(0), mSpPort(0), mStreamSock(-1),
+	mBufferBytes(T7SIM_DEFAULT_BUFFER_BYTES), mEnable(0), mStreaming(0), mStreamStart(0), mScansProduced(0),
+	mScansSkipped(0), mPacketsSent(0), mMaxBacklog(0), mRunning(0)
+{
+	memset(&mStream, 0, sizeof(mStream));
+}
+
+T7Simulator::~T7Simulator()
+{
+	stop();
+}
+
+int T7Simulator::start(int crPort, int spPort, unsigned int bufferBytes)
+{
+	if(mRunning.load())
+		return -1;
+	mBufferBytes = bufferBytes;
+	mCrListen = listenLocal(crPort, &mCrPort);
+	mSpListen = listenLocal(spPort, &mSpPort);
+	if(mCrListen < 0 || mSpListen < 0)
+	{
+		printf("T7Simulator::start error: Could not listen on 127.0.0.1\n");
+		stop();
+		return -1;
+	}
+	mRunning.store(1);
+	mCrThread = std::thread(&T7Simulator::runCommand, this);
+	mSpThread = std::thread(&T7Simulator::runStream, this);
+	return 0;
+}
+
+void T7Simulator::stop()
+{
+	mRunning.store(0);
+	if(mCrThread.joinable())
+		mCrThread.join();
+	if(mSpThread.joinable())
+		mSpThread.join();
+	if(mCrListen >= 0)
+		close(mCrListen);
+	if(mSpListen >= 0)
+		close(mSpListen);
+	mCrListen = -1;
+	mSpListen = -1;
+}
+
+double T7Simulator::scanReadyTime(unsigned long long scanIndex) const
+{
+	const T7SimStream s = mStream;
+	unsigned long long samples = 0;
+
+	if(mStreamStart == 0 || s.scanRate <= 0 || s.numAddresses == 0 || s.samplesPerPacket == 0)
+		return 0;
+	//Samples up to the end of the packet holding the last sample of the scan
+	samples = ((scanIndex + 1)*s.numAddresses + s.samplesPerPacket - 1)/s.samplesPerPacket*s.samplesPerPacket;
+	return mStreamStart + (double)samples/(s.numAddresses*(double)s.scanRate);
+}
+
+int T7Simulator::beforePacket(unsigned long long, unsigned short *, unsigned short *, unsigned char *)
+{
+	return 0;
+}
+
+int T7Simulator::sendPacket(int sock, const unsigned char *packet, int size)
+{
+	return sendAll(sock, packet, size);
+}
+
+int T7Simulator::beforeCommand(unsigned char, unsigned short)
+{
+	return 0;
+}
+
+void T7Simulator::resetStreamConnection()
+{
+	int sock = mStreamSock.exchange(-1);
+	struct linger lin;
+
+	if(sock < 0)
+		return;
+	//RST instead of FIN
+	lin.l_onoff = 1;
+	lin.l_linger = 0;
+	setsockopt(sock, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+	close(sock);
+}
+
+/* Registers */
+
+void T7Simulator::writeRegisters(unsigned short address, unsigned int numRegisters, const unsigned char *data)
+{
+	unsigned int i = 0;
+	unsigned short value = 0;
+
+	std::lock_guard<std::mutex> lock(mRegisterLock);
+	for(i = 0; i < numRegisters; i++)
+	{
+		bytesToUint16(&data[i*BYTES_PER_REGISTER], &value);
+		mRegisters[address + i] = value;
+	}
+}
+
+void T7Simulator::readRegisters(unsigned short address, unsigned int numRegisters, unsigned char *data)
+{
+	DeviceCalibration cal;
+	unsigned int flashPtr = 0;
+	unsigned int i = 0;
+	unsigned int index = 0;
+
+	if(address == REG_FLASH_READ)
+	{
+		//Nominal calibration constants, in DeviceCalibration order
+		getNominalCalibration(&cal);
+		flashPtr = registerUint32(REG_FLASH_PTR);
+		index = (flashPtr - FLASH_CAL_ADDRESS)/4;
+		for(i = 0; i < numRegisters/2; i++)
+		{
+			if(index + i < sizeof(cal)/sizeof(float))
+				floatToBytes(((const float *)&cal)[index + i], &data[i*4]);
+			else
+				floatToBytes(0.0f, &data[i*4]);
+		}
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mRegisterLock);
+	for(i = 0; i < numRegisters; i++)
+	{
+		std::map<unsigned short, unsigned short>::const_iterator it = mRegisters.find(address + i);
+		uint16ToBytes(it == mRegisters.end() ? 0 : it->second, &data[i*BYTES_PER_REGISTER]);
+	}
+}
+
+unsigned int T7Simulator::registerUint32(unsigned short address)
+{
+	unsigned char data[4];
+	unsigned int value = 0;
+	readRegisters(address, 2, data);
+	bytesToUint32(data, &value);
+	return value;
+}
+
+float T7Simulator::registerFloat(unsigned short address)
+{
+	unsigned char data[4];
+	float value = 0;
+	readRegisters(address, 2, data);
+	bytesToFloat(data, &value);
+	return value;
+}
+
+/* Command/response port */
+
+void T7Simulator::runCommand()
+{
+	int sock = -1;
+
+	while(mRunning.load())
+	{
+		if(waitReadable(mCrListen) <= 0)
+			continue;
+		sock = accept(mCrListen, NULL, NULL);
+		if(sock < 0)
+			continue;
+		while(handleCommand(sock) == 0) {}
+		close(sock);
+		mEnable.store(0);
+	}
+}
+
+//Answers one Modbus command. Returns -1 when the connection is closed.
+int T7Simulator::handleCommand(int sock)
+{
+	unsigned char com[6 + 260];
+	unsigned char res[9 + 255];
+	unsigned short transID = 0;
+	unsigned short length = 0;
+	unsigned short address = 0;
+	unsigned short numRegisters = 0;
+	unsigned char function = 0;
+	int exception = 0;
+	int resSize = 0;
+
+	if(readExact(sock, com, 6, mRunning) != 0)
+		return -1;
+	bytesToUint16(com, &transID);
+	bytesToUint16(&com[4], &length);
+	if(length < 2 || length > 260 || readExact(sock, &com[6], length, mRunning) != 0)
+		return -1;
+	function = com[7];
+	bytesToUint16(&com[8], &address);
+	bytesToUint16(&com[10], &numRegisters);
+
+	exception = beforeCommand(function, address);
+	if(exception == 0 && function == 3 && numRegisters <= 127)
+	{
+		setModbusPacketHeader(res, transID, 3 + numRegisters*BYTES_PER_REGISTER, com[6]);
+		res[7] = 3;
+		res[8] = (unsigned char)(numRegisters*BYTES_PER_REGISTER);
+		readRegisters(address, numRegisters, &res[9]);
+		resSize = 9 + numRegisters*BYTES_PER_REGISTER;
+	}
+	else if(exception == 0 && function == 16 && numRegisters <= 127)
+	{
+		writeRegisters(address, numRegisters, &com[WRITE_MULT_REGS_COM_DATA_INDEX]);
+		if(address <= REG_STREAM_ENABLE && address + numRegisters > REG_STREAM_ENABLE)
+		{
+			if(registerUint32(REG_STREAM_ENABLE))
+			{
+				mStream.scanRate = registerFloat(REG_STREAM_SCANRATE_HZ);
+				mStream.numAddresses = registerUint32(REG_STREAM_NUM_ADDRESSES);
+				mStream.samplesPerPacket = registerUint32(REG_STREAM_SAMPLES_PER_PACKET);
+				mStream.numScans = registerUint32(REG_STREAM_NUM_SCANS);
+				mEnable.store(1);
+			}
+			else
+				mEnable.store(0);
+		}
+		setModbusPacketHeader(res, transID, 6, com[6]);
+		memcpy(&res[7], &com[7], 5);
+		resSize = WRITE_MULT_REGS_RESP_SIZE;
+	}
+	else
+	{
+		//Exception response, illegal function unless a fault says otherwise
+		setModbusPacketHeader(res, transID, 3, com[6]);
+		res[7] = function | 0x80;
+		res[8] = (unsigned char)(exception ? exception : 1);
+		resSize = 9;
+	}
+	return sendAll(sock, res, resSize);
+}
+
+/* Stream port */
+
+void T7Simulator::runStream()
+{
+	int sock = -1;
+	int noDelay = 1;
+
+	while(mRunning.load())
+	{
+		if(mStreamSock.load() < 0)
+		{
+			if(waitReadable(mSpListen) <= 0)
+				continue;
+			sock = accept(mSpListen, NULL, NULL);
+			if(sock < 0)
+				continue;
+			//One segment per send, so that split packets arrive split
+			setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+			mStreamSock.store(sock);
+		}
+		if(!mEnable.load())
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+		streamLoop(mStreamSock.load());
+		if(mEnable.load())
+		{
+			//The connection failed while streaming
+			resetStreamConnection();
+			mEnable.store(0);
+		}
+	}
+	resetStreamConnection();
+}
+
+void T7Simulator::streamLoop(int sock)
+{
+	const T7SimStream s = mStream;
+	const unsigned int capacityScans = mBufferBytes/(s.numAddresses*STREAM_BYTES_PER_SAMPLE);
+	unsigned char packet[TCP_MAX_PACKET_BYTES];
+	unsigned char raw[STREAM_MAX_SAMPLES_PER_PACKET_TCP*STREAM_BYTES_PER_SAMPLE];
+	unsigned long long produced = 0; //Scans produced by the device clock
+	unsigned long long storeEnd = 0; //Scans [emitScan, storeEnd) are in the buffer
+	unsigned long long emitScan = 0; //Next scan to send
+	unsigned long long skipStart = 0; //First scan lost in the current recovery
+	unsigned long long packetIndex = 0;
+	unsigned long long available = 0;
+	unsigned int emitChannel = 0; //Next channel of emitScan to send
+	unsigned int dummyLeft = 0; //Dummy samples left to send
+	unsigned int backlog = 0;
+	unsigned int i = 0;
+	unsigned short raw16 = 0;
+	unsigned short status = 0;
+	unsigned short additionalInfo = 0;
+	unsigned short endInfo = 0; //additionalInfo of the pending STREAM_AUTO_RECOVER_END
+	int recovering = 0;
+	int endPending = 0;
+	double now = 0;
+	double wait = 0;
+
+	if(s.scanRate <= 0 || s.numAddresses == 0 || s.numAddresses > MAX_NUM_STREAM_ADDR ||
+	   s.samplesPerPacket == 0 || s.samplesPerPacket > STREAM_MAX_SAMPLES_PER_PACKET_TCP || capacityScans == 0)
+	{
+		mEnable.store(0);
+		return;
+	}
+	mScansProduced.store(0);
+	mScansSkipped.store(0);
+	mPacketsSent.store(0);
+	mMaxBacklog.store(0);
+	mStreamStart = lsl::local_clock();
+	mStreaming.store(1);
+
+	while(mRunning.load() && mEnable.load() && mStreamSock.load() == sock)
+	{
+		now = lsl::local_clock();
+		produced = (unsigned long long)((now - mStreamStart)*s.scanRate);
+		mScansProduced.store(produced);
+
+		//Fill the buffer, or lose the new scans while it is full
+		if(!recovering)
+		{
+			storeEnd = produced;
+			if(storeEnd - emitScan > capacityScans)
+			{
+				recovering = 1;
+				storeEnd = emitScan + capacityScans;
+				skipStart = storeEnd;
+			}
+		}
+		else if(emitScan == storeEnd && dummyLeft == 0)
+		{
+			//Buffer empty. Mark the gap with a dummy scan and resume.
+			recovering = 0;
+			mScansSkipped.store(mScansSkipped.load() + (produced - skipStart));
+			endInfo = (unsigned short)(produced - skipStart > 0xFFFF ? 0xFFFF : produced - skipStart);
+			endPending = produced - skipStart > 0xFFFF ? 2 : 1;
+			dummyLeft = s.numAddresses;
+			emitScan = produced;
+			storeEnd = produced;
+		}
+
+		available = (storeEnd - emitScan)*s.numAddresses - emitChannel + dummyLeft;
+		if(available < s.samplesPerPacket)
+		{
+			//Sleep until the packet is complete
+			wait = (double)(s.samplesPerPacket - available)/(s.numAddresses*(double)s.scanRate);
+			if(recovering || wait > T7SIM_POLL_MS/1000.0)
+				wait = T7SIM_POLL_MS/1000.0;
+			std::this_thread::sleep_for(std::chrono::microseconds((long long)(wait*1e6) + 1));
+			continue;
+		}
+
+		status = 0;
+		additionalInfo = 0;
+		if(endPending)
+		{
+			status = endPending == 2 ? STREAM_STATUS_AUTO_RECOVER_END_OVERFLOW : STREAM_STATUS_AUTO_RECOVER_END;
+			additionalInfo = endInfo;
+			endPending = 0;
+		}
+		else if(recovering)
+			status = STREAM_STATUS_AUTO_RECOVER_ACTIVE;
+
+		for(i = 0; i < s.samplesPerPacket; i++)
+		{
+			if(dummyLeft > 0)
+			{
+				raw16 = 0xFFFF;
+				dummyLeft--;
+			}
+			else
+			{
+				if(emitChannel == 0)
+					raw16 = (unsigned short)(emitScan % T7SIM_INDEX_MODULO);
+				else
+					raw16 = (unsigned short)((emitScan*37 + emitChannel*1000) % T7SIM_INDEX_MODULO);
+				if(++emitChannel >= s.numAddresses)
+				{
+					emitChannel = 0;
+					emitScan++;
+				}
+			}
+			uint16ToBytes(raw16, &raw[i*STREAM_BYTES_PER_SAMPLE]);
+		}
+
+		backlog = (unsigned int)((storeEnd - emitScan)*s.numAddresses - emitChannel)*STREAM_BYTES_PER_SAMPLE;
+		if(backlog > mMaxBacklog.load())
+			mMaxBacklog.store(backlog);
+		if(beforePacket(packetIndex, &status, &additionalInfo, raw) == 0)
+		{
+			buildStreamPacket((unsigned short)packetIndex, (unsigned short)(backlog > 0xFFFF ? 0xFFFF : backlog), status,
+			                  additionalInfo, raw, s.samplesPerPacket, packet);
+			if(sendPacket(sock, packet, STREAM_HEADER_BYTES + s.samplesPerPacket*STREAM_BYTES_PER_SAMPLE) != 0)
+				break;
+			mPacketsSent.store(mPacketsSent.load() + 1);
+		}
+		packetIndex++;
+		if(status == STREAM_STATUS_SCAN_OVERLAP || status == STREAM_STATUS_AUTO_RECOVER_END_OVERFLOW ||
+		   status == STREAM_STATUS_BURST_COMPLETE)
+		{
+			//The T7 stops streaming after these
+			mEnable.store(0);
+			break;
+		}
+	}
+	mStreaming.store(0);
+}
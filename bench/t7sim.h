@@ -0,0 +1,125 @@
+/**
+ * Name: t7sim.h
+ * Desc: Provides a local stand-in for a T7 that speaks enough of the Modbus
+ *       TCP and spontaneous stream protocols for the publisher: register
+ *       reads and writes on the command/response port (calibration flash,
+ *       AIN and stream configuration, STREAM_ENABLE) and function 76 stream
+ *       packets on the stream port. Scans are produced at the configured
+ *       scan rate into a device buffer of bufferBytes. When the host does
+ *       not keep up the buffer overflows and the stand-in goes through auto
+ *       recovery like a T7: STREAM_AUTO_RECOVER_ACTIVE packets, then
+ *       STREAM_AUTO_RECOVER_END with the skipped scans and a dummy scan.
+ *
+ *       Channel 0 of scan k carries k modulo T7SIM_INDEX_MODULO, so an
+ *       inlet can check the data continuity and time each scan. The other
+ *       channels carry a sawtooth. Unix only.
+**/
+
+#ifndef T7SIM_H_
+#define T7SIM_H_
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
+
+//Scan index modulo in channel 0. 0xFFFF is the dummy sample.
+#define T7SIM_INDEX_MODULO 0xFFFF
+
+//T7 stream buffer default and maximum.
+#define T7SIM_DEFAULT_BUFFER_BYTES 32768
+
+//Stream configuration written by the publisher.
+typedef struct
+{
+	float scanRate;
+	unsigned int numAddresses;
+	unsigned int samplesPerPacket;
+	unsigned int numScans; //0 = continuous
+} T7SimStream;
+
+class T7Simulator
+{
+public:
+	T7Simulator();
+	~T7Simulator();
+
+	//Listens on 127.0.0.1 and starts the server threads. Returns -1 on
+	//error, 0 on success.
+	//crPort, spPort: The ports, 0 for any free port.
+	//bufferBytes: The device stream buffer.
+	int start(int crPort, int spPort, unsigned int bufferBytes);
+
+	//Stops the server threads and closes the sockets.
+	void stop();
+
+	int crPort() const { return mCrPort; }
+	int spPort() const { return mSpPort; }
+
+	//Stream clock (lsl::local_clock) time at which a scan was complete in
+	//a packet, when the device could send it. 0 before the stream started.
+	double scanReadyTime(unsigned long long scanIndex) const;
+
+	//Counters of the current or last stream.
+	unsigned long long scansProduced() const { return mScansProduced.load(); }
+	unsigned long long scansSkipped() const { return mScansSkipped.load(); }
+	unsigned long long packetsSent() const { return mPacketsSent.load(); }
+	unsigned int maxBacklogBytes() const { return mMaxBacklog.load(); }
+	int streaming() const { return mStreaming.load(); }
+	T7SimStream streamConfig() const { return mStream; }
+
+protected:
+	//Fault injection hooks. The defaults send every packet as it is.
+	//Called by the stream thread before each packet. Can change the status
+	//and additional info, or return 1 to drop the packet, 0 to send it.
+	virtual int beforePacket(unsigned long long packetIndex, unsigned short *status, unsigned short *additionalInfo,
+	                         unsigned char *rawData);
+
+	//Sends a stream packet, can split or delay it. Returns -1 on error.
+	virtual int sendPacket(int sock, const unsigned char *packet, int size);
+
+	//Called for each Modbus command. Return a Modbus exception code (1 to
+	//255) to answer with an exception, 0 to answer normally.
+	virtual int beforeCommand(unsigned char function, unsigned short address);
+
+	//Closes the stream connection, as a reset would.
+	void resetStreamConnection();
+
+private:
+	T7Simulator(const T7Simulator &);
+	T7Simulator &operator=(const T7Simulator &);
+
+	void runCommand();
+	void runStream();
+	int handleCommand(int sock);
+	void streamLoop(int sock);
+	void writeRegisters(unsigned short address, unsigned int numRegisters, const unsigned char *data);
+	void readRegisters(unsigned short address, unsigned int numRegisters, unsigned char *data);
+	unsigned int registerUint32(unsigned short address);
+	float registerFloat(unsigned short address);
+
+	int mCrListen;
+	int mSpListen;
+	int mCrPort;
+	int mSpPort;
+	std::atomic<int> mStreamSock;
+	unsigned int mBufferBytes;
+
+	std::map<unsigned short, unsigned short> mRegisters;
+	std::mutex mRegisterLock;
+	T7SimStream mStream;
+	std::atomic<int> mEnable; //STREAM_ENABLE as written
+	std::atomic<int> mStreaming;
+	double mStreamStart; //lsl::local_clock at STREAM_ENABLE
+
+	std::atomic<unsigned long long> mScansProduced;
+	std::atomic<unsigned long long> mScansSkipped;
+	std::atomic<unsigned long long> mPacketsSent;
+	std::atomic<unsigned int> mMaxBacklog;
+
+	std::thread mCrThread;
+	std::thread mSpThread;
+	std::atomic<int> mRunning;
+};
+
+#endif
@@ -0,0 +1,22 @@
+/**
+ * Name: allocwatch.h
+ * Desc: Provides heap allocation counters, per thread and for the whole
+ *       process. operator new and delete are always counted. Building with
+ *       LSLPUB_ALLOC_HOOKS (CMake option, Linux/glibc only) also interposes
+ *       malloc, calloc and realloc so C allocations are counted too.
+**/
+
+#ifndef ALLOCWATCH_H_
+#define ALLOCWATCH_H_
+
+//Returns the number of heap allocations made by the calling thread.
+unsigned long long threadAllocCount();
+
+//Returns the number of heap allocations made by the process.
+unsigned long long processAllocCount();
+
+//Returns 1 if malloc, calloc and realloc are counted, 0 if only operator new
+//is.
+int allocHooksEnabled();
+
+#endif
@@ -0,0 +1,117 @@
+/**
+ * Name: arrowipc.h
+ * Desc: Provides an Apache Arrow IPC writer for the calibrated scans, so
+ *       pandas or polars load them as DataFrames without parsing. Each
+ *       record batch holds one second of scans in the columns time
+ *       (timestamp[us, UTC]), scan_index (int64), lsl_time (float64) and
+ *       ch0, ch1, ... (float32). The stream thread copies the complete scans
+ *       of each packet into chunk buffers and never waits: when every buffer
+ *       is queued, the scans are dropped and counted. A writer thread
+ *       transposes each chunk into columns and writes it as a record batch,
+ *       to a file in the IPC file format (memory-mappable once closed), or
+ *       in the IPC stream format to the client of a Unix socket.
+**/
+
+#ifndef ARROWIPC_H_
+#define ARROWIPC_H_
+
+#include <atomic>
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+
+#include "budget.h"
+#include "chunkqueue.h"
+
+//Path prefix that selects the Unix socket output.
+#define ARROW_SOCKET_PREFIX "unix:"
+
+//Seconds of scans in a record batch, and seconds of batches the writer can
+//fall behind before scans are dropped.
+#define ARROW_BATCH_SEC 1.0
+#define ARROW_QUEUE_SEC 8.0
+#define ARROW_MIN_CHUNKS 4
+
+//Alignment of the column buffers in a record batch body.
+#define ARROW_ALIGN 64
+
+class ArrowWriter : public ChunkQueue
+{
+public:
+	ArrowWriter();
+	~ArrowWriter();
+
+	//Allocates the chunk buffers from the sink budget, creates the file or
+	//listens on the socket, and starts the writer thread. Returns -1 on
+	//error, 0 on success.
+	//path: The file, or unix:PATH to serve the stream on a Unix socket. A
+	//      client gets the schema then the batches written while it is
+	//      connected, one client at a time.
+	//scanRate: Scans per second.
+	//numAddresses: The number of float32 channels.
+	//budget: The memory budget of the stream.
+	int open(const char *path, float scanRate, unsigned int numAddresses, MemoryBudget *budget);
+
+	//Appends complete scans. Never blocks. Call it from the stream thread.
+	//scans: numScans*numAddresses samples.
+	//firstScan: Index of the first scan.
+	//lastScanTime: LSL time of the last scan, the others are spaced at the
+	//              nominal rate before it.
+	void write(const float *scans, unsigned int numScans, unsigned long long firstScan, double lastScanTime);
+
+	//Queues the last partial batch, writes everything queued, the end of
+	//stream and the file footer, and closes the output.
+	void close();
+
+	bool isOpen() const { return mArena != NULL; }
+
+	unsigned long long scansWritten() const { return mScansWritten.load(std::memory_order_relaxed); }
+	unsigned long long droppedScans() const { return mQueueStats.droppedScans.load(std::memory_order_relaxed); }
+	const ChunkQueueStats *stats() const { return &mQueueStats; }
+
+private:
+	ArrowWriter(const ArrowWriter &);
+	ArrowWriter &operator=(const ArrowWriter &);
+
+	//Location of a message in the file, for the footer.
+	typedef struct
+	{
+		unsigned long long offset;
+		unsigned int metaBytes; //Prefix and metadata
+		unsigned long long bodyBytes;
+	} Block;
+
+	unsigned int writeChunks(unsigned long long first, unsigned int count);
+	void poll();
+	void idle();
+	void finish();
+	size_t buildSchema(std::vector<unsigned char> &fb) const;
+	int writeMessage(const unsigned char *body, unsigned long long bodyBytes);
+	int writeSchema();
+	int writeBatch(const ScanChunkHeader *header);
+	int writeFooter();
+	int writeBytes(const void *data, unsigned long long bytes);
+	void acceptClient();
+	void dropClient();
+	void closeSocket();
+
+	char mPath[256];
+	bool mSocket; //Unix socket output, else file
+	long long mUnixOffsetUs; //Unix time minus LSL time, in microseconds
+
+	unsigned char *mArena; //allocAligned block holding the buffers
+	unsigned char *mBody; //Columns of a record batch
+	std::atomic<unsigned long long> mScansWritten;
+	ChunkQueueStats mQueueStats;
+
+	//Writer thread side
+	FILE *mFile;
+	int mListenFd;
+	int mClientFd;
+	int mError;
+	unsigned long long mOffset; //Bytes written to the file
+	std::vector<unsigned char> mMeta; //Flatbuffer being built
+	std::vector<Block> mBlocks; //Record batches of the file
+};
+
+#endif
@@ -0,0 +1,106 @@
+/**
+ * Name: blackbox.h
+ * Desc: Provides a crash-safe "black box" of the last minutes of calibrated
+ *       scans: a fixed-size ring in a memory-mapped file, with a header
+ *       holding the write cursor and a timestamp anchor. Writing scans is a
+ *       memcpy into the mapping, a thread syncs it to disk periodically, and
+ *       the file can be recovered after a crash of the process or of the
+ *       host up to the last synced scan. Unix only.
+**/
+
+#ifndef BLACKBOX_H_
+#define BLACKBOX_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#define BLACKBOX_MAGIC "LJT7BBX1"
+#define BLACKBOX_MAGIC_BYTES 8
+#define BLACKBOX_VERSION 1
+#define BLACKBOX_BYTE_ORDER_MARK 0x01020304
+
+//Bytes of the header, the first page of the file. The ring follows it.
+#define BLACKBOX_HEADER_BYTES 4096
+
+//Sync periods of scans the ring keeps on top of the requested minutes, so
+//that scans written after the last sync can not overwrite the recovered
+//ones.
+#define BLACKBOX_GUARD_PERIODS 2
+
+//Header of a black box file. The fields after capacityScans are updated
+//while streaming.
+typedef struct
+{
+	char magic[BLACKBOX_MAGIC_BYTES];
+	unsigned int version;
+	unsigned int byteOrderMark;
+	unsigned int numAddresses;
+	unsigned int reserved;
+	double scanRate;
+	unsigned long long capacityScans; //Scans in the ring
+	unsigned long long guardScans; //Scans of the ring not recovered
+
+	std::atomic<unsigned long long> writtenScans; //Scans written since the start, the cursor is writtenScans % capacityScans
+	std::atomic<unsigned long long> syncedScans; //writtenScans at the last completed sync
+
+	//Anchor of the timestamps: time of the last scan written.
+	std::atomic<unsigned long long> anchorScan; //Index of that scan, starting at 0
+	std::atomic<double> anchorLslTime; //LSL clock, as the outlet timestamps
+	std::atomic<long long> anchorUnixNs; //Wall clock
+} BlackBoxHeader;
+
+class BlackBox
+{
+public:
+	BlackBox();
+	~BlackBox();
+
+	//Creates the file, maps it and starts the sync thread. Every page is
+	//allocated on disk and mapped before streaming. Returns -1 on error, 0
+	//on success.
+	//path: The black box file, truncated.
+	//scanRate: Scans per second.
+	//numAddresses: The number of samples per scan.
+	//minutes: Minutes of scans kept.
+	//syncSec: Seconds between two syncs to disk.
+	int open(const char *path, float scanRate, unsigned int numAddresses, double minutes, double syncSec);
+
+	//Copies complete scans into the ring and moves the anchor to the last
+	//one. No system call.
+	//scans: numScans*numAddresses samples.
+	void write(const float *scans, unsigned int numScans);
+
+	//Syncs the ring a last time, stops the sync thread and unmaps the file.
+	void close();
+
+	bool isOpen() const { return mHeader != NULL; }
+
+	const BlackBoxHeader *header() const { return mHeader; }
+
+private:
+	BlackBox(const BlackBox &);
+	BlackBox &operator=(const BlackBox &);
+
+	void run();
+	int sync();
+
+	int mFd;
+	size_t mMapBytes;
+	BlackBoxHeader *mHeader;
+	float *mRing;
+	double mSyncSec;
+
+	std::thread mThread;
+	std::mutex mMutex;
+	std::condition_variable mWake;
+	int mRunning; //Guarded by mMutex
+};
+
+//Writes the scans of a black box file recovered up to its last sync to a CSV
+//file (scan index, LSL time, Unix time, samples). Returns -1 on error, 0 on
+//success.
+int recoverBlackBox(const char *path, const char *csvPath);
+
+#endif
@@ -0,0 +1,90 @@
+/**
+ * Name: blockpool.h
+ * Desc: Provides a pool of fixed-size, cache line aligned blocks shared by the
+ *       stages of the acquisition pipeline (raw stream packets, converted
+ *       samples, outbound chunks). Blocks are borrowed through reference
+ *       counted handles and go back to the pool when the last handle is
+ *       released, so any stage can hold on to a block without copying it.
+ *       Nothing is allocated after init.
+**/
+
+#ifndef BLOCKPOOL_H_
+#define BLOCKPOOL_H_
+
+#include <atomic>
+
+class BlockPool;
+
+//Reference counted handle on a pool block. Copying the handle shares the
+//block, the block is returned when the last copy is released or destroyed.
+class BlockHandle
+{
+public:
+	BlockHandle();
+	BlockHandle(const BlockHandle &other);
+	BlockHandle &operator=(const BlockHandle &other);
+	~BlockHandle();
+
+	//Drops this reference. The handle is invalid afterwards.
+	void release();
+
+	bool valid() const { return mPool != 0; }
+
+	//Start of the block, aligned to BUDGET_CACHE_LINE.
+	unsigned char *data() const;
+
+	//Capacity of the block in bytes.
+	unsigned int capacity() const;
+
+	//Bytes of the block filled by the stage that wrote it. Shared by all the
+	//handles of the block.
+	unsigned int length() const;
+	void setLength(unsigned int length);
+
+private:
+	friend class BlockPool;
+	BlockHandle(BlockPool *pool, unsigned int index);
+
+	BlockPool *mPool;
+	unsigned int mIndex;
+};
+
+class BlockPool
+{
+public:
+	BlockPool();
+	~BlockPool();
+
+	//Allocates numBlocks blocks of blockBytes bytes (rounded up to a cache
+	//line). Returns -1 on error, 0 on success.
+	int init(unsigned int blockBytes, unsigned int numBlocks);
+
+	//Borrows a free block. Returns an invalid handle if every block is in use.
+	BlockHandle acquire();
+
+	unsigned int blockSize() const { return mBlockBytes; }
+	unsigned int numBlocks() const { return mNumBlocks; }
+	unsigned int numFree() const { return mNumFree.load(std::memory_order_relaxed); }
+
+private:
+	friend class BlockHandle;
+	BlockPool(const BlockPool &);
+	BlockPool &operator=(const BlockPool &);
+
+	void retain(unsigned int index);
+	void put(unsigned int index);
+
+	unsigned char *mArena;
+	unsigned int mBlockBytes;
+	unsigned int mNumBlocks;
+	std::atomic<int> *mRefs;
+	unsigned int *mLengths;
+
+	//Stack of free block indexes. Handles can be released from any thread.
+	unsigned int *mFreeList;
+	unsigned int mFreeTop;
+	std::atomic<unsigned int> mNumFree;
+	std::atomic_flag mLock;
+};
+
+#endif
@@ -0,0 +1,81 @@
+/**
+ * Name: budget.h
+ * Desc: Provides the memory budget of the acquisition. The budget is split
+ *       once at startup between the packet and sample block pools, the LSL
+ *       outlet buffer and the sinks, and every acquisition buffer is
+ *       allocated up front from that split.
+**/
+
+#ifndef BUDGET_H_
+#define BUDGET_H_
+
+#include <stddef.h>
+
+//Alignment of the acquisition buffers
+#define BUDGET_CACHE_LINE 64
+
+//Seconds of stream packets the packet and sample block pools cover, and the
+//minimum number of blocks they get.
+#define BUDGET_RING_SEC 2.0
+#define BUDGET_MIN_PACKETS 8
+
+//Minimum seconds of samples the LSL outlet must be able to buffer, and the
+//maximum it gets (liblsl's default).
+#define BUDGET_MIN_OUTLET_SEC 1.0
+#define BUDGET_MAX_OUTLET_SEC 360.0
+
+//Approximate bookkeeping bytes liblsl keeps per buffered sample on top of the
+//channel data.
+#define BUDGET_LSL_SAMPLE_OVERHEAD 64
+
+//Split of a memory budget.
+typedef struct
+{
+	unsigned long long totalBytes;
+
+	//Packet blocks: whole stream responses (header + raw samples).
+	unsigned int packetBytes; //Bytes of one block, cache line aligned
+	unsigned int numPackets;
+
+	//Sample blocks: calibrated samples of one packet plus one partial scan.
+	unsigned int blockSamples; //Floats per block
+	unsigned int blockBytes; //Bytes of one block, cache line aligned
+	unsigned int numBlocks;
+
+	//LSL outlet buffer.
+	unsigned long long outletBytes;
+	int outletMaxBuffered; //max_buffered argument of lsl::stream_outlet
+
+	//Left for the sinks. reserveSinkMemory takes from it.
+	unsigned long long sinkBytes;
+	unsigned long long sinkUsedBytes;
+} MemoryBudget;
+
+//Splits budgetBytes between the acquisition buffers of a stream. Returns -1
+//if the stream configuration does not fit in the budget, 0 on success.
+//budgetBytes: The total memory budget in bytes.
+//scanRate: Scans per second.
+//numAddresses: The number of samples per scan.
+//samplesPerPacket: The number of samples in one stream packet.
+//budget: The returned split.
+int planMemoryBudget(unsigned long long budgetBytes, float scanRate,
+                     unsigned int numAddresses, unsigned int samplesPerPacket,
+                     MemoryBudget *budget);
+
+//Takes bytes from the sink share of the budget. Returns -1 if the sink share
+//can not fit them, 0 on success.
+//name: The sink name, for the error message.
+int reserveSinkMemory(MemoryBudget *budget, const char *name,
+                      unsigned long long bytes);
+
+//Prints the split of the budget to the terminal.
+void printMemoryBudget(const MemoryBudget *budget);
+
+//Allocates size bytes aligned to BUDGET_CACHE_LINE. The memory is touched so
+//it is resident before streaming. Returns NULL on error.
+void *allocAligned(size_t size);
+
+//Frees memory returned by allocAligned.
+void freeAligned(void *ptr);
+
+#endif
@@ -0,0 +1,115 @@
+/**
+ * Name: capture.h
+ * Desc: Provides the capture file of a stream and its reader. A capture
+ *       holds the stream configuration, the calibration constants and every
+ *       raw function 76 response read from the stream port with its receive
+ *       time, so that a stream can be fed again through the same packet
+ *       checks, conversion and LSL push without a device. The file is
+ *       written in the byte order and layout of the host.
+**/
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <atomic>
+#include <stdio.h>
+
+#include "budget.h"
+#include "calibration.h"
+#include "chunkqueue.h"
+#include "stream.h"
+
+#define CAPTURE_MAGIC "LJT7CAP1"
+#define CAPTURE_MAGIC_BYTES 8
+#define CAPTURE_VERSION 1
+#define CAPTURE_BYTE_ORDER_MARK 0x01020304
+
+//stdio buffer of the writer thread, and bytes of packets queued for it,
+//taken from the sink budget.
+#define CAPTURE_WRITE_BUFFER_BYTES (1024*1024)
+#define CAPTURE_QUEUE_BYTES (4*1024*1024)
+#define CAPTURE_MIN_CHUNKS 16
+
+//Stream configuration and calibration of a capture.
+typedef struct
+{
+	float scanRate;
+	unsigned int numAddresses;
+	unsigned int samplesPerPacket;
+	unsigned int scanListAddresses[MAX_NUM_STREAM_ADDR];
+	unsigned int gainList[MAX_NUM_STREAM_ADDR];
+	DeviceCalibration devCal;
+} CaptureHeader;
+
+//Writes a capture. The stream thread copies each packet into a chunk
+//buffer and never waits for the disk: when every buffer is queued, the
+//packet is dropped and counted. A writer thread writes the queued packets.
+class CaptureWriter : public ChunkQueue
+{
+public:
+	CaptureWriter();
+	~CaptureWriter();
+
+	//Creates the file, writes the header and starts the writer thread.
+	//Returns -1 on error, 0 on success.
+	//budget: The write and chunk buffers are reserved from its sink share.
+	int open(const char *path, const CaptureHeader *header, MemoryBudget *budget);
+
+	//Queues a stream response. Never blocks. Call it from the stream
+	//thread. Returns -1 if the response was dropped, 0 on success.
+	//receiveNs: monotonicNs when the response was read.
+	int write(unsigned long long receiveNs, const unsigned char *packet, int size);
+
+	//Writes everything queued, stops the writer thread and closes the file.
+	void close();
+
+	bool isOpen() const { return mArena != NULL; }
+	unsigned long long packets() const { return mPackets.load(std::memory_order_relaxed); }
+	unsigned long long droppedPackets() const { return mDroppedPackets.load(std::memory_order_relaxed); }
+	const ChunkQueueStats *queueStats() const { return &mQueueStats; }
+
+private:
+	CaptureWriter(const CaptureWriter &);
+	CaptureWriter &operator=(const CaptureWriter &);
+
+	unsigned int writeChunks(unsigned long long first, unsigned int count);
+
+	unsigned char *mArena; //allocAligned block holding the buffers
+	unsigned int mMaxPacketBytes;
+	std::atomic<unsigned long long> mPackets; //Packets written
+	std::atomic<unsigned long long> mDroppedPackets; //Packets dropped because every chunk was queued
+	ChunkQueueStats mQueueStats;
+
+	//Writer thread side
+	FILE *mFile;
+	int mError; //A write failed, reported once
+};
+
+//Reads a capture.
+class CaptureReader
+{
+public:
+	CaptureReader();
+	~CaptureReader();
+
+	//Opens a capture and reads its header. Returns -1 on error, 0 on
+	//success.
+	int open(const char *path, CaptureHeader *header);
+
+	//Reads the next stream response. Returns 1 if a response was read, 0 at
+	//the end of the capture, -1 on error.
+	//receiveNs: The returned receive time.
+	//packet: The returned response, maxSize bytes.
+	//size: The returned response size.
+	int read(unsigned long long *receiveNs, unsigned char *packet, int maxSize, int *size);
+
+	void close();
+
+private:
+	CaptureReader(const CaptureReader &);
+	CaptureReader &operator=(const CaptureReader &);
+
+	FILE *mFile;
+};
+
+#endif
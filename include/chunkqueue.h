@@ -0,0 +1,123 @@
+/**
+ * Name: chunkqueue.h
+ * Desc: Provides the chunk queue shared by the sinks (recorder, XDF, Arrow,
+ *       PostgreSQL). The stream thread fills fixed-size chunk buffers in
+ *       order and never waits: when every buffer is queued, the scans are
+ *       dropped and counted. A writer thread hands the queued chunks to the
+ *       sink, which derives from the queue and only encodes and writes
+ *       them.
+**/
+
+#ifndef CHUNKQUEUE_H_
+#define CHUNKQUEUE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+//Milliseconds the writer sleeps when it missed a wake up.
+#define CHUNKQUEUE_POLL_MS 100
+
+//Counters of a chunk queue. Written by the stream and writer threads, read
+//by any thread.
+typedef struct
+{
+	std::atomic<unsigned int> queueDepth; //Full chunks waiting for the writer
+	std::atomic<unsigned int> maxQueueDepth;
+	std::atomic<unsigned int> queueCapacity;
+	std::atomic<unsigned long long> droppedScans; //Scans dropped because every chunk was queued
+} ChunkQueueStats;
+
+//Header of a chunk buffer filled by appendScans, the scans follow it.
+typedef struct
+{
+	unsigned long long firstScan;
+	double firstTime; //LSL time of the first scan
+	unsigned int numScans;
+	unsigned int reserved;
+} ScanChunkHeader;
+
+class ChunkQueue
+{
+public:
+	ChunkQueue();
+	virtual ~ChunkQueue();
+
+protected:
+	//Starts the writer thread on the chunk buffers. Set mChunks, mChunkBytes
+	//and mNumChunks first, and mScanRate, mNumAddresses and mChunkScans for
+	//appendScans. Returns -1 if the thread could not start, 0 on success.
+	//stats: The counters of the queue, written until closeQueue.
+	//threadName: Name of the writer thread, a string literal.
+	int openQueue(ChunkQueueStats *stats, const char *threadName);
+
+	//Queues the partial chunk of appendScans, waits for the writer to write
+	//everything queued and stops it.
+	void closeQueue();
+
+	//Chunk buffers are filled and written in order.
+	unsigned char *chunk(unsigned long long n) const { return mChunks + (n % mNumChunks)*mChunkBytes; }
+
+	//Returns the chunk being filled, NULL if none is and the writer has not
+	//freed the next buffer. Stream thread only.
+	unsigned char *fillChunk() const;
+
+	//Queues the chunk being filled for the writer. Stream thread only.
+	void submit();
+
+	//Counts scans dropped by the stream thread.
+	void dropScans(unsigned long long numScans);
+
+	//Copies complete scans into ScanChunkHeader chunks of mChunkScans scans
+	//and queues the full ones. Never blocks. Stream thread only.
+	//scans: numScans*mNumAddresses samples.
+	//firstScan: Index of the first scan.
+	//lastScanTime: LSL time of the last scan, the others are spaced at the
+	//              nominal rate before it, unlike the outlet's times.
+	void appendScans(const float *scans, unsigned int numScans, unsigned long long firstScan, double lastScanTime);
+
+	//True until closeQueue, for a sink that keeps chunks queued.
+	bool running() const { return mRunning.load() != 0; }
+
+	//Writer thread hooks. writeChunks gets count > 0 queued chunks from
+	//chunk first and returns the number it is done with, 0 to be called
+	//again after CHUNKQUEUE_POLL_MS. poll is called before each look at the
+	//queue, idle before each wait on an empty queue and finish once
+	//everything is written.
+	virtual unsigned int writeChunks(unsigned long long first, unsigned int count) = 0;
+	virtual void poll();
+	virtual void idle();
+	virtual void finish();
+
+	float mScanRate;
+	unsigned int mNumAddresses;
+	unsigned int mChunkScans; //Scans of a full chunk
+	unsigned int mChunkBytes; //Bytes of a chunk buffer, with its header
+
+	unsigned char *mChunks;
+	unsigned int mNumChunks;
+
+	//Stream thread side
+	unsigned int mFill; //Scans in the chunk being filled by appendScans
+
+private:
+	ChunkQueue(const ChunkQueue &);
+	ChunkQueue &operator=(const ChunkQueue &);
+
+	void run();
+	void wait();
+
+	//Chunk n is free once mCompleted > n - mNumChunks
+	std::atomic<unsigned long long> mSubmitted;
+	std::atomic<unsigned long long> mCompleted;
+	ChunkQueueStats *mStats;
+	const char *mThreadName;
+
+	std::thread mThread;
+	std::mutex mMutex;
+	std::condition_variable mWake;
+	std::atomic<int> mRunning;
+};
+
+#endif
@@ -0,0 +1,48 @@
+/**
+ * Name: codec.h
+ * Desc: Provides a lossless codec for blocks of raw 16-bit stream samples.
+ *       Each channel is coded on its own: the first sample as is, then the
+ *       differences between consecutive samples, zigzag encoded so small
+ *       negative and positive steps both give small values, and bit-packed
+ *       in blocks of CODEC_BLOCK_VALUES with the width of the largest value
+ *       in the block. Values are packed in 8 interleaved 16-bit lanes, the
+ *       lanes of an SSE2 register, or of a plain loop on other CPUs. Both
+ *       give the same bytes. Nothing is allocated.
+**/
+
+#ifndef CODEC_H_
+#define CODEC_H_
+
+//Codecs of the recorder chunks.
+#define CODEC_RAW 0 //Samples as the T7 sends them
+#define CODEC_DELTA 1 //Per channel delta, zigzag and bit-packing
+
+//Values per bit-packed block, and lanes of the packing.
+#define CODEC_BLOCK_VALUES 128
+#define CODEC_LANES 8
+
+//Returns the largest number of bytes encodeSamples can produce.
+//numScans: The number of scans.
+//numAddresses: The number of samples per scan.
+unsigned int codecMaxEncodedBytes(unsigned int numScans, unsigned int numAddresses);
+
+//Encodes whole scans of raw samples with CODEC_DELTA. Returns the encoded
+//bytes.
+//rawData: numScans*numAddresses samples, 2 bytes each, as the T7 sends them.
+//out: The encoded samples, at least codecMaxEncodedBytes bytes.
+unsigned int encodeSamples(const unsigned char *rawData, unsigned int numScans, unsigned int numAddresses, unsigned char *out);
+
+//Decodes samples encoded by encodeSamples. Returns -1 if the encoded data
+//is invalid, 0 on success.
+//in: The encoded samples, inBytes bytes.
+//rawData: The returned samples, numScans*numAddresses samples of 2 bytes.
+int decodeSamples(const unsigned char *in, unsigned int inBytes, unsigned int numScans, unsigned int numAddresses, unsigned char *rawData);
+
+//Parses a codec name: raw or delta. Returns the CODEC_X value, -1 if the
+//name is unknown.
+int codecByName(const char *name);
+
+//Returns the name of a CODEC_X value.
+const char *codecName(int codec);
+
+#endif
@@ -0,0 +1,84 @@
+/**
+ * Name: config.h
+ * Desc: Provides the run-time configuration of the publisher and the parsing
+ *       of its command line options.
+**/
+
+#ifndef CONFIG_H_
+#define CONFIG_H_
+
+#define CONFIG_MAX_IP_LENGTH 64
+#define CONFIG_MAX_PATH_LENGTH 256
+
+//Publisher settings. Filled with defaults by getDefaultConfig and overridden
+//by the command line options in parseConfig.
+typedef struct
+{
+	char ipAddress[CONFIG_MAX_IP_LENGTH];
+	int crPort; //Command/response TCP port (most operations)
+	int spPort; //Spontaneous stream TCP port
+
+	float scanRate; //Scans per second
+	unsigned int numAddresses; //AIN0 - AIN(numAddresses-1) are streamed
+	unsigned int samplesPerPacket;
+
+	unsigned long long memBudgetBytes; //Shared by all acquisition buffers
+
+	double statsPeriodSec; //Period of the stream status report
+	int statsFormat; //STATS_FORMAT_TEXT or STATS_FORMAT_JSON
+
+	int metricsPort; //> 0: serve Prometheus metrics on 127.0.0.1 at that port
+
+	unsigned int traceEvents; //> 0: trace the pipeline, spans kept per thread
+	char traceFile[CONFIG_MAX_PATH_LENGTH]; //Chrome trace event JSON written on SIGUSR2 and at exit
+
+	int perfCounters; //1: count cycles, instructions, cache and branch misses of the conversion and publish stages
+
+	int diagnostics; //1: publish the health of each packet on a second LSL outlet
+
+	double latencyPrintSec; //Period of the stage latency summary, 0 = only when the stream stops
+	int latencyResetOnPrint; //1: clear the stage latencies after each summary
+
+	unsigned int allocCheckPackets; //> 0: run the allocation check on that many synthetic packets instead of streaming
+
+	char captureFile[CONFIG_MAX_PATH_LENGTH]; //Not empty: record the raw stream packets in that capture file
+	char replayFile[CONFIG_MAX_PATH_LENGTH]; //Not empty: replay that capture file instead of streaming
+	double replaySpeed; //Replay speed, 1 = real time, 0 = as fast as possible
+	char rawTeeFile[CONFIG_MAX_PATH_LENGTH]; //Not empty: splice a byte-exact copy of the stream socket to that file
+
+	char blackBoxFile[CONFIG_MAX_PATH_LENGTH]; //Not empty: keep the last scans in that memory-mapped ring file
+	double blackBoxMinutes; //Minutes of scans in the black box
+	double blackBoxSyncSec; //Seconds between two syncs of the black box to disk
+	char recoverFile[CONFIG_MAX_PATH_LENGTH]; //Not empty: print the scans of that black box file as CSV instead of streaming
+
+	char recordPrefix[CONFIG_MAX_PATH_LENGTH]; //Not empty: record the raw samples in segments PREFIX_NNNNNN.t7r
+	double recordChunkSec; //Duration of a recorder chunk
+	double recordSegmentSec; //Duration of a recorder segment
+	int recordSync; //RECORDER_SYNC_X
+	int recordCodec; //CODEC_X of the recorded chunks
+	int recordSummaries; //1 to write the min/max/mean summaries of the recording
+
+	char extractPath[CONFIG_MAX_PATH_LENGTH]; //Not empty: extract a time range of that recording instead of streaming
+	double extractFrom; //First LSL time of the extracted range
+	double extractTo; //Last LSL time of the extracted range, 0 = to the end
+	char extractChannels[CONFIG_MAX_PATH_LENGTH]; //"all" or scan list positions, comma separated
+	int extractFormat; //RECORDING_FORMAT_X
+	unsigned int extractLevel; //Scans per summary bin, 0 = the recorded scans
+
+	char xdfFile[CONFIG_MAX_PATH_LENGTH]; //Not empty: write the scans to that XDF file
+
+	char pgConninfo[CONFIG_MAX_PATH_LENGTH]; //Not empty: write the scans to PostgreSQL with that libpq connection string
+	char pgTable[CONFIG_MAX_PATH_LENGTH]; //Table of the scans
+
+	char arrowPath[CONFIG_MAX_PATH_LENGTH]; //Not empty: write Arrow IPC record batches to that file, or to unix:PATH
+} PublisherConfig;
+
+//Fills cfg with the default settings.
+void getDefaultConfig(PublisherConfig *cfg);
+
+//Overrides the settings in cfg with the command line options. A first
+//argument that is not an option is taken as the IP address, as in earlier
+//versions. Returns -1 on error, 0 on success.
+int parseConfig(int argc, const char *argv[], PublisherConfig *cfg);
+
+#endif
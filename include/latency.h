@@ -0,0 +1,90 @@
+/**
+ * Name: latency.h
+ * Desc: Provides fixed-size latency histograms with HDR-style log-linear
+ *       buckets (about 3% relative error from 1 ns to 18 minutes) and the
+ *       per-stage latencies of the stream pipeline, from the socket receive
+ *       to the LSL push. Recording is a few relaxed atomic operations and
+ *       never allocates. One thread records, any thread can read.
+**/
+
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include <atomic>
+
+//Each power of 2 is split in 2^LATENCY_SUB_BUCKET_BITS linear buckets.
+#define LATENCY_SUB_BUCKET_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+//Values are clamped to 2^LATENCY_MAX_EXP ns.
+#define LATENCY_MAX_EXP 40
+#define LATENCY_NUM_BUCKETS ((LATENCY_MAX_EXP - LATENCY_SUB_BUCKET_BITS + 2) * LATENCY_SUB_BUCKETS)
+
+typedef struct
+{
+	std::atomic<unsigned long long> counts[LATENCY_NUM_BUCKETS];
+	std::atomic<unsigned long long> total;
+	std::atomic<unsigned long long> sum; //ns
+	std::atomic<unsigned long long> max;
+
+	//Count and sum since latencyClear, kept by latencyReset so they only go
+	//up (Prometheus counters).
+	std::atomic<unsigned long long> allTotal;
+	std::atomic<unsigned long long> allSum; //ns
+} LatencyHistogram;
+
+//Stages of the stream pipeline.
+enum LatencyStage
+{
+	LATENCY_RECEIVE = 0, //Socket receive of a stream response
+	LATENCY_VALIDATE, //Header and transaction ID checks
+	LATENCY_CONVERT, //Raw samples to calibrated voltages
+	LATENCY_ASSEMBLE, //Scan assembly across packets
+	LATENCY_PUSH, //LSL push_chunk
+	LATENCY_TOTAL, //Packet arrival to the end of the LSL push
+	LATENCY_NUM_STAGES
+};
+
+typedef struct
+{
+	LatencyHistogram stages[LATENCY_NUM_STAGES];
+	std::atomic<unsigned long long> convertedSamples; //Raw samples timed by LATENCY_CONVERT, cleared with it
+	std::atomic<int> resetRequested;
+} StageLatencies;
+
+//Returns a monotonic timestamp in nanoseconds (CLOCK_MONOTONIC on Unix,
+//QueryPerformanceCounter on Windows).
+unsigned long long monotonicNs();
+
+//Records one value in a histogram. Only one thread may record in a
+//histogram.
+void latencyRecord(LatencyHistogram *hist, unsigned long long ns);
+
+//Returns the value at the given percentile (0 to 100) of a histogram, 0 if
+//it is empty. The value is the upper bound of its bucket.
+unsigned long long latencyPercentile(const LatencyHistogram *hist, double percentile);
+
+//Clears the buckets, count, sum and max of a histogram, and keeps allTotal
+//and allSum. Call it from the recording thread.
+void latencyReset(LatencyHistogram *hist);
+
+//Clears all of a histogram. Call it before the first record.
+void latencyClear(LatencyHistogram *hist);
+
+//Clears all of all the stages. Call it before the stream starts.
+void resetStageLatencies(StageLatencies *lat);
+
+//Asks the recording thread to reset all the stages. Safe from any thread and
+//from signal handlers.
+void requestStageLatenciesReset(StageLatencies *lat);
+
+//Resets all the stages (latencyReset) and the converted samples if a reset
+//was requested. Call it from the recording thread.
+void checkStageLatenciesReset(StageLatencies *lat);
+
+//Returns the name of a stage.
+const char *latencyStageName(int stage);
+
+//Prints count, p50, p99, p99.9 and max of each stage to the terminal.
+void printStageLatencies(const StageLatencies *lat);
+
+#endif
@@ -0,0 +1,62 @@
+/**
+ * Name: metrics.h
+ * Desc: Provides an optional local HTTP endpoint that serves the stream
+ *       counters and stage latencies in the Prometheus text format. The
+ *       server runs in its own thread and only reads the atomics the stream
+ *       thread updates, so a scrape costs nothing on the stream thread.
+**/
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <atomic>
+#include <thread>
+
+#include "publisher.h"
+#include "tcp.h"
+
+//Largest /metrics response.
+#define METRICS_MAX_RESPONSE_BYTES 16384
+
+//Serves GET /metrics on 127.0.0.1.
+class MetricsServer
+{
+public:
+	MetricsServer();
+	~MetricsServer();
+
+	//Starts listening and the server thread. Returns -1 on error, 0 on
+	//success.
+	//port: The local TCP port.
+	//publisher: The publisher whose counters, latencies and LSL consumers
+	//           are served.
+	//scanRate: The configured scan rate, served next to the scan counter
+	//          so the timed rate can be compared to it.
+	int start(int port, StreamPublisher *publisher, float scanRate);
+
+	//Stops the server thread and closes the socket.
+	void stop();
+
+private:
+	MetricsServer(const MetricsServer &);
+	MetricsServer &operator=(const MetricsServer &);
+
+	void run();
+	void serve(TCP_SOCKET client);
+	int formatMetrics();
+	void append(const char *format, ...);
+	void appendSocketMetric(const char *name, const char *help, std::atomic<int> SocketStats::*field);
+
+	StreamPublisher *mPublisher;
+	float mScanRate;
+	double mStartTime;
+	TCP_SOCKET mSock;
+
+	std::thread mThread;
+	std::atomic<int> mRunning;
+
+	char mBody[METRICS_MAX_RESPONSE_BYTES];
+	int mBodySize;
+};
+
+#endif
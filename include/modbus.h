@@ -63,6 +63,10 @@ int readMultipleRegistersTCP(TCP_SOCKET socket, unsigned short address,
 int writeMultipleRegistersTCP(TCP_SOCKET socket, unsigned short address,
                               unsigned char numRegisters, const unsigned char *data);
 
+//Returns the number of Modbus requests sent by readMultipleRegistersTCP and
+//writeMultipleRegistersTCP so far. Not thread safe, for startup profiling.
+unsigned int getModbusRoundTrips();
+
 //Reads the error code (Address 55000) from the LabJack device.
 //Returns -1 on error and 0 on success.
 //socket: The T7's socket. The socket needs to be on port 502.
@@ -88,7 +92,7 @@ unsigned short getNextTransactionID();
 //length: The length of the Modbus command
 //unitID: The unit ID of the Modbus command.
 void setModbusPacketHeader(unsigned char *packet, unsigned short transID,
-                           unsigned char length, unsigned char unitID);
+                           unsigned short length, unsigned char unitID);
 
 //Checks a Modbus response for errors. Returns -1 if an error is detected, 0 if
 //the response seems valid.
@@ -0,0 +1,79 @@
+/**
+ * Name: perfcount.h
+ * Desc: Provides hardware performance counters (cycles, instructions, cache
+ *       misses, branch misses) of the calling thread through
+ *       perf_event_open, and their totals per pipeline stage. Linux only,
+ *       the counters fail to open elsewhere.
+**/
+
+#ifndef PERFCOUNT_H_
+#define PERFCOUNT_H_
+
+#include <atomic>
+
+enum PerfEvent
+{
+	PERF_CYCLES = 0,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_NUM_EVENTS
+};
+
+//Profiled stages of the publisher.
+enum PerfStage
+{
+	PERF_STAGE_CONVERT = 0, //Raw samples to calibrated voltages
+	PERF_STAGE_PUBLISH, //All of publishPacket, conversion and LSL push included
+	PERF_NUM_STAGES
+};
+
+//A counter group of the calling thread, read with one system call. User
+//space only, so perf_event_paranoid <= 2 is enough.
+class PerfCounters
+{
+public:
+	PerfCounters();
+	~PerfCounters();
+
+	//Opens and starts the counters of the calling thread. Returns -1 if
+	//they are not available, 0 on success.
+	int open();
+
+	//Stops and closes the counters.
+	void close();
+
+	bool isOpen() const { return mFds[0] >= 0; }
+
+	//Reads the current values, PERF_NUM_EVENTS elements. Scaled if the
+	//kernel multiplexed the counters. Returns -1 on error, 0 on success.
+	int read(unsigned long long *values);
+
+private:
+	PerfCounters(const PerfCounters &);
+	PerfCounters &operator=(const PerfCounters &);
+
+	int mFds[PERF_NUM_EVENTS];
+};
+
+//Counter totals of each stage. Written by the stream thread only, read by
+//any thread.
+typedef struct
+{
+	std::atomic<unsigned long long> counts[PERF_NUM_STAGES][PERF_NUM_EVENTS];
+	std::atomic<unsigned long long> packets[PERF_NUM_STAGES]; //Packets counted in each stage
+	std::atomic<unsigned long long> samples[PERF_NUM_STAGES]; //Raw samples of those packets
+} PerfProfile;
+
+//Clears the totals.
+void resetPerfProfile(PerfProfile *profile);
+
+//Adds the difference of two readings around one packet to a stage.
+//samples: Raw samples of the packet.
+void perfProfileAdd(PerfProfile *profile, int stage, const unsigned long long *before,
+                    const unsigned long long *after, unsigned int samples);
+
+//Prints the totals of each stage per packet and per sample.
+void printPerfProfile(const PerfProfile *profile);
+
+#endif
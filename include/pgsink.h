@@ -0,0 +1,110 @@
+/**
+ * Name: pgsink.h
+ * Desc: Provides a sink that stores the calibrated scans in a PostgreSQL or
+ *       TimescaleDB table, one row per scan. The stream thread copies the
+ *       complete scans of each packet into chunk buffers and never waits for
+ *       the database: when every buffer is queued, the scans are dropped and
+ *       counted. A writer thread sends all the queued chunks with one COPY in
+ *       binary format, so a transaction holds thousands of scans and the
+ *       server parses no text. Built with -DLSLPUB_POSTGRES=ON (libpq).
+**/
+
+#ifndef PGSINK_H_
+#define PGSINK_H_
+
+#include <atomic>
+#include <string>
+
+#include "budget.h"
+#include "chunkqueue.h"
+
+struct pg_conn; //PGconn of libpq
+
+//Seconds of scans in a chunk, and seconds of chunks the writer can fall
+//behind before scans are dropped.
+#define PG_CHUNK_SEC 0.25
+#define PG_QUEUE_SEC 8.0
+#define PG_MIN_CHUNKS 4
+
+//Most chunks sent in one COPY, when the writer catches up.
+#define PG_MAX_BATCH_CHUNKS 16
+
+//Seconds between two reconnection attempts.
+#define PG_RECONNECT_SEC 1.0
+
+//Longest table name, letters, digits and underscores with an optional
+//schema before a dot.
+#define PG_MAX_TABLE_LENGTH 64
+
+//Counters of the sink. Written by the stream and writer threads, read by
+//any thread.
+typedef struct
+{
+	std::atomic<unsigned long long> rowsWritten;
+	std::atomic<unsigned long long> batches; //Committed COPY commands
+	std::atomic<unsigned long long> copyNs; //Time spent in the COPY commands
+	std::atomic<unsigned int> lastBatchScans;
+	std::atomic<unsigned long long> failedScans; //Scans of the failed COPY commands
+	std::atomic<unsigned long long> errors;
+	std::atomic<int> connected;
+	ChunkQueueStats queue;
+} PgSinkStats;
+
+class PgSink : public ChunkQueue
+{
+public:
+	PgSink();
+	~PgSink();
+
+	//Connects, creates the table if it does not exist (and makes it a
+	//hypertable when TimescaleDB is installed), allocates the chunk buffers
+	//from the sink budget and starts the writer thread. Returns -1 on
+	//error, 0 on success.
+	//conninfo: The libpq connection string.
+	//table: The table, columns time, scan_index, lsl_time, ch0, ch1, ...
+	//scanRate: Scans per second.
+	//numAddresses: The number of channels.
+	//budget: The memory budget of the stream.
+	int open(const char *conninfo, const char *table, float scanRate,
+	         unsigned int numAddresses, MemoryBudget *budget);
+
+	//Appends complete scans. Never blocks. Call it from the stream thread.
+	//scans: numScans*numAddresses samples.
+	//firstScan: Index of the first scan.
+	//lastScanTime: LSL time of the last scan, the others are spaced at the
+	//              nominal rate before it.
+	void write(const float *scans, unsigned int numScans, unsigned long long firstScan, double lastScanTime);
+
+	//Queues the last partial chunk, sends everything queued and
+	//disconnects.
+	void close();
+
+	bool isOpen() const { return mArena != NULL; }
+
+	const PgSinkStats *stats() const { return &mStats; }
+
+private:
+	PgSink(const PgSink &);
+	PgSink &operator=(const PgSink &);
+
+	unsigned int writeChunks(unsigned long long first, unsigned int count);
+	int createTable();
+	unsigned int encodeRows(const ScanChunkHeader *header, unsigned char *out) const;
+	int copyBatch(unsigned long long first, unsigned int numChunks);
+
+	char mTable[PG_MAX_TABLE_LENGTH + 1];
+	std::string mCopyCommand;
+	unsigned int mRowBytes;
+	long long mUnixOffsetUs; //PostgreSQL epoch time minus LSL time, in microseconds
+
+	unsigned char *mArena; //allocAligned block holding the buffers
+	unsigned char *mOut; //COPY data of a chunk
+	PgSinkStats mStats;
+
+	//Writer thread side
+	struct pg_conn *mConn;
+	double mNextReconnect;
+	int mFailing; //The last COPY failed, its error was printed
+};
+
+#endif
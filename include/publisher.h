@@ -0,0 +1,205 @@
+/**
+ * Name: publisher.h
+ * Desc: Provides the handling of spontaneous stream packets once they are
+ *       read and checked: stream status handling, conversion to calibrated
+ *       voltages, scan assembly and the LSL push. The stream read loop and
+ *       any other packet source (synthetic frames, replays) go through it.
+ *       Nothing is printed, status and errors go to the stream counters.
+ *       The irregular outlet stamps all the scans of a packet with the
+ *       push time, while the in-process sinks (recorder, XDF, Arrow,
+ *       PostgreSQL) deliberately back-date each scan from it at the nominal
+ *       rate, so their times are not the ones LSL consumers see.
+**/
+
+#ifndef PUBLISHER_H_
+#define PUBLISHER_H_
+
+#include "blackbox.h"
+#include "blockpool.h"
+#include "arrowipc.h"
+#include "budget.h"
+#include "calibration.h"
+#include "latency.h"
+#include "perfcount.h"
+#include "pgsink.h"
+#include "recorder.h"
+#include "stats.h"
+#include "stream.h"
+#include "xdf.h"
+
+namespace lsl { class stream_outlet; }
+
+//Channels of the diagnostics outlet.
+enum DiagnosticsChannel
+{
+	DIAG_BACKLOG = 0, //Device scan backlog
+	DIAG_STATUS, //Stream status
+	DIAG_ADDITIONAL_INFO, //Additional status information
+	DIAG_RX_QUEUE, //Host kernel receive queue of the stream socket (bytes, -1 = unknown)
+	DIAG_HOST_LATENCY, //Packet arrival to the end of the LSL push (us)
+	DIAG_NUM_CHANNELS
+};
+
+//max_buffered of the diagnostics outlet, in hundreds of samples.
+#define DIAG_MAX_BUFFERED 10
+
+class StreamPublisher
+{
+public:
+	StreamPublisher();
+	~StreamPublisher();
+
+	//Allocates the block pools from the budget and creates the LSL outlet.
+	//Returns -1 on error, 0 on success.
+	//devCal: The calibration constants applied to the samples.
+	//scanRate: Scans per second.
+	//numAddresses: The number of samples per scan.
+	//samplesPerPacket: The number of samples in one stream packet.
+	//gainList: The gain index of each address in the scan. Needs to have
+	//          numAddresses elements.
+	//budget: The planned memory budget of the stream.
+	int init(const DeviceCalibration *devCal, float scanRate,
+	         unsigned int numAddresses, unsigned int samplesPerPacket,
+	         const unsigned int *gainList, const MemoryBudget *budget);
+
+	//Borrows a block for the next stream response. The block needs to be
+	//STREAM_HEADER_BYTES + samplesPerPacket * 2 bytes. Returns an invalid
+	//handle if the packet pool is exhausted.
+	BlockHandle acquirePacket();
+
+	//Publishes one checked stream response. Returns -1 on error, 0 to keep
+	//streaming and 1 when the stream status ends the stream.
+	//packet: The stream response, sample data at STREAM_HEADER_BYTES.
+	//backlog, status, additionalInfo: The response header fields, as
+	//                                 returned by parseStreamPacket.
+	int publishPacket(const BlockHandle &packet, unsigned short backlog,
+	                  unsigned short status, unsigned short additionalInfo);
+
+	//Creates the diagnostics outlet, which carries the health of each packet
+	//next to the data, and reserves its buffer in the sink budget. Call it
+	//after init. Returns -1 on error, 0 on success.
+	int enableDiagnostics(MemoryBudget *budget);
+
+	//Pushes one diagnostics sample for the last published packet, if the
+	//diagnostics outlet is enabled.
+	//rxQueueBytes: Bytes waiting in the stream socket, -1 if unknown.
+	//hostLatencyNs: Packet arrival to the end of publishPacket.
+	void publishDiagnostics(int rxQueueBytes, unsigned long long hostLatencyNs);
+
+	//Keeps the last minutes of complete scans in a memory-mapped black box
+	//file, written by publishPacket. Call it after init. Returns -1 on
+	//error, 0 on success.
+	//path: The black box file.
+	//scanRate: Scans per second.
+	//minutes: Minutes of scans kept.
+	//syncSec: Seconds between two syncs to disk.
+	int enableBlackBox(const char *path, float scanRate, double minutes, double syncSec);
+
+	//Writes the complete scans to an XDF file from publishPacket, with the
+	//stream_info of the outlet as stream header. The outlet is irregular,
+	//the header gets the scan rate as nominal rate so readers can deduce
+	//the timestamps. Call it after init. Returns -1 on error, 0 on success.
+	//path: The XDF file.
+	//scanRate: Scans per second.
+	//budget: The chunk buffers are reserved from its sink share.
+	int enableXdf(const char *path, float scanRate, MemoryBudget *budget);
+
+	//Writes the queued scans and the footer of the XDF file and closes it.
+	//Call it once the stream stopped publishing.
+	void closeXdf() { mXdf.close(); }
+
+	//Queue counters of the XDF writer, for the stats reporter.
+	const ChunkQueueStats *xdfStats() const { return mXdf.stats(); }
+
+	//Writes the complete scans as Arrow IPC record batches from
+	//publishPacket, to a file or to the client of a Unix socket. Returns -1
+	//on error, 0 on success.
+	//path: The file, or unix:PATH.
+	//scanRate: Scans per second.
+	//budget: The chunk buffers are reserved from its sink share.
+	int enableArrow(const char *path, float scanRate, MemoryBudget *budget);
+
+	//Writes the queued scans and the end of the Arrow output and closes it.
+	//Call it once the stream stopped publishing.
+	void closeArrow() { mArrow.close(); }
+
+	//Queue counters of the Arrow writer, for the stats reporter.
+	const ChunkQueueStats *arrowStats() const { return mArrow.stats(); }
+
+	//Opens the hardware performance counters of the calling thread and
+	//counts them around the conversion and around all of publishPacket, on
+	//alternate packets. Call it from the thread that publishes. Returns -1 if the counters
+	//are not available, 0 on success.
+	int enablePerfCounters();
+
+	//Feeds the raw samples of each published packet to a recorder, with the
+	//scan indexes and the back-dated LSL times of the sinks, or stops with
+	//NULL. The recorder is not owned.
+	void setRecorder(Recorder *recorder) { mRecorder = recorder; }
+
+	//Feeds the complete scans of each published packet to a PostgreSQL
+	//sink, or stops with NULL. The sink is not owned.
+	void setPgSink(PgSink *sink) { mPgSink = sink; }
+
+	//Counter totals, when enabled.
+	const PerfProfile *perfProfile() const { return &mPerfProfile; }
+
+	//Scans read so far, including the partial scan in progress.
+	double scanTotal() const;
+
+	//Scans skipped by the T7 during auto recovery.
+	double numScansSkipped() const { return mNumScansSkipped; }
+
+	//Latencies of the conversion, scan assembly and push stages, recorded by
+	//publishPacket. The stream loop records the other stages.
+	StageLatencies *latencies() { return &mLatencies; }
+
+	//Stream counters, updated by publishPacket and by the stream loop.
+	StreamStats *stats() { return &mStats; }
+
+	//Returns true if an LSL inlet is connected. Safe from any thread.
+	bool haveConsumers() const;
+
+	unsigned int numAddresses() const { return mNumAddresses; }
+	unsigned int samplesPerPacket() const { return mSamplesPerPacket; }
+
+private:
+	StreamPublisher(const StreamPublisher &);
+	StreamPublisher &operator=(const StreamPublisher &);
+
+	int publish(const BlockHandle &packet, unsigned short backlog,
+	            unsigned short status, unsigned short additionalInfo);
+
+	DeviceCalibration mDevCal;
+	unsigned int mGainList[MAX_NUM_STREAM_ADDR];
+	float mScanRate;
+	unsigned int mNumAddresses;
+	unsigned int mSamplesPerPacket;
+
+	BlockPool mPacketPool; //Raw stream responses (header + samples)
+	BlockPool mSamplePool; //Calibrated samples, pushed to LSL as they are
+	BlockHandle mBlock; //Samples of the last packet, ends with the partial scan
+	unsigned int mNumSamples; //Converted samples in mBlock
+	unsigned int mCarry; //Samples of the partial scan at the end of mBlock
+
+	lsl::stream_outlet *mOutlet;
+	lsl::stream_outlet *mDiagOutlet;
+	float mDiagSample[DIAG_NUM_CHANNELS];
+	BlackBox mBlackBox;
+	XdfWriter mXdf;
+	ArrowWriter mArrow;
+	Recorder *mRecorder;
+	PgSink *mPgSink;
+	StageLatencies mLatencies;
+	StreamStats mStats;
+	PerfCounters mPerf;
+	PerfProfile mPerfProfile;
+	int mPerfStage; //PERF_STAGE_X counted on the next packet
+
+	unsigned int mAddrIndex; //The current scan's address index
+	double mScanTotal;
+	double mNumScansSkipped;
+	float mVolts;
+};
+
+#endif
@@ -0,0 +1,101 @@
+/**
+ * Name: rawtee.h
+ * Desc: Provides a byte-exact copy of the stream socket in a file without a
+ *       user space copy. The stream bytes are spliced from the socket into a
+ *       pipe, duplicated with tee into a second pipe and read from the first
+ *       one by the stream loop, while a writer thread splices the second pipe
+ *       to the file. A read costs three system calls (splice, tee, read)
+ *       instead of one recv. The stream loop never waits for the disk: if the
+ *       file pipe is full the bytes are dropped from the copy and counted, and
+ *       each gap is written to PATH.gaps as a line "OFFSET BYTES" (BYTES are
+ *       missing at OFFSET of the file), so the copy can still be parsed.
+ *       Linux only, the tee fails to open elsewhere.
+**/
+
+#ifndef RAWTEE_H_
+#define RAWTEE_H_
+
+#include <atomic>
+#include <stdio.h>
+#include <thread>
+
+#include "tcp.h"
+
+//Capacity requested for the pipe of the file, the bytes the writer thread
+//can fall behind before the copy drops bytes. Capped by
+///proc/sys/fs/pipe-max-size.
+#define RAWTEE_PIPE_BYTES (1024*1024)
+
+//Gaps queued for the writer thread. A gap is lost if the writer is this many
+//behind.
+#define RAWTEE_GAP_SLOTS 64
+
+//Bytes missing from the copy.
+typedef struct
+{
+	unsigned long long offset; //Offset in the file where the bytes are missing
+	unsigned long long bytes;
+} RawTeeGap;
+
+class RawTee
+{
+public:
+	RawTee();
+	~RawTee();
+
+	//Creates the file and the pipes and starts the writer thread. Returns -1
+	//on error, 0 on success.
+	//sock: The stream socket. Read it only through read afterwards.
+	//path: The file of the copy, truncated. Its gaps go to PATH.gaps, created
+	//      at the first gap.
+	int open(TCP_SOCKET sock, const char *path);
+
+	//Reads size bytes of the stream socket into packet, like
+	//readTCPNoPrint, and copies them to the file. Returns the bytes read, or
+	//<= 0 on error.
+	int read(unsigned char *packet, int size);
+
+	//Writes the remaining bytes, stops the writer thread and closes the
+	//file.
+	void close();
+
+	bool isOpen() const { return mFd >= 0; }
+
+	//Bytes written to the file.
+	unsigned long long bytesWritten() const { return mBytesWritten.load(std::memory_order_relaxed); }
+
+	//Bytes read from the socket but missing from the file.
+	unsigned long long bytesDropped() const { return mBytesDropped.load(std::memory_order_relaxed); }
+
+private:
+	RawTee(const RawTee &);
+	RawTee &operator=(const RawTee &);
+
+	void run();
+	void queueGap();
+	void writeGaps();
+
+	TCP_SOCKET mSock;
+	int mFd;
+	int mReadPipe[2]; //Socket to the stream loop
+	int mFilePipe[2]; //tee of mReadPipe to the writer thread
+	char mGapPath[260];
+	std::thread mThread;
+	std::atomic<unsigned long long> mBytesWritten;
+	std::atomic<unsigned long long> mBytesDropped;
+
+	//Stream thread side
+	unsigned long long mTeed; //Bytes queued to the file pipe
+	RawTeeGap mGap; //Gap being extended, bytes = 0 if none
+
+	//Gaps waiting for the writer thread. Single producer, single consumer.
+	RawTeeGap mGaps[RAWTEE_GAP_SLOTS];
+	std::atomic<unsigned int> mGapHead;
+	std::atomic<unsigned int> mGapTail;
+	std::atomic<unsigned long long> mLostGaps;
+
+	//Writer thread side
+	FILE *mGapFile;
+};
+
+#endif
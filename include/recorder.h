@@ -0,0 +1,207 @@
+/**
+ * Name: recorder.h
+ * Desc: Provides the in-process recorder of the raw stream samples. Samples
+ *       are copied into fixed-duration chunks of whole scans, and a writer
+ *       thread writes the full chunks to time-segmented files with O_DIRECT
+ *       from aligned buffers, so long recordings do not go through the page
+ *       cache. The stream thread never waits for the disk: when every chunk
+ *       buffer is queued, the scans are dropped and counted. The writer
+ *       thread can compress the chunks losslessly (codec.h). Each segment
+ *       starts with a header holding the stream configuration and the
+ *       calibration, so it can be converted to volts on its own, and ends
+ *       with an index of its chunks (recording.h reads them). The writer
+ *       thread also feeds the min/max/mean summaries of the recording
+ *       (summary.h). Unix only.
+**/
+
+#ifndef RECORDER_H_
+#define RECORDER_H_
+
+#include <atomic>
+
+#include "budget.h"
+#include "calibration.h"
+#include "chunkqueue.h"
+#include "codec.h"
+#include "stream.h"
+
+class SummaryPyramid;
+
+#define RECORDER_MAGIC "LJT7REC1"
+#define RECORDER_MAGIC_BYTES 8
+#define RECORDER_VERSION 2
+#define RECORDER_BYTE_ORDER_MARK 0x01020304
+#define RECORDER_CHUNK_MAGIC 0x4B4E4843 //"CHNK"
+
+//Alignment of the buffers, file offsets and write sizes for O_DIRECT, and
+//size of the segment header.
+#define RECORDER_ALIGN 4096
+
+//Seconds of chunks the writer can fall behind before scans are dropped, and
+//the minimum number of chunk buffers.
+#define RECORDER_QUEUE_SEC 8.0
+#define RECORDER_MIN_CHUNKS 4
+
+//Segment file suffix, after the prefix and the segment number.
+#define RECORDER_SUFFIX ".t7r"
+
+//Sync policies of the segments.
+#define RECORDER_SYNC_NONE 0 //Data written with O_DIRECT, metadata left to the file system
+#define RECORDER_SYNC_SEGMENT 1 //fdatasync when a segment is closed
+#define RECORDER_SYNC_CHUNK 2 //fdatasync after every chunk
+
+//Stream configuration and calibration of a recording.
+typedef struct
+{
+	float scanRate;
+	unsigned int numAddresses;
+	unsigned int scanListAddresses[MAX_NUM_STREAM_ADDR];
+	unsigned int gainList[MAX_NUM_STREAM_ADDR];
+	DeviceCalibration devCal;
+} RecordingInfo;
+
+//First RECORDER_ALIGN bytes of a segment. The counts and the index location
+//are written when the segment is closed.
+typedef struct
+{
+	char magic[RECORDER_MAGIC_BYTES];
+	unsigned int version;
+	unsigned int byteOrderMark;
+	unsigned int headerBytes; //sizeof(RecorderSegmentHeader)
+	unsigned int segment; //Number of the segment, starting at 0
+	double chunkSec; //Duration of a full chunk
+	unsigned int chunkScans; //Scans of a full chunk
+	unsigned int numChunks; //Chunks in the segment
+	unsigned long long firstScan; //Index of the first scan of the segment
+	unsigned long long numScans; //Scans in the segment, not counting the dropped ones
+	RecordingInfo info;
+	unsigned long long indexOffset; //File offset of the chunk index, 0 if the segment was not closed
+	unsigned int indexEntries; //Entries of the chunk index, numChunks
+} RecorderSegmentHeader;
+
+//Header of each chunk. The samples follow it, raw (2 bytes each, as the T7
+//sends them) or encoded by encodeSamples, then zeros up to the next
+//RECORDER_ALIGN boundary.
+typedef struct
+{
+	unsigned int magic; //RECORDER_CHUNK_MAGIC
+	unsigned int codec; //CODEC_X of the payload
+	unsigned long long firstScan; //Index of the first scan, counting the dropped scans
+	unsigned int numScans;
+	unsigned int payloadBytes; //Bytes after the chunk header
+	double lslTime; //LSL time of the first scan, back-dated at the nominal rate (publisher.h)
+	unsigned long long reserved[4];
+} RecorderChunkHeader;
+
+//Entry of the chunk index written after the last chunk of a segment, in
+//chunk order. Scan indexes and LSL times both increase, so a scan or a
+//time is found with a binary search.
+typedef struct
+{
+	unsigned long long firstScan; //As in the chunk header
+	double lslTime; //As in the chunk header
+	unsigned long long offset; //File offset of the chunk header
+	unsigned int numScans;
+	unsigned int payloadBytes;
+} RecorderIndexEntry;
+
+//Counters of the recorder. Written by the stream and writer threads, read
+//by any thread.
+typedef struct
+{
+	std::atomic<unsigned long long> bytesWritten;
+	std::atomic<unsigned long long> chunksWritten;
+	std::atomic<unsigned long long> rawBytes; //Payload bytes before the codec
+	std::atomic<unsigned long long> encodedBytes; //Payload bytes after the codec
+	std::atomic<unsigned long long> writeNs; //Time spent in write and sync calls
+	std::atomic<unsigned int> segment; //Number of the current segment
+	std::atomic<unsigned long long> writeErrors;
+	ChunkQueueStats queue;
+} RecorderStats;
+
+class Recorder : public ChunkQueue
+{
+public:
+	Recorder();
+	~Recorder();
+
+	//Allocates the chunk buffers from the sink budget, opens the first
+	//segment and starts the writer thread. Returns -1 on error, 0 on
+	//success.
+	//prefix: Path prefix of the segments, PREFIX_NNNNNN.t7r.
+	//info: The stream configuration and calibration.
+	//chunkSec: Duration of a chunk.
+	//segmentSec: Duration of a segment, rounded to whole chunks.
+	//syncPolicy: RECORDER_SYNC_X.
+	//codec: CODEC_X of the chunks. A chunk that does not compress is
+	//       written raw.
+	//summaries: 1 to write the min/max/mean summaries, PREFIX_xN.t7s.
+	//budget: The memory budget of the stream.
+	int open(const char *prefix, const RecordingInfo *info, double chunkSec,
+	         double segmentSec, int syncPolicy, int codec, int summaries, MemoryBudget *budget);
+
+	//Appends the raw samples of a stream packet, skipping the dummy 0xFFFF
+	//samples. Never blocks. Call it from the stream thread.
+	//rawData: numSamples samples, 2 bytes each.
+	//firstScan: Index of the scan of the first sample.
+	//firstScanTime: LSL time of that scan, the next ones follow at the
+	//               nominal rate.
+	void write(const unsigned char *rawData, unsigned int numSamples, unsigned long long firstScan, double firstScanTime);
+
+	//Queues the last partial chunk, writes everything queued and closes the
+	//segment. A partial scan at the end is not recorded.
+	void close();
+
+	bool isOpen() const { return mArena != NULL; }
+
+	const RecorderStats *stats() const { return &mStats; }
+
+private:
+	Recorder(const Recorder &);
+	Recorder &operator=(const Recorder &);
+
+	void queueChunk();
+	unsigned int writeChunks(unsigned long long first, unsigned int count);
+	void finish();
+	int openSegment(unsigned int segment);
+	void openNextSegment();
+	int closeSegment();
+	int writeAt(const unsigned char *data, unsigned int size, unsigned long long offset);
+
+	char mPrefix[256];
+	RecordingInfo mInfo;
+	double mChunkSec;
+	unsigned int mSegmentChunks;
+	int mSyncPolicy;
+	int mCodec;
+
+	unsigned char *mArena; //allocAligned block holding the aligned buffers
+	RecorderSegmentHeader *mHeader; //Aligned buffer of the segment header
+	RecorderIndexEntry *mIndex; //Aligned buffer of the segment's chunk index, mSegmentChunks entries
+	unsigned char *mEncoded; //Aligned buffer of an encoded chunk, NULL for CODEC_RAW
+
+	//Stream thread side
+	unsigned long long mScanIndex; //Index of the current scan, from the publisher at each packet
+	unsigned int mChunkSamples; //Samples in the current chunk
+	unsigned int mDropSamples; //Samples of the scan being dropped, no free chunk for it
+
+	//Writer thread side
+	int mFd; //-1 when no segment is open, until openNextSegment succeeds
+	unsigned long long mOffset;
+	bool mDirect;
+	unsigned int mNextSegment; //Segment opened by openNextSegment
+	unsigned long long mNextOpenNs; //monotonicNs of the next attempt to open it
+	int mStopped; //A segment could not be opened, the stop was printed
+	SummaryPyramid *mSummary; //NULL without summaries
+
+	RecorderStats mStats;
+};
+
+//Parses a sync policy name: none, segment or chunk. Returns the
+//RECORDER_SYNC_X value, -1 if the name is unknown.
+int recorderSyncPolicy(const char *name);
+
+//Returns the name of a RECORDER_SYNC_X value.
+const char *recorderSyncPolicyName(int policy);
+
+#endif
@@ -0,0 +1,98 @@
+/**
+ * Name: recording.h
+ * Desc: Reads the segments written by the recorder. A segment is mapped with
+ *       mmap and its chunks are located through the index at its end, so a
+ *       scan or a time is found with a binary search and only the chunks of
+ *       a range are touched. A segment that was not closed has no index: its
+ *       chunk headers are walked once when it is opened. Also provides the
+ *       extraction of a time range of some channels to a raw or CSV file,
+ *       from the recorded scans or from the min/max/mean summaries.
+ *       Unix only.
+**/
+
+#ifndef RECORDING_H_
+#define RECORDING_H_
+
+#include <stddef.h>
+#include <vector>
+
+#include "recorder.h"
+#include "summary.h"
+
+//Output formats of extractRecording.
+#define RECORDING_FORMAT_RAW 0 //2-byte samples as the T7 sends them, scan after scan
+#define RECORDING_FORMAT_CSV 1 //Scan index, LSL time and volts, one scan per line
+
+//A mapped segment file.
+class RecordingSegment
+{
+public:
+	RecordingSegment();
+	~RecordingSegment();
+
+	//Maps a segment and loads its chunk index, or rebuilds it from the chunk
+	//headers if the segment was not closed. Returns -1 on error, 0 on
+	//success.
+	int open(const char *path);
+
+	//Unmaps the segment.
+	void close();
+
+	bool isOpen() const { return mData != NULL; }
+
+	const RecorderSegmentHeader *header() const { return mHeader; }
+	unsigned int numChunks() const { return mNumChunks; }
+	const RecorderIndexEntry *entry(unsigned int n) const { return &mIndex[n]; }
+
+	//Returns the last chunk starting at or before a scan, 0 if the scan is
+	//before the first chunk, -1 if the segment has no chunk.
+	int findScan(unsigned long long scanIndex) const;
+
+	//Returns the last chunk starting at or before an LSL time, 0 if the time
+	//is before the first chunk, -1 if the segment has no chunk.
+	int findTime(double lslTime) const;
+
+	//Decodes the samples of a chunk. Returns -1 if the chunk is invalid, 0
+	//on success.
+	//rawData: entry(n)->numScans*numAddresses samples, 2 bytes each.
+	int readChunk(unsigned int n, unsigned char *rawData) const;
+
+private:
+	RecordingSegment(const RecordingSegment &);
+	RecordingSegment &operator=(const RecordingSegment &);
+
+	bool chunkInMapping(unsigned long long offset, unsigned long long payloadBytes) const;
+	int checkIndex() const;
+	int rebuildIndex();
+
+	unsigned char *mData; //The mapping
+	size_t mBytes;
+	const RecorderSegmentHeader *mHeader;
+	const RecorderIndexEntry *mIndex; //In the mapping, or mRebuilt
+	unsigned int mNumChunks;
+	std::vector<RecorderIndexEntry> mRebuilt;
+};
+
+//Writes the scans of a recording between two LSL times to a file. Returns
+//-1 on error, 0 on success.
+//path: A segment file (.t7r), or the prefix given to -record to read all
+//      its segments in order.
+//fromTime, toTime: The LSL time range, inclusive. toTime 0 = to the end.
+//channels: "all", or a comma separated list of positions in the scan list,
+//          starting at 0.
+//format: RECORDING_FORMAT_X.
+//outPath: The file to create.
+int extractRecording(const char *path, double fromTime, double toTime, const char *channels, int format, const char *outPath);
+
+//Writes the summary bins of a recording between two LSL times to a CSV
+//file: first scan, LSL time and scans of each bin, then the min, max and
+//mean volts of each channel. Returns -1 on error, 0 on success.
+//path: A summary file (.t7s), or the prefix given to -record.
+//decimation: Scans per bin of the level, 10, 100 or 1000.
+//fromTime, toTime, channels: As in extractRecording. A bin is written if
+//                            it starts before toTime and ends after
+//                            fromTime.
+//outPath: The file to create.
+int extractSummary(const char *path, unsigned int decimation, double fromTime, double toTime, const char *channels, const char *outPath);
+
+#endif
@@ -0,0 +1,60 @@
+/**
+ * Name: startup.h
+ * Desc: Provides the startup profile: the duration and the Modbus round
+ *       trips of each phase from the program start to the first published
+ *       sample, reported on every start.
+**/
+
+#ifndef STARTUP_H_
+#define STARTUP_H_
+
+#include <atomic>
+
+#define STARTUP_MAX_PHASES 16
+
+typedef struct
+{
+	const char *name;
+	unsigned long long durationNs;
+	unsigned int roundTrips; //Modbus requests sent during the phase
+	int excluded; //1: waiting for the user, not counted in the time to first sample
+} StartupPhase;
+
+typedef struct
+{
+	StartupPhase phases[STARTUP_MAX_PHASES];
+	int numPhases;
+	unsigned long long startNs; //monotonicNs at startupBegin
+	unsigned long long markNs; //End of the last phase
+	unsigned int markRoundTrips;
+	int failed; //Set by startupFail, the startup stopped before the first sample
+	std::atomic<int> complete; //Set by startupEnd or startupFail, the profile is no longer written
+} StartupProfile;
+
+//Starts the profile. The first phase starts now.
+void startupBegin(StartupProfile *profile);
+
+//Ends the current phase, started at the end of the previous one, and starts
+//the next.
+//name: The phase name, a string literal.
+void startupPhase(StartupProfile *profile, const char *name);
+
+//Same as startupPhase, for a phase that waits for the user. Its time is
+//left out of the time to first sample.
+void startupWait(StartupProfile *profile, const char *name);
+
+//Ends the last phase and marks the profile complete. Call it once the first
+//sample is published.
+void startupEnd(StartupProfile *profile, const char *name);
+
+//Ends the last phase as the one that failed and marks the profile complete,
+//if the first sample was not published. Returns 1 if it did, 0 if the
+//profile was already complete.
+//name: The phase name, a string literal.
+int startupFail(StartupProfile *profile, const char *name);
+
+//Prints the profile.
+//format: STATS_FORMAT_TEXT for a table, STATS_FORMAT_JSON for one JSON line.
+void printStartupProfile(const StartupProfile *profile, int format);
+
+#endif
@@ -0,0 +1,213 @@
+/**
+ * Name: stats.h
+ * Desc: Provides the stream status counters and the reporter thread that
+ *       prints them. The stream thread only updates lock-free counters and
+ *       never prints, so a slow terminal can not stall the acquisition. The
+ *       reporter prints at its own cadence, as text or as JSON lines.
+**/
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <atomic>
+#include <thread>
+
+#include "chunkqueue.h"
+#include "latency.h"
+#include "pgsink.h"
+#include "recorder.h"
+#include "startup.h"
+#include "stream.h"
+#include "tcp.h"
+
+//Stream errors kept for the reporter until it prints them.
+#define STATS_ERROR_SLOTS 8
+
+//Milliseconds between two samples of the socket state.
+#define STATS_SOCKET_SAMPLE_MS 50
+
+//Output formats of the reporter.
+#define STATS_FORMAT_TEXT 0
+#define STATS_FORMAT_JSON 1
+
+//Sockets whose kernel state is sampled by the reporter.
+#define STATS_SOCKET_COMMAND 0 //Command/response socket
+#define STATS_SOCKET_STREAM 1 //Spontaneous stream socket
+#define STATS_NUM_SOCKETS 2
+
+//Kernel state of a socket, as TCPSocketInfo. -1 = not sampled or not
+//reported by the platform.
+typedef struct
+{
+	std::atomic<int> rxQueueBytes;
+	std::atomic<int> rttUs;
+	std::atomic<int> rttVarUs;
+	std::atomic<int> totalRetrans;
+	std::atomic<int> lost;
+	std::atomic<int> rcvSpace;
+} SocketStats;
+
+//A stream error and the packet that caused it.
+typedef struct
+{
+	int error; //STREAM_ERROR_X code, or 0 for a socket read error
+	int size; //Bytes read, -1 if the read failed
+	unsigned char packet[TCP_MAX_PACKET_BYTES];
+} StreamErrorRecord;
+
+//Counters of the stream. Written by the stream thread only, read by any
+//thread.
+typedef struct
+{
+	std::atomic<unsigned long long> packets;
+	std::atomic<unsigned long long> bytes;
+	std::atomic<unsigned long long> scans; //Complete scans
+	std::atomic<unsigned long long> samples;
+	std::atomic<unsigned long long> dummySamples; //0xFFFF samples
+	std::atomic<unsigned long long> midScanDummies; //Dummy samples in the middle of a scan
+
+	std::atomic<unsigned int> backlog; //Last scan backlog
+	std::atomic<unsigned int> status; //Last status
+	std::atomic<unsigned int> additionalInfo; //Last additional status information
+	std::atomic<unsigned long long> autoRecoverActive; //Packets with STREAM_STATUS_AUTO_RECOVER_ACTIVE
+	std::atomic<unsigned long long> autoRecoverEnd; //Packets with STREAM_STATUS_AUTO_RECOVER_END
+	std::atomic<unsigned long long> scansSkipped;
+	std::atomic<unsigned long long> scanOverlap;
+	std::atomic<unsigned long long> autoRecoverEndOverflow;
+	std::atomic<unsigned long long> burstComplete;
+	std::atomic<unsigned long long> otherStatus; //Packets with any other non zero status
+
+	std::atomic<unsigned long long> readErrors;
+	std::atomic<unsigned long long> packetErrors;
+	std::atomic<unsigned long long> transactionIdGaps; //Packets with an unexpected transaction ID
+	std::atomic<unsigned long long> poolExhausted;
+
+	//Written by the reporter thread.
+	SocketStats sockets[STATS_NUM_SOCKETS];
+
+	//Last complete scan, guarded by a sequence counter (odd while written).
+	std::atomic<unsigned int> scanSeq;
+	std::atomic<unsigned long long> lastScanIndex;
+	std::atomic<unsigned int> numAddresses;
+	std::atomic<float> lastScan[MAX_NUM_STREAM_ADDR];
+
+	//Errors waiting for the reporter. Single producer, single consumer.
+	StreamErrorRecord errors[STATS_ERROR_SLOTS];
+	std::atomic<unsigned int> errorHead;
+	std::atomic<unsigned int> errorTail;
+	std::atomic<unsigned long long> droppedErrors;
+} StreamStats;
+
+//Clears all the counters. Call it before the stream starts.
+void resetStreamStats(StreamStats *stats);
+
+//Adds one to a counter. Only the stream thread writes the counters.
+inline void statsAdd(std::atomic<unsigned long long> &counter, unsigned long long value)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+//Stores the last complete scan.
+//scan: The scan samples, numAddresses elements.
+//scanIndex: Number of the scan, starting at 1.
+void statsSetLastScan(StreamStats *stats, const float *scan, unsigned int numAddresses, unsigned long long scanIndex);
+
+//Queues a stream error and a copy of its packet for the reporter. Dropped if
+//the reporter is behind.
+//error: STREAM_ERROR_X code, or 0 for a socket read error.
+//packet: The bytes read, size elements. Can be NULL if size <= 0.
+void statsRecordError(StreamStats *stats, int error, const unsigned char *packet, int size);
+
+//Samples the kernel state of a socket into stats.
+//index: STATS_SOCKET_X.
+void statsSampleSocket(StreamStats *stats, int index, TCP_SOCKET sock);
+
+//Prints the stream counters from its own thread.
+class StatsReporter
+{
+public:
+	StatsReporter();
+	~StatsReporter();
+
+	//Starts the reporter thread. Returns -1 on error, 0 on success.
+	//stats: The counters to report.
+	//latencies: The stage latencies to summarize, can be NULL.
+	//periodSec: Seconds between two status reports.
+	//latencyPeriodSec: Seconds between two latency summaries, 0 = only in
+	//                  the final report.
+	//latencyReset: 1 to clear the latencies after each summary.
+	//format: STATS_FORMAT_TEXT or STATS_FORMAT_JSON.
+	int start(StreamStats *stats, StageLatencies *latencies, double periodSec,
+	          double latencyPeriodSec, int latencyReset, int format);
+
+	//Samples the kernel receive queue and TCP_INFO of the sockets every
+	//STATS_SOCKET_SAMPLE_MS and reports them next to the device backlog.
+	//Call it before start. INVALID_SOCKET to skip a socket.
+	void watchSockets(TCP_SOCKET commandSock, TCP_SOCKET streamSock);
+
+	//Prints the startup profile once it is complete. Call it before start.
+	void watchStartup(const StartupProfile *profile);
+
+	//Reports the throughput and queue depth of a recorder. Call it before
+	//start.
+	void watchRecorder(const RecorderStats *recorder);
+
+	//Reports the throughput and back-pressure of a PostgreSQL sink. Call it
+	//before start.
+	void watchPgSink(const PgSinkStats *sink);
+
+	//Reports the queue depth and dropped scans of the XDF and Arrow
+	//writers. Call them before start.
+	void watchXdf(const ChunkQueueStats *queue);
+	void watchArrow(const ChunkQueueStats *queue);
+
+	//Stops the reporter thread after a final report.
+	void stop();
+
+private:
+	StatsReporter(const StatsReporter &);
+	StatsReporter &operator=(const StatsReporter &);
+
+	void run();
+	void report(double now, int final);
+	void printErrors();
+	void printLatencies();
+	void sampleSockets();
+
+	StreamStats *mStats;
+	StageLatencies *mLatencies;
+	double mPeriodSec;
+	double mLatencyPeriodSec;
+	int mLatencyReset;
+	int mFormat;
+
+	const StartupProfile *mStartup; //Printed once complete, then NULL
+	const RecorderStats *mRecorder;
+	const PgSinkStats *mPgSink;
+	const ChunkQueueStats *mXdf;
+	const ChunkQueueStats *mArrow;
+	TCP_SOCKET mSockets[STATS_NUM_SOCKETS];
+	int mMaxRxQueue[STATS_NUM_SOCKETS]; //Largest receive queue since the previous report
+
+	std::thread mThread;
+	std::atomic<int> mRunning;
+
+	//Values at the previous report
+	double mStartTime;
+	double mLastReport;
+	double mLastLatencyReport;
+	unsigned long long mLastScans;
+	unsigned long long mLastAutoRecoverActive;
+	unsigned long long mLastAutoRecoverEnd;
+	unsigned long long mLastOtherStatus;
+	unsigned long long mLastDummySamples;
+	unsigned long long mLastMidScanDummies;
+	unsigned long long mLastScanOverlap;
+	unsigned long long mLastAutoRecoverEndOverflow;
+	unsigned long long mLastBurstComplete;
+	unsigned long long mLastDroppedErrors;
+	unsigned long long mLastRecordedBytes;
+	unsigned long long mLastPgRows;
+};
+
+#endif
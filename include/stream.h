@@ -31,6 +31,20 @@
 //Bytes per sample in the stream response
 #define STREAM_BYTES_PER_SAMPLE 2
 
+//Bytes of the stream response header. Sample data starts after it.
+#define STREAM_HEADER_BYTES 16
+
+//Max number of addresses in the stream scan list
+#define MAX_NUM_STREAM_ADDR 128
+
+//Stream response errors returned by parseStreamPacket
+#define STREAM_ERROR_INCOMPLETE -1 //Response smaller than its header
+#define STREAM_ERROR_FUNCTION -2 //Unexpected Modbus function code
+#define STREAM_ERROR_MODBUS_EXCEPTION -3 //Modbus exception response
+#define STREAM_ERROR_LENGTH -4 //Response smaller than its Modbus length
+#define STREAM_ERROR_TRANSACTION_ID -5 //Not the next expected transaction ID
+#define STREAM_ERROR_TYPE -6 //Unexpected stream type
+
 //Reads the analog input settings that are going to be streamed.
 //Returns -1 on error, 0 on success.
 //sock: The T7's socket. The socket needs to be on port 502.
@@ -135,6 +149,48 @@ int spontaneousStreamRead(TCP_SOCKET sock, unsigned int samplesPerPacket,
                           unsigned short *backlog, unsigned short *status, 
                           unsigned short *additionalInfo, unsigned char *rawData);
 
+//Same as spontaneousStreamRead, but the whole stream response is read into the
+//caller's packet array and nothing is allocated or copied. The raw sample data
+//starts at packet[STREAM_HEADER_BYTES]. Returns -1 on error, 0 on success.
+//packet: Byte array receiving the stream response. The array needs to have
+//        STREAM_HEADER_BYTES + samplesPerPacket * 2 elements.
+int spontaneousStreamReadPacket(TCP_SOCKET sock, unsigned int samplesPerPacket,
+                                unsigned char *packet, unsigned short *backlog,
+                                unsigned short *status, unsigned short *additionalInfo);
+
+//Checks a spontaneous stream response and returns its header fields. The
+//transaction ID needs to be the next expected one, as for
+//spontaneousStreamRead. Nothing is printed, so it can be called from a stream
+//loop that must not block on the terminal. Returns one of the
+//STREAM_ERROR_X codes (all negative) on error, 0 on success.
+//packet: The stream response, including its header.
+//size: The number of bytes in packet.
+//backlog, status, additionalInfo: See spontaneousStreamRead.
+int parseStreamPacket(const unsigned char *packet, int size,
+                      unsigned short *backlog, unsigned short *status,
+                      unsigned short *additionalInfo);
+
+//Returns a description of a STREAM_ERROR_X code.
+const char *streamErrorString(int error);
+
+//Resets the expected transaction ID of the stream responses. streamStart does
+//this. Call it before feeding parseStreamPacket responses that do not come
+//from a started T7 stream.
+void resetStreamTransactionID();
+
+//Builds a spontaneous stream response as a T7 sends it. Used to feed the
+//stream pipeline without a device.
+//transID: The transaction ID of the response.
+//backlog, status, additionalInfo: The header fields of the response.
+//rawData: The raw sample data, samplesPerPacket * 2 bytes (big endian).
+//samplesPerPacket: The number of samples in the response.
+//packet: The built response. The array needs to have STREAM_HEADER_BYTES +
+//        samplesPerPacket * 2 elements.
+void buildStreamPacket(unsigned short transID, unsigned short backlog,
+                       unsigned short status, unsigned short additionalInfo,
+                       const unsigned char *rawData, unsigned int samplesPerPacket,
+                       unsigned char *packet);
+
 //Stops the currently running stream on a T7. Returns -1 on error, 0 on
 //success.
 //sock: The T7's socket. The socket needs to be on port 502.
@@ -0,0 +1,120 @@
+/**
+ * Name: summary.h
+ * Desc: Provides the min/max/mean summaries of a recording at 10, 100 and
+ *       1000 scans per bin, so a viewer can draw hours of a recording from
+ *       a few small files. Each scan updates the running bin of the first
+ *       level only; a full bin is written and merged into the running bin
+ *       of the next level, so the work per sample is constant. Each level is
+ *       a file of fixed-size records in scan order, PREFIX_xN.t7s, holding
+ *       the raw sample codes and the calibration to convert them.
+**/
+
+#ifndef SUMMARY_H_
+#define SUMMARY_H_
+
+#include <stdio.h>
+
+#include "budget.h"
+#include "recorder.h"
+
+#define SUMMARY_MAGIC "LJT7SUM1"
+#define SUMMARY_MAGIC_BYTES 8
+#define SUMMARY_VERSION 1
+#define SUMMARY_BYTE_ORDER_MARK 0x01020304
+
+//Levels of the pyramid, each one SUMMARY_FACTOR times coarser than the
+//previous one, starting at SUMMARY_FACTOR scans per bin.
+#define SUMMARY_LEVELS 3
+#define SUMMARY_FACTOR 10
+
+//stdio buffer of each level file, taken from the sink budget.
+#define SUMMARY_WRITE_BUFFER_BYTES (256*1024)
+
+//Level file suffix, after the prefix and the scans per bin.
+#define SUMMARY_SUFFIX ".t7s"
+
+//Start of a level file.
+typedef struct
+{
+	char magic[SUMMARY_MAGIC_BYTES];
+	unsigned int version;
+	unsigned int byteOrderMark;
+	unsigned int headerBytes; //sizeof(SummaryFileHeader)
+	unsigned int decimation; //Scans per bin
+	unsigned int recordBytes; //SummaryRecord and its numAddresses SummaryValue
+	unsigned int reserved;
+	RecordingInfo info;
+} SummaryFileHeader;
+
+//Header of a bin. Bins start on multiples of the decimation, bins without
+//any recorded scan are left out.
+typedef struct
+{
+	unsigned long long firstScan; //Bin number times the decimation
+	double lslTime; //LSL time of the first recorded scan of the bin
+	unsigned int numScans; //Recorded scans in the bin, less than the decimation around dropped scans
+	unsigned int reserved;
+} SummaryRecord;
+
+//Summary of a channel in a bin, in raw sample codes.
+typedef struct
+{
+	unsigned short min;
+	unsigned short max;
+	float mean;
+} SummaryValue;
+
+class SummaryPyramid
+{
+public:
+	SummaryPyramid();
+	~SummaryPyramid();
+
+	//Creates the level files. Returns -1 on error, 0 on success.
+	//prefix: Path prefix of the recording, the files are PREFIX_xN.t7s.
+	//info: The stream configuration and calibration.
+	//budget: The write buffers are reserved from its sink share.
+	int open(const char *prefix, const RecordingInfo *info, MemoryBudget *budget);
+
+	//Adds whole scans to the running bins. Call it from one thread.
+	//rawData: numScans*numAddresses samples, 2 bytes each.
+	//firstScan: Index of the first scan.
+	//lslTime: LSL time of the first scan, the next ones at the nominal rate.
+	void add(const unsigned char *rawData, unsigned long long firstScan, double lslTime, unsigned int numScans);
+
+	//Writes the buffered bins to the files. Returns -1 on error, 0 on
+	//success.
+	int flush();
+
+	//Writes the running bins, even partial, and closes the files.
+	void close();
+
+	bool isOpen() const { return mLevels[0].file != NULL; }
+
+private:
+	SummaryPyramid(const SummaryPyramid &);
+	SummaryPyramid &operator=(const SummaryPyramid &);
+
+	//Running bin of a level.
+	typedef struct
+	{
+		FILE *file;
+		char *buffer;
+		unsigned long long bin; //Bin number at this level
+		double lslTime;
+		unsigned int numScans;
+		unsigned short min[MAX_NUM_STREAM_ADDR];
+		unsigned short max[MAX_NUM_STREAM_ADDR];
+		unsigned long long sum[MAX_NUM_STREAM_ADDR];
+	} Level;
+
+	void reset(Level *level);
+	void emit(int level);
+
+	RecordingInfo mInfo;
+	Level mLevels[SUMMARY_LEVELS];
+	SummaryValue mValues[MAX_NUM_STREAM_ADDR];
+	int mError;
+};
+
+#endif
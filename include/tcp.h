@@ -17,6 +17,18 @@ typedef int TCP_SOCKET;
 
 #define TCP_MAX_PACKET_BYTES 1040
 
+//Kernel state of a connected socket. Fields the platform does not report
+//are -1.
+typedef struct
+{
+	int rxQueueBytes; //Received bytes not read yet (SIOCINQ)
+	int rttUs; //Smoothed round trip time
+	int rttVarUs; //Round trip time variation
+	int totalRetrans; //Segments retransmitted since the connection opened
+	int lost; //Segments currently considered lost
+	int rcvSpace; //Receive buffer space the kernel tunes the window to
+} TCPSocketInfo;
+
 //For debugging purposes. Prints a packet/array to the terminal.
 void printPacket(const unsigned char *packet, int size);
 
@@ -42,9 +54,25 @@ int writeTCP(TCP_SOCKET sock, const unsigned char *packet, int size);
 //sock: The device's socket.
 //packet: The packet from the the device. This is a returned unsigned char
 //        array.
-//size: The number of bytes to read.
+//size: The number of bytes to read. Reads until size bytes arrived, the
+//      connection closed or an error occured.
 int readTCP(TCP_SOCKET sock, unsigned char *packet, int size);
 
+//Same as readTCP, but nothing is printed. For stream loops that must not
+//block on the terminal. Returns the number of bytes read, or -1 on error.
+int readTCPNoPrint(TCP_SOCKET sock, unsigned char *packet, int size);
+
+//Returns the number of received bytes not read yet (SIOCINQ), or -1 on
+//error. One system call.
+int readQueueTCP(TCP_SOCKET sock);
+
+//Reads the kernel state of a socket: the receive queue (SIOCINQ) and, on
+//Linux, TCP_INFO. Safe while another thread reads the socket. Returns -1 on
+//error, 0 on success.
+//sock: The device's socket.
+//info: The returned state.
+int getTCPSocketInfo(TCP_SOCKET sock, TCPSocketInfo *info);
+
 //Closes a socket. Returns -1 on error, 0 on success.
 int closeTCP(TCP_SOCKET sock);
 
@@ -0,0 +1,78 @@
+/**
+ * Name: trace.h
+ * Desc: Provides an optional trace of the acquisition pipeline. Each thread
+ *       records the begin and end times of its stages in its own lock-free
+ *       ring buffer, which keeps the most recent spans. On demand the rings
+ *       are written in the Chrome trace event JSON format, which Perfetto
+ *       (ui.perfetto.dev) and chrome://tracing open.
+**/
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <atomic>
+
+//Threads that can record spans.
+#define TRACE_MAX_THREADS 8
+#define TRACE_MAX_THREAD_NAME 32
+
+//Traced spans.
+enum TraceName
+{
+	TRACE_STREAM_READ = 0, //Socket receive of a stream response
+	TRACE_VALIDATE, //Header and transaction ID checks
+	TRACE_CONVERT, //Raw samples to calibrated voltages
+	TRACE_ASSEMBLE, //Scan assembly across packets
+	TRACE_PUSH, //LSL push_chunk
+	TRACE_AUTO_RECOVER, //Packet with an auto recover status (instant)
+	TRACE_REPORT, //Status report of the stats reporter
+	TRACE_SCRAPE, //Metrics scrape
+	TRACE_RECORD, //Recorder chunk write
+	TRACE_NUM_NAMES
+};
+
+//Set by traceInit. Checked before every record.
+extern std::atomic<int> gTraceEnabled;
+
+//Allocates one ring of eventsPerThread spans per thread and enables the
+//recording. eventsPerThread is rounded up to a power of 2. Returns -1 on
+//error, 0 on success.
+int traceInit(unsigned int eventsPerThread);
+
+//Names the calling thread in the trace.
+void traceSetThreadName(const char *name);
+
+//Records a span of the calling thread. Timestamps are monotonicNs values.
+//Does nothing if tracing is off. Never allocates or blocks.
+void traceRecord(int name, unsigned long long beginNs, unsigned long long endNs);
+
+inline void traceSpan(int name, unsigned long long beginNs, unsigned long long endNs)
+{
+	if(gTraceEnabled.load(std::memory_order_relaxed))
+		traceRecord(name, beginNs, endNs);
+}
+
+//Records an instant event of the calling thread.
+inline void traceInstant(int name, unsigned long long ns)
+{
+	if(gTraceEnabled.load(std::memory_order_relaxed))
+		traceRecord(name, ns, ns);
+}
+
+//Writes the spans in the rings to a Chrome trace event JSON file. Safe
+//while other threads record: spans overwritten during the dump are left
+//out. Returns -1 on error, 0 on success.
+int traceDump(const char *path);
+
+//Asks for a dump to the path given to traceSetDumpPath. Safe from signal
+//handlers.
+void traceRequestDump();
+
+//Sets the path of the dumps requested with traceRequestDump.
+void traceSetDumpPath(const char *path);
+
+//Writes the requested dump, if any. Call it from a thread that may block on
+//the file system.
+void traceDumpIfRequested();
+
+#endif
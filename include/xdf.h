@@ -0,0 +1,113 @@
+/**
+ * Name: xdf.h
+ * Desc: Provides an in-process XDF file writer for the calibrated scans, so
+ *       a full rate recording needs no LSL inlet and recorder. The stream
+ *       thread copies the complete scans of each packet into chunk buffers
+ *       and never waits for the disk: when every buffer is queued, the scans
+ *       are dropped and counted. A writer thread writes each full buffer as
+ *       one XDF Samples chunk in which only the first sample carries a
+ *       timestamp, the others are deduced from the nominal rate by the
+ *       readers. Clock offsets, boundaries and the stream footer are
+ *       written as LabRecorder does.
+**/
+
+#ifndef XDF_H_
+#define XDF_H_
+
+#include <atomic>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "budget.h"
+#include "chunkqueue.h"
+
+//Chunk tags of the XDF format.
+#define XDF_TAG_FILE_HEADER 1
+#define XDF_TAG_STREAM_HEADER 2
+#define XDF_TAG_SAMPLES 3
+#define XDF_TAG_CLOCK_OFFSET 4
+#define XDF_TAG_BOUNDARY 5
+#define XDF_TAG_STREAM_FOOTER 6
+
+//Stream ID of the scans in the file.
+#define XDF_STREAM_ID 1
+
+//Seconds of scans in a Samples chunk, and seconds of chunks the writer can
+//fall behind before scans are dropped.
+#define XDF_CHUNK_SEC 1.0
+#define XDF_QUEUE_SEC 8.0
+#define XDF_MIN_CHUNKS 4
+
+//Seconds between two clock offset records, and between two boundary
+//chunks.
+#define XDF_CLOCK_OFFSET_SEC 5.0
+#define XDF_BOUNDARY_SEC 10.0
+
+class XdfWriter : public ChunkQueue
+{
+public:
+	XdfWriter();
+	~XdfWriter();
+
+	//Allocates the chunk buffers from the sink budget, writes the file and
+	//stream headers and starts the writer thread. Returns -1 on error, 0 on
+	//success.
+	//path: The XDF file.
+	//streamXml: The stream header, the stream_info XML of the outlet with
+	//           the scan rate as nominal rate.
+	//scanRate: Scans per second.
+	//numAddresses: The number of float32 channels.
+	//budget: The memory budget of the stream.
+	int open(const char *path, const std::string &streamXml, float scanRate,
+	         unsigned int numAddresses, MemoryBudget *budget);
+
+	//Appends complete scans. Never blocks. Call it from the stream thread.
+	//scans: numScans*numAddresses samples.
+	//firstScan: Index of the first scan.
+	//lastScanTime: LSL time of the last scan, the others are spaced at the
+	//              nominal rate before it.
+	void write(const float *scans, unsigned int numScans, unsigned long long firstScan, double lastScanTime);
+
+	//Queues the last partial chunk, writes everything queued, the stream
+	//footer, and closes the file.
+	void close();
+
+	bool isOpen() const { return mArena != NULL; }
+
+	unsigned long long scansWritten() const { return mScansWritten.load(std::memory_order_relaxed); }
+	unsigned long long droppedScans() const { return mQueueStats.droppedScans.load(std::memory_order_relaxed); }
+	const ChunkQueueStats *stats() const { return &mQueueStats; }
+
+private:
+	XdfWriter(const XdfWriter &);
+	XdfWriter &operator=(const XdfWriter &);
+
+	unsigned int writeChunks(unsigned long long first, unsigned int count);
+	void poll();
+	void idle();
+	void finish();
+	int writeChunk(unsigned short tag, const unsigned char *content, unsigned long long bytes);
+	int writeSamples(const ScanChunkHeader *header);
+	int writeClockOffset(double now);
+	int writeBoundary();
+	int writeFooter();
+
+	char mPath[256];
+	unsigned char *mArena; //allocAligned block holding the buffers
+	unsigned char *mOut; //Samples chunk being written
+	unsigned long long mOutBytes;
+	std::atomic<unsigned long long> mScansWritten;
+	ChunkQueueStats mQueueStats;
+
+	//Writer thread side
+	FILE *mFile;
+	int mError;
+	double mFirstTime;
+	double mLastTime;
+	double mNextOffset;
+	double mNextBoundary;
+	std::vector<double> mOffsetTimes; //Collection times of the clock offsets, for the footer
+};
+
+#endif
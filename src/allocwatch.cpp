@@ -0,0 +1,120 @@
+#include "allocwatch.h"
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+
+static thread_local unsigned long long tAllocCount = 0;
+static std::atomic<unsigned long long> gAllocCount(0);
+
+static inline void countAllocation()
+{
+	tAllocCount++;
+	gAllocCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+unsigned long long threadAllocCount()
+{
+	return tAllocCount;
+}
+
+unsigned long long processAllocCount()
+{
+	return gAllocCount.load(std::memory_order_relaxed);
+}
+
+#if defined(LSLPUB_ALLOC_HOOKS) && defined(__GLIBC__)
+
+//glibc's own allocator entry points, wrapped by the definitions below.
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t num, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+extern "C" void *malloc(size_t size)
+{
+	countAllocation();
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t num, size_t size)
+{
+	countAllocation();
+	return __libc_calloc(num, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+	countAllocation();
+	return __libc_realloc(ptr, size);
+}
+
+int allocHooksEnabled()
+{
+	return 1;
+}
+
+//operator new goes through the malloc above and is already counted.
+static inline void *allocate(size_t size)
+{
+	return malloc(size ? size : 1);
+}
+
+#else
+
+int allocHooksEnabled()
+{
+	return 0;
+}
+
+static inline void *allocate(size_t size)
+{
+	countAllocation();
+	return malloc(size ? size : 1);
+}
+
+#endif
+
+void *operator new(size_t size)
+{
+	void *ptr = allocate(size);
+	if(ptr == NULL)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void *operator new[](size_t size)
+{
+	void *ptr = allocate(size);
+	if(ptr == NULL)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+	return allocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+	return allocate(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+	free(ptr);
+}
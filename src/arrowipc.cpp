@@ -0,0 +1,633 @@
+#include "arrowipc.h"
+#include <lsl_cpp.h>
+#include <chrono>
+#include <exception>
+#include <math.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+//Values of the Arrow flatbuffer schema (Message.fbs and Schema.fbs).
+#define ARROW_METADATA_V5 4
+#define ARROW_HEADER_SCHEMA 1
+#define ARROW_HEADER_RECORD_BATCH 3
+#define ARROW_TYPE_INT 2
+#define ARROW_TYPE_FLOATING_POINT 3
+#define ARROW_TYPE_TIMESTAMP 10
+#define ARROW_PRECISION_SINGLE 1
+#define ARROW_PRECISION_DOUBLE 2
+#define ARROW_UNIT_MICROSECOND 2
+
+//Columns before the channels: time, scan_index and lsl_time.
+#define ARROW_INDEX_COLUMNS 3
+
+//Start and end of the file format.
+static const char ARROW_MAGIC[8] = {'A', 'R', 'R', 'O', 'W', '1', 0, 0};
+#define ARROW_MAGIC_BYTES 6
+
+//A message starts with a continuation marker and the metadata length, the
+//stream ends with a zero length.
+static const unsigned int CONTINUATION = 0xFFFFFFFF;
+
+static int isLittleEndian()
+{
+	const unsigned int one = 1;
+	return *(const unsigned char *)&one == 1;
+}
+
+static unsigned long long alignUp(unsigned long long size, unsigned long long align)
+{
+	return (size + align - 1) & ~(align - 1);
+}
+
+//The flatbuffers are built front to back: a table or vector is written
+//before the objects it refers to, so every offset points forward.
+
+//Appends zeroed bytes at an aligned position. Returns the position.
+static size_t fbAlloc(std::vector<unsigned char> &fb, size_t bytes, size_t align)
+{
+	size_t pos = (size_t)alignUp(fb.size(), align);
+
+	fb.resize(pos + bytes, 0);
+	return pos;
+}
+
+static void fbPut(std::vector<unsigned char> &fb, size_t pos, unsigned long long value, unsigned int bytes)
+{
+	unsigned int i = 0;
+
+	for(i = 0; i < bytes; i++)
+		fb[pos + i] = (unsigned char)(value >> (8*i));
+}
+
+//Points the offset field at pos to target.
+static void fbLink(std::vector<unsigned char> &fb, size_t pos, size_t target)
+{
+	fbPut(fb, pos, target - pos, 4);
+}
+
+//Writes the vtable of a table, then the table with its fields in order,
+//each aligned to its size. Returns the table position.
+//sizes: Bytes of each field, 0 if it is absent.
+//pos: Receives the position of each field.
+static size_t fbTable(std::vector<unsigned char> &fb, const unsigned int *sizes, unsigned int numFields, size_t *pos)
+{
+	unsigned int offsets[8];
+	unsigned int end = 4; //After the vtable offset
+	size_t vtable = 0;
+	size_t table = 0;
+	unsigned int i = 0;
+
+	for(i = 0; i < numFields; i++)
+	{
+		offsets[i] = 0;
+		if(sizes[i] == 0)
+			continue;
+		end = (unsigned int)alignUp(end, sizes[i]);
+		offsets[i] = end;
+		end += sizes[i];
+	}
+	vtable = fbAlloc(fb, 4 + 2*numFields, 2);
+	fbPut(fb, vtable, 4 + 2*numFields, 2);
+	fbPut(fb, vtable + 2, end, 2);
+	for(i = 0; i < numFields; i++)
+		fbPut(fb, vtable + 4 + 2*i, offsets[i], 2);
+	table = fbAlloc(fb, end, 8);
+	fbPut(fb, table, table - vtable, 4);
+	for(i = 0; i < numFields; i++)
+		pos[i] = table + offsets[i];
+	return table;
+}
+
+//Returns the position of the length, the elements follow it aligned.
+static size_t fbVector(std::vector<unsigned char> &fb, unsigned int count, unsigned int elementBytes, unsigned int align)
+{
+	size_t pos = (size_t)alignUp(fb.size() + 4, align) - 4;
+
+	fb.resize(pos + 4 + (size_t)count*elementBytes, 0);
+	fbPut(fb, pos, count, 4);
+	return pos;
+}
+
+static size_t fbString(std::vector<unsigned char> &fb, const char *value)
+{
+	size_t length = strlen(value);
+	size_t pos = fbAlloc(fb, 4 + length + 1, 4);
+
+	fbPut(fb, pos, length, 4);
+	memcpy(&fb[pos + 4], value, length);
+	return pos;
+}
+
+//Starts a Message: version, header type, header and body length. Returns
+//the position of the header offset.
+static size_t fbMessage(std::vector<unsigned char> &fb, unsigned int headerType, unsigned long long bodyBytes)
+{
+	static const unsigned int sizes[4] = {2, 1, 4, 8};
+	size_t pos[4];
+
+	fb.clear();
+	fbAlloc(fb, 4, 4);
+	fbLink(fb, 0, fbTable(fb, sizes, 4, pos));
+	fbPut(fb, pos[0], ARROW_METADATA_V5, 2);
+	fbPut(fb, pos[1], headerType, 1);
+	fbPut(fb, pos[3], bodyBytes, 8);
+	return pos[2];
+}
+
+ArrowWriter::ArrowWriter() : mSocket(false), mUnixOffsetUs(0), mArena(NULL), mBody(NULL), mScansWritten(0), mFile(NULL),
+	mListenFd(-1), mClientFd(-1), mError(0), mOffset(0)
+{
+	mPath[0] = '\0';
+	mQueueStats.droppedScans.store(0);
+}
+
+ArrowWriter::~ArrowWriter()
+{
+	close();
+}
+
+int ArrowWriter::open(const char *path, float scanRate, unsigned int numAddresses, MemoryBudget *budget)
+{
+	unsigned long long arenaBytes = 0;
+	unsigned long long bodyBytes = 0;
+	size_t prefixLength = strlen(ARROW_SOCKET_PREFIX);
+
+	if(isOpen() || numAddresses == 0 || scanRate <= 0)
+	{
+		printf("ArrowWriter::open error: Invalid stream configuration.\n");
+		return -1;
+	}
+	if(!isLittleEndian())
+	{
+		printf("ArrowWriter::open error: Writing Arrow needs a little endian host.\n");
+		return -1;
+	}
+	mSocket = strncmp(path, ARROW_SOCKET_PREFIX, prefixLength) == 0;
+	if(mSocket)
+		path += prefixLength;
+	strncpy(mPath, path, sizeof(mPath) - 1);
+	mPath[sizeof(mPath) - 1] = '\0';
+	mScanRate = scanRate;
+	mNumAddresses = numAddresses;
+	mChunkScans = (unsigned int)(ARROW_BATCH_SEC*scanRate + 0.5);
+	if(mChunkScans == 0)
+		mChunkScans = 1;
+	mChunkBytes = (unsigned int)alignUp(sizeof(ScanChunkHeader) + (unsigned long long)mChunkScans*numAddresses*sizeof(float), 64);
+	mNumChunks = (unsigned int)(ARROW_QUEUE_SEC/ARROW_BATCH_SEC + 0.5);
+	if(mNumChunks < ARROW_MIN_CHUNKS)
+		mNumChunks = ARROW_MIN_CHUNKS;
+
+	//Chunk buffers, then the body of a record batch: the three 8-byte index
+	//columns and the channels, each padded to ARROW_ALIGN
+	bodyBytes = ARROW_INDEX_COLUMNS*alignUp(8ULL*mChunkScans, ARROW_ALIGN) + numAddresses*alignUp(4ULL*mChunkScans, ARROW_ALIGN);
+	arenaBytes = (unsigned long long)mNumChunks*mChunkBytes + bodyBytes;
+	if(reserveSinkMemory(budget, "Arrow writer", arenaBytes) != 0)
+		return -1;
+	mArena = (unsigned char *)allocAligned((size_t)arenaBytes);
+	if(mArena == NULL)
+		return -1;
+	mChunks = mArena;
+	mBody = mChunks + (size_t)mNumChunks*mChunkBytes;
+
+	mError = 0;
+	mOffset = 0;
+	try
+	{
+		mBlocks.clear();
+		mBlocks.reserve((size_t)(3600/ARROW_BATCH_SEC)); //An hour of batches
+	}
+	catch(std::exception &)
+	{
+		mError = 1;
+	}
+	if(mSocket)
+	{
+#ifndef WIN32
+		struct sockaddr_un addr;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if(strlen(mPath) >= sizeof(addr.sun_path))
+		{
+			printf("ArrowWriter::open error: Socket path %s is too long\n", mPath);
+			mError = 1;
+		}
+		else
+		{
+			strcpy(addr.sun_path, mPath);
+			unlink(mPath);
+			mListenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+			if(mListenFd < 0 || bind(mListenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(mListenFd, 1) != 0 ||
+			   fcntl(mListenFd, F_SETFL, O_NONBLOCK) != 0)
+			{
+				printf("ArrowWriter::open error: Could not listen on %s: %s\n", mPath, strerror(errno));
+				mError = 1;
+			}
+		}
+#else
+		printf("ArrowWriter::open error: The socket output needs Unix sockets.\n");
+		mError = 1;
+#endif
+	}
+	else
+	{
+		mFile = fopen(mPath, "wb");
+		if(mFile == NULL)
+		{
+			printf("ArrowWriter::open error: Could not create %s\n", mPath);
+			mError = 1;
+		}
+		else if(writeBytes(ARROW_MAGIC, sizeof(ARROW_MAGIC)) != 0 || writeSchema() != 0)
+		{
+			printf("ArrowWriter::open error: Could not write %s\n", mPath);
+			mError = 1;
+		}
+	}
+	if(mError)
+	{
+		closeSocket();
+		if(mFile != NULL)
+			fclose(mFile);
+		mFile = NULL;
+		freeAligned(mArena);
+		mArena = NULL;
+		return -1;
+	}
+
+	mUnixOffsetUs = (long long)std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count() - llround(lsl::local_clock()*1e6);
+	mScansWritten.store(0);
+	if(openQueue(&mQueueStats, "arrow writer") != 0)
+	{
+		printf("ArrowWriter::open error: Could not start the writer thread\n");
+		closeSocket();
+		if(mFile != NULL)
+			fclose(mFile);
+		mFile = NULL;
+		freeAligned(mArena);
+		mArena = NULL;
+		return -1;
+	}
+	printf("Writing Arrow %s %s: %u scans per record batch, %u chunk buffers (%.1f MB)\n",
+	       mSocket ? "stream on socket" : "file", mPath, mChunkScans, mNumChunks, arenaBytes/(1024.0*1024.0));
+	return 0;
+}
+
+void ArrowWriter::write(const float *scans, unsigned int numScans, unsigned long long firstScan, double lastScanTime)
+{
+	if(mArena != NULL)
+		appendScans(scans, numScans, firstScan, lastScanTime);
+}
+
+void ArrowWriter::close()
+{
+	if(mArena == NULL)
+		return;
+	closeQueue();
+	printf("Arrow: %llu scans written to %s, %llu dropped%s\n", mScansWritten.load(), mPath, mQueueStats.droppedScans.load(),
+	       mError ? ", write errors" : "");
+	freeAligned(mArena);
+	mArena = NULL;
+	mChunks = NULL;
+	mBody = NULL;
+}
+
+//Schema table: the fields time, scan_index, lsl_time and the channels,
+//none nullable. Returns its position.
+size_t ArrowWriter::buildSchema(std::vector<unsigned char> &fb) const
+{
+	static const unsigned int schemaSizes[2] = {2, 4}; //endianness, fields
+	static const unsigned int fieldSizes[6] = {4, 1, 1, 4, 0, 4}; //name, nullable, type_type, type, dictionary, children
+	static const unsigned int timestampSizes[2] = {2, 4}; //unit, timezone
+	static const unsigned int intSizes[2] = {4, 1}; //bitWidth, is_signed
+	static const unsigned int floatSizes[1] = {2}; //precision
+	const unsigned int numFields = ARROW_INDEX_COLUMNS + mNumAddresses;
+	char name[32];
+	size_t schemaPos[2];
+	size_t fieldPos[6];
+	size_t typePos[2];
+	size_t schema = 0;
+	size_t fields = 0;
+	size_t field = 0;
+	unsigned int i = 0;
+
+	schema = fbTable(fb, schemaSizes, 2, schemaPos);
+	fields = fbVector(fb, numFields, 4, 4);
+	fbLink(fb, schemaPos[1], fields);
+	for(i = 0; i < numFields; i++)
+	{
+		field = fbTable(fb, fieldSizes, 6, fieldPos);
+		fbLink(fb, fields + 4 + 4*i, field);
+		if(i == 0)
+			strcpy(name, "time");
+		else if(i == 1)
+			strcpy(name, "scan_index");
+		else if(i == 2)
+			strcpy(name, "lsl_time");
+		else
+			snprintf(name, sizeof(name), "ch%u", i - ARROW_INDEX_COLUMNS);
+		fbLink(fb, fieldPos[0], fbString(fb, name));
+		if(i == 0)
+		{
+			fbPut(fb, fieldPos[2], ARROW_TYPE_TIMESTAMP, 1);
+			fbLink(fb, fieldPos[3], fbTable(fb, timestampSizes, 2, typePos));
+			fbPut(fb, typePos[0], ARROW_UNIT_MICROSECOND, 2);
+			fbLink(fb, typePos[1], fbString(fb, "UTC"));
+		}
+		else if(i == 1)
+		{
+			fbPut(fb, fieldPos[2], ARROW_TYPE_INT, 1);
+			fbLink(fb, fieldPos[3], fbTable(fb, intSizes, 2, typePos));
+			fbPut(fb, typePos[0], 64, 4);
+			fbPut(fb, typePos[1], 1, 1);
+		}
+		else
+		{
+			fbPut(fb, fieldPos[2], ARROW_TYPE_FLOATING_POINT, 1);
+			fbLink(fb, fieldPos[3], fbTable(fb, floatSizes, 1, typePos));
+			fbPut(fb, typePos[0], i == 2 ? ARROW_PRECISION_DOUBLE : ARROW_PRECISION_SINGLE, 2);
+		}
+		fbLink(fb, fieldPos[5], fbVector(fb, 0, 4, 4));
+	}
+	return schema;
+}
+
+//Writes the continuation marker, the metadata length, the flatbuffer in
+//mMeta padded to 8 bytes, then the body.
+int ArrowWriter::writeMessage(const unsigned char *body, unsigned long long bodyBytes)
+{
+	static const unsigned char padding[8] = {0};
+	unsigned int prefix[2];
+	unsigned int metaBytes = (unsigned int)alignUp(mMeta.size(), 8);
+
+	prefix[0] = CONTINUATION;
+	prefix[1] = metaBytes;
+	if(writeBytes(prefix, sizeof(prefix)) != 0 || writeBytes(mMeta.data(), mMeta.size()) != 0 ||
+	   writeBytes(padding, metaBytes - mMeta.size()) != 0 || writeBytes(body, bodyBytes) != 0)
+		return -1;
+	return 0;
+}
+
+int ArrowWriter::writeSchema()
+{
+	try
+	{
+		size_t header = fbMessage(mMeta, ARROW_HEADER_SCHEMA, 0);
+		fbLink(mMeta, header, buildSchema(mMeta));
+	}
+	catch(std::exception &)
+	{
+		return -1;
+	}
+	return writeMessage(NULL, 0);
+}
+
+//Transposes a chunk into the columns of a record batch and writes it.
+int ArrowWriter::writeBatch(const ScanChunkHeader *header)
+{
+	static const unsigned int batchSizes[3] = {8, 4, 4}; //length, nodes, buffers
+	const unsigned int numScans = header->numScans;
+	const unsigned int numColumns = ARROW_INDEX_COLUMNS + mNumAddresses;
+	const unsigned long long wide = alignUp(8ULL*numScans, ARROW_ALIGN);
+	const unsigned long long narrow = alignUp(4ULL*numScans, ARROW_ALIGN);
+	const unsigned long long bodyBytes = ARROW_INDEX_COLUMNS*wide + mNumAddresses*narrow;
+	const float *scan = (const float *)((const unsigned char *)header + sizeof(ScanChunkHeader));
+	long long *time = (long long *)mBody;
+	unsigned long long *index = (unsigned long long *)(mBody + wide);
+	double *lslTime = (double *)(mBody + 2*wide);
+	float *channel = (float *)(mBody + 3*wide);
+	Block block;
+	size_t batchPos[3];
+	size_t nodes = 0;
+	size_t buffers = 0;
+	unsigned long long offset = 0;
+	unsigned long long bytes = 0;
+	unsigned int i = 0;
+	unsigned int j = 0;
+
+	memset(mBody, 0, (size_t)bodyBytes);
+	for(i = 0; i < numScans; i++, scan += mNumAddresses)
+	{
+		lslTime[i] = header->firstTime + i/mScanRate;
+		time[i] = llround(lslTime[i]*1e6) + mUnixOffsetUs;
+		index[i] = header->firstScan + i;
+		for(j = 0; j < mNumAddresses; j++)
+			channel[j*(narrow/4) + i] = scan[j];
+	}
+
+	//A field node per column, and an empty validity buffer and a data buffer
+	try
+	{
+		size_t batch = 0;
+
+		batch = fbMessage(mMeta, ARROW_HEADER_RECORD_BATCH, bodyBytes);
+		fbLink(mMeta, batch, fbTable(mMeta, batchSizes, 3, batchPos));
+		fbPut(mMeta, batchPos[0], numScans, 8);
+		nodes = fbVector(mMeta, numColumns, 16, 8);
+		fbLink(mMeta, batchPos[1], nodes);
+		buffers = fbVector(mMeta, 2*numColumns, 16, 8);
+		fbLink(mMeta, batchPos[2], buffers);
+		for(i = 0; i < numColumns; i++)
+		{
+			bytes = i < ARROW_INDEX_COLUMNS ? 8ULL*numScans : 4ULL*numScans;
+			fbPut(mMeta, nodes + 4 + 16*i, numScans, 8);
+			fbPut(mMeta, buffers + 4 + 32*i, offset, 8);
+			fbPut(mMeta, buffers + 4 + 32*i + 16, offset, 8);
+			fbPut(mMeta, buffers + 4 + 32*i + 24, bytes, 8);
+			offset += i < ARROW_INDEX_COLUMNS ? wide : narrow;
+		}
+	}
+	catch(std::exception &)
+	{
+		return -1;
+	}
+
+	block.offset = mOffset;
+	block.metaBytes = 8 + (unsigned int)alignUp(mMeta.size(), 8);
+	block.bodyBytes = bodyBytes;
+	if(writeMessage(mBody, bodyBytes) != 0)
+		return -1;
+	if(mFile != NULL)
+	{
+		try
+		{
+			mBlocks.push_back(block);
+		}
+		catch(std::exception &)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+//End of stream, then the footer with the schema and the record batch
+//locations, its length and the magic.
+int ArrowWriter::writeFooter()
+{
+	static const unsigned int footerSizes[4] = {2, 4, 4, 4}; //version, schema, dictionaries, recordBatches
+	const unsigned int endOfStream[2] = {CONTINUATION, 0};
+	unsigned int footerBytes = 0;
+	size_t footerPos[4];
+	size_t batches = 0;
+	size_t i = 0;
+
+	if(writeBytes(endOfStream, sizeof(endOfStream)) != 0)
+		return -1;
+	try
+	{
+		mMeta.clear();
+		fbAlloc(mMeta, 4, 4);
+		fbLink(mMeta, 0, fbTable(mMeta, footerSizes, 4, footerPos));
+		fbPut(mMeta, footerPos[0], ARROW_METADATA_V5, 2);
+		fbLink(mMeta, footerPos[1], buildSchema(mMeta));
+		fbLink(mMeta, footerPos[2], fbVector(mMeta, 0, 24, 8));
+		batches = fbVector(mMeta, (unsigned int)mBlocks.size(), 24, 8);
+		fbLink(mMeta, footerPos[3], batches);
+		for(i = 0; i < mBlocks.size(); i++)
+		{
+			fbPut(mMeta, batches + 4 + 24*i, mBlocks[i].offset, 8);
+			fbPut(mMeta, batches + 4 + 24*i + 8, mBlocks[i].metaBytes, 4);
+			fbPut(mMeta, batches + 4 + 24*i + 16, mBlocks[i].bodyBytes, 8);
+		}
+	}
+	catch(std::exception &)
+	{
+		return -1;
+	}
+	footerBytes = (unsigned int)mMeta.size();
+	if(writeBytes(mMeta.data(), mMeta.size()) != 0 || writeBytes(&footerBytes, 4) != 0 ||
+	   writeBytes(ARROW_MAGIC, ARROW_MAGIC_BYTES) != 0)
+		return -1;
+	return 0;
+}
+
+//Writes to the file, or to the socket client if one is connected. A
+//client that went away is dropped, it is not an error.
+int ArrowWriter::writeBytes(const void *data, unsigned long long bytes)
+{
+	const unsigned char *p = (const unsigned char *)data;
+#ifndef WIN32
+	ssize_t sent = 0;
+#endif
+
+	if(bytes == 0)
+		return 0;
+	if(mFile != NULL)
+	{
+		if(fwrite(data, (size_t)bytes, 1, mFile) != 1)
+			return -1;
+		mOffset += bytes;
+		return 0;
+	}
+#ifndef WIN32
+	while(mClientFd >= 0 && bytes > 0)
+	{
+		sent = send(mClientFd, p, (size_t)bytes, MSG_NOSIGNAL);
+		if(sent < 0 && errno == EINTR)
+			continue;
+		if(sent <= 0)
+		{
+			printf("Arrow: Client of %s disconnected\n", mPath);
+			dropClient();
+			break;
+		}
+		p += sent;
+		bytes -= sent;
+	}
+#endif
+	return 0;
+}
+
+//Takes a waiting client of the socket and sends it the schema.
+void ArrowWriter::acceptClient()
+{
+#ifndef WIN32
+	int fd = -1;
+
+	if(mListenFd < 0 || mClientFd >= 0)
+		return;
+	fd = accept(mListenFd, NULL, NULL);
+	if(fd < 0)
+		return;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	mClientFd = fd;
+	printf("Arrow: Client connected to %s\n", mPath);
+	if(writeSchema() != 0)
+		dropClient();
+#endif
+}
+
+void ArrowWriter::dropClient()
+{
+#ifndef WIN32
+	if(mClientFd >= 0)
+		::close(mClientFd);
+	mClientFd = -1;
+#endif
+}
+
+void ArrowWriter::closeSocket()
+{
+	dropClient();
+#ifndef WIN32
+	if(mListenFd >= 0)
+	{
+		::close(mListenFd);
+		unlink(mPath);
+	}
+	mListenFd = -1;
+#endif
+}
+
+//A waiting client of the socket is taken within CHUNKQUEUE_POLL_MS.
+void ArrowWriter::poll()
+{
+	if(mSocket)
+		acceptClient();
+}
+
+void ArrowWriter::idle()
+{
+	if(mFile != NULL)
+		fflush(mFile);
+}
+
+unsigned int ArrowWriter::writeChunks(unsigned long long first, unsigned int)
+{
+	const ScanChunkHeader *header = (const ScanChunkHeader *)chunk(first);
+
+	if(mSocket && mClientFd < 0)
+	{
+		//Nobody to stream to
+	}
+	else if(writeBatch(header) != 0)
+		mError = 1;
+	else if(!mSocket || mClientFd >= 0)
+		mScansWritten.store(mScansWritten.load(std::memory_order_relaxed) + header->numScans, std::memory_order_relaxed);
+	return 1;
+}
+
+void ArrowWriter::finish()
+{
+	if(mFile != NULL)
+	{
+		if(writeFooter() != 0 || fclose(mFile) != 0)
+			mError = 1;
+		mFile = NULL;
+	}
+	else
+	{
+		//End of stream for the client
+		const unsigned int endOfStream[2] = {CONTINUATION, 0};
+		writeBytes(endOfStream, sizeof(endOfStream));
+		closeSocket();
+	}
+}
@@ -0,0 +1,298 @@
+#include "blackbox.h"
+#include "trace.h"
+#include <lsl_cpp.h>
+#include <chrono>
+#include <exception>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+BlackBox::BlackBox() : mFd(-1), mMapBytes(0), mHeader(NULL), mRing(NULL), mSyncSec(0), mRunning(0)
+{
+}
+
+BlackBox::~BlackBox()
+{
+	close();
+}
+
+static long long unixTimeNs()
+{
+	return (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void BlackBox::write(const float *scans, unsigned int numScans)
+{
+	const unsigned int numAddresses = mHeader->numAddresses;
+	const unsigned long long capacity = mHeader->capacityScans;
+	unsigned long long written = mHeader->writtenScans.load(std::memory_order_relaxed);
+	unsigned long long slot = 0;
+	unsigned long long first = 0;
+
+	if(numScans == 0)
+		return;
+	if(numScans > capacity)
+	{
+		//Only the last capacity scans fit
+		scans += (numScans - capacity)*numAddresses;
+		written += numScans - capacity;
+		numScans = (unsigned int)capacity;
+	}
+
+	//Two copies when the scans wrap around the end of the ring
+	slot = written % capacity;
+	first = capacity - slot < numScans ? capacity - slot : numScans;
+	memcpy(&mRing[slot*numAddresses], scans, first*numAddresses*sizeof(float));
+	if(first < numScans)
+		memcpy(mRing, &scans[first*numAddresses], (numScans - first)*numAddresses*sizeof(float));
+
+	//The cursor moves after the scans, so a reader never sees a scan before its data
+	mHeader->anchorScan.store(written + numScans - 1, std::memory_order_relaxed);
+	mHeader->anchorLslTime.store(lsl::local_clock(), std::memory_order_relaxed);
+	mHeader->anchorUnixNs.store(unixTimeNs(), std::memory_order_relaxed);
+	mHeader->writtenScans.store(written + numScans, std::memory_order_release);
+}
+
+#ifndef WIN32
+int BlackBox::open(const char *path, float scanRate, unsigned int numAddresses, double minutes, double syncSec)
+{
+	unsigned long long guardScans = 0;
+	unsigned long long capacityScans = 0;
+	int ret = 0;
+
+	if(isOpen() || scanRate <= 0 || numAddresses == 0 || minutes <= 0 || syncSec <= 0)
+		return -1;
+	guardScans = (unsigned long long)(BLACKBOX_GUARD_PERIODS*syncSec*scanRate) + 1;
+	capacityScans = (unsigned long long)(minutes*60.0*scanRate) + guardScans;
+	mMapBytes = BLACKBOX_HEADER_BYTES + (size_t)(capacityScans*numAddresses*sizeof(float));
+
+	mFd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(mFd < 0)
+	{
+		printf("BlackBox::open error: Could not create %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+
+	//Allocate every block now, so a full disk fails here and not with a
+	//SIGBUS in the stream loop
+#ifdef __linux__
+	ret = posix_fallocate(mFd, 0, (off_t)mMapBytes);
+#else
+	ret = ftruncate(mFd, (off_t)mMapBytes) == 0 ? 0 : errno;
+#endif
+	if(ret != 0)
+	{
+		printf("BlackBox::open error: Could not allocate %llu MB for %s (%s)\n",
+		       (unsigned long long)(mMapBytes >> 20), path, strerror(ret));
+		close();
+		return -1;
+	}
+#ifdef MAP_POPULATE
+	mHeader = (BlackBoxHeader *)mmap(NULL, mMapBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, 0);
+#else
+	mHeader = (BlackBoxHeader *)mmap(NULL, mMapBytes, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+#endif
+	if(mHeader == MAP_FAILED)
+	{
+		printf("BlackBox::open error: Could not map %s (%s)\n", path, strerror(errno));
+		mHeader = NULL;
+		close();
+		return -1;
+	}
+	mRing = (float *)((char *)mHeader + BLACKBOX_HEADER_BYTES);
+
+	//The new file reads as zeros, only the constant fields are set
+	memcpy(mHeader->magic, BLACKBOX_MAGIC, BLACKBOX_MAGIC_BYTES);
+	mHeader->version = BLACKBOX_VERSION;
+	mHeader->byteOrderMark = BLACKBOX_BYTE_ORDER_MARK;
+	mHeader->numAddresses = numAddresses;
+	mHeader->scanRate = scanRate;
+	mHeader->capacityScans = capacityScans;
+	mHeader->guardScans = guardScans;
+	mSyncSec = syncSec;
+	if(sync() != 0)
+	{
+		close();
+		return -1;
+	}
+
+	mRunning = 1;
+	try
+	{
+		mThread = std::thread(&BlackBox::run, this);
+	}
+	catch(std::exception &)
+	{
+		printf("BlackBox::open error: Could not start the sync thread\n");
+		mRunning = 0;
+		close();
+		return -1;
+	}
+	printf("Black box: %g minutes of scans (%llu MB) in %s, synced every %.3f s\n", minutes,
+	       (unsigned long long)(mMapBytes >> 20), path, syncSec);
+	return 0;
+}
+
+void BlackBox::close()
+{
+	if(mThread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mRunning = 0;
+		}
+		mWake.notify_all();
+		mThread.join();
+	}
+	if(mHeader != NULL)
+	{
+		sync();
+		munmap(mHeader, mMapBytes);
+	}
+	mHeader = NULL;
+	mRing = NULL;
+	if(mFd >= 0)
+		::close(mFd);
+	mFd = -1;
+}
+
+int BlackBox::sync()
+{
+	unsigned long long written = mHeader->writtenScans.load(std::memory_order_acquire);
+
+	//Scans first, then the header that declares them synced
+	if(msync(mHeader, mMapBytes, MS_SYNC) != 0)
+	{
+		printf("BlackBox::sync error: %s\n", strerror(errno));
+		return -1;
+	}
+	mHeader->syncedScans.store(written, std::memory_order_relaxed);
+	if(msync(mHeader, BLACKBOX_HEADER_BYTES, MS_SYNC) != 0)
+	{
+		printf("BlackBox::sync error: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+void BlackBox::run()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+
+	traceSetThreadName("black box sync");
+	while(mRunning)
+	{
+		mWake.wait_for(lock, std::chrono::duration<double>(mSyncSec));
+		if(!mRunning)
+			break;
+		lock.unlock();
+		sync();
+		lock.lock();
+	}
+}
+int recoverBlackBox(const char *path, const char *csvPath)
+{
+	BlackBoxHeader header;
+	FILE *file = NULL;
+	FILE *out = NULL;
+	float scan[BLACKBOX_HEADER_BYTES/sizeof(float)];
+	unsigned long long synced = 0;
+	unsigned long long first = 0;
+	unsigned long long index = 0;
+	unsigned long long anchorScan = 0;
+	double anchorLslTime = 0;
+	long long anchorUnixNs = 0;
+	double offset = 0;
+	unsigned int i = 0;
+
+	file = fopen(path, "rb");
+	if(file == NULL)
+	{
+		printf("recoverBlackBox error: Could not open %s\n", path);
+		return -1;
+	}
+	if(fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, BLACKBOX_MAGIC, BLACKBOX_MAGIC_BYTES) != 0)
+	{
+		printf("recoverBlackBox error: %s is not a black box\n", path);
+		fclose(file);
+		return -1;
+	}
+	if(header.version != BLACKBOX_VERSION || header.byteOrderMark != BLACKBOX_BYTE_ORDER_MARK ||
+	   header.numAddresses == 0 || header.numAddresses*sizeof(float) > sizeof(scan) ||
+	   header.capacityScans <= header.guardScans || header.scanRate <= 0)
+	{
+		printf("recoverBlackBox error: %s was written by another version or kind of host\n", path);
+		fclose(file);
+		return -1;
+	}
+
+	//The ring may hold scans written after the last sync in the guard part
+	synced = header.syncedScans.load();
+	first = synced > header.capacityScans - header.guardScans ? synced - (header.capacityScans - header.guardScans) : 0;
+	anchorScan = header.anchorScan.load();
+	anchorLslTime = header.anchorLslTime.load();
+	anchorUnixNs = header.anchorUnixNs.load();
+	printf("%s: %u channels at %.3f Hz, %llu scans written, %llu synced, recovering scans %llu to %llu in %s\n", path,
+	       header.numAddresses, header.scanRate, header.writtenScans.load(), synced, first, synced > 0 ? synced - 1 : 0, csvPath);
+	out = fopen(csvPath, "w");
+	if(out == NULL)
+	{
+		printf("recoverBlackBox error: Could not create %s\n", csvPath);
+		fclose(file);
+		return -1;
+	}
+
+	for(index = first; index < synced; index++)
+	{
+		if(fseeko(file, BLACKBOX_HEADER_BYTES + (off_t)((index % header.capacityScans)*header.numAddresses*sizeof(float)), SEEK_SET) != 0 ||
+		   fread(scan, sizeof(float), header.numAddresses, file) != header.numAddresses)
+		{
+			printf("recoverBlackBox error: %s is truncated\n", path);
+			fclose(out);
+			fclose(file);
+			return -1;
+		}
+		//Timestamps from the anchor at the nominal scan rate
+		offset = ((double)index - (double)anchorScan)/header.scanRate;
+		fprintf(out, "%llu,%.6f,%.6f", index, anchorLslTime + offset, anchorUnixNs/1e9 + offset);
+		for(i = 0; i < header.numAddresses; i++)
+			fprintf(out, ",%.6f", scan[i]);
+		fprintf(out, "\n");
+	}
+	fclose(out);
+	fclose(file);
+	return 0;
+}
+#else
+int BlackBox::open(const char *path, float scanRate, unsigned int numAddresses, double minutes, double syncSec)
+{
+	printf("BlackBox::open error: The black box needs mmap.\n");
+	return -1;
+}
+
+void BlackBox::close()
+{
+}
+
+int BlackBox::sync()
+{
+	return -1;
+}
+
+void BlackBox::run()
+{
+}
+
+int recoverBlackBox(const char *path, const char *csvPath)
+{
+	printf("recoverBlackBox error: The black box needs mmap.\n");
+	return -1;
+}
+#endif
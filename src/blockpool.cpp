@@ -0,0 +1,140 @@
+#include "blockpool.h"
+#include "budget.h"
+#include <stdio.h>
+
+BlockHandle::BlockHandle() : mPool(0), mIndex(0)
+{
+}
+
+BlockHandle::BlockHandle(BlockPool *pool, unsigned int index) : mPool(pool), mIndex(index)
+{
+}
+
+BlockHandle::BlockHandle(const BlockHandle &other) : mPool(other.mPool), mIndex(other.mIndex)
+{
+	if(mPool)
+		mPool->retain(mIndex);
+}
+
+BlockHandle &BlockHandle::operator=(const BlockHandle &other)
+{
+	if(other.mPool)
+		other.mPool->retain(other.mIndex);
+	release();
+	mPool = other.mPool;
+	mIndex = other.mIndex;
+	return *this;
+}
+
+BlockHandle::~BlockHandle()
+{
+	release();
+}
+
+void BlockHandle::release()
+{
+	if(mPool)
+		mPool->put(mIndex);
+	mPool = 0;
+	mIndex = 0;
+}
+
+unsigned char *BlockHandle::data() const
+{
+	return mPool ? &mPool->mArena[(size_t)mIndex*mPool->mBlockBytes] : 0;
+}
+
+unsigned int BlockHandle::capacity() const
+{
+	return mPool ? mPool->mBlockBytes : 0;
+}
+
+unsigned int BlockHandle::length() const
+{
+	return mPool ? mPool->mLengths[mIndex] : 0;
+}
+
+void BlockHandle::setLength(unsigned int length)
+{
+	if(mPool)
+		mPool->mLengths[mIndex] = length;
+}
+
+BlockPool::BlockPool() : mArena(0), mBlockBytes(0), mNumBlocks(0), mRefs(0), mLengths(0), mFreeList(0), mFreeTop(0), mNumFree(0)
+{
+	mLock.clear();
+}
+
+BlockPool::~BlockPool()
+{
+	if(mNumFree.load() != mNumBlocks)
+		printf("~BlockPool warning: %u blocks still in use\n", mNumBlocks - mNumFree.load());
+	freeAligned(mArena);
+	delete[] mRefs;
+	delete[] mLengths;
+	delete[] mFreeList;
+}
+
+int BlockPool::init(unsigned int blockBytes, unsigned int numBlocks)
+{
+	unsigned int i = 0;
+
+	if(mArena != 0 || blockBytes == 0 || numBlocks == 0)
+	{
+		printf("BlockPool::init error: Invalid pool (%u blocks of %u bytes)\n", numBlocks, blockBytes);
+		return -1;
+	}
+	mBlockBytes = (blockBytes + BUDGET_CACHE_LINE - 1) & ~(unsigned int)(BUDGET_CACHE_LINE - 1);
+	mArena = (unsigned char *)allocAligned((size_t)mBlockBytes*numBlocks);
+	if(mArena == 0)
+		return -1;
+
+	mNumBlocks = numBlocks;
+	mRefs = new std::atomic<int>[numBlocks];
+	mLengths = new unsigned int[numBlocks];
+	mFreeList = new unsigned int[numBlocks];
+	for(i = 0; i < numBlocks; i++)
+	{
+		mRefs[i].store(0);
+		mLengths[i] = 0;
+		mFreeList[i] = numBlocks - 1 - i; //Block 0 is handed out first
+	}
+	mFreeTop = numBlocks;
+	mNumFree.store(numBlocks);
+	return 0;
+}
+
+BlockHandle BlockPool::acquire()
+{
+	unsigned int index = 0;
+
+	while(mLock.test_and_set(std::memory_order_acquire)) {}
+	if(mFreeTop == 0)
+	{
+		mLock.clear(std::memory_order_release);
+		return BlockHandle();
+	}
+	index = mFreeList[--mFreeTop];
+	mLock.clear(std::memory_order_release);
+
+	mNumFree.fetch_sub(1, std::memory_order_relaxed);
+	mRefs[index].store(1, std::memory_order_relaxed);
+	mLengths[index] = 0;
+	return BlockHandle(this, index);
+}
+
+void BlockPool::retain(unsigned int index)
+{
+	mRefs[index].fetch_add(1, std::memory_order_relaxed);
+}
+
+void BlockPool::put(unsigned int index)
+{
+	if(mRefs[index].fetch_sub(1, std::memory_order_acq_rel) != 1)
+		return;
+
+	while(mLock.test_and_set(std::memory_order_acquire)) {}
+	mFreeList[mFreeTop++] = index;
+	mLock.clear(std::memory_order_release);
+	mNumFree.fetch_add(1, std::memory_order_relaxed);
+}
@@ -0,0 +1,127 @@
+#include "budget.h"
+#include "stream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <malloc.h>
+#endif
+
+static unsigned int alignUp(unsigned int size)
+{
+	return (size + BUDGET_CACHE_LINE - 1) & ~(unsigned int)(BUDGET_CACHE_LINE - 1);
+}
+
+int planMemoryBudget(unsigned long long budgetBytes, float scanRate, unsigned int numAddresses, unsigned int samplesPerPacket, MemoryBudget *budget)
+{
+	double packetsPerSec = 0;
+	double outletSampleBytes = 0;
+	double outletSec = 0;
+	unsigned long long poolBytes = 0;
+	unsigned long long minOutletBytes = 0;
+	unsigned long long left = 0;
+
+	memset(budget, 0, sizeof(MemoryBudget));
+	if(scanRate <= 0 || numAddresses == 0 || samplesPerPacket == 0)
+	{
+		printf("planMemoryBudget error: Invalid stream configuration.\n");
+		return -1;
+	}
+	budget->totalBytes = budgetBytes;
+
+	//Packet and sample blocks cover BUDGET_RING_SEC of packets.
+	packetsPerSec = (double)scanRate*numAddresses/samplesPerPacket;
+	budget->packetBytes = alignUp(STREAM_HEADER_BYTES + samplesPerPacket*STREAM_BYTES_PER_SAMPLE);
+	budget->numPackets = (unsigned int)(packetsPerSec*BUDGET_RING_SEC + 1);
+	if(budget->numPackets < BUDGET_MIN_PACKETS)
+		budget->numPackets = BUDGET_MIN_PACKETS;
+
+	//A scan can straddle two packets, so a block also holds the partial scan
+	//carried over from the previous packet.
+	budget->blockSamples = samplesPerPacket + numAddresses - 1;
+	budget->blockBytes = alignUp(budget->blockSamples*sizeof(float));
+	budget->numBlocks = budget->numPackets;
+
+	poolBytes = (unsigned long long)budget->packetBytes*budget->numPackets
+		+ (unsigned long long)budget->blockBytes*budget->numBlocks;
+
+	//liblsl buffers whole samples (scans) of numAddresses floats.
+	outletSampleBytes = numAddresses*sizeof(float) + BUDGET_LSL_SAMPLE_OVERHEAD;
+	minOutletBytes = (unsigned long long)(outletSampleBytes*scanRate*BUDGET_MIN_OUTLET_SEC);
+
+	if(poolBytes + minOutletBytes > budgetBytes)
+	{
+		printf("planMemoryBudget error: The stream needs at least %.3f MB (%u packets of %u bytes, %u blocks of %u bytes, %.0f s of outlet buffer) but the budget is %.3f MB.\n",
+		       (poolBytes + minOutletBytes)/(1024.0*1024.0), budget->numPackets, budget->packetBytes,
+		       budget->numBlocks, budget->blockBytes, BUDGET_MIN_OUTLET_SEC, budgetBytes/(1024.0*1024.0));
+		return -1;
+	}
+
+	//The outlet gets half of what is left, up to liblsl's default, and the
+	//sinks the rest.
+	left = budgetBytes - poolBytes;
+	outletSec = (left/2)/(outletSampleBytes*scanRate);
+	if(outletSec < BUDGET_MIN_OUTLET_SEC)
+		outletSec = BUDGET_MIN_OUTLET_SEC;
+	if(outletSec > BUDGET_MAX_OUTLET_SEC)
+		outletSec = BUDGET_MAX_OUTLET_SEC;
+	budget->outletBytes = (unsigned long long)(outletSampleBytes*scanRate*outletSec);
+
+	//The outlet is irregular rate, so max_buffered is in hundreds of samples.
+	budget->outletMaxBuffered = (int)(scanRate*outletSec/100.0);
+	if(budget->outletMaxBuffered < 1)
+		budget->outletMaxBuffered = 1;
+
+	budget->sinkBytes = left - budget->outletBytes;
+	budget->sinkUsedBytes = 0;
+	return 0;
+}
+
+int reserveSinkMemory(MemoryBudget *budget, const char *name, unsigned long long bytes)
+{
+	if(budget->sinkUsedBytes + bytes > budget->sinkBytes)
+	{
+		printf("reserveSinkMemory error: %s needs %.3f MB but only %.3f MB of the sink budget are left.\n",
+		       name, bytes/(1024.0*1024.0), (budget->sinkBytes - budget->sinkUsedBytes)/(1024.0*1024.0));
+		return -1;
+	}
+	budget->sinkUsedBytes += bytes;
+	return 0;
+}
+
+void printMemoryBudget(const MemoryBudget *budget)
+{
+	printf("Memory Budget (%.3f MB):\n", budget->totalBytes/(1024.0*1024.0));
+	printf("  Packet Blocks = %u x %u bytes, Sample Blocks = %u x %u bytes\n",
+	       budget->numPackets, budget->packetBytes, budget->numBlocks, budget->blockBytes);
+	printf("  Outlet = %.3f MB (max_buffered = %d), Sinks = %.3f MB\n",
+	       budget->outletBytes/(1024.0*1024.0), budget->outletMaxBuffered, budget->sinkBytes/(1024.0*1024.0));
+}
+
+void *allocAligned(size_t size)
+{
+	void *ptr = NULL;
+#ifdef WIN32
+	ptr = _aligned_malloc(size, BUDGET_CACHE_LINE);
+#else
+	if(posix_memalign(&ptr, BUDGET_CACHE_LINE, size) != 0)
+		ptr = NULL;
+#endif
+	if(ptr == NULL)
+	{
+		printf("allocAligned error: Could not allocate %lu bytes\n", (unsigned long)size);
+		return NULL;
+	}
+	memset(ptr, 0, size); //Fault the pages in now instead of while streaming.
+	return ptr;
+}
+
+void freeAligned(void *ptr)
+{
+#ifdef WIN32
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
@@ -0,0 +1,204 @@
+#include "capture.h"
+#include <string.h>
+
+//File header before the CaptureHeader.
+typedef struct
+{
+	char magic[CAPTURE_MAGIC_BYTES];
+	unsigned int version;
+	unsigned int byteOrderMark;
+	unsigned int headerBytes; //sizeof(CaptureHeader)
+} CaptureFileHeader;
+
+//Record header before each stream response.
+typedef struct
+{
+	unsigned long long receiveNs;
+	unsigned int size;
+	unsigned int reserved;
+} CaptureRecord;
+
+CaptureWriter::CaptureWriter() : mArena(NULL), mMaxPacketBytes(0), mPackets(0), mDroppedPackets(0), mFile(NULL), mError(0)
+{
+	mQueueStats.droppedScans.store(0);
+}
+
+CaptureWriter::~CaptureWriter()
+{
+	close();
+}
+
+int CaptureWriter::open(const char *path, const CaptureHeader *header, MemoryBudget *budget)
+{
+	CaptureFileHeader fileHeader;
+	unsigned long long arenaBytes = 0;
+
+	if(isOpen())
+		return -1;
+
+	//One packet with its record header per chunk buffer, then the stdio
+	//buffer of the writer thread
+	mMaxPacketBytes = STREAM_HEADER_BYTES + header->samplesPerPacket*2;
+	mChunkBytes = (unsigned int)((sizeof(CaptureRecord) + mMaxPacketBytes + 63) & ~63U);
+	mNumChunks = CAPTURE_QUEUE_BYTES/mChunkBytes;
+	if(mNumChunks < CAPTURE_MIN_CHUNKS)
+		mNumChunks = CAPTURE_MIN_CHUNKS;
+	arenaBytes = (unsigned long long)mNumChunks*mChunkBytes + CAPTURE_WRITE_BUFFER_BYTES;
+	if(reserveSinkMemory(budget, "Capture", arenaBytes) != 0)
+		return -1;
+	mArena = (unsigned char *)allocAligned((size_t)arenaBytes);
+	mFile = fopen(path, "wb");
+	if(mArena == NULL || mFile == NULL)
+	{
+		printf("CaptureWriter::open error: Could not create %s\n", path);
+		close();
+		return -1;
+	}
+	mChunks = mArena;
+	setvbuf(mFile, (char *)mChunks + (size_t)mNumChunks*mChunkBytes, _IOFBF, CAPTURE_WRITE_BUFFER_BYTES);
+
+	memset(&fileHeader, 0, sizeof(fileHeader));
+	memcpy(fileHeader.magic, CAPTURE_MAGIC, CAPTURE_MAGIC_BYTES);
+	fileHeader.version = CAPTURE_VERSION;
+	fileHeader.byteOrderMark = CAPTURE_BYTE_ORDER_MARK;
+	fileHeader.headerBytes = sizeof(CaptureHeader);
+	if(fwrite(&fileHeader, sizeof(fileHeader), 1, mFile) != 1 || fwrite(header, sizeof(CaptureHeader), 1, mFile) != 1)
+	{
+		printf("CaptureWriter::open error: Could not write %s\n", path);
+		close();
+		return -1;
+	}
+	mPackets.store(0);
+	mDroppedPackets.store(0);
+	mError = 0;
+	if(openQueue(&mQueueStats, "capture writer") != 0)
+	{
+		printf("CaptureWriter::open error: Could not start the writer thread\n");
+		close();
+		return -1;
+	}
+	return 0;
+}
+
+int CaptureWriter::write(unsigned long long receiveNs, const unsigned char *packet, int size)
+{
+	CaptureRecord *record = NULL;
+
+	if(!isOpen() || size <= 0 || (unsigned int)size > mMaxPacketBytes)
+		return -1;
+	record = (CaptureRecord *)fillChunk();
+	if(record == NULL)
+	{
+		mDroppedPackets.store(mDroppedPackets.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return -1;
+	}
+	record->receiveNs = receiveNs;
+	record->size = (unsigned int)size;
+	record->reserved = 0;
+	memcpy((unsigned char *)record + sizeof(CaptureRecord), packet, size);
+	submit();
+	return 0;
+}
+
+unsigned int CaptureWriter::writeChunks(unsigned long long first, unsigned int count)
+{
+	const CaptureRecord *record = NULL;
+	unsigned int i = 0;
+
+	for(i = 0; i < count; i++)
+	{
+		record = (const CaptureRecord *)chunk(first + i);
+		if(mError)
+			continue;
+		if(fwrite(record, sizeof(CaptureRecord) + record->size, 1, mFile) != 1)
+		{
+			printf("CaptureWriter error: The capture is incomplete from packet %llu\n", packets());
+			mError = 1;
+			continue;
+		}
+		mPackets.store(mPackets.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+	return count;
+}
+
+void CaptureWriter::close()
+{
+	closeQueue();
+	if(mFile != NULL)
+		fclose(mFile);
+	mFile = NULL;
+	freeAligned(mArena);
+	mArena = NULL;
+	mChunks = NULL;
+}
+
+CaptureReader::CaptureReader() : mFile(NULL)
+{
+}
+
+CaptureReader::~CaptureReader()
+{
+	close();
+}
+
+int CaptureReader::open(const char *path, CaptureHeader *header)
+{
+	CaptureFileHeader fileHeader;
+
+	if(mFile != NULL)
+		return -1;
+	mFile = fopen(path, "rb");
+	if(mFile == NULL)
+	{
+		printf("CaptureReader::open error: Could not open %s\n", path);
+		return -1;
+	}
+	if(fread(&fileHeader, sizeof(fileHeader), 1, mFile) != 1 ||
+	   memcmp(fileHeader.magic, CAPTURE_MAGIC, CAPTURE_MAGIC_BYTES) != 0)
+	{
+		printf("CaptureReader::open error: %s is not a stream capture\n", path);
+		close();
+		return -1;
+	}
+	if(fileHeader.version != CAPTURE_VERSION || fileHeader.byteOrderMark != CAPTURE_BYTE_ORDER_MARK ||
+	   fileHeader.headerBytes != sizeof(CaptureHeader))
+	{
+		printf("CaptureReader::open error: %s was written by another version or kind of host\n", path);
+		close();
+		return -1;
+	}
+	if(fread(header, sizeof(CaptureHeader), 1, mFile) != 1 || header->numAddresses == 0 ||
+	   header->numAddresses > MAX_NUM_STREAM_ADDR || header->samplesPerPacket == 0 ||
+	   header->samplesPerPacket > STREAM_MAX_SAMPLES_PER_PACKET_TCP)
+	{
+		printf("CaptureReader::open error: Invalid capture header in %s\n", path);
+		close();
+		return -1;
+	}
+	return 0;
+}
+
+int CaptureReader::read(unsigned long long *receiveNs, unsigned char *packet, int maxSize, int *size)
+{
+	CaptureRecord record;
+
+	if(mFile == NULL)
+		return -1;
+	if(fread(&record, sizeof(record), 1, mFile) != 1)
+		return feof(mFile) ? 0 : -1;
+	if(record.size == 0 || record.size > (unsigned int)maxSize || fread(packet, record.size, 1, mFile) != 1)
+	{
+		printf("CaptureReader::read error: Truncated or invalid packet record\n");
+		return -1;
+	}
+	*receiveNs = record.receiveNs;
+	*size = (int)record.size;
+	return 1;
+}
+
+void CaptureReader::close()
+{
+	if(mFile != NULL)
+		fclose(mFile);
+	mFile = NULL;
+}
@@ -0,0 +1,168 @@
+#include "chunkqueue.h"
+#include "trace.h"
+#include <chrono>
+#include <exception>
+#include <string.h>
+
+static void storeMax(std::atomic<unsigned int> &value, unsigned int candidate)
+{
+	if(candidate > value.load(std::memory_order_relaxed))
+		value.store(candidate, std::memory_order_relaxed);
+}
+
+ChunkQueue::ChunkQueue() : mScanRate(0), mNumAddresses(0), mChunkScans(0), mChunkBytes(0), mChunks(NULL), mNumChunks(0), mFill(0),
+	mSubmitted(0), mCompleted(0), mStats(NULL), mThreadName(""), mRunning(0)
+{
+}
+
+//The sink stops the writer in its own destructor, the hooks are gone here.
+ChunkQueue::~ChunkQueue()
+{
+}
+
+int ChunkQueue::openQueue(ChunkQueueStats *stats, const char *threadName)
+{
+	mStats = stats;
+	mThreadName = threadName;
+	mFill = 0;
+	mSubmitted.store(0);
+	mCompleted.store(0);
+	mStats->queueDepth.store(0);
+	mStats->maxQueueDepth.store(0);
+	mStats->queueCapacity.store(mNumChunks);
+	mStats->droppedScans.store(0);
+	mRunning.store(1);
+	try
+	{
+		mThread = std::thread(&ChunkQueue::run, this);
+	}
+	catch(std::exception &)
+	{
+		mRunning.store(0);
+		return -1;
+	}
+	return 0;
+}
+
+void ChunkQueue::closeQueue()
+{
+	if(!mThread.joinable())
+		return;
+	if(mFill > 0)
+	{
+		((ScanChunkHeader *)chunk(mSubmitted.load(std::memory_order_relaxed)))->numScans = mFill;
+		submit();
+	}
+	mRunning.store(0);
+	mWake.notify_one();
+	mThread.join();
+}
+
+unsigned char *ChunkQueue::fillChunk() const
+{
+	unsigned long long submitted = mSubmitted.load(std::memory_order_relaxed);
+
+	if(submitted - mCompleted.load(std::memory_order_acquire) >= mNumChunks)
+		return NULL;
+	return chunk(submitted);
+}
+
+void ChunkQueue::submit()
+{
+	unsigned long long submitted = mSubmitted.load(std::memory_order_relaxed) + 1;
+
+	mFill = 0;
+	mSubmitted.store(submitted, std::memory_order_release);
+	storeMax(mStats->maxQueueDepth, (unsigned int)(submitted - mCompleted.load(std::memory_order_relaxed)));
+	mWake.notify_one();
+}
+
+void ChunkQueue::dropScans(unsigned long long numScans)
+{
+	mStats->droppedScans.store(mStats->droppedScans.load(std::memory_order_relaxed) + numScans, std::memory_order_relaxed);
+}
+
+void ChunkQueue::appendScans(const float *scans, unsigned int numScans, unsigned long long firstScan, double lastScanTime)
+{
+	ScanChunkHeader *header = (ScanChunkHeader *)fillChunk();
+	unsigned int count = 0;
+	unsigned int i = 0;
+
+	while(i < numScans)
+	{
+		if(mFill == 0)
+		{
+			header = (ScanChunkHeader *)fillChunk();
+			if(header == NULL)
+			{
+				dropScans(numScans - i);
+				return;
+			}
+			header->firstScan = firstScan + i;
+			header->firstTime = lastScanTime - (numScans - 1 - i)/mScanRate;
+		}
+		count = numScans - i < mChunkScans - mFill ? numScans - i : mChunkScans - mFill;
+		memcpy((float *)((unsigned char *)header + sizeof(ScanChunkHeader)) + (size_t)mFill*mNumAddresses,
+		       scans + (size_t)i*mNumAddresses, (size_t)count*mNumAddresses*sizeof(float));
+		mFill += count;
+		i += count;
+		if(mFill == mChunkScans)
+		{
+			header->numScans = mFill;
+			submit();
+		}
+	}
+}
+
+void ChunkQueue::poll()
+{
+}
+
+void ChunkQueue::idle()
+{
+}
+
+void ChunkQueue::finish()
+{
+}
+
+void ChunkQueue::wait()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+
+	//The stream thread notifies without the lock, so a wake up can be missed
+	mWake.wait_for(lock, std::chrono::milliseconds(CHUNKQUEUE_POLL_MS));
+}
+
+void ChunkQueue::run()
+{
+	unsigned long long completed = 0;
+	unsigned long long submitted = 0;
+	unsigned int done = 0;
+
+	traceSetThreadName(mThreadName);
+	while(1)
+	{
+		poll();
+		completed = mCompleted.load(std::memory_order_relaxed);
+		submitted = mSubmitted.load(std::memory_order_acquire);
+		mStats->queueDepth.store((unsigned int)(submitted - completed), std::memory_order_relaxed);
+		if(completed == submitted)
+		{
+			if(!mRunning.load())
+				break;
+			idle();
+			wait();
+			continue;
+		}
+
+		done = writeChunks(completed, (unsigned int)(submitted - completed));
+		if(done == 0)
+		{
+			wait();
+			continue;
+		}
+		mCompleted.store(completed + done, std::memory_order_release);
+	}
+	finish();
+}
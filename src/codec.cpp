@@ -0,0 +1,298 @@
+#include "codec.h"
+#include "stream.h"
+#include <stddef.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+//Bytes of a packed block of the given width, after its width byte.
+#define PACKED_BYTES(width) ((width)*CODEC_BLOCK_VALUES/8)
+
+static const char *CODEC_NAMES[] = {"raw", "delta"};
+
+const char *codecName(int codec)
+{
+	if(codec < 0 || codec >= (int)(sizeof(CODEC_NAMES)/sizeof(CODEC_NAMES[0])))
+		return "unknown";
+	return CODEC_NAMES[codec];
+}
+
+int codecByName(const char *name)
+{
+	int i = 0;
+	for(i = 0; i < (int)(sizeof(CODEC_NAMES)/sizeof(CODEC_NAMES[0])); i++)
+	{
+		if(strcmp(name, CODEC_NAMES[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+unsigned int codecMaxEncodedBytes(unsigned int numScans, unsigned int numAddresses)
+{
+	unsigned int blocks = (numScans + CODEC_BLOCK_VALUES - 1)/CODEC_BLOCK_VALUES;
+	return numAddresses*(STREAM_BYTES_PER_SAMPLE + blocks*(1 + PACKED_BYTES(16)));
+}
+
+//Samples are big endian, as every other T7 value.
+static inline unsigned short readSample(const unsigned char *bytes)
+{
+	return (unsigned short)((bytes[0] << 8) | bytes[1]);
+}
+
+static inline void writeSample(unsigned short value, unsigned char *bytes)
+{
+	bytes[0] = (unsigned char)(value >> 8);
+	bytes[1] = (unsigned char)value;
+}
+
+static unsigned int bitWidth(unsigned int value)
+{
+	unsigned int width = 0;
+	while(value)
+	{
+		width++;
+		value >>= 1;
+	}
+	return width;
+}
+
+//Packs CODEC_BLOCK_VALUES values of WIDTH bits. Value i goes to lane
+//i % CODEC_LANES, each lane is a stream of little endian 16-bit words
+//interleaved with the other lanes. The width is a template argument so the
+//shifts are constants. With SSE2 the 8 lanes are the 16-bit lanes of a
+//register, elsewhere the lane loops are left to the compiler.
+#ifdef __SSE2__
+template<unsigned int WIDTH>
+static void packBlock(const unsigned short *values, unsigned char *out)
+{
+	__m128i acc = _mm_setzero_si128();
+	__m128i v;
+	unsigned int bits = 0;
+	unsigned int i = 0;
+
+	for(i = 0; i < CODEC_BLOCK_VALUES/CODEC_LANES; i++, values += CODEC_LANES)
+	{
+		//The bits shifted out of the 16-bit lanes start the next word
+		v = _mm_loadu_si128((const __m128i *)values);
+		acc = _mm_or_si128(acc, _mm_sll_epi16(v, _mm_cvtsi32_si128(bits)));
+		if(bits + WIDTH >= 16)
+		{
+			_mm_storeu_si128((__m128i *)out, acc);
+			out += CODEC_LANES*2;
+			acc = _mm_srl_epi16(v, _mm_cvtsi32_si128(16 - bits));
+			bits = bits + WIDTH - 16;
+		}
+		else
+			bits += WIDTH;
+	}
+}
+
+template<unsigned int WIDTH>
+static void unpackBlock(const unsigned char *in, unsigned short *values)
+{
+	const __m128i mask = _mm_set1_epi16((short)((1u << WIDTH) - 1));
+	__m128i acc = _mm_setzero_si128();
+	__m128i word;
+	unsigned int bits = 0;
+	unsigned int i = 0;
+
+	for(i = 0; i < CODEC_BLOCK_VALUES/CODEC_LANES; i++, values += CODEC_LANES)
+	{
+		if(bits < WIDTH)
+		{
+			//The value ends in the next word
+			word = _mm_loadu_si128((const __m128i *)in);
+			in += CODEC_LANES*2;
+			_mm_storeu_si128((__m128i *)values, _mm_and_si128(_mm_or_si128(acc, _mm_sll_epi16(word, _mm_cvtsi32_si128(bits))), mask));
+			acc = _mm_srl_epi16(word, _mm_cvtsi32_si128(WIDTH - bits));
+			bits = bits + 16 - WIDTH;
+		}
+		else
+		{
+			_mm_storeu_si128((__m128i *)values, _mm_and_si128(acc, mask));
+			acc = _mm_srl_epi16(acc, _mm_cvtsi32_si128(WIDTH));
+			bits -= WIDTH;
+		}
+	}
+}
+#else
+template<unsigned int WIDTH>
+static void packBlock(const unsigned short *values, unsigned char *out)
+{
+	unsigned int acc[CODEC_LANES] = {0};
+	unsigned int bits = 0;
+	unsigned int i = 0;
+	unsigned int lane = 0;
+
+	for(i = 0; i < CODEC_BLOCK_VALUES/CODEC_LANES; i++, values += CODEC_LANES)
+	{
+		for(lane = 0; lane < CODEC_LANES; lane++)
+			acc[lane] |= (unsigned int)values[lane] << bits;
+		bits += WIDTH;
+		if(bits >= 16)
+		{
+			bits -= 16;
+			for(lane = 0; lane < CODEC_LANES; lane++)
+			{
+				out[lane*2] = (unsigned char)acc[lane];
+				out[lane*2 + 1] = (unsigned char)(acc[lane] >> 8);
+				acc[lane] = (unsigned int)values[lane] >> (WIDTH - bits);
+			}
+			out += CODEC_LANES*2;
+		}
+	}
+}
+
+template<unsigned int WIDTH>
+static void unpackBlock(const unsigned char *in, unsigned short *values)
+{
+	const unsigned int mask = (1u << WIDTH) - 1;
+	unsigned int acc[CODEC_LANES] = {0};
+	unsigned int bits = 0;
+	unsigned int i = 0;
+	unsigned int lane = 0;
+
+	for(i = 0; i < CODEC_BLOCK_VALUES/CODEC_LANES; i++, values += CODEC_LANES)
+	{
+		if(bits < WIDTH)
+		{
+			for(lane = 0; lane < CODEC_LANES; lane++)
+				acc[lane] |= (unsigned int)(in[lane*2] | (in[lane*2 + 1] << 8)) << bits;
+			in += CODEC_LANES*2;
+			bits += 16;
+		}
+		for(lane = 0; lane < CODEC_LANES; lane++)
+		{
+			values[lane] = (unsigned short)(acc[lane] & mask);
+			acc[lane] >>= WIDTH;
+		}
+		bits -= WIDTH;
+	}
+}
+#endif
+
+typedef void (*PackFunc)(const unsigned short *values, unsigned char *out);
+typedef void (*UnpackFunc)(const unsigned char *in, unsigned short *values);
+
+//Width 0 packs nothing, the block repeats the previous sample.
+static const PackFunc PACK[17] = {NULL, packBlock<1>, packBlock<2>, packBlock<3>, packBlock<4>, packBlock<5>,
+	packBlock<6>, packBlock<7>, packBlock<8>, packBlock<9>, packBlock<10>, packBlock<11>, packBlock<12>,
+	packBlock<13>, packBlock<14>, packBlock<15>, packBlock<16>};
+static const UnpackFunc UNPACK[17] = {NULL, unpackBlock<1>, unpackBlock<2>, unpackBlock<3>, unpackBlock<4>, unpackBlock<5>,
+	unpackBlock<6>, unpackBlock<7>, unpackBlock<8>, unpackBlock<9>, unpackBlock<10>, unpackBlock<11>, unpackBlock<12>,
+	unpackBlock<13>, unpackBlock<14>, unpackBlock<15>, unpackBlock<16>};
+
+//The layout is the first sample of each channel, then for each block of
+//CODEC_BLOCK_VALUES scans after the first one, each channel's width byte
+//and packed zigzag differences. Blocks of scans are transposed first so the
+//raw samples are read in order.
+unsigned int encodeSamples(const unsigned char *rawData, unsigned int numScans, unsigned int numAddresses, unsigned char *out)
+{
+	const unsigned int stride = numAddresses*STREAM_BYTES_PER_SAMPLE;
+	unsigned short current[MAX_NUM_STREAM_ADDR][CODEC_BLOCK_VALUES + 1]; //Previous sample, then the block's samples
+	unsigned short values[CODEC_BLOCK_VALUES];
+	const unsigned char *row = NULL;
+	unsigned char *start = out;
+	unsigned short delta = 0;
+	unsigned int all = 0;
+	unsigned int width = 0;
+	unsigned int addr = 0;
+	unsigned int scan = 0;
+	unsigned int count = 0;
+	unsigned int i = 0;
+
+	if(numScans == 0 || numAddresses == 0 || numAddresses > MAX_NUM_STREAM_ADDR)
+		return 0;
+	for(addr = 0; addr < numAddresses; addr++)
+	{
+		current[addr][CODEC_BLOCK_VALUES] = readSample(&rawData[addr*STREAM_BYTES_PER_SAMPLE]);
+		writeSample(current[addr][CODEC_BLOCK_VALUES], out);
+		out += STREAM_BYTES_PER_SAMPLE;
+	}
+	for(scan = 1; scan < numScans; scan += count)
+	{
+		count = numScans - scan < CODEC_BLOCK_VALUES ? numScans - scan : CODEC_BLOCK_VALUES;
+		for(addr = 0; addr < numAddresses; addr++)
+			current[addr][0] = current[addr][CODEC_BLOCK_VALUES];
+		for(i = 0; i < count; i++)
+		{
+			row = &rawData[(scan + i)*stride];
+			for(addr = 0; addr < numAddresses; addr++)
+				current[addr][i + 1] = readSample(&row[addr*STREAM_BYTES_PER_SAMPLE]);
+		}
+		for(addr = 0; addr < numAddresses; addr++)
+		{
+			//A short last block repeats its last sample, differences of 0
+			for(i = count; i < CODEC_BLOCK_VALUES; i++)
+				current[addr][i + 1] = current[addr][count];
+
+			//Zigzag of the 16-bit wrapping difference: 0, -1, 1, -2, ... -> 0, 1, 2, 3, ...
+			all = 0;
+			for(i = 0; i < CODEC_BLOCK_VALUES; i++)
+			{
+				delta = (unsigned short)(current[addr][i + 1] - current[addr][i]);
+				values[i] = (unsigned short)((delta << 1) ^ (0u - (delta >> 15)));
+				all |= values[i];
+			}
+			width = bitWidth(all);
+			*out++ = (unsigned char)width;
+			if(width > 0)
+				PACK[width](values, out);
+			out += PACKED_BYTES(width);
+		}
+	}
+	return (unsigned int)(out - start);
+}
+
+int decodeSamples(const unsigned char *in, unsigned int inBytes, unsigned int numScans, unsigned int numAddresses, unsigned char *rawData)
+{
+	const unsigned int stride = numAddresses*STREAM_BYTES_PER_SAMPLE;
+	const unsigned char *end = in + inBytes;
+	unsigned short previous[MAX_NUM_STREAM_ADDR];
+	unsigned short values[CODEC_BLOCK_VALUES];
+	unsigned char *out = NULL;
+	unsigned int width = 0;
+	unsigned int addr = 0;
+	unsigned int scan = 0;
+	unsigned int count = 0;
+	unsigned int i = 0;
+
+	if(numScans == 0)
+		return 0;
+	if(numAddresses == 0 || numAddresses > MAX_NUM_STREAM_ADDR || inBytes < numAddresses*STREAM_BYTES_PER_SAMPLE)
+		return -1;
+	for(addr = 0; addr < numAddresses; addr++)
+	{
+		previous[addr] = readSample(in);
+		writeSample(previous[addr], &rawData[addr*STREAM_BYTES_PER_SAMPLE]);
+		in += STREAM_BYTES_PER_SAMPLE;
+	}
+	for(scan = 1; scan < numScans; scan += count)
+	{
+		count = numScans - scan < CODEC_BLOCK_VALUES ? numScans - scan : CODEC_BLOCK_VALUES;
+		for(addr = 0; addr < numAddresses; addr++)
+		{
+			if(in >= end || *in > 16 || (unsigned int)(end - in - 1) < PACKED_BYTES(*in))
+				return -1;
+			width = *in++;
+			out = &rawData[scan*stride + addr*STREAM_BYTES_PER_SAMPLE];
+			if(width == 0)
+			{
+				for(i = 0; i < count; i++, out += stride)
+					writeSample(previous[addr], out);
+				continue;
+			}
+			UNPACK[width](in, values);
+			in += PACKED_BYTES(width);
+			for(i = 0; i < count; i++, out += stride)
+			{
+				previous[addr] = (unsigned short)(previous[addr] + ((values[i] >> 1) ^ (0u - (values[i] & 1))));
+				writeSample(previous[addr], out);
+			}
+		}
+	}
+	return in == end ? 0 : -1;
+}
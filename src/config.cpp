@@ -0,0 +1,273 @@
+#include <string>
+#include <vector>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "stream.h"
+#include "recorder.h"
+#include "recording.h"
+#include "stats.h"
+#include "tools.h"
+
+void getDefaultConfig(PublisherConfig *cfg)
+{
+	memset(cfg, 0, sizeof(PublisherConfig));
+	strncpy(cfg->ipAddress, "192.168.1.207", CONFIG_MAX_IP_LENGTH-1);
+	cfg->crPort = 502;
+	cfg->spPort = 702;
+	cfg->scanRate = 1000.0f;
+	cfg->numAddresses = 2;
+	cfg->samplesPerPacket = STREAM_MAX_SAMPLES_PER_PACKET_TCP; //For better throughput set this to high values.
+	cfg->memBudgetBytes = 64ULL*1024*1024;
+	cfg->statsPeriodSec = 1.0;
+	cfg->statsFormat = STATS_FORMAT_TEXT;
+	strncpy(cfg->traceFile, "lslpub_trace.json", CONFIG_MAX_PATH_LENGTH-1);
+	cfg->latencyPrintSec = 10.0;
+	cfg->latencyResetOnPrint = 0;
+	cfg->replaySpeed = 1.0;
+	cfg->blackBoxMinutes = 10.0;
+	cfg->blackBoxSyncSec = 1.0;
+	cfg->recordChunkSec = 1.0;
+	cfg->recordSegmentSec = 3600.0;
+	cfg->recordSync = RECORDER_SYNC_SEGMENT;
+	cfg->recordCodec = CODEC_DELTA;
+	cfg->recordSummaries = 1;
+	strncpy(cfg->extractChannels, "all", CONFIG_MAX_PATH_LENGTH-1);
+	cfg->extractFormat = RECORDING_FORMAT_CSV;
+	strncpy(cfg->pgTable, "labjack_scans", CONFIG_MAX_PATH_LENGTH-1);
+}
+
+//Option lists in the form get_arg uses them.
+typedef struct
+{
+	std::vector<std::string> flags;
+	std::vector<std::string> labels;
+	std::vector<std::string> values;
+} Options;
+
+//Adds an option. The value starts as the current setting, formatted with
+//printf's format.
+static void addOption(Options *opts, const char *flag, const char *label, const char *format, ...)
+{
+	char buf[256];
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+	opts->flags.push_back(flag);
+	opts->labels.push_back(label);
+	opts->values.push_back(buf);
+}
+
+static const char *optionValue(const Options *opts, const char *flag)
+{
+	size_t i = 0;
+	for(i = 0; i < opts->flags.size(); i++)
+		if(opts->flags[i] == flag)
+			return opts->values[i].c_str();
+	return "";
+}
+
+int parseConfig(int argc, const char *argv[], PublisherConfig *cfg)
+{
+	Options opts;
+
+	addOption(&opts, "-ip", "IP address of the T7", "%s", cfg->ipAddress);
+	addOption(&opts, "-crport", "Command/response TCP port", "%d", cfg->crPort);
+	addOption(&opts, "-spport", "Spontaneous stream TCP port", "%d", cfg->spPort);
+	addOption(&opts, "-rate", "Scan rate (Hz)", "%.3f", cfg->scanRate);
+	addOption(&opts, "-chan", "Number of streamed AINs", "%u", cfg->numAddresses);
+	addOption(&opts, "-spp", "Samples per packet", "%u", cfg->samplesPerPacket);
+	addOption(&opts, "-mem", "Memory budget of the acquisition buffers (MB)", "%.3f", cfg->memBudgetBytes/(1024.0*1024.0));
+	addOption(&opts, "-statsec", "Period of the stream status report (s)", "%.3f", cfg->statsPeriodSec);
+	addOption(&opts, "-statfmt", "Format of the status report (text/json)", "%s", cfg->statsFormat == STATS_FORMAT_JSON ? "json" : "text");
+	addOption(&opts, "-metricsport", "Local port of the Prometheus metrics endpoint (0 = off)", "%d", cfg->metricsPort);
+	addOption(&opts, "-trace", "Spans kept per thread by the pipeline trace (0 = off)", "%u", cfg->traceEvents);
+	addOption(&opts, "-tracefile", "Chrome trace event file of the pipeline trace", "%s", cfg->traceFile);
+	addOption(&opts, "-perf", "Hardware counters of the conversion and publish stages (0/1)", "%d", cfg->perfCounters);
+	addOption(&opts, "-diag", "LSL diagnostics outlet (0/1)", "%d", cfg->diagnostics);
+	addOption(&opts, "-latsec", "Period of the stage latency summary (s, 0 = at stop only)", "%.3f", cfg->latencyPrintSec);
+	addOption(&opts, "-latreset", "Clear the stage latencies after each summary (0/1)", "%d", cfg->latencyResetOnPrint);
+	addOption(&opts, "-alloccheck", "Synthetic packets of the allocation check (0 = stream)", "%u", cfg->allocCheckPackets);
+	addOption(&opts, "-capture", "Capture file of the raw stream packets (empty = off)", "%s", cfg->captureFile);
+	addOption(&opts, "-replay", "Capture file to replay instead of streaming (empty = off)", "%s", cfg->replayFile);
+	addOption(&opts, "-speed", "Replay speed (1 = real time, 0 = as fast as possible)", "%.3f", cfg->replaySpeed);
+	addOption(&opts, "-tee", "File of a zero-copy raw copy of the stream socket (empty = off)", "%s", cfg->rawTeeFile);
+	addOption(&opts, "-blackbox", "Memory-mapped ring file of the last scans (empty = off)", "%s", cfg->blackBoxFile);
+	addOption(&opts, "-bbmin", "Minutes of scans in the black box", "%.3f", cfg->blackBoxMinutes);
+	addOption(&opts, "-bbsync", "Seconds between two syncs of the black box to disk", "%.3f", cfg->blackBoxSyncSec);
+	addOption(&opts, "-bbrecover", "Black box file to print as CSV instead of streaming (empty = off)", "%s", cfg->recoverFile);
+	addOption(&opts, "-record", "Path prefix of the recorded segments (empty = off)", "%s", cfg->recordPrefix);
+	addOption(&opts, "-recchunk", "Duration of a recorder chunk (s)", "%.3f", cfg->recordChunkSec);
+	addOption(&opts, "-recseg", "Duration of a recorder segment (s)", "%.3f", cfg->recordSegmentSec);
+	addOption(&opts, "-recsync", "Recorder sync policy (none/segment/chunk)", "%s", recorderSyncPolicyName(cfg->recordSync));
+	addOption(&opts, "-reccodec", "Codec of the recorded chunks (raw/delta)", "%s", codecName(cfg->recordCodec));
+	addOption(&opts, "-recsum", "Min/max/mean summaries of the recording (0/1)", "%d", cfg->recordSummaries);
+	addOption(&opts, "-extract", "Recording (segment or prefix) to extract instead of streaming (empty = off)", "%s", cfg->extractPath);
+	addOption(&opts, "-xfrom", "First LSL time of the extracted range (s)", "%.6f", cfg->extractFrom);
+	addOption(&opts, "-xto", "Last LSL time of the extracted range (s, 0 = to the end)", "%.6f", cfg->extractTo);
+	addOption(&opts, "-xchan", "Extracted channels (all or scan list positions, e.g. 0,2,5)", "%s", cfg->extractChannels);
+	addOption(&opts, "-xformat", "Format of the extracted file (csv/raw)", "%s", cfg->extractFormat == RECORDING_FORMAT_RAW ? "raw" : "csv");
+	addOption(&opts, "-xlevel", "Extract the summaries of that many scans per bin (0 = scans, 10/100/1000)", "%u", cfg->extractLevel);
+	addOption(&opts, "-xdf", "XDF file written in process (empty = off)", "%s", cfg->xdfFile);
+	addOption(&opts, "-pg", "libpq connection string of the PostgreSQL sink (empty = off)", "%s", cfg->pgConninfo);
+	addOption(&opts, "-pgtable", "PostgreSQL table of the scans", "%s", cfg->pgTable);
+	addOption(&opts, "-arrow", "Arrow IPC file, or unix:PATH socket (empty = off)", "%s", cfg->arrowPath);
+
+	if(argc > 1 && argv[1][0] != '-')
+	{
+		//Legacy usage: the IP address is the first argument.
+		opts.values[0] = argv[1];
+		argc--;
+		argv++;
+	}
+	get_arg(argc, (char **)argv, opts.flags, opts.labels, opts.values);
+
+	strncpy(cfg->ipAddress, optionValue(&opts, "-ip"), CONFIG_MAX_IP_LENGTH-1);
+	cfg->ipAddress[CONFIG_MAX_IP_LENGTH-1] = '\0';
+	cfg->crPort = atoi(optionValue(&opts, "-crport"));
+	cfg->spPort = atoi(optionValue(&opts, "-spport"));
+	cfg->scanRate = (float)atof(optionValue(&opts, "-rate"));
+	cfg->numAddresses = (unsigned int)strtoul(optionValue(&opts, "-chan"), NULL, 10);
+	cfg->samplesPerPacket = (unsigned int)strtoul(optionValue(&opts, "-spp"), NULL, 10);
+	cfg->memBudgetBytes = (unsigned long long)(atof(optionValue(&opts, "-mem"))*1024.0*1024.0);
+	cfg->statsPeriodSec = atof(optionValue(&opts, "-statsec"));
+	if(strcmp(optionValue(&opts, "-statfmt"), "json") == 0)
+		cfg->statsFormat = STATS_FORMAT_JSON;
+	else if(strcmp(optionValue(&opts, "-statfmt"), "text") == 0)
+		cfg->statsFormat = STATS_FORMAT_TEXT;
+	else
+	{
+		printf("parseConfig error: Invalid status report format %s. Needs to be text or json.\n", optionValue(&opts, "-statfmt"));
+		return -1;
+	}
+	cfg->metricsPort = atoi(optionValue(&opts, "-metricsport"));
+	cfg->traceEvents = (unsigned int)strtoul(optionValue(&opts, "-trace"), NULL, 10);
+	strncpy(cfg->traceFile, optionValue(&opts, "-tracefile"), CONFIG_MAX_PATH_LENGTH-1);
+	cfg->traceFile[CONFIG_MAX_PATH_LENGTH-1] = '\0';
+	cfg->perfCounters = atoi(optionValue(&opts, "-perf"));
+	cfg->diagnostics = atoi(optionValue(&opts, "-diag"));
+	cfg->latencyPrintSec = atof(optionValue(&opts, "-latsec"));
+	cfg->latencyResetOnPrint = atoi(optionValue(&opts, "-latreset"));
+	cfg->allocCheckPackets = (unsigned int)strtoul(optionValue(&opts, "-alloccheck"), NULL, 10);
+	strncpy(cfg->captureFile, optionValue(&opts, "-capture"), CONFIG_MAX_PATH_LENGTH-1);
+	cfg->captureFile[CONFIG_MAX_PATH_LENGTH-1] = '\0';
+	strncpy(cfg->replayFile, optionValue(&opts, "-replay"), CONFIG_MAX_PATH_LENGTH-1);
+	cfg->replayFile[CONFIG_MAX_PATH_LENGTH-1] = '\0';
+	cfg->replaySpeed = atof(optionValue(&opts, "-speed"));
+	strncpy(cfg->rawTeeFile, optionValue(&opts, "-tee"), CONFIG_MAX_PATH_LENGTH-1);
+	cfg->rawTeeFile[CONFIG_MAX_PATH_LENGTH-1] = '\0';
+	strncpy(cfg->blackBoxFile, optionValue(&opts, "-blackbox"), CONFIG_MAX_PATH_LENGTH-1);
+	cfg->blackBoxFile[CONFIG_MAX_PATH_LENGTH-1] = '\0';
+	cfg->blackBoxMinutes = atof(optionValue(&opts, "-bbmin"));
+	cfg->blackBoxSyncSec = atof(optionValue(&opts, "-bbsync"));
+	strncpy(cfg->recoverFile, optionValue(&opts, "-bbrecover"), CONFIG_MAX_PATH_LENGTH-1);
+	cfg->recoverFile[CONFIG_MAX_PATH_LENGTH-1] = '\0';
+	strncpy(cfg->recordPrefix, optionValue(&opts, "-record"), CONFIG_MAX_PATH_LENGTH-1);
+	cfg->recordPrefix[CONFIG_MAX_PATH_LENGTH-1] = '\0';
+	cfg->recordChunkSec = atof(optionValue(&opts, "-recchunk"));
+	cfg->recordSegmentSec = atof(optionValue(&opts, "-recseg"));
+	cfg->recordSync = recorderSyncPolicy(optionValue(&opts, "-recsync"));
+	if(cfg->recordSync < 0)
+	{
+		printf("parseConfig error: Invalid recorder sync policy %s. Needs to be none, segment or chunk.\n", optionValue(&opts, "-recsync"));
+		return -1;
+	}
+	cfg->recordCodec = codecByName(optionValue(&opts, "-reccodec"));
+	if(cfg->recordCodec < 0)
+	{
+		printf("parseConfig error: Invalid recorder codec %s. Needs to be raw or delta.\n", optionValue(&opts, "-reccodec"));
+		return -1;
+	}
+	cfg->recordSummaries = atoi(optionValue(&opts, "-recsum"));
+	strncpy(cfg->extractPath, optionValue(&opts, "-extract"), CONFIG_MAX_PATH_LENGTH-1);
+	cfg->extractPath[CONFIG_MAX_PATH_LENGTH-1] = '\0';
+	cfg->extractFrom = atof(optionValue(&opts, "-xfrom"));
+	cfg->extractTo = atof(optionValue(&opts, "-xto"));
+	strncpy(cfg->extractChannels, optionValue(&opts, "-xchan"), CONFIG_MAX_PATH_LENGTH-1);
+	cfg->extractChannels[CONFIG_MAX_PATH_LENGTH-1] = '\0';
+	if(strcmp(optionValue(&opts, "-xformat"), "raw") == 0)
+		cfg->extractFormat = RECORDING_FORMAT_RAW;
+	else if(strcmp(optionValue(&opts, "-xformat"), "csv") == 0)
+		cfg->extractFormat = RECORDING_FORMAT_CSV;
+	else
+	{
+		printf("parseConfig error: Invalid extraction format %s. Needs to be csv or raw.\n", optionValue(&opts, "-xformat"));
+		return -1;
+	}
+	cfg->extractLevel = (unsigned int)strtoul(optionValue(&opts, "-xlevel"), NULL, 10);
+	strncpy(cfg->xdfFile, optionValue(&opts, "-xdf"), CONFIG_MAX_PATH_LENGTH-1);
+	cfg->xdfFile[CONFIG_MAX_PATH_LENGTH-1] = '\0';
+	strncpy(cfg->pgConninfo, optionValue(&opts, "-pg"), CONFIG_MAX_PATH_LENGTH-1);
+	cfg->pgConninfo[CONFIG_MAX_PATH_LENGTH-1] = '\0';
+	strncpy(cfg->pgTable, optionValue(&opts, "-pgtable"), CONFIG_MAX_PATH_LENGTH-1);
+	cfg->pgTable[CONFIG_MAX_PATH_LENGTH-1] = '\0';
+	strncpy(cfg->arrowPath, optionValue(&opts, "-arrow"), CONFIG_MAX_PATH_LENGTH-1);
+	cfg->arrowPath[CONFIG_MAX_PATH_LENGTH-1] = '\0';
+
+	if(cfg->scanRate <= 0.0f)
+	{
+		printf("parseConfig error: Invalid scan rate %.3f\n", cfg->scanRate);
+		return -1;
+	}
+	if(cfg->numAddresses == 0 || cfg->numAddresses > MAX_NUM_STREAM_ADDR)
+	{
+		printf("parseConfig error: Invalid number of AINs (%u). Needs to be 1 to %d.\n", cfg->numAddresses, MAX_NUM_STREAM_ADDR);
+		return -1;
+	}
+	if(cfg->samplesPerPacket == 0 || cfg->samplesPerPacket > STREAM_MAX_SAMPLES_PER_PACKET_TCP)
+	{
+		printf("parseConfig error: Invalid samples per packet (%u). Needs to be 1 to %d.\n", cfg->samplesPerPacket, STREAM_MAX_SAMPLES_PER_PACKET_TCP);
+		return -1;
+	}
+	if(cfg->statsPeriodSec <= 0.0)
+	{
+		printf("parseConfig error: Invalid status report period %.3f\n", cfg->statsPeriodSec);
+		return -1;
+	}
+	if(cfg->metricsPort < 0 || cfg->metricsPort > 65535)
+	{
+		printf("parseConfig error: Invalid metrics port %d\n", cfg->metricsPort);
+		return -1;
+	}
+	if(cfg->replaySpeed < 0.0)
+	{
+		printf("parseConfig error: Invalid replay speed %.3f\n", cfg->replaySpeed);
+		return -1;
+	}
+	if(cfg->blackBoxMinutes <= 0.0 || cfg->blackBoxSyncSec <= 0.0)
+	{
+		printf("parseConfig error: Invalid black box length %.3f min or sync period %.3f s\n", cfg->blackBoxMinutes, cfg->blackBoxSyncSec);
+		return -1;
+	}
+	if(cfg->recordChunkSec <= 0.0 || cfg->recordSegmentSec < cfg->recordChunkSec)
+	{
+		printf("parseConfig error: Invalid recorder chunk %.3f s or segment %.3f s\n", cfg->recordChunkSec, cfg->recordSegmentSec);
+		return -1;
+	}
+	if(cfg->extractLevel != 0 && cfg->extractLevel != 10 && cfg->extractLevel != 100 && cfg->extractLevel != 1000)
+	{
+		printf("parseConfig error: Invalid summary level %u. Needs to be 0, 10, 100 or 1000.\n", cfg->extractLevel);
+		return -1;
+	}
+	if(cfg->extractLevel != 0 && cfg->extractFormat != RECORDING_FORMAT_CSV)
+	{
+		printf("parseConfig error: The summaries are only extracted as CSV.\n");
+		return -1;
+	}
+	if(cfg->extractTo > 0.0 && cfg->extractTo < cfg->extractFrom)
+	{
+		printf("parseConfig error: Invalid extraction range %.6f to %.6f\n", cfg->extractFrom, cfg->extractTo);
+		return -1;
+	}
+	if(cfg->memBudgetBytes == 0)
+	{
+		printf("parseConfig error: The memory budget can not be 0.\n");
+		return -1;
+	}
+	return 0;
+}
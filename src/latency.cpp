@@ -0,0 +1,167 @@
+#include "latency.h"
+#include <stdio.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+static const char *STAGE_NAMES[LATENCY_NUM_STAGES] = {"receive", "validate", "convert", "assemble", "push", "total"};
+
+unsigned long long monotonicNs()
+{
+#ifdef WIN32
+	static LARGE_INTEGER freq = {0};
+	LARGE_INTEGER count;
+	if(freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (unsigned long long)(count.QuadPart / freq.QuadPart) * 1000000000ULL
+		+ (unsigned long long)(count.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static int highestBit(unsigned long long value)
+{
+	int bit = 0;
+	while(value >>= 1)
+		bit++;
+	return bit;
+}
+
+static int bucketIndex(unsigned long long ns)
+{
+	int exp = 0;
+
+	if(ns < LATENCY_SUB_BUCKETS)
+		return (int)ns;
+	exp = highestBit(ns);
+	if(exp >= LATENCY_MAX_EXP)
+		return LATENCY_NUM_BUCKETS - 1;
+	return (exp - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS
+		+ (int)((ns >> (exp - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+//Upper bound (inclusive) of the values in a bucket.
+static unsigned long long bucketValue(int index)
+{
+	int exp = 0;
+	unsigned long long sub = 0;
+
+	if(index < LATENCY_SUB_BUCKETS)
+		return (unsigned long long)index;
+	exp = index / LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKET_BITS - 1;
+	sub = (unsigned long long)(index % LATENCY_SUB_BUCKETS);
+	return ((1ULL << exp) | (sub << (exp - LATENCY_SUB_BUCKET_BITS))) + (1ULL << (exp - LATENCY_SUB_BUCKET_BITS)) - 1;
+}
+
+void latencyRecord(LatencyHistogram *hist, unsigned long long ns)
+{
+	std::atomic<unsigned long long> &count = hist->counts[bucketIndex(ns)];
+
+	//Single writer: plain increments, atomic only so readers see whole values.
+	count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	hist->total.store(hist->total.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	hist->sum.store(hist->sum.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+	if(ns > hist->max.load(std::memory_order_relaxed))
+		hist->max.store(ns, std::memory_order_relaxed);
+	hist->allTotal.store(hist->allTotal.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	hist->allSum.store(hist->allSum.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+}
+
+unsigned long long latencyPercentile(const LatencyHistogram *hist, double percentile)
+{
+	unsigned long long total = hist->total.load(std::memory_order_relaxed);
+	unsigned long long target = 0;
+	unsigned long long seen = 0;
+	unsigned long long max = hist->max.load(std::memory_order_relaxed);
+	unsigned long long value = 0;
+	int i = 0;
+
+	if(total == 0)
+		return 0;
+	target = (unsigned long long)(percentile / 100.0 * total + 0.5);
+	if(target < 1)
+		target = 1;
+	for(i = 0; i < LATENCY_NUM_BUCKETS; i++)
+	{
+		seen += hist->counts[i].load(std::memory_order_relaxed);
+		if(seen >= target)
+		{
+			value = bucketValue(i);
+			return value < max ? value : max;
+		}
+	}
+	return max;
+}
+
+void latencyReset(LatencyHistogram *hist)
+{
+	int i = 0;
+	for(i = 0; i < LATENCY_NUM_BUCKETS; i++)
+		hist->counts[i].store(0, std::memory_order_relaxed);
+	hist->total.store(0, std::memory_order_relaxed);
+	hist->sum.store(0, std::memory_order_relaxed);
+	hist->max.store(0, std::memory_order_relaxed);
+}
+
+void latencyClear(LatencyHistogram *hist)
+{
+	latencyReset(hist);
+	hist->allTotal.store(0, std::memory_order_relaxed);
+	hist->allSum.store(0, std::memory_order_relaxed);
+}
+
+void resetStageLatencies(StageLatencies *lat)
+{
+	int i = 0;
+	for(i = 0; i < LATENCY_NUM_STAGES; i++)
+		latencyClear(&lat->stages[i]);
+	lat->convertedSamples.store(0);
+	lat->resetRequested.store(0);
+}
+
+void requestStageLatenciesReset(StageLatencies *lat)
+{
+	lat->resetRequested.store(1);
+}
+
+void checkStageLatenciesReset(StageLatencies *lat)
+{
+	int i = 0;
+
+	if(!lat->resetRequested.load(std::memory_order_relaxed))
+		return;
+	for(i = 0; i < LATENCY_NUM_STAGES; i++)
+		latencyReset(&lat->stages[i]);
+	lat->convertedSamples.store(0, std::memory_order_relaxed);
+	lat->resetRequested.store(0);
+}
+
+const char *latencyStageName(int stage)
+{
+	if(stage < 0 || stage >= LATENCY_NUM_STAGES)
+		return "unknown";
+	return STAGE_NAMES[stage];
+}
+
+void printStageLatencies(const StageLatencies *lat)
+{
+	int i = 0;
+	const LatencyHistogram *hist = NULL;
+
+	printf("\nStage latencies (us):      count        p50        p99      p99.9        max\n");
+	for(i = 0; i < LATENCY_NUM_STAGES; i++)
+	{
+		hist = &lat->stages[i];
+		printf("  %-10s %16llu %10.3f %10.3f %10.3f %10.3f\n", latencyStageName(i),
+		       hist->total.load(std::memory_order_relaxed),
+		       latencyPercentile(hist, 50.0)/1000.0, latencyPercentile(hist, 99.0)/1000.0,
+		       latencyPercentile(hist, 99.9)/1000.0, hist->max.load(std::memory_order_relaxed)/1000.0);
+	}
+}
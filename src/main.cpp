@@ -23,30 +23,82 @@
 #include <sys/time.h>
 #endif
 
-#include <vector>
-#include <iostream>
-#include <lsl_cpp.h>
-
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
+#include <chrono>
+#include <thread>
 
 #include "tcp.h" //For TCP functions for communicating with a T7.
 #include "calibration.h" //For reading the calibration constants from a T7 and applying them on stream data.
+#include "modbus.h" //For the byte order conversions of the synthetic stream data.
 #include "stream.h" //Provides the stream related functions. These functions handle the Modbus calls. 
-
+#include "config.h" //Run-time settings and command line options.
+#include "budget.h" //Memory budget of the acquisition buffers.
+#include "publisher.h" //Status handling, conversion, scan assembly and LSL push of stream packets.
+#include "allocwatch.h" //Heap allocation counters.
+#include "stats.h" //Stream counters and their reporter thread.
+#include "metrics.h" //Prometheus endpoint of the stream counters.
+#include "trace.h" //Pipeline trace in the Chrome trace event format.
+#include "startup.h" //Duration and Modbus round trips of the startup phases.
+#include "capture.h" //Capture and replay of the raw stream packets.
+#include "rawtee.h" //Zero-copy raw copy of the stream socket.
+#include "recorder.h" //Segmented recording of the raw samples.
+#include "pgsink.h" //Binary COPY of the scans to PostgreSQL.
+#include "recording.h" //Indexed reading and extraction of the recordings.
+
+
+//Packets read before the stream loop is expected to stop allocating.
+#define WARMUP_PACKETS 100
 
 int gQuit = 0;
+StageLatencies *gLatencies = NULL; //Cleared on SIGUSR1
 
-void streamExample(const char* IP_ADDR);
+void streamExample(const PublisherConfig *cfg);
+int allocationCheck(const PublisherConfig *cfg);
+int replayCapture(const PublisherConfig *cfg);
+void setTraceDumpHandler();
 
 int	main(int argc, const char* argv[])
 {
-	const char DEFAULT_IP_ADDR[] = "192.168.1.207"; //Set your IP Addresses here, or set it using the first argument when running the program.
-	if(argc > 1)
-		streamExample(argv[1]);
-	else
-		streamExample(DEFAULT_IP_ADDR);
+	PublisherConfig cfg;
+	char csvFile[CONFIG_MAX_PATH_LENGTH + 4];
+	char extractFile[CONFIG_MAX_PATH_LENGTH + 16];
+
+	//Set your IP Addresses in getDefaultConfig, or set it using the -ip option
+	//(or the first argument) when running the program.
+	getDefaultConfig(&cfg);
+	if(parseConfig(argc, argv, &cfg) != 0)
+		return 1;
+	if(cfg.traceEvents > 0)
+		{
+			if(traceInit(cfg.traceEvents) != 0)
+				return 1;
+			traceSetDumpPath(cfg.traceFile);
+			setTraceDumpHandler();
+		}
+	if(cfg.allocCheckPackets > 0)
+		return allocationCheck(&cfg) == 0 ? 0 : 1;
+	if(cfg.replayFile[0] != '\0')
+		return replayCapture(&cfg) == 0 ? 0 : 1;
+	if(cfg.recoverFile[0] != '\0')
+		{
+			snprintf(csvFile, sizeof(csvFile), "%s.csv", cfg.recoverFile);
+			return recoverBlackBox(cfg.recoverFile, csvFile) == 0 ? 0 : 1;
+		}
+	if(cfg.extractPath[0] != '\0' && cfg.extractLevel > 0)
+		{
+			snprintf(extractFile, sizeof(extractFile), "%s_x%u.csv", cfg.extractPath, cfg.extractLevel);
+			return extractSummary(cfg.extractPath, cfg.extractLevel, cfg.extractFrom, cfg.extractTo, cfg.extractChannels, extractFile) == 0 ? 0 : 1;
+		}
+	if(cfg.extractPath[0] != '\0')
+		{
+			snprintf(extractFile, sizeof(extractFile), "%s.%s", cfg.extractPath, cfg.extractFormat == RECORDING_FORMAT_RAW ? "raw" : "csv");
+			return extractRecording(cfg.extractPath, cfg.extractFrom, cfg.extractTo, cfg.extractChannels,
+			                        cfg.extractFormat, extractFile) == 0 ? 0 : 1;
+		}
+	streamExample(&cfg);
 	return 0;
 }
 
@@ -90,16 +142,59 @@ void deleteQuitHandler()
 #endif
 }
 
-void streamExample(const char* IP_ADDR)
+#ifndef WIN32
+//Handling function for SIGUSR1. Clears the stage latency histograms.
+void latencyResetHandler(int)
+{
+	if(gLatencies)
+		requestStageLatenciesReset(gLatencies);
+}
+#endif
+
+void setLatencyResetHandler()
+{
+#ifndef WIN32
+	struct sigaction sigHandler;
+	sigHandler.sa_handler = latencyResetHandler;
+	sigemptyset(&sigHandler.sa_mask);
+	sigHandler.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sigHandler, NULL);
+#endif
+}
+
+#ifndef WIN32
+//Handling function for SIGUSR2. The stats reporter writes the trace.
+void traceDumpHandler(int)
+{
+	traceRequestDump();
+}
+#endif
+
+void setTraceDumpHandler()
+{
+#ifndef WIN32
+	struct sigaction sigHandler;
+	sigHandler.sa_handler = traceDumpHandler;
+	sigemptyset(&sigHandler.sa_mask);
+	sigHandler.sa_flags = SA_RESTART;
+	sigaction(SIGUSR2, &sigHandler, NULL);
+#endif
+}
+
+void streamExample(const PublisherConfig *cfg)
 {
 	//Time related
 	double startTime = 0;
 	double endTime = 0;
-	double lastPrint = 0;
+	unsigned long long tRecv = 0; //Start of the socket receive
+	unsigned long long tArrival = 0; //Packet arrival (end of the socket receive)
+	unsigned long long tValid = 0; //End of the header checks
+	unsigned long long tDone = 0; //End of the LSL push
 
 	//IP address and port settings
-	const int CR_PORT = 502; //Command/response TCP port (most operations)
-	const int SP_PORT = 702; //Spontaneous stream TCP port
+	const char *IP_ADDR = cfg->ipAddress;
+	const int CR_PORT = cfg->crPort; //Command/response TCP port (most operations)
+	const int SP_PORT = cfg->spPort; //Spontaneous stream TCP port
 
 	//Sockets
 	TCP_SOCKET crSock = 0; //Command/Response socket
@@ -108,8 +203,7 @@ void streamExample(const char* IP_ADDR)
 	//Calibration constants
 	DeviceCalibration devCal;
 
-	//Stream config. settings. Except for NUM_ADDRESSES, configured later.
-	enum {NUM_ADDRESSES = 2};
+	//Stream config. settings. Configured later from cfg.
 	float scanRate = 0;
 	unsigned int numAddresses = 0;
 	unsigned int samplesPerPacket = 0;
@@ -118,10 +212,20 @@ void streamExample(const char* IP_ADDR)
 	unsigned int bufferSizeBytes = 0;
 	unsigned int autoTarget = 0;
 	unsigned int numScans = 0;
-	unsigned int scanListAddresses[NUM_ADDRESSES] = {0};
-	unsigned short nChanList[NUM_ADDRESSES] = {0};
-	float rangeList[NUM_ADDRESSES] = {0.0};
-	unsigned int gainList[NUM_ADDRESSES]; //Based off rangeList
+	unsigned int scanListAddresses[MAX_NUM_STREAM_ADDR] = {0};
+	unsigned short nChanList[MAX_NUM_STREAM_ADDR] = {0};
+	float rangeList[MAX_NUM_STREAM_ADDR] = {0.0};
+	unsigned int gainList[MAX_NUM_STREAM_ADDR]; //Based off rangeList
+
+	//Acquisition buffers, all allocated up front from the memory budget.
+	MemoryBudget budget;
+	StreamPublisher publisher;
+	CaptureWriter capture;
+	CaptureHeader captureHeader;
+	RawTee rawTee;
+	Recorder recorder;
+	RecordingInfo recordingInfo;
+	PgSink pgSink;
 
 	//Stream read returns
 	unsigned short backlog = 0;
@@ -129,22 +233,29 @@ void streamExample(const char* IP_ADDR)
 	unsigned short additionalInfo = 0;
 
 	//Stream read loop variables
-	unsigned int i = 0, j = 0;
-	unsigned int addrIndex = 0;
-	float volts = 0.0f;
-	unsigned char *rawData;
-	int printStream = 0;
-	int printStreamStart = 0;
-	const double printStreamTimeSec = 1.0; //How often to print to the terminal in seconds.
+	unsigned int i = 0;
+	int ret = 0;
+	int size = 0;
+	int packetSize = 0;
+	StageLatencies *latencies = publisher.latencies();
+	StreamStats *stats = publisher.stats();
+	StatsReporter reporter;
+	MetricsServer metrics;
+	StartupProfile startup;
 	double scanTotal = 0;
 	double numScansSkipped = 0;
+	unsigned int numPackets = 0;
+	unsigned long long warmAllocs = 0; //Stream thread allocations at the end of the warm-up
 
+	startupBegin(&startup);
 	printf("Connecting to %s ...\n", IP_ADDR);
 
 	//Open sockets
 	
 	arSock = openTCP(IP_ADDR, SP_PORT);
+	startupPhase(&startup, "openTCP stream port");
 	crSock = openTCP(IP_ADDR, CR_PORT);
+	startupPhase(&startup, "openTCP command port");
 	printf("Connecting to %s ...\n", IP_ADDR);
 	if(crSock == INVALID_SOCKET || arSock == INVALID_SOCKET)
 		goto END;
@@ -156,18 +267,19 @@ void streamExample(const char* IP_ADDR)
 	//Get device calibration
 	printf("Reading	calibration constants.\n");
 	getCalibration(crSock, &devCal);
+	startupPhase(&startup, "getCalibration");
 
 	//Configure stream
-	scanRate = 1000.0f; //Scans per second. Samples per second = scanRate * numAddresses
-	numAddresses = NUM_ADDRESSES;
-	samplesPerPacket = STREAM_MAX_SAMPLES_PER_PACKET_TCP;  //Max is 512. For better throughput set this to high values.
+	scanRate = cfg->scanRate; //Scans per second. Samples per second = scanRate * numAddresses
+	numAddresses = cfg->numAddresses;
+	samplesPerPacket = cfg->samplesPerPacket;  //Max is 512. For better throughput set this to high values.
 	settling = 10.0; //10 microseconds
 	resolutionIndex = 0; //Default
 	bufferSizeBytes = 0; //Default
 	autoTarget = STREAM_TARGET_ETHERNET; //Stream target is Ethernet.
 	numScans = 0; //0 = Run continuously.
 
-	//Using a loop to add Modbus addresses for AIN0 - AIN(NUM_ADDRESSES-1) to the
+	//Using a loop to add Modbus addresses for AIN0 - AIN(numAddresses-1) to the
 	//stream scan and configure the analog input settings.
 	for(i = 0; i < numAddresses; i++)
 		{
@@ -192,6 +304,7 @@ void streamExample(const char* IP_ADDR)
 	printf("Configuring analog inputs.\n");
 	if(ainConfig(crSock, numAddresses, scanListAddresses, nChanList, rangeList) != 0)
 		goto END;
+	startupPhase(&startup, "ainConfig");
 
 	printf("Configuring stream settings.\n");
 	if(streamConfig(crSock, scanRate, numAddresses, samplesPerPacket, settling, resolutionIndex, bufferSizeBytes, autoTarget, numScans, scanListAddresses) != 0)
@@ -200,12 +313,14 @@ void streamExample(const char* IP_ADDR)
 			streamStop(crSock);
 			goto END;
 		}
+	startupPhase(&startup, "streamConfig");
 
 	//Read back stream settings
 	printf("Reading stream configuration.\n");
 	if(readStreamConfig(crSock, &scanRate, &numAddresses, &samplesPerPacket, &settling, &resolutionIndex, &bufferSizeBytes, &autoTarget, &numScans) != 0)
 		goto END;
-	if(numAddresses != NUM_ADDRESSES)
+	startupPhase(&startup, "readStreamConfig");
+	if(numAddresses != cfg->numAddresses)
 		{
 			printf("Modbus addresses were not set correctly.\n");
 			goto END;
@@ -214,10 +329,12 @@ void streamExample(const char* IP_ADDR)
 	printf("Reading stream scan list.\n");
 	if(readStreamAddressesConfig(crSock, numAddresses, scanListAddresses) != 0)
 		goto END;
+	startupPhase(&startup, "readStreamAddressesConfig");
 
 	printf("Reading analog inputs configuration.\n");
 	if(readAinConfig(crSock, numAddresses, scanListAddresses, nChanList, rangeList) != 0)
 		goto END;
+	startupPhase(&startup, "readAinConfig");
 
 	printf("Stream Configuration:\n");
 	printf("  Scan Rate (Hz) = %.3f, Samples Per Packet = %u, # Samples Per Scan = %u\n", scanRate, samplesPerPacket, numAddresses);
@@ -234,11 +351,77 @@ void streamExample(const char* IP_ADDR)
 	for(i = 0; i < numAddresses; i++)
 		printf("%.3f ", rangeList[i]);
 	printf("\n");
+
+	//Split the memory budget and allocate every acquisition buffer before
+	//streaming. Refuse to stream if the configuration does not fit.
+	if(planMemoryBudget(cfg->memBudgetBytes, scanRate, numAddresses, samplesPerPacket, &budget) != 0)
+		goto END;
+	printMemoryBudget(&budget);
+	if(publisher.init(&devCal, scanRate, numAddresses, samplesPerPacket, gainList, &budget) != 0)
+		goto END;
+	if(cfg->perfCounters && publisher.enablePerfCounters() != 0)
+		goto END;
+	if(cfg->diagnostics && publisher.enableDiagnostics(&budget) != 0)
+		goto END;
+	if(cfg->blackBoxFile[0] != '\0' && publisher.enableBlackBox(cfg->blackBoxFile, scanRate, cfg->blackBoxMinutes, cfg->blackBoxSyncSec) != 0)
+		goto END;
+	if(cfg->xdfFile[0] != '\0')
+		{
+			if(publisher.enableXdf(cfg->xdfFile, scanRate, &budget) != 0)
+				goto END;
+			reporter.watchXdf(publisher.xdfStats());
+		}
+	if(cfg->arrowPath[0] != '\0')
+		{
+			if(publisher.enableArrow(cfg->arrowPath, scanRate, &budget) != 0)
+				goto END;
+			reporter.watchArrow(publisher.arrowStats());
+		}
+	if(cfg->captureFile[0] != '\0')
+		{
+			memset(&captureHeader, 0, sizeof(CaptureHeader));
+			captureHeader.scanRate = scanRate;
+			captureHeader.numAddresses = numAddresses;
+			captureHeader.samplesPerPacket = samplesPerPacket;
+			memcpy(captureHeader.scanListAddresses, scanListAddresses, sizeof(scanListAddresses));
+			memcpy(captureHeader.gainList, gainList, numAddresses*sizeof(unsigned int));
+			captureHeader.devCal = devCal;
+			if(capture.open(cfg->captureFile, &captureHeader, &budget) != 0)
+				goto END;
+		}
+	if(cfg->rawTeeFile[0] != '\0' && rawTee.open(arSock, cfg->rawTeeFile) != 0)
+		goto END;
+	if(cfg->recordPrefix[0] != '\0')
+		{
+			memset(&recordingInfo, 0, sizeof(RecordingInfo));
+			recordingInfo.scanRate = scanRate;
+			recordingInfo.numAddresses = numAddresses;
+			memcpy(recordingInfo.scanListAddresses, scanListAddresses, sizeof(scanListAddresses));
+			memcpy(recordingInfo.gainList, gainList, numAddresses*sizeof(unsigned int));
+			recordingInfo.devCal = devCal;
+			if(recorder.open(cfg->recordPrefix, &recordingInfo, cfg->recordChunkSec, cfg->recordSegmentSec, cfg->recordSync, cfg->recordCodec,
+			                 cfg->recordSummaries, &budget) != 0)
+				goto END;
+			publisher.setRecorder(&recorder);
+			reporter.watchRecorder(recorder.stats());
+		}
+	if(cfg->pgConninfo[0] != '\0')
+		{
+			if(pgSink.open(cfg->pgConninfo, cfg->pgTable, scanRate, numAddresses, &budget) != 0)
+				goto END;
+			publisher.setPgSink(&pgSink);
+			reporter.watchPgSink(pgSink.stats());
+		}
+	startupPhase(&startup, "buffers and outlets");
+
 	printf("Press Enter key to start streaming.\nPress Ctrl+C to stop streaming.\n");
 	getchar();
+	startupWait(&startup, "wait for Enter");
 
-	//Set signal handling for Ctrl+C
+	//Set signal handling for Ctrl+C, and SIGUSR1 to clear the stage latencies
 	setQuitHandler();
+	gLatencies = latencies;
+	setLatencyResetHandler();
 
 	//Set spontaneous stream port timeouts to expected time per packet + 2 seconds.
 	setCommTimeoutTCP(arSock, (int)(samplesPerPacket/(scanRate*numAddresses))+2);
@@ -250,159 +433,112 @@ void streamExample(const char* IP_ADDR)
 			streamStop(crSock);
 			goto END;
 		}
+	startupPhase(&startup, "streamStart");
 
 	startTime = getTimeSec();
-	lastPrint = startTime;
 
 	printf("Reading streaming data.\n");
-	rawData = (unsigned char *)malloc(samplesPerPacket*STREAM_BYTES_PER_SAMPLE);
+	traceSetThreadName("stream");
+	reporter.watchSockets(crSock, arSock);
+	reporter.watchStartup(&startup);
+	if(reporter.start(stats, latencies, cfg->statsPeriodSec, cfg->latencyPrintSec, cfg->latencyResetOnPrint, cfg->statsFormat) != 0)
+		goto STOP_STREAM;
+	if(cfg->metricsPort > 0 && metrics.start(cfg->metricsPort, &publisher, scanRate) != 0)
+		goto STOP_STREAM;
+	startupPhase(&startup, "reporters");
+	packetSize = STREAM_HEADER_BYTES + samplesPerPacket*STREAM_BYTES_PER_SAMPLE;
 
 	//Stream read loop. If encountering stream buffer overflows in your own code,
 	//move your stream read loop to its own dedicated thread and perform
 	//operations on stream data in different threads.
-	try {
-	        lsl::stream_info info("LabJack", "labJackSamples", numAddresses, lsl::IRREGULAR_RATE,lsl::cf_float32);
-		lsl::stream_outlet outlet(info);
-		std::vector<std::vector<float>> chunk;
-		
-		while(!gQuit)
-			{
-				backlog = 0;
-				status = 0;
-				additionalInfo = 0;
-
-				if(spontaneousStreamRead(arSock, samplesPerPacket, &backlog, &status, &additionalInfo, rawData) != 0)
-					{
-						if(gQuit)
-							break; //Stream read error due to interrupt (Ctrl+C). Expected and stopping loop.
-						goto STOP_STREAM;
-					}
-				backlog = backlog / (numAddresses*STREAM_BYTES_PER_SAMPLE); //Scan backlog
-		
-				//Check status
-				if(status == STREAM_STATUS_SCAN_OVERLAP)
-					{
-						//Stream scan overlap occured. This usually indicates the scan rate
-						//is too fast for the stream configuration.
-						//Stopping the stream.
-						printf("\nReceived stream status error 2942 - STREAM_SCAN_OVERLAP. Stopping stream.\n");
-						gQuit = 1;
-						continue;
-					}
-				else if(status == STREAM_STATUS_AUTO_RECOVER_END_OVERFLOW)
-					{
-						//During auto recovery the skipped samples counter (16-bit) overflowed.
-						//Stopping the stream because of unknown amount of skipped samples.
-						printf("\nReceived stream status error 2943 - STREAM_AUTO_RECOVER_END_OVERFLOW. Stopping stream.\n");
-						printf("Scan Backlog = %u\n", backlog);
-						gQuit = 1;
-						continue;
-					}
-				else if(status == STREAM_STATUS_AUTO_RECOVER_ACTIVE)
-					{
-						//Stream buffer overload occured. In auto recovery mode. Continue
-						//reading existing samples from the T7's stream buffer which is still valid.
-						printf("\nReceived stream status 2940 -	STREAM_AUTO_RECOVER_ACTIVE.\n");
-						printf("Scan Backlog = %u\n", backlog);
-					}
-				else if(status == STREAM_STATUS_AUTO_RECOVER_END)
-					{
-						//Auto recover mode has ended. The number of skipped scans are reported
-						//and new samples are coming in.
-						numScansSkipped += (double)additionalInfo; //# skipped scans
-						printf("\nReceived stream status 2941 - STREAM_AUTO_RECOVER_END. %u scans were skipped.\n", additionalInfo);
-						printf("Scan Backlog = %u\n", backlog);
-					}
-				else if(status == STREAM_STATUS_BURST_COMPLETE)
-					{
-						//Stream burst has completed. Status used when numScans
-						//(Address 4020 - STREAM_NUM_SCANS) is configured to a non-zero value.
-						printf("Stream burst has completed\n");
-						gQuit = 1;
-					}
-				else if(status != 0)
-					{
-						printf("\nReceived stream status %u\n", status);
-					}
-				
-			
-				chunk.clear();
-				std::vector<float> s;
-				int k=-1;
-				//Convert to voltage and display readings
-				for(j = 0; j < samplesPerPacket; j++)
-					{
-						if(rawData[j*STREAM_BYTES_PER_SAMPLE] == 0xFF && rawData[j*STREAM_BYTES_PER_SAMPLE+1] == 0xFF)
-							{
-								//Dummy value to indicate where the missing scan/samples would be.
-								//numAddresses samples will	be 0xFFFF, and then new data.
-								printf("Dummy sample detected, addr. index = %d\n",	addrIndex);
-								if(addrIndex != 0)
-									{
-										printf("\nReceived dummy sample (0xFFFF) in the middle of a scan. Incomplete scans shouldn't happen.\n");
-										printf("Scan sample index = %d\n", addrIndex);
-									}
-								continue;
-							}
-						ainBinToVolts(&devCal, &rawData[j*STREAM_BYTES_PER_SAMPLE], gainList[addrIndex], &volts);
-						if(j%numAddresses==0)
-							{
-								k++;
-								std::vector<float> s;
-								chunk.push_back(s);
-							}
-						chunk[k].push_back(volts);
-						//Print to terminal
-						if(printStream)
-							{
-								if(addrIndex == 0 && !printStreamStart)
-									{
-										//Start printing (Stream info and the current scan)
-										printf("\nScan # %.00f: ", scanTotal+1);
-										printStreamStart = 1;
-									}
-								if(printStreamStart)
-									printf("%f ", volts);
-								if(addrIndex == (numAddresses - 1) && printStreamStart)
-									{
-										//Stop printing
-										printStream = 0;
-										printStreamStart = 0;
-										//Backlog is in bytes
-										printf("\nScan Backlog = %u, Status = %u, Additional Info. = %u\n", backlog, status, additionalInfo);
-									}
-							}
-
-						//The current scan's address index.
-						addrIndex++;
-						if(addrIndex >=	numAddresses)
-							{
-								addrIndex = 0;
-								scanTotal++;
-							}
-					}
-				// send it
-				outlet.push_chunk(chunk);
-				
-
-				if((getTimeSec() - lastPrint) > printStreamTimeSec)
-					{
-						//Initiate terminal printing
-						printStream = 1;
-						printStreamStart = 0;
-						lastPrint = getTimeSec();
-					}
-			}
-
-	} catch (std::exception& e) { std::cerr << "[ERROR] Got an exception: " << e.what() << std::endl; }
-	
-	
+	while(!gQuit)
+		{
+			BlockHandle packet = publisher.acquirePacket();
+			if(!packet.valid())
+				{
+					statsAdd(stats->poolExhausted, 1);
+					break;
+				}
+
+			backlog = 0;
+			status = 0;
+			additionalInfo = 0;
+
+			//Same as spontaneousStreamReadPacket, with the receive and the
+			//header checks timed separately. Errors go to the reporter.
+			tRecv = monotonicNs();
+			if(rawTee.isOpen())
+				size = rawTee.read(packet.data(), packetSize);
+			else
+				size = readTCPNoPrint(arSock, packet.data(), packetSize);
+			tArrival = monotonicNs();
+			if(size <= 0)
+				{
+					if(gQuit)
+						break; //Stream read error due to interrupt (Ctrl+C). Expected and stopping loop.
+					statsAdd(stats->readErrors, 1);
+					statsRecordError(stats, 0, packet.data(), size);
+					break;
+				}
+			if(capture.isOpen())
+				capture.write(tArrival, packet.data(), size);
+			ret = parseStreamPacket(packet.data(), size, &backlog, &status, &additionalInfo);
+			if(ret != 0)
+				{
+					statsAdd(stats->packetErrors, 1);
+					if(ret == STREAM_ERROR_TRANSACTION_ID)
+						statsAdd(stats->transactionIdGaps, 1);
+					statsRecordError(stats, ret, packet.data(), size);
+					break;
+				}
+			tValid = monotonicNs();
+			traceSpan(TRACE_STREAM_READ, tRecv, tArrival);
+			traceSpan(TRACE_VALIDATE, tArrival, tValid);
+			packet.setLength(packetSize);
+
+			ret = publisher.publishPacket(packet, backlog, status, additionalInfo);
+			if(ret < 0)
+				break;
+			if(ret > 0)
+				gQuit = 1;
+
+			checkStageLatenciesReset(latencies);
+			latencyRecord(&latencies->stages[LATENCY_RECEIVE], tArrival - tRecv);
+			latencyRecord(&latencies->stages[LATENCY_VALIDATE], tValid - tArrival);
+			tDone = monotonicNs();
+			latencyRecord(&latencies->stages[LATENCY_TOTAL], tDone - tArrival);
+			if(cfg->diagnostics)
+				publisher.publishDiagnostics(readQueueTCP(arSock), tDone - tArrival);
+
+			if(numPackets == 0)
+				startupEnd(&startup, "first sample");
+			if(++numPackets == WARMUP_PACKETS)
+				warmAllocs = threadAllocCount();
+		}
 
 	endTime = getTimeSec();
+	recorder.close(); //Writes the queued chunks, counted in the final report
+	pgSink.close();
+	publisher.closeXdf();
+	publisher.closeArrow();
+	reporter.stop(); //Prints the final report, with any pending errors
+	metrics.stop();
+	if(cfg->traceEvents > 0)
+		traceDump(cfg->traceFile);
 	printf("\nStopped stream reading.\n\n");
+	if(capture.isOpen())
+		{
+			capture.close();
+			printf("Captured %llu packets in %s, %llu packets dropped\n", capture.packets(), cfg->captureFile, capture.droppedPackets());
+		}
+	if(rawTee.isOpen())
+		{
+			rawTee.close();
+			printf("Raw tee: %llu bytes in %s, %llu bytes dropped\n", rawTee.bytesWritten(), cfg->rawTeeFile, rawTee.bytesDropped());
+		}
 
-	if(addrIndex > 0)
-		scanTotal += ((double)addrIndex/(double)numAddresses); //Add uncounted samples to scan total
+	scanTotal = publisher.scanTotal();
+	numScansSkipped = publisher.numScansSkipped();
 
 	printf("Configured Scan Rate = %.00f\n", scanRate);
 	printf("# Scans = %.03f\n", scanTotal);
@@ -410,15 +546,23 @@ void streamExample(const char* IP_ADDR)
 	printf("Time taken = %f sec.\n", (endTime-startTime));
 	printf("Timed Scan Rate = %0.03f\n", (scanTotal/(endTime-startTime)));
 	printf("Timed Sample Rate = %0.03f\n", ((scanTotal*numAddresses)/(endTime-startTime)));
+	if(numPackets > WARMUP_PACKETS)
+		printf("Heap allocations after warm-up = %llu (%u packets)\n", threadAllocCount() - warmAllocs, numPackets - WARMUP_PACKETS);
+	printPerfProfile(publisher.perfProfile());
 
  STOP_STREAM:
-	free(rawData);
 	printf("Stopping stream\n");
 	if(streamStop(crSock))
 		goto END;
 	printf("Stream stopped\n");
  END:
+	//The partial profile shows the phase that failed
+	reporter.stop();
+	if(startupFail(&startup, "until the failure"))
+		printStartupProfile(&startup, cfg->statsFormat);
 	deleteQuitHandler();
+	gLatencies = NULL;
+	rawTee.close();
 
 	//Close sockets
 	closeTCP(crSock);
@@ -429,3 +573,257 @@ void streamExample(const char* IP_ADDR)
 
 	return;
 }
+
+//Feeds synthetic stream packets through the packet check, conversion, scan
+//assembly and LSL push used by the stream loop, and fails if the stream
+//thread allocates after the warm-up. No device is needed. Returns -1 on
+//failure, 0 on success.
+int allocationCheck(const PublisherConfig *cfg)
+{
+	DeviceCalibration devCal;
+	MemoryBudget budget;
+	StreamPublisher publisher;
+	unsigned int gainList[MAX_NUM_STREAM_ADDR] = {0};
+	unsigned char rawData[STREAM_MAX_SAMPLES_PER_PACKET_TCP*STREAM_BYTES_PER_SAMPLE];
+	const unsigned int samplesPerPacket = cfg->samplesPerPacket;
+	const int packetSize = STREAM_HEADER_BYTES + samplesPerPacket*STREAM_BYTES_PER_SAMPLE;
+	unsigned short backlog = 0;
+	unsigned short status = 0;
+	unsigned short additionalInfo = 0;
+	unsigned int i = 0, j = 0;
+	unsigned long long warmAllocs = 0;
+	unsigned long long allocs = 0;
+
+	getNominalCalibration(&devCal);
+	if(planMemoryBudget(cfg->memBudgetBytes, cfg->scanRate, cfg->numAddresses, samplesPerPacket, &budget) != 0)
+		return -1;
+	if(publisher.init(&devCal, cfg->scanRate, cfg->numAddresses, samplesPerPacket, gainList, &budget) != 0)
+		return -1;
+	if(cfg->perfCounters && publisher.enablePerfCounters() != 0)
+		return -1;
+	if(cfg->diagnostics && publisher.enableDiagnostics(&budget) != 0)
+		return -1;
+	resetStreamTransactionID();
+	traceSetThreadName("stream");
+
+	printf("Allocation check: %u channels, %u samples per packet, %u packets after %u warm-up packets (%s counted).\n",
+	       cfg->numAddresses, samplesPerPacket, cfg->allocCheckPackets, WARMUP_PACKETS,
+	       allocHooksEnabled() ? "malloc and operator new" : "operator new");
+
+	for(i = 0; i < WARMUP_PACKETS + cfg->allocCheckPackets; i++)
+		{
+			BlockHandle packet = publisher.acquirePacket();
+			if(!packet.valid())
+				{
+					printf("Packet block pool exhausted.\n");
+					return -1;
+				}
+
+			//Sawtooth samples. 0xFFFF is the dummy sample, never produce it.
+			for(j = 0; j < samplesPerPacket; j++)
+				uint16ToBytes((unsigned short)(((i*samplesPerPacket + j)*37) % 0xFFFF), &rawData[j*STREAM_BYTES_PER_SAMPLE]);
+			buildStreamPacket((unsigned short)i, 0, 0, 0, rawData, samplesPerPacket, packet.data());
+
+			if(parseStreamPacket(packet.data(), packetSize, &backlog, &status, &additionalInfo) != 0)
+				return -1;
+			packet.setLength(packetSize);
+			if(publisher.publishPacket(packet, backlog, status, additionalInfo) != 0)
+				return -1;
+			publisher.publishDiagnostics(-1, 0);
+
+			if(i + 1 == WARMUP_PACKETS)
+				warmAllocs = threadAllocCount();
+		}
+
+	allocs = threadAllocCount() - warmAllocs;
+	printStageLatencies(publisher.latencies());
+	printPerfProfile(publisher.perfProfile());
+	if(cfg->traceEvents > 0)
+		traceDump(cfg->traceFile);
+	if(allocs != 0)
+		{
+			printf("Allocation check FAILED: %llu heap allocations in the stream loop after warm-up.\n", allocs);
+			return -1;
+		}
+	printf("Allocation check passed: no heap allocation in the stream loop after warm-up.\n");
+	return 0;
+}
+
+//Feeds the packets of a capture file through the packet checks, conversion,
+//scan assembly and LSL push of the stream loop, paced by their receive times
+//divided by the replay speed, or as fast as possible with speed 0. No device
+//is needed. Returns -1 on failure, 0 on success.
+int replayCapture(const PublisherConfig *cfg)
+{
+	CaptureReader reader;
+	CaptureHeader header;
+	MemoryBudget budget;
+	StreamPublisher publisher;
+	StageLatencies *latencies = publisher.latencies();
+	StreamStats *stats = publisher.stats();
+	StatsReporter reporter;
+	MetricsServer metrics;
+	Recorder recorder;
+	RecordingInfo recordingInfo;
+	PgSink pgSink;
+	unsigned short backlog = 0;
+	unsigned short status = 0;
+	unsigned short additionalInfo = 0;
+	unsigned long long receiveNs = 0;
+	unsigned long long firstReceiveNs = 0;
+	unsigned long long startNs = 0;
+	unsigned long long endNs = 0;
+	unsigned long long tArrival = 0, tValid = 0, tDone = 0;
+	unsigned long long numPackets = 0;
+	unsigned long long target = 0;
+	const char *stopReason = NULL; //Why the replay stopped early, NULL at the end of the capture
+	int size = 0;
+	int ret = 0;
+	int result = 0;
+
+	if(reader.open(cfg->replayFile, &header) != 0)
+		return -1;
+	printf("Replaying %s: %u channels at %.3f Hz, %u samples per packet, speed %s.\n", cfg->replayFile,
+	       header.numAddresses, header.scanRate, header.samplesPerPacket, cfg->replaySpeed > 0 ? "paced" : "as fast as possible");
+	if(planMemoryBudget(cfg->memBudgetBytes, header.scanRate, header.numAddresses, header.samplesPerPacket, &budget) != 0)
+		return -1;
+	if(publisher.init(&header.devCal, header.scanRate, header.numAddresses, header.samplesPerPacket, header.gainList, &budget) != 0)
+		return -1;
+	if(cfg->perfCounters && publisher.enablePerfCounters() != 0)
+		return -1;
+	if(cfg->diagnostics && publisher.enableDiagnostics(&budget) != 0)
+		return -1;
+	if(cfg->blackBoxFile[0] != '\0' &&
+	   publisher.enableBlackBox(cfg->blackBoxFile, header.scanRate, cfg->blackBoxMinutes, cfg->blackBoxSyncSec) != 0)
+		return -1;
+	if(cfg->xdfFile[0] != '\0')
+		{
+			if(publisher.enableXdf(cfg->xdfFile, header.scanRate, &budget) != 0)
+				return -1;
+			reporter.watchXdf(publisher.xdfStats());
+		}
+	if(cfg->arrowPath[0] != '\0')
+		{
+			if(publisher.enableArrow(cfg->arrowPath, header.scanRate, &budget) != 0)
+				return -1;
+			reporter.watchArrow(publisher.arrowStats());
+		}
+	if(cfg->recordPrefix[0] != '\0')
+		{
+			memset(&recordingInfo, 0, sizeof(RecordingInfo));
+			recordingInfo.scanRate = header.scanRate;
+			recordingInfo.numAddresses = header.numAddresses;
+			memcpy(recordingInfo.scanListAddresses, header.scanListAddresses, sizeof(header.scanListAddresses));
+			memcpy(recordingInfo.gainList, header.gainList, sizeof(header.gainList));
+			recordingInfo.devCal = header.devCal;
+			if(recorder.open(cfg->recordPrefix, &recordingInfo, cfg->recordChunkSec, cfg->recordSegmentSec, cfg->recordSync, cfg->recordCodec,
+			                 cfg->recordSummaries, &budget) != 0)
+				return -1;
+			publisher.setRecorder(&recorder);
+			reporter.watchRecorder(recorder.stats());
+		}
+	if(cfg->pgConninfo[0] != '\0')
+		{
+			if(pgSink.open(cfg->pgConninfo, cfg->pgTable, header.scanRate, header.numAddresses, &budget) != 0)
+				return -1;
+			publisher.setPgSink(&pgSink);
+			reporter.watchPgSink(pgSink.stats());
+		}
+	resetStreamTransactionID();
+	traceSetThreadName("stream");
+	setQuitHandler();
+	gLatencies = latencies;
+	setLatencyResetHandler();
+	if(reporter.start(stats, latencies, cfg->statsPeriodSec, cfg->latencyPrintSec, cfg->latencyResetOnPrint, cfg->statsFormat) != 0)
+		return -1;
+	if(cfg->metricsPort > 0 && metrics.start(cfg->metricsPort, &publisher, header.scanRate) != 0)
+		{
+			reporter.stop();
+			return -1;
+		}
+
+	startNs = monotonicNs();
+	while(!gQuit)
+		{
+			BlockHandle packet = publisher.acquirePacket();
+			if(!packet.valid())
+				{
+					statsAdd(stats->poolExhausted, 1);
+					stopReason = "the packet pool is exhausted";
+					result = -1;
+					break;
+				}
+			ret = reader.read(&receiveNs, packet.data(), budget.packetBytes, &size);
+			if(ret <= 0)
+				{
+					if(ret < 0)
+						stopReason = "a capture read error";
+					result = ret;
+					break;
+				}
+
+			//Wait for the receive time of the packet, relative to the first one
+			if(numPackets == 0)
+				firstReceiveNs = receiveNs;
+			if(cfg->replaySpeed > 0)
+				{
+					target = startNs + (unsigned long long)((receiveNs - firstReceiveNs)/cfg->replaySpeed);
+					if(target > monotonicNs())
+						std::this_thread::sleep_for(std::chrono::nanoseconds(target - monotonicNs()));
+				}
+
+			tArrival = monotonicNs();
+			ret = parseStreamPacket(packet.data(), size, &backlog, &status, &additionalInfo);
+			if(ret != 0)
+				{
+					statsAdd(stats->packetErrors, 1);
+					if(ret == STREAM_ERROR_TRANSACTION_ID)
+						statsAdd(stats->transactionIdGaps, 1);
+					statsRecordError(stats, ret, packet.data(), size);
+					stopReason = "an invalid stream packet";
+					result = -1;
+					break;
+				}
+			tValid = monotonicNs();
+			traceSpan(TRACE_VALIDATE, tArrival, tValid);
+			packet.setLength(size);
+
+			ret = publisher.publishPacket(packet, backlog, status, additionalInfo);
+			if(ret != 0)
+				{
+					if(ret < 0)
+						stopReason = "a publish error";
+					result = ret < 0 ? -1 : 0;
+					break;
+				}
+
+			checkStageLatenciesReset(latencies);
+			latencyRecord(&latencies->stages[LATENCY_VALIDATE], tValid - tArrival);
+			tDone = monotonicNs();
+			latencyRecord(&latencies->stages[LATENCY_TOTAL], tDone - tArrival);
+			if(cfg->diagnostics)
+				publisher.publishDiagnostics(-1, tDone - tArrival);
+			numPackets++;
+		}
+	endNs = monotonicNs();
+	recorder.close();
+	pgSink.close();
+	publisher.closeXdf();
+	publisher.closeArrow();
+	reporter.stop();
+	metrics.stop();
+	deleteQuitHandler();
+	gLatencies = NULL;
+	if(cfg->traceEvents > 0)
+		traceDump(cfg->traceFile);
+
+	printf("\nReplayed %llu packets, %.03f scans in %f sec (%.03f scans/s).\n", numPackets, publisher.scanTotal(),
+	       (endNs - startNs)/1e9, publisher.scanTotal()/((endNs - startNs)/1e9));
+	if(numPackets > 1 && endNs > startNs)
+		printf("Captured over %f sec, replayed at %.2fx.\n", (receiveNs - firstReceiveNs)/1e9,
+		       (double)(receiveNs - firstReceiveNs)/(endNs - startNs));
+	printPerfProfile(publisher.perfProfile());
+	if(stopReason != NULL)
+		printf("Replay stopped on %s.\n", stopReason);
+	return result;
+}
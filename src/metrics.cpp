@@ -0,0 +1,257 @@
+#include "metrics.h"
+#include "allocwatch.h"
+#include "trace.h"
+#include <exception>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <winsock.h>
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+
+//Milliseconds the server waits for a connection before checking if it needs
+//to stop.
+#define METRICS_POLL_MS 200
+
+static void closeSocket(TCP_SOCKET sock)
+{
+#ifdef WIN32
+	closesocket(sock);
+#else
+	close(sock);
+#endif
+}
+
+MetricsServer::MetricsServer() : mPublisher(0), mScanRate(0), mStartTime(0), mSock(INVALID_SOCKET), mRunning(0), mBodySize(0)
+{
+	mBody[0] = '\0';
+}
+
+MetricsServer::~MetricsServer()
+{
+	stop();
+}
+
+int MetricsServer::start(int port, StreamPublisher *publisher, float scanRate)
+{
+	struct sockaddr_in address;
+	int reuse = 1;
+
+	if(mRunning.load())
+		return -1;
+	if(port <= 0 || port > 65535)
+	{
+		printf("MetricsServer::start error: Invalid port %d\n", port);
+		return -1;
+	}
+	mPublisher = publisher;
+	mScanRate = scanRate;
+	mStartTime = monotonicNs()/1000000000.0;
+
+	mSock = socket(AF_INET, SOCK_STREAM, 0);
+	if(mSock == INVALID_SOCKET)
+	{
+		printf("MetricsServer::start error: Could not create socket\n");
+		return -1;
+	}
+	setsockopt(mSock, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(mSock, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(mSock, 4) < 0)
+	{
+		printf("MetricsServer::start error: Could not listen on 127.0.0.1:%d\n", port);
+		closeSocket(mSock);
+		mSock = INVALID_SOCKET;
+		return -1;
+	}
+
+	mRunning.store(1);
+	try
+	{
+		mThread = std::thread(&MetricsServer::run, this);
+	}
+	catch(std::exception &)
+	{
+		printf("MetricsServer::start error: Could not start the server thread\n");
+		mRunning.store(0);
+		closeSocket(mSock);
+		mSock = INVALID_SOCKET;
+		return -1;
+	}
+	printf("Serving metrics on http://127.0.0.1:%d/metrics\n", port);
+	return 0;
+}
+
+void MetricsServer::stop()
+{
+	if(!mThread.joinable())
+		return;
+	mRunning.store(0);
+	mThread.join();
+	closeSocket(mSock);
+	mSock = INVALID_SOCKET;
+}
+
+void MetricsServer::run()
+{
+	fd_set fds;
+	struct timeval tv;
+	TCP_SOCKET client = INVALID_SOCKET;
+	unsigned long long t0 = 0;
+
+	traceSetThreadName("metrics server");
+	while(mRunning.load())
+	{
+		FD_ZERO(&fds);
+		FD_SET(mSock, &fds);
+		tv.tv_sec = 0;
+		tv.tv_usec = METRICS_POLL_MS*1000;
+		if(select((int)mSock + 1, &fds, NULL, NULL, &tv) <= 0)
+			continue;
+		client = accept(mSock, NULL, NULL);
+		if(client == INVALID_SOCKET)
+			continue;
+		t0 = monotonicNs();
+		serve(client);
+		closeSocket(client);
+		traceSpan(TRACE_SCRAPE, t0, monotonicNs());
+	}
+}
+
+void MetricsServer::serve(TCP_SOCKET client)
+{
+	char request[1024];
+	char header[256];
+	int size = 0;
+	int headerSize = 0;
+	int found = 0;
+
+	//Only the request line matters. Read until the end of the headers.
+	setCommTimeoutTCP(client, 1);
+	while(size < (int)sizeof(request) - 1)
+	{
+		int ret = recv(client, &request[size], sizeof(request) - 1 - size, 0);
+		if(ret <= 0)
+			break;
+		size += ret;
+		request[size] = '\0';
+		if(strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+			break;
+	}
+	request[size] = '\0';
+
+	found = strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0;
+	if(found)
+		formatMetrics();
+	else
+		mBodySize = snprintf(mBody, sizeof(mBody), "Not found. Metrics are at /metrics\n");
+
+	headerSize = snprintf(header, sizeof(header),
+	                      "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",
+	                      found ? "200 OK" : "404 Not Found", mBodySize);
+	if(send(client, header, headerSize, 0) == headerSize)
+		send(client, mBody, mBodySize, 0);
+}
+
+void MetricsServer::append(const char *format, ...)
+{
+	va_list args;
+	int ret = 0;
+
+	if(mBodySize >= (int)sizeof(mBody) - 1)
+		return;
+	va_start(args, format);
+	ret = vsnprintf(&mBody[mBodySize], sizeof(mBody) - mBodySize, format, args);
+	va_end(args);
+	if(ret > 0)
+		mBodySize += ret;
+	if(mBodySize > (int)sizeof(mBody) - 1)
+		mBodySize = sizeof(mBody) - 1;
+}
+
+//Appends a gauge of both sockets, labeled by socket. Sockets that were not
+//sampled are left out.
+void MetricsServer::appendSocketMetric(const char *name, const char *help, std::atomic<int> SocketStats::*field)
+{
+	static const char *SOCKET_LABELS[STATS_NUM_SOCKETS] = {"command", "stream"};
+	const StreamStats *s = mPublisher->stats();
+	int value = 0;
+	int i = 0;
+
+	append("# HELP lslpub_%s %s\n# TYPE lslpub_%s gauge\n", name, help, name);
+	for(i = 0; i < STATS_NUM_SOCKETS; i++)
+	{
+		value = (s->sockets[i].*field).load(std::memory_order_relaxed);
+		if(value >= 0)
+			append("lslpub_%s{socket=\"%s\"} %d\n", name, SOCKET_LABELS[i], value);
+	}
+}
+
+//Appends a metric with its HELP and TYPE lines.
+#define METRIC(name, type, help, format, value) \
+	append("# HELP lslpub_" name " " help "\n# TYPE lslpub_" name " " type "\nlslpub_" name " " format "\n", value)
+
+int MetricsServer::formatMetrics()
+{
+	const StreamStats *s = mPublisher->stats();
+	const StageLatencies *lat = mPublisher->latencies();
+	const LatencyHistogram *hist = NULL;
+	const LatencyHistogram *convert = &lat->stages[LATENCY_CONVERT];
+	unsigned long long converted = lat->convertedSamples.load(std::memory_order_relaxed);
+	const double quantiles[3] = {0.5, 0.99, 0.999};
+	int i = 0, j = 0;
+
+	mBodySize = 0;
+	METRIC("up_seconds", "gauge", "Seconds since the stream started.", "%.3f", monotonicNs()/1000000000.0 - mStartTime);
+	METRIC("configured_scan_rate_hz", "gauge", "Configured scan rate.", "%.3f", mScanRate);
+	METRIC("addresses", "gauge", "Samples per scan.", "%u", mPublisher->numAddresses());
+	METRIC("packets_total", "counter", "Stream packets received.", "%llu", s->packets.load(std::memory_order_relaxed));
+	METRIC("bytes_total", "counter", "Stream packet bytes received.", "%llu", s->bytes.load(std::memory_order_relaxed));
+	METRIC("scans_total", "counter", "Complete scans pushed to LSL.", "%llu", s->scans.load(std::memory_order_relaxed));
+	METRIC("samples_total", "counter", "Samples pushed to LSL.", "%llu", s->samples.load(std::memory_order_relaxed));
+	METRIC("device_backlog_scans", "gauge", "Scan backlog of the T7 stream buffer in the last packet.", "%u", s->backlog.load(std::memory_order_relaxed));
+	METRIC("device_status", "gauge", "Stream status of the last packet.", "%u", s->status.load(std::memory_order_relaxed));
+	METRIC("auto_recover_active_packets_total", "counter", "Packets received in auto recovery.", "%llu", s->autoRecoverActive.load(std::memory_order_relaxed));
+	METRIC("auto_recover_end_total", "counter", "Auto recoveries that ended.", "%llu", s->autoRecoverEnd.load(std::memory_order_relaxed));
+	METRIC("scans_skipped_total", "counter", "Scans skipped by the T7 during auto recovery.", "%llu", s->scansSkipped.load(std::memory_order_relaxed));
+	METRIC("dummy_samples_total", "counter", "Dummy (0xFFFF) samples received.", "%llu", s->dummySamples.load(std::memory_order_relaxed));
+	METRIC("transaction_id_gaps_total", "counter", "Stream packets with an unexpected transaction ID.", "%llu", s->transactionIdGaps.load(std::memory_order_relaxed));
+	METRIC("read_errors_total", "counter", "Stream socket read errors.", "%llu", s->readErrors.load(std::memory_order_relaxed));
+	METRIC("packet_errors_total", "counter", "Invalid stream packets.", "%llu", s->packetErrors.load(std::memory_order_relaxed));
+	METRIC("pool_exhausted_total", "counter", "Packet or sample block pool exhaustions.", "%llu", s->poolExhausted.load(std::memory_order_relaxed));
+	METRIC("heap_allocations_total", "counter", "Heap allocations of the process (operator new, and malloc with LSLPUB_ALLOC_HOOKS).", "%llu", processAllocCount());
+	METRIC("convert_ns_per_sample", "gauge", "Mean conversion time per raw sample since the last latency reset.", "%.3f",
+	       converted ? (double)convert->sum.load(std::memory_order_relaxed)/converted : 0.0);
+	METRIC("lsl_consumers", "gauge", "1 if an LSL inlet is connected to the outlet.", "%d", mPublisher->haveConsumers() ? 1 : 0);
+
+	appendSocketMetric("socket_rx_queue_bytes", "Received bytes waiting in the host kernel (SIOCINQ).", &SocketStats::rxQueueBytes);
+	appendSocketMetric("socket_rtt_us", "Smoothed TCP round trip time.", &SocketStats::rttUs);
+	appendSocketMetric("socket_rtt_var_us", "TCP round trip time variation.", &SocketStats::rttVarUs);
+	appendSocketMetric("socket_retransmits", "TCP segments retransmitted since the connection opened.", &SocketStats::totalRetrans);
+	appendSocketMetric("socket_lost", "TCP segments currently considered lost.", &SocketStats::lost);
+	appendSocketMetric("socket_rcv_space_bytes", "Receive buffer space the kernel tunes the TCP window to.", &SocketStats::rcvSpace);
+
+	//The quantiles cover the samples since the last latency reset, the sum
+	//and count never reset
+	append("# HELP lslpub_stage_latency_seconds Latency of each stage of the stream pipeline.\n"
+	       "# TYPE lslpub_stage_latency_seconds summary\n");
+	for(i = 0; i < LATENCY_NUM_STAGES; i++)
+	{
+		hist = &lat->stages[i];
+		for(j = 0; j < 3; j++)
+			append("lslpub_stage_latency_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n", latencyStageName(i), quantiles[j],
+			       latencyPercentile(hist, quantiles[j]*100.0)/1000000000.0);
+		append("lslpub_stage_latency_seconds_sum{stage=\"%s\"} %.9f\n", latencyStageName(i), hist->allSum.load(std::memory_order_relaxed)/1000000000.0);
+		append("lslpub_stage_latency_seconds_count{stage=\"%s\"} %llu\n", latencyStageName(i), hist->allTotal.load(std::memory_order_relaxed));
+	}
+	return mBodySize;
+}
@@ -8,6 +8,32 @@
 #define CPU_ENDIAN_NOT_CHECKED 0
 
 static int CPU_ENDIAN =	CPU_ENDIAN_NOT_CHECKED;
+static unsigned int MODBUS_ROUND_TRIPS = 0;
+
+//Bytes of the Modbus TCP header before the part counted by its length.
+#define MODBUS_MBAP_BYTES 6
+
+//Reads a Modbus response: the header, then the number of bytes its length
+//gives, so that a shorter exception response does not wait for the
+//timeout. Returns the bytes read, or the readTCP result on error.
+//size: The expected response size, and the size of res.
+static int readModbusResponseTCP(TCP_SOCKET socket, unsigned char *res, int size)
+{
+	unsigned short length = 0;
+	int ret = 0;
+
+	if((ret = readTCP(socket, res, MODBUS_MBAP_BYTES)) != MODBUS_MBAP_BYTES)
+		return ret;
+	bytesToUint16(&res[4], &length);
+	if(length == 0 || MODBUS_MBAP_BYTES + length > size)
+	{
+		printf("readModbusResponseTCP error: Unexpected Modbus length %u, expected %d\n", length, size - MODBUS_MBAP_BYTES);
+		return -1;
+	}
+	if((ret = readTCP(socket, &res[MODBUS_MBAP_BYTES], length)) != length)
+		return ret < 0 ? ret : MODBUS_MBAP_BYTES + ret;
+	return MODBUS_MBAP_BYTES + length;
+}
 
 //This reverses the data's byte order for little endian	processors. This is
 //useful for converting data types to/from big endian.
@@ -92,10 +118,11 @@ int	readMultipleRegistersTCP(TCP_SOCKET socket, unsigned short address, unsigned
 	if(setupReadMultRegsCom(transID, 0, address, numRegisters, com, &resSize) != 0)
 		return -1;
 
+	MODBUS_ROUND_TRIPS++;
 	if(writeTCP(socket, com, READ_MULT_REGS_COM_SIZE) != READ_MULT_REGS_COM_SIZE)
 		return -1;
 
-	if((size = readTCP(socket, res, resSize)) <= 0)
+	if((size = readModbusResponseTCP(socket, res, resSize)) <= 0)
 		return -1;
 
 	if(checkReadMultRegsRes(res, size, transID) != 0)
@@ -118,10 +145,11 @@ int writeMultipleRegistersTCP(TCP_SOCKET socket, unsigned short address, unsigne
 	if(setupWriteMultRegsCom(transID, 0, address, numRegisters, data, com, &comSize) != 0)
 		return -1;
 
+	MODBUS_ROUND_TRIPS++;
 	if(writeTCP(socket, com, comSize) != comSize)
 		return -1;
 
-	if((size = readTCP(socket, res, WRITE_MULT_REGS_RESP_SIZE)) <= 0)
+	if((size = readModbusResponseTCP(socket, res, WRITE_MULT_REGS_RESP_SIZE)) <= 0)
 		return -1;
 
 	if(checkModbusResponse(res, size, transID, WRITE_MULT_REGS_COM_FUNCTION_CODE) != 0)
@@ -130,6 +158,11 @@ int writeMultipleRegistersTCP(TCP_SOCKET socket, unsigned short address, unsigne
 	return 0;
 }
 
+unsigned int getModbusRoundTrips()
+{
+	return MODBUS_ROUND_TRIPS;
+}
+
 int readLabJackError(TCP_SOCKET socket, unsigned short *errorCode)
 {
 	unsigned char data[2];
@@ -145,7 +178,7 @@ unsigned short getNextTransactionID()
 	return transactionID++;
 }
 
-void setModbusPacketHeader(unsigned char *packet, unsigned short transID, unsigned char length, unsigned char unitID)
+void setModbusPacketHeader(unsigned char *packet, unsigned short transID, unsigned short length, unsigned char unitID)
 {
 	uint16ToBytes(transID, packet);
 	packet[2] = 0; //Protcol ID (MSB)
@@ -0,0 +1,174 @@
+#include "perfcount.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static const char *EVENT_NAMES[PERF_NUM_EVENTS] = {"cycles", "instructions", "cache-misses", "branch-misses"};
+static const char *STAGE_NAMES[PERF_NUM_STAGES] = {"convert", "publish"};
+
+PerfCounters::PerfCounters()
+{
+	int i = 0;
+	for(i = 0; i < PERF_NUM_EVENTS; i++)
+		mFds[i] = -1;
+}
+
+PerfCounters::~PerfCounters()
+{
+	close();
+}
+
+#ifdef __linux__
+static const unsigned long long EVENT_CONFIGS[PERF_NUM_EVENTS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+
+//Group read layout with PERF_FORMAT_GROUP, TOTAL_TIME_ENABLED and
+//TOTAL_TIME_RUNNING.
+typedef struct
+{
+	unsigned long long nr;
+	unsigned long long timeEnabled;
+	unsigned long long timeRunning;
+	unsigned long long values[PERF_NUM_EVENTS];
+} PerfGroupRead;
+
+int PerfCounters::open()
+{
+	struct perf_event_attr attr;
+	int i = 0;
+
+	if(isOpen())
+		return 0;
+	for(i = 0; i < PERF_NUM_EVENTS; i++)
+	{
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = EVENT_CONFIGS[i];
+		attr.disabled = (i == 0); //The leader starts the group
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		mFds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, i == 0 ? -1 : mFds[0], 0);
+		if(mFds[i] < 0)
+		{
+			printf("PerfCounters::open error: Could not open the %s counter (%s). Check /proc/sys/kernel/perf_event_paranoid.\n",
+			       EVENT_NAMES[i], strerror(errno));
+			close();
+			return -1;
+		}
+	}
+	ioctl(mFds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(mFds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	return 0;
+}
+
+void PerfCounters::close()
+{
+	int i = 0;
+
+	if(mFds[0] >= 0)
+		ioctl(mFds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+	for(i = PERF_NUM_EVENTS - 1; i >= 0; i--)
+	{
+		if(mFds[i] >= 0)
+			::close(mFds[i]);
+		mFds[i] = -1;
+	}
+}
+
+int PerfCounters::read(unsigned long long *values)
+{
+	PerfGroupRead group;
+	int i = 0;
+
+	if(::read(mFds[0], &group, sizeof(group)) != (ssize_t)sizeof(group) || group.nr != PERF_NUM_EVENTS)
+		return -1;
+	for(i = 0; i < PERF_NUM_EVENTS; i++)
+	{
+		values[i] = group.values[i];
+		if(group.timeRunning > 0 && group.timeRunning < group.timeEnabled)
+			values[i] = (unsigned long long)((double)values[i]*group.timeEnabled/group.timeRunning);
+	}
+	return 0;
+}
+#else
+int PerfCounters::open()
+{
+	printf("PerfCounters::open error: Hardware counters need Linux perf_event_open.\n");
+	return -1;
+}
+
+void PerfCounters::close()
+{
+}
+
+int PerfCounters::read(unsigned long long *)
+{
+	return -1;
+}
+#endif
+
+void resetPerfProfile(PerfProfile *profile)
+{
+	int s = 0, e = 0;
+	for(s = 0; s < PERF_NUM_STAGES; s++)
+	{
+		for(e = 0; e < PERF_NUM_EVENTS; e++)
+			profile->counts[s][e].store(0);
+		profile->packets[s].store(0);
+		profile->samples[s].store(0);
+	}
+}
+
+void perfProfileAdd(PerfProfile *profile, int stage, const unsigned long long *before, const unsigned long long *after, unsigned int samples)
+{
+	std::atomic<unsigned long long> *counts = profile->counts[stage];
+	int e = 0;
+
+	for(e = 0; e < PERF_NUM_EVENTS; e++)
+	{
+		if(after[e] >= before[e])
+			counts[e].store(counts[e].load(std::memory_order_relaxed) + after[e] - before[e], std::memory_order_relaxed);
+	}
+	profile->packets[stage].store(profile->packets[stage].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	profile->samples[stage].store(profile->samples[stage].load(std::memory_order_relaxed) + samples, std::memory_order_relaxed);
+}
+
+void printPerfProfile(const PerfProfile *profile)
+{
+	unsigned long long packets = 0;
+	unsigned long long samples = 0;
+	unsigned long long count = 0;
+	int s = 0, e = 0;
+
+	if(profile->packets[PERF_STAGE_CONVERT].load() == 0 && profile->packets[PERF_STAGE_PUBLISH].load() == 0)
+		return;
+	printf("\nHardware counters (each stage on alternate packets):\n");
+	printf("  %-10s %-14s %16s %14s %12s\n", "stage", "event", "total", "per packet", "per sample");
+	for(s = 0; s < PERF_NUM_STAGES; s++)
+	{
+		packets = profile->packets[s].load();
+		samples = profile->samples[s].load();
+		if(packets == 0 || samples == 0)
+			continue;
+		printf("  %-10s %-14s %16llu %14s %12s\n", STAGE_NAMES[s], "packets", packets, "", "");
+		for(e = 0; e < PERF_NUM_EVENTS; e++)
+		{
+			count = profile->counts[s][e].load();
+			printf("  %-10s %-14s %16llu %14.1f %12.3f\n", STAGE_NAMES[s], EVENT_NAMES[e], count,
+			       (double)count/packets, (double)count/samples);
+		}
+		count = profile->counts[s][PERF_CYCLES].load();
+		if(count > 0)
+			printf("  %-10s %-14s %16s %14s %12.3f\n", STAGE_NAMES[s], "IPC", "", "",
+			       (double)profile->counts[s][PERF_INSTRUCTIONS].load()/count);
+	}
+}
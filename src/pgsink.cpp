@@ -0,0 +1,413 @@
+#include "pgsink.h"
+#include "latency.h"
+#include <lsl_cpp.h>
+#include <chrono>
+#include <exception>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef LSLPUB_POSTGRES
+#include <libpq-fe.h>
+#endif
+
+//Seconds from the Unix epoch to the PostgreSQL epoch, 2000-01-01.
+#define PG_EPOCH_UNIX_SEC 946684800LL
+
+//Start of the binary COPY data: signature, flags and header extension
+//length. The data ends with a field count of -1.
+static const unsigned char COPY_HEADER[19] = {'P', 'G', 'C', 'O', 'P', 'Y', '\n', 0xFF, '\r', '\n', 0,
+                                              0, 0, 0, 0, 0, 0, 0, 0};
+static const unsigned char COPY_TRAILER[2] = {0xFF, 0xFF};
+
+//Binary COPY values are in network byte order.
+static unsigned char *putU16(unsigned char *out, unsigned short value)
+{
+	out[0] = (unsigned char)(value >> 8);
+	out[1] = (unsigned char)value;
+	return out + 2;
+}
+
+static unsigned char *putU32(unsigned char *out, unsigned int value)
+{
+	out[0] = (unsigned char)(value >> 24);
+	out[1] = (unsigned char)(value >> 16);
+	out[2] = (unsigned char)(value >> 8);
+	out[3] = (unsigned char)value;
+	return out + 4;
+}
+
+static unsigned char *putU64(unsigned char *out, unsigned long long value)
+{
+	putU32(out, (unsigned int)(value >> 32));
+	return putU32(out + 4, (unsigned int)value);
+}
+
+PgSink::PgSink() : mRowBytes(0), mUnixOffsetUs(0), mArena(NULL), mOut(NULL), mConn(NULL), mNextReconnect(0), mFailing(0)
+{
+	mTable[0] = '\0';
+	mStats.rowsWritten.store(0);
+	mStats.batches.store(0);
+	mStats.copyNs.store(0);
+	mStats.lastBatchScans.store(0);
+	mStats.failedScans.store(0);
+	mStats.errors.store(0);
+	mStats.connected.store(0);
+	mStats.queue.queueDepth.store(0);
+	mStats.queue.maxQueueDepth.store(0);
+	mStats.queue.queueCapacity.store(0);
+	mStats.queue.droppedScans.store(0);
+}
+
+PgSink::~PgSink()
+{
+	close();
+}
+
+void PgSink::write(const float *scans, unsigned int numScans, unsigned long long firstScan, double lastScanTime)
+{
+	if(mArena != NULL)
+		appendScans(scans, numScans, firstScan, lastScanTime);
+}
+
+//One row per scan: time, scan_index, lsl_time, then the channels. Returns
+//the bytes written.
+unsigned int PgSink::encodeRows(const ScanChunkHeader *header, unsigned char *out) const
+{
+	const unsigned char *start = out;
+	const float *scan = (const float *)((const unsigned char *)header + sizeof(ScanChunkHeader));
+	unsigned long long bits = 0;
+	unsigned int value = 0;
+	double lslTime = 0;
+	unsigned int i = 0;
+	unsigned int j = 0;
+
+	for(i = 0; i < header->numScans; i++)
+	{
+		lslTime = header->firstTime + i/mScanRate;
+		out = putU16(out, (unsigned short)(3 + mNumAddresses));
+		out = putU32(out, 8);
+		out = putU64(out, (unsigned long long)(llround(lslTime*1e6) + mUnixOffsetUs));
+		out = putU32(out, 8);
+		out = putU64(out, header->firstScan + i);
+		memcpy(&bits, &lslTime, 8);
+		out = putU32(out, 8);
+		out = putU64(out, bits);
+		for(j = 0; j < mNumAddresses; j++, scan++)
+		{
+			memcpy(&value, scan, 4);
+			out = putU32(out, 4);
+			out = putU32(out, value);
+		}
+	}
+	return (unsigned int)(out - start);
+}
+
+#ifdef LSLPUB_POSTGRES
+//Letters, digits and underscores, with at most one dot before the table.
+static int isValidTable(const char *table)
+{
+	unsigned int dots = 0;
+	size_t i = 0;
+
+	if(table[0] == '\0' || table[0] == '.' || strlen(table) > PG_MAX_TABLE_LENGTH)
+		return 0;
+	for(i = 0; table[i] != '\0'; i++)
+	{
+		if(table[i] == '.' && table[i + 1] != '\0' && ++dots <= 1)
+			continue;
+		if(!((table[i] >= 'a' && table[i] <= 'z') || (table[i] >= 'A' && table[i] <= 'Z') ||
+		     (table[i] >= '0' && table[i] <= '9') || table[i] == '_'))
+			return 0;
+	}
+	return 1;
+}
+
+int PgSink::open(const char *conninfo, const char *table, float scanRate, unsigned int numAddresses, MemoryBudget *budget)
+{
+	unsigned long long arenaBytes = 0;
+	unsigned long long outBytes = 0;
+	char column[32];
+	unsigned int i = 0;
+
+	if(isOpen() || numAddresses == 0 || scanRate <= 0)
+	{
+		printf("PgSink::open error: Invalid stream configuration.\n");
+		return -1;
+	}
+	if(!isValidTable(table))
+	{
+		printf("PgSink::open error: Invalid table name %s. Needs letters, digits and underscores, with an optional schema.\n", table);
+		return -1;
+	}
+	strcpy(mTable, table);
+	mScanRate = scanRate;
+	mNumAddresses = numAddresses;
+	mChunkScans = (unsigned int)(PG_CHUNK_SEC*scanRate + 0.5);
+	if(mChunkScans == 0)
+		mChunkScans = 1;
+	mChunkBytes = (unsigned int)((sizeof(ScanChunkHeader) + (unsigned long long)mChunkScans*numAddresses*sizeof(float) + 63) & ~63ULL);
+	mNumChunks = (unsigned int)(PG_QUEUE_SEC/PG_CHUNK_SEC + 0.5);
+	if(mNumChunks < PG_MIN_CHUNKS)
+		mNumChunks = PG_MIN_CHUNKS;
+
+	//Chunk buffers, then the COPY data of one chunk: field count, then
+	//length and value of each field
+	mRowBytes = 2 + 3*(4 + 8) + numAddresses*(4 + 4);
+	outBytes = sizeof(COPY_HEADER) + (unsigned long long)mChunkScans*mRowBytes;
+	arenaBytes = (unsigned long long)mNumChunks*mChunkBytes + outBytes;
+	if(reserveSinkMemory(budget, "PostgreSQL sink", arenaBytes) != 0)
+		return -1;
+
+	try
+	{
+		mCopyCommand = std::string("COPY ") + mTable + " (time, scan_index, lsl_time";
+		for(i = 0; i < numAddresses; i++)
+		{
+			snprintf(column, sizeof(column), ", ch%u", i);
+			mCopyCommand += column;
+		}
+		mCopyCommand += ") FROM STDIN (FORMAT binary)";
+	}
+	catch(std::exception &)
+	{
+		return -1;
+	}
+
+	mConn = PQconnectdb(conninfo);
+	if(mConn == NULL || PQstatus(mConn) != CONNECTION_OK)
+	{
+		printf("PgSink::open error: Could not connect: %s", mConn ? PQerrorMessage(mConn) : "out of memory\n");
+		PQfinish(mConn);
+		mConn = NULL;
+		return -1;
+	}
+	if(createTable() != 0)
+	{
+		PQfinish(mConn);
+		mConn = NULL;
+		return -1;
+	}
+	mArena = (unsigned char *)allocAligned((size_t)arenaBytes);
+	if(mArena == NULL)
+	{
+		PQfinish(mConn);
+		mConn = NULL;
+		return -1;
+	}
+	mChunks = mArena;
+	mOut = mChunks + (size_t)mNumChunks*mChunkBytes;
+
+	mUnixOffsetUs = (long long)std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count() - PG_EPOCH_UNIX_SEC*1000000LL - llround(lsl::local_clock()*1e6);
+	mFailing = 0;
+	mStats.connected.store(1);
+	if(openQueue(&mStats.queue, "pg writer") != 0)
+	{
+		printf("PgSink::open error: Could not start the writer thread\n");
+		PQfinish(mConn);
+		mConn = NULL;
+		freeAligned(mArena);
+		mArena = NULL;
+		return -1;
+	}
+	printf("Writing scans to PostgreSQL table %s: %u scans per chunk, %u chunk buffers (%.1f MB)\n",
+	       mTable, mChunkScans, mNumChunks, arenaBytes/(1024.0*1024.0));
+	return 0;
+}
+
+//Creates the table if needed. With TimescaleDB the table becomes a
+//hypertable on time, a failure there only prints a warning.
+int PgSink::createTable()
+{
+	PGresult *res = NULL;
+	std::string command;
+	char column[32];
+	unsigned int i = 0;
+
+	try
+	{
+		command = std::string("CREATE TABLE IF NOT EXISTS ") + mTable +
+		          " (time timestamptz NOT NULL, scan_index bigint NOT NULL, lsl_time double precision NOT NULL";
+		for(i = 0; i < mNumAddresses; i++)
+		{
+			snprintf(column, sizeof(column), ", ch%u real", i);
+			command += column;
+		}
+		command += ")";
+	}
+	catch(std::exception &)
+	{
+		return -1;
+	}
+	res = PQexec(mConn, command.c_str());
+	if(PQresultStatus(res) != PGRES_COMMAND_OK)
+	{
+		printf("PgSink::open error: Could not create table %s: %s", mTable, PQerrorMessage(mConn));
+		PQclear(res);
+		return -1;
+	}
+	PQclear(res);
+
+	res = PQexec(mConn, "SELECT 1 FROM pg_extension WHERE extname = 'timescaledb'");
+	i = PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) > 0;
+	PQclear(res);
+	if(!i)
+		return 0;
+	try
+	{
+		command = std::string("SELECT create_hypertable('") + mTable + "', 'time', if_not_exists => TRUE, migrate_data => TRUE)";
+	}
+	catch(std::exception &)
+	{
+		return 0;
+	}
+	res = PQexec(mConn, command.c_str());
+	if(PQresultStatus(res) != PGRES_TUPLES_OK)
+		printf("PgSink::open warning: Could not make %s a hypertable: %s", mTable, PQerrorMessage(mConn));
+	PQclear(res);
+	return 0;
+}
+
+void PgSink::close()
+{
+	if(mArena == NULL)
+		return;
+	closeQueue();
+	printf("PostgreSQL: %llu scans written to %s in %llu COPY commands, %llu dropped, %llu failed\n",
+	       mStats.rowsWritten.load(), mTable, mStats.batches.load(), mStats.queue.droppedScans.load(), mStats.failedScans.load());
+	PQfinish(mConn);
+	mConn = NULL;
+	freeAligned(mArena);
+	mArena = NULL;
+	mChunks = NULL;
+	mOut = NULL;
+}
+
+//Sends numChunks queued chunks from chunk first with one COPY, a single
+//transaction. Returns -1 on error, 0 on success.
+int PgSink::copyBatch(unsigned long long first, unsigned int numChunks)
+{
+	PGresult *res = NULL;
+	unsigned int bytes = 0;
+	unsigned int i = 0;
+	int ret = 0;
+
+	res = PQexec(mConn, mCopyCommand.c_str());
+	if(PQresultStatus(res) != PGRES_COPY_IN)
+	{
+		if(!mFailing)
+			printf("PgSink error: Could not start the COPY: %s", PQerrorMessage(mConn));
+		PQclear(res);
+		return -1;
+	}
+	PQclear(res);
+
+	memcpy(mOut, COPY_HEADER, sizeof(COPY_HEADER));
+	bytes = sizeof(COPY_HEADER);
+	for(i = 0; i < numChunks && ret == 0; i++)
+	{
+		bytes += encodeRows((const ScanChunkHeader *)chunk(first + i), mOut + bytes);
+		if(PQputCopyData(mConn, (const char *)mOut, (int)bytes) != 1)
+			ret = -1;
+		bytes = 0;
+	}
+	if(ret == 0 && PQputCopyData(mConn, (const char *)COPY_TRAILER, sizeof(COPY_TRAILER)) != 1)
+		ret = -1;
+	if(PQputCopyEnd(mConn, ret == 0 ? NULL : "sink error") != 1)
+		ret = -1;
+	while((res = PQgetResult(mConn)) != NULL)
+	{
+		if(PQresultStatus(res) != PGRES_COMMAND_OK)
+			ret = -1;
+		PQclear(res);
+	}
+	if(ret != 0 && !mFailing)
+		printf("PgSink error: The COPY failed: %s", PQerrorMessage(mConn));
+	return ret;
+}
+
+//Sends up to PG_MAX_BATCH_CHUNKS queued chunks with one COPY.
+unsigned int PgSink::writeChunks(unsigned long long first, unsigned int count)
+{
+	unsigned long long scans = 0;
+	unsigned long long t0 = 0;
+	unsigned int i = 0;
+	double now = 0;
+
+	if(count > PG_MAX_BATCH_CHUNKS)
+		count = PG_MAX_BATCH_CHUNKS;
+	for(i = 0; i < count; i++)
+		scans += ((const ScanChunkHeader *)chunk(first + i))->numScans;
+
+	//The chunks wait in the queue while the server is unreachable, the
+	//stream thread drops scans once it is full
+	if(PQstatus(mConn) != CONNECTION_OK)
+	{
+		mStats.connected.store(0, std::memory_order_relaxed);
+		if(!running())
+		{
+			mStats.failedScans.store(mStats.failedScans.load(std::memory_order_relaxed) + scans, std::memory_order_relaxed);
+			return count;
+		}
+		now = lsl::local_clock();
+		if(now >= mNextReconnect)
+		{
+			mNextReconnect = now + PG_RECONNECT_SEC;
+			PQreset(mConn);
+			mStats.connected.store(PQstatus(mConn) == CONNECTION_OK, std::memory_order_relaxed);
+		}
+		return 0;
+	}
+
+	t0 = monotonicNs();
+	if(copyBatch(first, count) == 0)
+	{
+		mFailing = 0;
+		mStats.rowsWritten.store(mStats.rowsWritten.load(std::memory_order_relaxed) + scans, std::memory_order_relaxed);
+		mStats.batches.store(mStats.batches.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		mStats.lastBatchScans.store((unsigned int)scans, std::memory_order_relaxed);
+	}
+	else if(PQstatus(mConn) == CONNECTION_OK)
+	{
+		//Rejected by the server, sending it again would fail again
+		mFailing = 1;
+		mStats.errors.store(mStats.errors.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		mStats.failedScans.store(mStats.failedScans.load(std::memory_order_relaxed) + scans, std::memory_order_relaxed);
+	}
+	else
+	{
+		//Lost the connection, the chunks are sent again after a reconnection
+		mFailing = 1;
+		mStats.errors.store(mStats.errors.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		count = 0;
+	}
+	mStats.copyNs.store(mStats.copyNs.load(std::memory_order_relaxed) + (monotonicNs() - t0), std::memory_order_relaxed);
+	return count;
+}
+#else
+int PgSink::open(const char *, const char *, float, unsigned int, MemoryBudget *)
+{
+	printf("PgSink::open error: The PostgreSQL sink needs a build with -DLSLPUB_POSTGRES=ON.\n");
+	return -1;
+}
+
+void PgSink::close()
+{
+}
+
+int PgSink::createTable()
+{
+	return -1;
+}
+
+int PgSink::copyBatch(unsigned long long, unsigned int)
+{
+	return -1;
+}
+
+unsigned int PgSink::writeChunks(unsigned long long, unsigned int)
+{
+	return 0;
+}
+#endif
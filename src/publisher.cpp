@@ -0,0 +1,342 @@
+#include "publisher.h"
+#include "trace.h"
+#include <lsl_cpp.h>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+
+StreamPublisher::StreamPublisher() : mScanRate(0), mNumAddresses(0), mSamplesPerPacket(0), mNumSamples(0), mCarry(0), mOutlet(0), mDiagOutlet(0), mRecorder(0), mPgSink(0),
+	mPerfStage(PERF_STAGE_PUBLISH), mAddrIndex(0), mScanTotal(0), mNumScansSkipped(0), mVolts(0.0f)
+{
+	memset(&mDevCal, 0, sizeof(DeviceCalibration));
+	memset(mGainList, 0, sizeof(mGainList));
+	memset(mDiagSample, 0, sizeof(mDiagSample));
+	resetStageLatencies(&mLatencies);
+	resetStreamStats(&mStats);
+	resetPerfProfile(&mPerfProfile);
+}
+
+StreamPublisher::~StreamPublisher()
+{
+	mBlock.release();
+	delete mDiagOutlet;
+	delete mOutlet;
+}
+
+int StreamPublisher::init(const DeviceCalibration *devCal, float scanRate, unsigned int numAddresses, unsigned int samplesPerPacket, const unsigned int *gainList, const MemoryBudget *budget)
+{
+	if(scanRate <= 0 || numAddresses == 0 || numAddresses > MAX_NUM_STREAM_ADDR || samplesPerPacket > STREAM_MAX_SAMPLES_PER_PACKET_TCP)
+	{
+		printf("StreamPublisher::init error: Invalid stream configuration.\n");
+		return -1;
+	}
+	if(budget->packetBytes < STREAM_HEADER_BYTES + samplesPerPacket*STREAM_BYTES_PER_SAMPLE || budget->blockSamples < samplesPerPacket + numAddresses - 1)
+	{
+		printf("StreamPublisher::init error: The memory budget was planned for another stream configuration.\n");
+		return -1;
+	}
+
+	mDevCal = *devCal;
+	memcpy(mGainList, gainList, numAddresses*sizeof(unsigned int));
+	mScanRate = scanRate;
+	mNumAddresses = numAddresses;
+	mSamplesPerPacket = samplesPerPacket;
+
+	if(mPacketPool.init(budget->packetBytes, budget->numPackets) != 0 || mSamplePool.init(budget->blockBytes, budget->numBlocks) != 0)
+		return -1;
+
+	try
+	{
+		lsl::stream_info info("LabJack", "labJackSamples", numAddresses, lsl::IRREGULAR_RATE, lsl::cf_float32);
+		mOutlet = new lsl::stream_outlet(info, 0, budget->outletMaxBuffered);
+	}
+	catch(std::exception &e)
+	{
+		std::cerr << "[ERROR] Got an exception: " << e.what() << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
+int StreamPublisher::enableDiagnostics(MemoryBudget *budget)
+{
+	static const char *LABELS[DIAG_NUM_CHANNELS] = {"backlog", "status", "additionalInfo", "rxQueueBytes", "hostLatencyUs"};
+	static const char *UNITS[DIAG_NUM_CHANNELS] = {"scans", "", "", "bytes", "microseconds"};
+	int i = 0;
+
+	if(mOutlet == 0 || mDiagOutlet != 0)
+		return -1;
+	if(reserveSinkMemory(budget, "Diagnostics outlet",
+	                     DIAG_MAX_BUFFERED*100ULL*(DIAG_NUM_CHANNELS*sizeof(float) + BUDGET_LSL_SAMPLE_OVERHEAD)) != 0)
+		return -1;
+	try
+	{
+		lsl::stream_info info("LabJackDiagnostics", "Diagnostics", DIAG_NUM_CHANNELS, lsl::IRREGULAR_RATE, lsl::cf_float32);
+		lsl::xml_element channels = info.desc().append_child("channels");
+		for(i = 0; i < DIAG_NUM_CHANNELS; i++)
+			channels.append_child("channel").append_child_value("label", LABELS[i]).append_child_value("unit", UNITS[i]);
+		mDiagOutlet = new lsl::stream_outlet(info, 0, DIAG_MAX_BUFFERED);
+	}
+	catch(std::exception &e)
+	{
+		std::cerr << "[ERROR] Got an exception: " << e.what() << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
+void StreamPublisher::publishDiagnostics(int rxQueueBytes, unsigned long long hostLatencyNs)
+{
+	if(mDiagOutlet == 0)
+		return;
+	mDiagSample[DIAG_BACKLOG] = (float)mStats.backlog.load(std::memory_order_relaxed);
+	mDiagSample[DIAG_STATUS] = (float)mStats.status.load(std::memory_order_relaxed);
+	mDiagSample[DIAG_ADDITIONAL_INFO] = (float)mStats.additionalInfo.load(std::memory_order_relaxed);
+	mDiagSample[DIAG_RX_QUEUE] = (float)rxQueueBytes;
+	mDiagSample[DIAG_HOST_LATENCY] = hostLatencyNs/1000.0f;
+	mDiagOutlet->push_sample(mDiagSample);
+}
+
+int StreamPublisher::enableBlackBox(const char *path, float scanRate, double minutes, double syncSec)
+{
+	if(mOutlet == 0 || mBlackBox.isOpen())
+		return -1;
+	return mBlackBox.open(path, scanRate, mNumAddresses, minutes, syncSec);
+}
+
+int StreamPublisher::enableXdf(const char *path, float scanRate, MemoryBudget *budget)
+{
+	std::string xml;
+	size_t start = 0;
+	size_t end = 0;
+	char rate[32];
+
+	if(mOutlet == 0 || mXdf.isOpen())
+		return -1;
+	try
+	{
+		xml = mOutlet->info().as_xml();
+		start = xml.find("<nominal_srate>");
+		end = xml.find("</nominal_srate>");
+		if(start != std::string::npos && end != std::string::npos && end > start)
+		{
+			snprintf(rate, sizeof(rate), "%.6f", scanRate);
+			start += strlen("<nominal_srate>");
+			xml.replace(start, end - start, rate);
+		}
+	}
+	catch(std::exception &e)
+	{
+		std::cerr << "[ERROR] Got an exception: " << e.what() << std::endl;
+		return -1;
+	}
+	return mXdf.open(path, xml, scanRate, mNumAddresses, budget);
+}
+
+int StreamPublisher::enableArrow(const char *path, float scanRate, MemoryBudget *budget)
+{
+	if(mOutlet == 0 || mArrow.isOpen())
+		return -1;
+	return mArrow.open(path, scanRate, mNumAddresses, budget);
+}
+
+int StreamPublisher::enablePerfCounters()
+{
+	return mPerf.open();
+}
+
+BlockHandle StreamPublisher::acquirePacket()
+{
+	return mPacketPool.acquire();
+}
+
+//The counters are read around the whole publish on one packet and around
+//the conversion on the next, so no read lands inside a counted region.
+int StreamPublisher::publishPacket(const BlockHandle &packet, unsigned short backlog, unsigned short status, unsigned short additionalInfo)
+{
+	unsigned long long perfStart[PERF_NUM_EVENTS] = {0};
+	unsigned long long perfEnd[PERF_NUM_EVENTS] = {0};
+	int ret = 0;
+
+	if(!mPerf.isOpen() || mPerfStage != PERF_STAGE_PUBLISH)
+		return publish(packet, backlog, status, additionalInfo);
+	mPerf.read(perfStart);
+	ret = publish(packet, backlog, status, additionalInfo);
+	mPerf.read(perfEnd);
+	perfProfileAdd(&mPerfProfile, PERF_STAGE_PUBLISH, perfStart, perfEnd, mSamplesPerPacket);
+	mPerfStage = PERF_STAGE_CONVERT;
+	return ret;
+}
+
+int StreamPublisher::publish(const BlockHandle &packet, unsigned short backlog, unsigned short status, unsigned short additionalInfo)
+{
+	const unsigned char *rawData = &packet.data()[STREAM_HEADER_BYTES];
+	BlockHandle block;
+	float *samples = NULL;
+	unsigned int j = 0;
+	unsigned long long firstScan = 0;
+	unsigned int numScans = 0;
+	double lastScanTime = 0;
+	int ret = 0;
+	unsigned long long t0 = 0, t1 = 0, t2 = 0, t3 = 0, t4 = 0;
+	const bool perf = mPerf.isOpen() && mPerfStage == PERF_STAGE_CONVERT;
+	unsigned long long perfConvertStart[PERF_NUM_EVENTS] = {0};
+	unsigned long long perfConvertEnd[PERF_NUM_EVENTS] = {0};
+
+	backlog = backlog / (mNumAddresses*STREAM_BYTES_PER_SAMPLE); //Scan backlog
+	statsAdd(mStats.packets, 1);
+	statsAdd(mStats.bytes, packet.length());
+	mStats.backlog.store(backlog, std::memory_order_relaxed);
+	mStats.status.store(status, std::memory_order_relaxed);
+	mStats.additionalInfo.store(additionalInfo, std::memory_order_relaxed);
+
+	//Check status
+	if(status == STREAM_STATUS_SCAN_OVERLAP)
+	{
+		//Stream scan overlap occured. This usually indicates the scan rate
+		//is too fast for the stream configuration.
+		//Stopping the stream.
+		statsAdd(mStats.scanOverlap, 1);
+		return 1;
+	}
+	else if(status == STREAM_STATUS_AUTO_RECOVER_END_OVERFLOW)
+	{
+		//During auto recovery the skipped samples counter (16-bit) overflowed.
+		//Stopping the stream because of unknown amount of skipped samples.
+		statsAdd(mStats.autoRecoverEndOverflow, 1);
+		return 1;
+	}
+	else if(status == STREAM_STATUS_AUTO_RECOVER_ACTIVE)
+	{
+		//Stream buffer overload occured. In auto recovery mode. Continue
+		//reading existing samples from the T7's stream buffer which is still valid.
+		statsAdd(mStats.autoRecoverActive, 1);
+		traceInstant(TRACE_AUTO_RECOVER, monotonicNs());
+	}
+	else if(status == STREAM_STATUS_AUTO_RECOVER_END)
+	{
+		//Auto recover mode has ended. The number of skipped scans are reported
+		//and new samples are coming in.
+		mNumScansSkipped += (double)additionalInfo; //# skipped scans
+		statsAdd(mStats.autoRecoverEnd, 1);
+		statsAdd(mStats.scansSkipped, additionalInfo);
+		traceInstant(TRACE_AUTO_RECOVER, monotonicNs());
+	}
+	else if(status == STREAM_STATUS_BURST_COMPLETE)
+	{
+		//Stream burst has completed. Status used when numScans
+		//(Address 4020 - STREAM_NUM_SCANS) is configured to a non-zero value.
+		statsAdd(mStats.burstComplete, 1);
+		ret = 1;
+	}
+	else if(status != 0)
+	{
+		statsAdd(mStats.otherStatus, 1);
+	}
+
+	//Start a new block with the partial scan left by the previous packet
+	t0 = monotonicNs();
+	block = mSamplePool.acquire();
+	if(!block.valid())
+	{
+		statsAdd(mStats.poolExhausted, 1);
+		return -1;
+	}
+	samples = (float *)block.data();
+	if(mCarry > 0)
+		memcpy(samples, &((const float *)mBlock.data())[mNumSamples - mCarry], mCarry*sizeof(float));
+	mNumSamples = mCarry;
+	t1 = monotonicNs();
+	if(perf)
+		mPerf.read(perfConvertStart);
+
+	//Convert to voltage
+	firstScan = (unsigned long long)mScanTotal;
+	for(j = 0; j < mSamplesPerPacket; j++)
+	{
+		if(rawData[j*STREAM_BYTES_PER_SAMPLE] == 0xFF && rawData[j*STREAM_BYTES_PER_SAMPLE+1] == 0xFF)
+		{
+			//Dummy value to indicate where the missing scan/samples would be.
+			//numAddresses samples will	be 0xFFFF, and then new data.
+			//Incomplete scans shouldn't happen.
+			statsAdd(mStats.dummySamples, 1);
+			if(mAddrIndex != 0)
+				statsAdd(mStats.midScanDummies, 1);
+			continue;
+		}
+		ainBinToVolts(&mDevCal, &rawData[j*STREAM_BYTES_PER_SAMPLE], mGainList[mAddrIndex], &mVolts);
+		samples[mNumSamples++] = mVolts;
+
+		//The current scan's address index.
+		mAddrIndex++;
+		if(mAddrIndex >= mNumAddresses)
+		{
+			mAddrIndex = 0;
+			mScanTotal++;
+		}
+	}
+
+	//Send the complete scans, keep the partial one for the next packet
+	if(perf)
+		mPerf.read(perfConvertEnd);
+	t2 = monotonicNs();
+	mCarry = mNumSamples % mNumAddresses;
+	block.setLength(mNumSamples*sizeof(float));
+	mBlock = block;
+
+	//The sinks share the time of the last scan and back-date the others at
+	//the nominal rate. The outlet does not: it is irregular, and LSL stamps
+	//every scan of the pushed chunk with the push time, so its consumers see
+	//up to one packet later times than the sinks. The sinks all index the
+	//scans from firstScan, the scan in progress when the packet started.
+	numScans = (mNumSamples - mCarry)/mNumAddresses;
+	if(mRecorder || mXdf.isOpen() || mArrow.isOpen() || mPgSink)
+		lastScanTime = lsl::local_clock();
+	if(mRecorder)
+		mRecorder->write(rawData, mSamplesPerPacket, firstScan, lastScanTime - ((double)numScans - 1.0)/mScanRate);
+	if(numScans > 0)
+	{
+		statsAdd(mStats.scans, numScans);
+		statsSetLastScan(&mStats, &samples[mNumSamples - mCarry - mNumAddresses], mNumAddresses, (unsigned long long)mScanTotal);
+		if(mBlackBox.isOpen())
+			mBlackBox.write(samples, numScans);
+		if(mXdf.isOpen())
+			mXdf.write(samples, numScans, firstScan, lastScanTime);
+		if(mArrow.isOpen())
+			mArrow.write(samples, numScans, firstScan, lastScanTime);
+		if(mPgSink)
+			mPgSink->write(samples, numScans, firstScan, lastScanTime);
+	}
+	statsAdd(mStats.samples, mNumSamples - mCarry);
+	t3 = monotonicNs();
+	if(mNumSamples > mCarry)
+		mOutlet->push_chunk_multiplexed(samples, mNumSamples - mCarry);
+
+	t4 = monotonicNs();
+
+	latencyRecord(&mLatencies.stages[LATENCY_CONVERT], t2 - t1);
+	statsAdd(mLatencies.convertedSamples, mSamplesPerPacket);
+	latencyRecord(&mLatencies.stages[LATENCY_ASSEMBLE], (t1 - t0) + (t3 - t2));
+	latencyRecord(&mLatencies.stages[LATENCY_PUSH], t4 - t3);
+	traceSpan(TRACE_ASSEMBLE, t0, t1);
+	traceSpan(TRACE_CONVERT, t1, t2);
+	traceSpan(TRACE_ASSEMBLE, t2, t3);
+	traceSpan(TRACE_PUSH, t3, t4);
+	if(perf)
+	{
+		perfProfileAdd(&mPerfProfile, PERF_STAGE_CONVERT, perfConvertStart, perfConvertEnd, mSamplesPerPacket);
+		mPerfStage = PERF_STAGE_PUBLISH;
+	}
+	return ret;
+}
+
+bool StreamPublisher::haveConsumers() const
+{
+	return mOutlet != 0 && mOutlet->have_consumers();
+}
+
+double StreamPublisher::scanTotal() const
+{
+	//Add uncounted samples to scan total
+	return mScanTotal + (mNumAddresses ? (double)mAddrIndex/(double)mNumAddresses : 0.0);
+}
@@ -0,0 +1,235 @@
+#include "rawtee.h"
+#include "trace.h"
+#include <exception>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+RawTee::RawTee() : mSock(INVALID_SOCKET), mFd(-1), mBytesWritten(0), mBytesDropped(0), mTeed(0), mGapHead(0), mGapTail(0),
+                   mLostGaps(0), mGapFile(NULL)
+{
+	mReadPipe[0] = mReadPipe[1] = -1;
+	mFilePipe[0] = mFilePipe[1] = -1;
+	mGapPath[0] = '\0';
+	mGap.offset = mGap.bytes = 0;
+}
+
+RawTee::~RawTee()
+{
+	close();
+}
+
+#ifdef __linux__
+static void closeFd(int *fd)
+{
+	if(*fd >= 0)
+		::close(*fd);
+	*fd = -1;
+}
+
+int RawTee::open(TCP_SOCKET sock, const char *path)
+{
+	if(isOpen())
+		return -1;
+	if(pipe(mReadPipe) != 0 || pipe(mFilePipe) != 0)
+	{
+		printf("RawTee::open error: Could not create the pipes (%s)\n", strerror(errno));
+		close();
+		return -1;
+	}
+	if(fcntl(mFilePipe[1], F_SETPIPE_SZ, RAWTEE_PIPE_BYTES) < 0)
+		printf("RawTee::open warning: Could not grow the file pipe to %d bytes, using %d.\n",
+		       RAWTEE_PIPE_BYTES, fcntl(mFilePipe[1], F_GETPIPE_SZ));
+	mFd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(mFd < 0)
+	{
+		printf("RawTee::open error: Could not create %s (%s)\n", path, strerror(errno));
+		close();
+		return -1;
+	}
+	snprintf(mGapPath, sizeof(mGapPath), "%s.gaps", path);
+	mSock = sock;
+	mBytesWritten.store(0);
+	mBytesDropped.store(0);
+	mTeed = 0;
+	mGap.offset = mGap.bytes = 0;
+	mGapHead.store(0);
+	mGapTail.store(0);
+	mLostGaps.store(0);
+	try
+	{
+		mThread = std::thread(&RawTee::run, this);
+	}
+	catch(std::exception &)
+	{
+		printf("RawTee::open error: Could not start the writer thread\n");
+		close();
+		return -1;
+	}
+	return 0;
+}
+
+int RawTee::read(unsigned char *packet, int size)
+{
+	int done = 0;
+	ssize_t moved = 0;
+	ssize_t copied = 0;
+	ssize_t ret = 0;
+
+	while(done < size)
+	{
+		//Socket to the read pipe, blocking with the socket timeout
+		moved = splice(mSock, NULL, mReadPipe[1], NULL, size - done, SPLICE_F_MOVE);
+		if(moved <= 0)
+			return done > 0 ? done : (int)moved;
+
+		//Duplicate the pipe pages for the writer, never waiting for it. tee
+		//copies the first bytes, the rest are a gap of the copy.
+		copied = tee(mReadPipe[0], mFilePipe[1], moved, SPLICE_F_NONBLOCK);
+		if(copied < 0)
+			copied = 0;
+		if(copied > 0)
+		{
+			queueGap();
+			mTeed += copied;
+		}
+		if(copied < moved)
+		{
+			if(mGap.bytes == 0)
+				mGap.offset = mTeed;
+			mGap.bytes += moved - copied;
+			mBytesDropped.store(mBytesDropped.load(std::memory_order_relaxed) + (moved - copied), std::memory_order_relaxed);
+		}
+
+		//The stream loop's own copy
+		while(moved > 0)
+		{
+			ret = ::read(mReadPipe[0], &packet[done], moved);
+			if(ret <= 0)
+			{
+				if(ret < 0 && errno == EINTR)
+					continue;
+				return done > 0 ? done : (int)ret;
+			}
+			done += (int)ret;
+			moved -= ret;
+		}
+	}
+	return done;
+}
+
+void RawTee::close()
+{
+	//The writer thread ends when the file pipe is empty and closed
+	if(mThread.joinable())
+		queueGap();
+	closeFd(&mFilePipe[1]);
+	if(mThread.joinable())
+		mThread.join();
+	closeFd(&mFilePipe[0]);
+	closeFd(&mReadPipe[0]);
+	closeFd(&mReadPipe[1]);
+	closeFd(&mFd);
+	mSock = INVALID_SOCKET;
+}
+
+//Queues the gap being extended for the writer thread.
+void RawTee::queueGap()
+{
+	unsigned int head = mGapHead.load(std::memory_order_relaxed);
+
+	if(mGap.bytes == 0)
+		return;
+	if(head - mGapTail.load(std::memory_order_acquire) >= RAWTEE_GAP_SLOTS)
+		mLostGaps.store(mLostGaps.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	else
+	{
+		mGaps[head % RAWTEE_GAP_SLOTS] = mGap;
+		mGapHead.store(head + 1, std::memory_order_release);
+	}
+	mGap.offset = mGap.bytes = 0;
+}
+
+//Appends the queued gaps to the gap file.
+void RawTee::writeGaps()
+{
+	unsigned int tail = mGapTail.load(std::memory_order_relaxed);
+	const RawTeeGap *gap = NULL;
+
+	while(tail != mGapHead.load(std::memory_order_acquire))
+	{
+		gap = &mGaps[tail % RAWTEE_GAP_SLOTS];
+		if(mGapFile == NULL)
+		{
+			mGapFile = fopen(mGapPath, "w");
+			if(mGapFile == NULL)
+				printf("RawTee::writeGaps error: Could not create %s (%s)\n", mGapPath, strerror(errno));
+		}
+		if(mGapFile != NULL)
+			fprintf(mGapFile, "%llu %llu\n", gap->offset, gap->bytes);
+		tail++;
+		mGapTail.store(tail, std::memory_order_release);
+	}
+}
+
+void RawTee::run()
+{
+	ssize_t ret = 0;
+
+	traceSetThreadName("raw tee");
+	while(1)
+	{
+		ret = splice(mFilePipe[0], NULL, mFd, NULL, RAWTEE_PIPE_BYTES, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if(ret == 0)
+			break;
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			//The pipe fills up and the stream loop drops the rest of the copy
+			printf("RawTee::run error: Could not write the copy (%s)\n", strerror(errno));
+			break;
+		}
+		mBytesWritten.store(mBytesWritten.load(std::memory_order_relaxed) + ret, std::memory_order_relaxed);
+		writeGaps();
+	}
+	writeGaps();
+	if(mLostGaps.load() > 0)
+		printf("RawTee::run warning: %llu gaps are missing from %s\n", mLostGaps.load(), mGapPath);
+	if(mGapFile != NULL)
+		fclose(mGapFile);
+	mGapFile = NULL;
+}
+#else
+int RawTee::open(TCP_SOCKET, const char *)
+{
+	printf("RawTee::open error: The raw tee needs Linux splice and tee.\n");
+	return -1;
+}
+
+int RawTee::read(unsigned char *, int)
+{
+	return -1;
+}
+
+void RawTee::close()
+{
+}
+
+void RawTee::queueGap()
+{
+}
+
+void RawTee::writeGaps()
+{
+}
+
+void RawTee::run()
+{
+}
+#endif
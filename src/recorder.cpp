@@ -0,0 +1,478 @@
+#include "recorder.h"
+#include "latency.h"
+#include "summary.h"
+#include "trace.h"
+#include <exception>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//Seconds between two attempts to open a segment after a failure.
+#define RECORDER_RETRY_SEC 1.0
+
+static const char *SYNC_NAMES[] = {"none", "segment", "chunk"};
+
+int recorderSyncPolicy(const char *name)
+{
+	int i = 0;
+	for(i = 0; i < (int)(sizeof(SYNC_NAMES)/sizeof(SYNC_NAMES[0])); i++)
+	{
+		if(strcmp(name, SYNC_NAMES[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+const char *recorderSyncPolicyName(int policy)
+{
+	if(policy < 0 || policy >= (int)(sizeof(SYNC_NAMES)/sizeof(SYNC_NAMES[0])))
+		return "unknown";
+	return SYNC_NAMES[policy];
+}
+
+static unsigned int alignUp(unsigned long long size)
+{
+	return (unsigned int)((size + RECORDER_ALIGN - 1) & ~(unsigned long long)(RECORDER_ALIGN - 1));
+}
+
+Recorder::Recorder() : mChunkSec(0), mSegmentChunks(0), mSyncPolicy(RECORDER_SYNC_SEGMENT), mCodec(CODEC_RAW), mArena(NULL),
+	mHeader(NULL), mIndex(NULL), mEncoded(NULL), mScanIndex(0), mChunkSamples(0), mDropSamples(0), mFd(-1), mOffset(0), mDirect(false),
+	mNextSegment(0), mNextOpenNs(0), mStopped(0), mSummary(NULL)
+{
+	mPrefix[0] = '\0';
+	memset(&mInfo, 0, sizeof(RecordingInfo));
+	mStats.bytesWritten.store(0);
+	mStats.chunksWritten.store(0);
+	mStats.rawBytes.store(0);
+	mStats.encodedBytes.store(0);
+	mStats.writeNs.store(0);
+	mStats.segment.store(0);
+	mStats.writeErrors.store(0);
+	mStats.queue.queueDepth.store(0);
+	mStats.queue.maxQueueDepth.store(0);
+	mStats.queue.queueCapacity.store(0);
+	mStats.queue.droppedScans.store(0);
+}
+
+Recorder::~Recorder()
+{
+	close();
+}
+
+void Recorder::write(const unsigned char *rawData, unsigned int numSamples, unsigned long long firstScan, double firstScanTime)
+{
+	const unsigned int numAddresses = mInfo.numAddresses;
+	const unsigned int capacity = mChunkScans*numAddresses;
+	unsigned char *payload = NULL;
+	RecorderChunkHeader *header = NULL;
+	unsigned int j = 0;
+
+	if(mArena == NULL)
+		return;
+	mScanIndex = firstScan;
+	if(mChunkSamples > 0)
+		payload = fillChunk() + sizeof(RecorderChunkHeader); //The chunk being filled, never NULL
+	for(j = 0; j < numSamples; j++, rawData += STREAM_BYTES_PER_SAMPLE)
+	{
+		if(rawData[0] == 0xFF && rawData[1] == 0xFF)
+			continue; //Dummy sample, as in StreamPublisher::publishPacket
+
+		if(mChunkSamples == 0 && mDropSamples == 0)
+		{
+			//A chunk starts on a scan boundary, if the writer freed its buffer
+			header = (RecorderChunkHeader *)fillChunk();
+			if(header == NULL)
+			{
+				mDropSamples = 1;
+				if(mDropSamples == numAddresses)
+				{
+					mDropSamples = 0;
+					mScanIndex++;
+					dropScans(1);
+				}
+				continue;
+			}
+			header->magic = RECORDER_CHUNK_MAGIC;
+			header->codec = CODEC_RAW;
+			header->firstScan = mScanIndex;
+			header->lslTime = firstScanTime + (double)(mScanIndex - firstScan)/mInfo.scanRate;
+			payload = (unsigned char *)header + sizeof(RecorderChunkHeader);
+		}
+		else if(mDropSamples > 0)
+		{
+			//Rest of a dropped scan
+			if(++mDropSamples == numAddresses)
+			{
+				mDropSamples = 0;
+				mScanIndex++;
+				dropScans(1);
+			}
+			continue;
+		}
+
+		memcpy(&payload[mChunkSamples*STREAM_BYTES_PER_SAMPLE], rawData, STREAM_BYTES_PER_SAMPLE);
+		if(++mChunkSamples % numAddresses == 0)
+			mScanIndex++;
+		if(mChunkSamples == capacity)
+			queueChunk();
+	}
+}
+
+//Queues the complete scans of the current chunk.
+void Recorder::queueChunk()
+{
+	RecorderChunkHeader *header = (RecorderChunkHeader *)fillChunk();
+
+	header->numScans = mChunkSamples/mInfo.numAddresses;
+	header->payloadBytes = header->numScans*mInfo.numAddresses*STREAM_BYTES_PER_SAMPLE;
+	mChunkSamples = 0;
+	submit();
+}
+
+#ifndef WIN32
+int Recorder::open(const char *prefix, const RecordingInfo *info, double chunkSec, double segmentSec, int syncPolicy, int codec, int summaries, MemoryBudget *budget)
+{
+	unsigned long long arenaBytes = 0;
+	unsigned int indexBytes = 0;
+	unsigned int encodedBytes = 0;
+
+	if(isOpen() || info->numAddresses == 0 || info->numAddresses > MAX_NUM_STREAM_ADDR || info->scanRate <= 0 ||
+	   chunkSec <= 0 || segmentSec <= 0 || syncPolicy < RECORDER_SYNC_NONE || syncPolicy > RECORDER_SYNC_CHUNK ||
+	   (codec != CODEC_RAW && codec != CODEC_DELTA))
+	{
+		printf("Recorder::open error: Invalid recording configuration.\n");
+		return -1;
+	}
+	if(sizeof(RecorderSegmentHeader) > RECORDER_ALIGN)
+		return -1;
+	strncpy(mPrefix, prefix, sizeof(mPrefix) - 1);
+	mPrefix[sizeof(mPrefix) - 1] = '\0';
+	mInfo = *info;
+	mChunkSec = chunkSec;
+	mChunkScans = (unsigned int)(chunkSec*info->scanRate + 0.5);
+	if(mChunkScans == 0)
+		mChunkScans = 1;
+	mChunkBytes = alignUp(sizeof(RecorderChunkHeader) + (unsigned long long)mChunkScans*info->numAddresses*STREAM_BYTES_PER_SAMPLE);
+	mSegmentChunks = (unsigned int)(segmentSec/chunkSec + 0.5);
+	if(mSegmentChunks == 0)
+		mSegmentChunks = 1;
+	mSyncPolicy = syncPolicy;
+	mCodec = codec;
+	mNumChunks = (unsigned int)(RECORDER_QUEUE_SEC/chunkSec + 0.5);
+	if(mNumChunks < RECORDER_MIN_CHUNKS)
+		mNumChunks = RECORDER_MIN_CHUNKS;
+
+	//Chunk buffers, the segment header, the chunk index and the encoded
+	//chunk, aligned for O_DIRECT
+	indexBytes = alignUp((unsigned long long)mSegmentChunks*sizeof(RecorderIndexEntry));
+	if(mCodec != CODEC_RAW)
+		encodedBytes = alignUp(sizeof(RecorderChunkHeader) + (unsigned long long)codecMaxEncodedBytes(mChunkScans, info->numAddresses));
+	arenaBytes = (unsigned long long)mNumChunks*mChunkBytes + 2*RECORDER_ALIGN + indexBytes + encodedBytes;
+	if(reserveSinkMemory(budget, "Recorder", arenaBytes) != 0)
+		return -1;
+	mArena = (unsigned char *)allocAligned((size_t)arenaBytes);
+	if(mArena == NULL)
+		return -1;
+	mChunks = (unsigned char *)(((size_t)mArena + RECORDER_ALIGN - 1) & ~(size_t)(RECORDER_ALIGN - 1));
+	mHeader = (RecorderSegmentHeader *)(mChunks + (size_t)mNumChunks*mChunkBytes);
+	mIndex = (RecorderIndexEntry *)((unsigned char *)mHeader + RECORDER_ALIGN);
+	mEncoded = mCodec != CODEC_RAW ? (unsigned char *)mIndex + indexBytes : NULL;
+
+	mScanIndex = 0;
+	mChunkSamples = 0;
+	mDropSamples = 0;
+	if(summaries)
+	{
+		try
+		{
+			mSummary = new SummaryPyramid();
+		}
+		catch(std::exception &)
+		{
+			mSummary = NULL;
+		}
+		if(mSummary == NULL || mSummary->open(mPrefix, &mInfo, budget) != 0)
+		{
+			delete mSummary;
+			mSummary = NULL;
+			freeAligned(mArena);
+			mArena = NULL;
+			return -1;
+		}
+	}
+	mNextSegment = 0;
+	mNextOpenNs = 0;
+	mStopped = 0;
+	if(openSegment(0) != 0)
+	{
+		delete mSummary;
+		mSummary = NULL;
+		freeAligned(mArena);
+		mArena = NULL;
+		return -1;
+	}
+
+	if(openQueue(&mStats.queue, "recorder") != 0)
+	{
+		printf("Recorder::open error: Could not start the writer thread\n");
+		closeSegment();
+		delete mSummary;
+		mSummary = NULL;
+		freeAligned(mArena);
+		mArena = NULL;
+		return -1;
+	}
+	printf("Recording to %s_*%s: %u scans per chunk, %u chunks per segment, %u chunk buffers (%.1f MB), sync %s, codec %s%s%s\n",
+	       mPrefix, RECORDER_SUFFIX, mChunkScans, mSegmentChunks, mNumChunks, arenaBytes/(1024.0*1024.0),
+	       SYNC_NAMES[mSyncPolicy], codecName(mCodec), mSummary ? ", summaries" : "", mDirect ? "" : ", without O_DIRECT");
+	return 0;
+}
+
+void Recorder::close()
+{
+	if(mArena == NULL)
+		return;
+	if(mChunkSamples >= mInfo.numAddresses)
+		queueChunk();
+	closeQueue();
+	delete mSummary; //Writes the running bins
+	mSummary = NULL;
+	freeAligned(mArena);
+	mArena = NULL;
+	mChunks = NULL;
+	mHeader = NULL;
+	mIndex = NULL;
+	mEncoded = NULL;
+}
+
+int Recorder::writeAt(const unsigned char *data, unsigned int size, unsigned long long offset)
+{
+	ssize_t ret = 0;
+	unsigned int done = 0;
+
+	while(done < size)
+	{
+		ret = pwrite(mFd, data + done, size - done, (off_t)(offset + done));
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+		{
+			if(mStats.writeErrors.load(std::memory_order_relaxed) == 0)
+				printf("Recorder error: Could not write segment %u (%s)\n", mHeader->segment, ret < 0 ? strerror(errno) : "no space");
+			mStats.writeErrors.store(mStats.writeErrors.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			return -1;
+		}
+		done += (unsigned int)ret;
+	}
+	return 0;
+}
+
+static int syncData(int fd)
+{
+#ifdef __linux__
+	return fdatasync(fd);
+#else
+	return fsync(fd);
+#endif
+}
+
+int Recorder::openSegment(unsigned int segment)
+{
+	char path[sizeof(mPrefix) + 32];
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+	snprintf(path, sizeof(path), "%s_%06u%s", mPrefix, segment, RECORDER_SUFFIX);
+#ifdef O_DIRECT
+	mFd = ::open(path, flags | O_DIRECT, 0644);
+	mDirect = mFd >= 0;
+	if(mFd < 0 && errno == EINVAL)
+		mFd = ::open(path, flags, 0644); //The file system does not support O_DIRECT
+#else
+	mFd = ::open(path, flags, 0644);
+#ifdef F_NOCACHE
+	mDirect = mFd >= 0 && fcntl(mFd, F_NOCACHE, 1) == 0;
+#endif
+#endif
+	if(mFd < 0)
+	{
+		if(!mStopped)
+			printf("Recorder error: Could not create %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+
+	memset(mHeader, 0, RECORDER_ALIGN);
+	memcpy(mHeader->magic, RECORDER_MAGIC, RECORDER_MAGIC_BYTES);
+	mHeader->version = RECORDER_VERSION;
+	mHeader->byteOrderMark = RECORDER_BYTE_ORDER_MARK;
+	mHeader->headerBytes = sizeof(RecorderSegmentHeader);
+	mHeader->segment = segment;
+	mHeader->chunkSec = mChunkSec;
+	mHeader->chunkScans = mChunkScans;
+	mHeader->info = mInfo;
+	mStats.segment.store(segment, std::memory_order_relaxed);
+
+	//The header is written again with the counts when the segment closes
+	mOffset = 0;
+	if(writeAt((const unsigned char *)mHeader, RECORDER_ALIGN, 0) != 0)
+	{
+		::close(mFd);
+		mFd = -1;
+		return -1;
+	}
+	mOffset = RECORDER_ALIGN;
+	return 0;
+}
+
+//Opens mNextSegment after a failure, at most every RECORDER_RETRY_SEC, so a
+//full disk or a transient error does not end the recording.
+void Recorder::openNextSegment()
+{
+	unsigned long long now = monotonicNs();
+
+	if(now < mNextOpenNs)
+		return;
+	mNextOpenNs = now + (unsigned long long)(RECORDER_RETRY_SEC*1e9);
+	if(openSegment(mNextSegment) == 0)
+	{
+		if(mStopped)
+			printf("Recorder: Recording resumed in segment %u\n", mNextSegment);
+		mStopped = 0;
+	}
+	else if(!mStopped)
+	{
+		printf("Recorder error: Recording stopped, opening segment %u again every %.0f s\n", mNextSegment, RECORDER_RETRY_SEC);
+		mStopped = 1;
+	}
+}
+
+int Recorder::closeSegment()
+{
+	unsigned int indexBytes = 0;
+	unsigned int size = 0;
+	int ret = 0;
+
+	if(mFd < 0)
+		return 0;
+
+	//Index after the last chunk, then the header that locates it
+	indexBytes = mHeader->numChunks*sizeof(RecorderIndexEntry);
+	size = alignUp(indexBytes);
+	memset((unsigned char *)mIndex + indexBytes, 0, size - indexBytes);
+	if(size > 0 && writeAt((const unsigned char *)mIndex, size, mOffset) == 0)
+	{
+		mHeader->indexOffset = mOffset;
+		mHeader->indexEntries = mHeader->numChunks;
+		mOffset += size;
+	}
+	else if(size > 0)
+		ret = -1;
+	if(mSummary != NULL && mSummary->flush() != 0)
+		ret = -1;
+	if(writeAt((const unsigned char *)mHeader, RECORDER_ALIGN, 0) != 0)
+		ret = -1;
+	if(mSyncPolicy != RECORDER_SYNC_NONE && syncData(mFd) != 0)
+		ret = -1;
+#ifdef POSIX_FADV_DONTNEED
+	if(!mDirect)
+		posix_fadvise(mFd, 0, 0, POSIX_FADV_DONTNEED); //Only written pages, keep them out of the cache
+#endif
+	::close(mFd);
+	mFd = -1;
+	return ret;
+}
+
+//Writes the first chunk to the current segment, or to a new one when it is
+//full.
+unsigned int Recorder::writeChunks(unsigned long long first, unsigned int)
+{
+	unsigned long long t0 = monotonicNs();
+	RecorderChunkHeader *header = NULL;
+	const unsigned char *rawData = NULL;
+	unsigned int rawBytes = 0;
+	unsigned int encodedBytes = 0;
+	unsigned int size = 0;
+
+	if(mFd >= 0 && mHeader->numChunks >= mSegmentChunks)
+	{
+		closeSegment();
+		mNextSegment = mHeader->segment + 1;
+		mNextOpenNs = 0;
+	}
+	if(mFd < 0)
+		openNextSegment();
+	header = (RecorderChunkHeader *)chunk(first);
+	rawData = (const unsigned char *)header + sizeof(RecorderChunkHeader);
+	rawBytes = header->payloadBytes;
+	if(mEncoded != NULL)
+	{
+		//Keep the raw chunk if it does not get smaller, noise can not be compressed
+		encodedBytes = encodeSamples(rawData, header->numScans,
+		                             mInfo.numAddresses, mEncoded + sizeof(RecorderChunkHeader));
+		if(encodedBytes < rawBytes)
+		{
+			memcpy(mEncoded, header, sizeof(RecorderChunkHeader));
+			header = (RecorderChunkHeader *)mEncoded;
+			header->codec = mCodec;
+			header->payloadBytes = encodedBytes;
+		}
+	}
+	size = alignUp(sizeof(RecorderChunkHeader) + header->payloadBytes);
+	memset((unsigned char *)header + sizeof(RecorderChunkHeader) + header->payloadBytes, 0,
+	       size - sizeof(RecorderChunkHeader) - header->payloadBytes);
+	if(mFd >= 0 && writeAt((const unsigned char *)header, size, mOffset) == 0)
+	{
+		if(mHeader->numChunks == 0)
+			mHeader->firstScan = header->firstScan;
+		mIndex[mHeader->numChunks].firstScan = header->firstScan;
+		mIndex[mHeader->numChunks].lslTime = header->lslTime;
+		mIndex[mHeader->numChunks].offset = mOffset;
+		mIndex[mHeader->numChunks].numScans = header->numScans;
+		mIndex[mHeader->numChunks].payloadBytes = header->payloadBytes;
+		mHeader->numChunks++;
+		if(mSummary != NULL)
+			mSummary->add(rawData, header->firstScan, header->lslTime, header->numScans);
+		mHeader->numScans += header->numScans;
+		mOffset += size;
+		if(mSyncPolicy == RECORDER_SYNC_CHUNK)
+			syncData(mFd);
+		mStats.bytesWritten.store(mStats.bytesWritten.load(std::memory_order_relaxed) + size, std::memory_order_relaxed);
+		mStats.chunksWritten.store(mStats.chunksWritten.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		mStats.rawBytes.store(mStats.rawBytes.load(std::memory_order_relaxed) + rawBytes, std::memory_order_relaxed);
+		mStats.encodedBytes.store(mStats.encodedBytes.load(std::memory_order_relaxed) + header->payloadBytes, std::memory_order_relaxed);
+	}
+	else if(mFd < 0)
+		mStats.writeErrors.store(mStats.writeErrors.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); //No segment open
+	mStats.writeNs.store(mStats.writeNs.load(std::memory_order_relaxed) + (monotonicNs() - t0), std::memory_order_relaxed);
+	traceSpan(TRACE_RECORD, t0, monotonicNs());
+	return 1;
+}
+
+void Recorder::finish()
+{
+	closeSegment();
+}
+#else
+int Recorder::open(const char *prefix, const RecordingInfo *info, double chunkSec, double segmentSec, int syncPolicy, int codec, int summaries, MemoryBudget *budget)
+{
+	printf("Recorder::open error: The recorder needs pwrite and O_DIRECT.\n");
+	return -1;
+}
+
+void Recorder::close()
+{
+}
+
+unsigned int Recorder::writeChunks(unsigned long long, unsigned int)
+{
+	return 0;
+}
+
+void Recorder::finish()
+{
+}
+#endif
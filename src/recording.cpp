@@ -0,0 +1,576 @@
+#include "recording.h"
+#include "codec.h"
+#include "modbus.h"
+#include <exception>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static unsigned long long alignUp(unsigned long long size)
+{
+	return (size + RECORDER_ALIGN - 1) & ~(unsigned long long)(RECORDER_ALIGN - 1);
+}
+
+RecordingSegment::RecordingSegment() : mData(NULL), mBytes(0), mHeader(NULL), mIndex(NULL), mNumChunks(0)
+{
+}
+
+RecordingSegment::~RecordingSegment()
+{
+	close();
+}
+
+int RecordingSegment::findScan(unsigned long long scanIndex) const
+{
+	unsigned int low = 0;
+	unsigned int high = mNumChunks;
+	unsigned int mid = 0;
+
+	if(mNumChunks == 0)
+		return -1;
+	//First chunk starting after the scan, the one before holds it
+	while(low < high)
+	{
+		mid = low + (high - low)/2;
+		if(mIndex[mid].firstScan <= scanIndex)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low > 0 ? (int)low - 1 : 0;
+}
+
+int RecordingSegment::findTime(double lslTime) const
+{
+	unsigned int low = 0;
+	unsigned int high = mNumChunks;
+	unsigned int mid = 0;
+
+	if(mNumChunks == 0)
+		return -1;
+	while(low < high)
+	{
+		mid = low + (high - low)/2;
+		if(mIndex[mid].lslTime <= lslTime)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low > 0 ? (int)low - 1 : 0;
+}
+
+int RecordingSegment::readChunk(unsigned int n, unsigned char *rawData) const
+{
+	const RecorderIndexEntry *index = NULL;
+	const RecorderChunkHeader *header = NULL;
+	const unsigned int numAddresses = mHeader->info.numAddresses;
+
+	if(n >= mNumChunks)
+		return -1;
+	index = &mIndex[n];
+	header = (const RecorderChunkHeader *)(mData + index->offset);
+	if(header->magic != RECORDER_CHUNK_MAGIC || header->numScans != index->numScans || header->payloadBytes != index->payloadBytes)
+		return -1;
+	if(header->codec == CODEC_RAW)
+	{
+		if(header->payloadBytes != (unsigned long long)header->numScans*numAddresses*STREAM_BYTES_PER_SAMPLE)
+			return -1;
+		memcpy(rawData, (const unsigned char *)header + sizeof(RecorderChunkHeader), header->payloadBytes);
+		return 0;
+	}
+	if(header->codec == CODEC_DELTA)
+		return decodeSamples((const unsigned char *)header + sizeof(RecorderChunkHeader), header->payloadBytes, header->numScans, numAddresses, rawData);
+	return -1;
+}
+
+//Returns true if a chunk header and its payload are inside the mapping.
+bool RecordingSegment::chunkInMapping(unsigned long long offset, unsigned long long payloadBytes) const
+{
+	return offset >= RECORDER_ALIGN && offset <= mBytes && sizeof(RecorderChunkHeader) <= mBytes - offset &&
+	       payloadBytes <= mBytes - offset - sizeof(RecorderChunkHeader);
+}
+
+//Checks the index read from the segment footer. Returns -1 if an entry
+//points outside the mapping, 0 otherwise.
+int RecordingSegment::checkIndex() const
+{
+	unsigned int n = 0;
+
+	for(n = 0; n < mNumChunks; n++)
+	{
+		if(!chunkInMapping(mIndex[n].offset, mIndex[n].payloadBytes))
+			return -1;
+	}
+	return 0;
+}
+
+//Parses "all" or a comma separated list of scan list positions. Returns the
+//number of channels, -1 if the list is invalid.
+static int parseChannels(const char *channels, unsigned int numAddresses, unsigned int *selected)
+{
+	const char *s = channels;
+	char *end = NULL;
+	unsigned long value = 0;
+	unsigned int count = 0;
+
+	if(strcmp(channels, "all") == 0)
+	{
+		for(count = 0; count < numAddresses; count++)
+			selected[count] = count;
+		return (int)count;
+	}
+	while(*s != '\0')
+	{
+		value = strtoul(s, &end, 10);
+		if(end == s || value >= numAddresses || count >= MAX_NUM_STREAM_ADDR)
+			return -1;
+		selected[count++] = (unsigned int)value;
+		s = end;
+		if(*s == ',')
+			s++;
+		else if(*s != '\0')
+			return -1;
+	}
+	return count > 0 ? (int)count : -1;
+}
+
+#ifndef WIN32
+int RecordingSegment::open(const char *path)
+{
+	struct stat st;
+	int fd = -1;
+	void *data = NULL;
+
+	if(isOpen())
+		return -1;
+	fd = ::open(path, O_RDONLY);
+	if(fd < 0)
+	{
+		printf("RecordingSegment::open error: Could not open %s\n", path);
+		return -1;
+	}
+	if(fstat(fd, &st) != 0 || st.st_size < RECORDER_ALIGN)
+	{
+		printf("RecordingSegment::open error: %s is not a recorder segment\n", path);
+		::close(fd);
+		return -1;
+	}
+	data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(data == MAP_FAILED)
+	{
+		printf("RecordingSegment::open error: Could not map %s\n", path);
+		return -1;
+	}
+	mData = (unsigned char *)data;
+	mBytes = (size_t)st.st_size;
+	mHeader = (const RecorderSegmentHeader *)mData;
+	if(memcmp(mHeader->magic, RECORDER_MAGIC, RECORDER_MAGIC_BYTES) != 0)
+	{
+		printf("RecordingSegment::open error: %s is not a recorder segment\n", path);
+		close();
+		return -1;
+	}
+	if(mHeader->version != RECORDER_VERSION || mHeader->byteOrderMark != RECORDER_BYTE_ORDER_MARK ||
+	   mHeader->headerBytes != sizeof(RecorderSegmentHeader) || mHeader->info.numAddresses == 0 ||
+	   mHeader->info.numAddresses > MAX_NUM_STREAM_ADDR || mHeader->info.scanRate <= 0)
+	{
+		printf("RecordingSegment::open error: %s was written by another version or kind of host\n", path);
+		close();
+		return -1;
+	}
+
+	if(mHeader->indexOffset >= RECORDER_ALIGN && mHeader->indexOffset <= mBytes &&
+	   (unsigned long long)mHeader->indexEntries*sizeof(RecorderIndexEntry) <= mBytes - mHeader->indexOffset)
+	{
+		mIndex = (const RecorderIndexEntry *)(mData + mHeader->indexOffset);
+		mNumChunks = mHeader->indexEntries;
+		if(checkIndex() != 0)
+		{
+			printf("RecordingSegment::open warning: The chunk index of %s points outside the file, walking its chunks\n", path);
+			mIndex = NULL;
+			mNumChunks = 0;
+		}
+	}
+	if(mIndex == NULL && rebuildIndex() != 0)
+	{
+		printf("RecordingSegment::open error: Could not index %s\n", path);
+		close();
+		return -1;
+	}
+	return 0;
+}
+
+int RecordingSegment::rebuildIndex()
+{
+	const RecorderChunkHeader *header = NULL;
+	RecorderIndexEntry entry;
+	unsigned long long offset = RECORDER_ALIGN;
+
+	//Chunks follow each other up to the end of what was written
+	mRebuilt.clear();
+	while(offset + sizeof(RecorderChunkHeader) <= mBytes)
+	{
+		header = (const RecorderChunkHeader *)(mData + offset);
+		if(header->magic != RECORDER_CHUNK_MAGIC || !chunkInMapping(offset, header->payloadBytes))
+			break;
+		entry.firstScan = header->firstScan;
+		entry.lslTime = header->lslTime;
+		entry.offset = offset;
+		entry.numScans = header->numScans;
+		entry.payloadBytes = header->payloadBytes;
+		try
+		{
+			mRebuilt.push_back(entry);
+		}
+		catch(std::exception &)
+		{
+			return -1;
+		}
+		offset += alignUp(sizeof(RecorderChunkHeader) + header->payloadBytes);
+	}
+	mIndex = mRebuilt.empty() ? NULL : &mRebuilt[0];
+	mNumChunks = (unsigned int)mRebuilt.size();
+	return 0;
+}
+
+void RecordingSegment::close()
+{
+	if(mData != NULL)
+		munmap(mData, mBytes);
+	mData = NULL;
+	mBytes = 0;
+	mHeader = NULL;
+	mIndex = NULL;
+	mNumChunks = 0;
+	mRebuilt.clear();
+}
+
+int extractRecording(const char *path, double fromTime, double toTime, const char *channels, int format, const char *outPath)
+{
+	RecordingSegment segment;
+	const RecordingInfo *info = NULL;
+	const RecorderIndexEntry *entry = NULL;
+	char segmentPath[1024];
+	unsigned int selected[MAX_NUM_STREAM_ADDR];
+	unsigned char scan[MAX_NUM_STREAM_ADDR*STREAM_BYTES_PER_SAMPLE];
+	std::vector<unsigned char> rawData;
+	const unsigned char *sample = NULL;
+	FILE *out = NULL;
+	const size_t pathLength = strlen(path);
+	const size_t suffixLength = strlen(RECORDER_SUFFIX);
+	const bool single = pathLength > suffixLength && strcmp(path + pathLength - suffixLength, RECORDER_SUFFIX) == 0;
+	unsigned long long scans = 0;
+	unsigned int chunksRead = 0;
+	unsigned int numAddresses = 0;
+	unsigned int seg = 0;
+	unsigned int n = 0;
+	unsigned int i = 0;
+	unsigned int j = 0;
+	double firstTime = 0;
+	double lastTime = 0;
+	double time = 0;
+	float volts = 0;
+	int numSelected = 0;
+	int ret = 0;
+	bool done = false;
+
+	for(seg = 0; !done && ret == 0; seg++)
+	{
+		if(single)
+		{
+			if(seg > 0)
+				break;
+			snprintf(segmentPath, sizeof(segmentPath), "%s", path);
+		}
+		else
+		{
+			snprintf(segmentPath, sizeof(segmentPath), "%s_%06u%s", path, seg, RECORDER_SUFFIX);
+			if(seg > 0 && access(segmentPath, F_OK) != 0)
+				break; //Last segment
+		}
+		if(segment.open(segmentPath) != 0)
+		{
+			ret = -1;
+			break;
+		}
+		info = &segment.header()->info;
+		if(out == NULL)
+		{
+			numAddresses = info->numAddresses;
+			numSelected = parseChannels(channels, numAddresses, selected);
+			if(numSelected < 0)
+			{
+				printf("extractRecording error: Invalid channels %s for %u channels\n", channels, numAddresses);
+				ret = -1;
+				break;
+			}
+			out = fopen(outPath, format == RECORDING_FORMAT_RAW ? "wb" : "w");
+			if(out == NULL)
+			{
+				printf("extractRecording error: Could not create %s\n", outPath);
+				ret = -1;
+				break;
+			}
+		}
+		else if(info->numAddresses != numAddresses)
+		{
+			printf("extractRecording error: %s belongs to another recording\n", segmentPath);
+			ret = -1;
+			break;
+		}
+		if(segment.numChunks() == 0)
+		{
+			segment.close();
+			continue;
+		}
+
+		//Skip the segment from its index if the range is not in it
+		entry = segment.entry(0);
+		if(firstTime == 0)
+			firstTime = entry->lslTime;
+		entry = segment.entry(segment.numChunks() - 1);
+		lastTime = entry->lslTime + (entry->numScans - 1)/info->scanRate;
+		if(toTime > 0 && segment.entry(0)->lslTime > toTime)
+			done = true;
+		for(n = (unsigned int)segment.findTime(fromTime); !done && lastTime >= fromTime && n < segment.numChunks(); n++)
+		{
+			entry = segment.entry(n);
+			if(toTime > 0 && entry->lslTime > toTime)
+			{
+				done = true;
+				break;
+			}
+			try
+			{
+				rawData.resize((size_t)entry->numScans*numAddresses*STREAM_BYTES_PER_SAMPLE);
+			}
+			catch(std::exception &)
+			{
+				ret = -1;
+				break;
+			}
+			if(segment.readChunk(n, rawData.empty() ? NULL : &rawData[0]) != 0)
+			{
+				printf("extractRecording error: Chunk %u of %s is invalid\n", n, segmentPath);
+				ret = -1;
+				break;
+			}
+			chunksRead++;
+
+			//Scan times from the chunk's first scan at the nominal scan rate
+			for(i = 0; i < entry->numScans; i++)
+			{
+				time = entry->lslTime + i/info->scanRate;
+				if(time < fromTime)
+					continue;
+				if(toTime > 0 && time > toTime)
+				{
+					done = true;
+					break;
+				}
+				sample = &rawData[(size_t)i*numAddresses*STREAM_BYTES_PER_SAMPLE];
+				if(format == RECORDING_FORMAT_RAW)
+				{
+					for(j = 0; j < (unsigned int)numSelected; j++)
+						memcpy(&scan[j*STREAM_BYTES_PER_SAMPLE], &sample[selected[j]*STREAM_BYTES_PER_SAMPLE], STREAM_BYTES_PER_SAMPLE);
+					fwrite(scan, STREAM_BYTES_PER_SAMPLE, numSelected, out);
+				}
+				else
+				{
+					fprintf(out, "%llu,%.6f", entry->firstScan + i, time);
+					for(j = 0; j < (unsigned int)numSelected; j++)
+					{
+						ainBinToVolts(&info->devCal, &sample[selected[j]*STREAM_BYTES_PER_SAMPLE], info->gainList[selected[j]], &volts);
+						fprintf(out, ",%.6f", volts);
+					}
+					fprintf(out, "\n");
+				}
+				scans++;
+			}
+		}
+		segment.close();
+	}
+
+	if(out != NULL)
+	{
+		if(fclose(out) != 0)
+		{
+			printf("extractRecording error: Could not write %s\n", outPath);
+			ret = -1;
+		}
+	}
+	if(ret == 0)
+	{
+		printf("Extracted %llu scans of %d channels from %u chunks to %s\n", scans, numSelected, chunksRead, outPath);
+		if(scans == 0)
+			printf("The recording spans LSL times %.6f to %.6f\n", firstTime, lastTime);
+	}
+	return ret;
+}
+
+//Converts a fractional code, such as a summary mean, by interpolating the
+//calibrated volts of the codes around it.
+static void meanCodeToVolts(const DeviceCalibration *devCal, float mean, unsigned int gainIndex, float *volts)
+{
+	unsigned char code[STREAM_BYTES_PER_SAMPLE];
+	unsigned short low = (unsigned short)mean;
+	float fraction = mean - low;
+	float high = 0;
+
+	uint16ToBytes(low, code);
+	ainBinToVolts(devCal, code, gainIndex, volts);
+	if(fraction > 0 && low < 0xFFFF)
+	{
+		uint16ToBytes(low + 1, code);
+		ainBinToVolts(devCal, code, gainIndex, &high);
+		*volts += fraction*(high - *volts);
+	}
+}
+
+int extractSummary(const char *path, unsigned int decimation, double fromTime, double toTime, const char *channels, const char *outPath)
+{
+	const SummaryFileHeader *header = NULL;
+	const SummaryRecord *record = NULL;
+	const SummaryValue *value = NULL;
+	char summaryPath[1024];
+	unsigned int selected[MAX_NUM_STREAM_ADDR];
+	unsigned char code[STREAM_BYTES_PER_SAMPLE];
+	unsigned char *data = NULL;
+	struct stat st;
+	FILE *out = NULL;
+	const size_t pathLength = strlen(path);
+	const size_t suffixLength = strlen(SUMMARY_SUFFIX);
+	unsigned long long numRecords = 0;
+	unsigned long long low = 0;
+	unsigned long long high = 0;
+	unsigned long long mid = 0;
+	unsigned long long bins = 0;
+	unsigned int j = 0;
+	float volts = 0;
+	int numSelected = 0;
+	int fd = -1;
+	int ret = 0;
+
+	if(pathLength > suffixLength && strcmp(path + pathLength - suffixLength, SUMMARY_SUFFIX) == 0)
+		snprintf(summaryPath, sizeof(summaryPath), "%s", path);
+	else
+		snprintf(summaryPath, sizeof(summaryPath), "%s_x%u%s", path, decimation, SUMMARY_SUFFIX);
+	fd = ::open(summaryPath, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(SummaryFileHeader))
+	{
+		printf("extractSummary error: Could not open %s\n", summaryPath);
+		if(fd >= 0)
+			::close(fd);
+		return -1;
+	}
+	data = (unsigned char *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(data == (unsigned char *)MAP_FAILED)
+	{
+		printf("extractSummary error: Could not map %s\n", summaryPath);
+		return -1;
+	}
+	header = (const SummaryFileHeader *)data;
+	if(memcmp(header->magic, SUMMARY_MAGIC, SUMMARY_MAGIC_BYTES) != 0 || header->version != SUMMARY_VERSION ||
+	   header->byteOrderMark != SUMMARY_BYTE_ORDER_MARK || header->headerBytes != sizeof(SummaryFileHeader) ||
+	   header->info.numAddresses == 0 || header->info.numAddresses > MAX_NUM_STREAM_ADDR || header->info.scanRate <= 0 ||
+	   header->recordBytes != sizeof(SummaryRecord) + header->info.numAddresses*sizeof(SummaryValue))
+	{
+		printf("extractSummary error: %s is not a summary of this version or kind of host\n", summaryPath);
+		munmap(data, (size_t)st.st_size);
+		return -1;
+	}
+	numSelected = parseChannels(channels, header->info.numAddresses, selected);
+	if(numSelected < 0)
+	{
+		printf("extractSummary error: Invalid channels %s for %u channels\n", channels, header->info.numAddresses);
+		munmap(data, (size_t)st.st_size);
+		return -1;
+	}
+	out = fopen(outPath, "w");
+	if(out == NULL)
+	{
+		printf("extractSummary error: Could not create %s\n", outPath);
+		munmap(data, (size_t)st.st_size);
+		return -1;
+	}
+
+	//Fixed-size records in time order: first bin ending after fromTime
+	numRecords = ((unsigned long long)st.st_size - sizeof(SummaryFileHeader))/header->recordBytes;
+	high = numRecords;
+	while(low < high)
+	{
+		mid = low + (high - low)/2;
+		record = (const SummaryRecord *)(data + sizeof(SummaryFileHeader) + mid*header->recordBytes);
+		if(record->lslTime + header->decimation/header->info.scanRate <= fromTime)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	for(; low < numRecords; low++)
+	{
+		record = (const SummaryRecord *)(data + sizeof(SummaryFileHeader) + low*header->recordBytes);
+		if(toTime > 0 && record->lslTime > toTime)
+			break;
+		value = (const SummaryValue *)(record + 1);
+		fprintf(out, "%llu,%.6f,%u", record->firstScan, record->lslTime, record->numScans);
+		for(j = 0; j < (unsigned int)numSelected; j++)
+		{
+			uint16ToBytes(value[selected[j]].min, code);
+			ainBinToVolts(&header->info.devCal, code, header->info.gainList[selected[j]], &volts);
+			fprintf(out, ",%.6f", volts);
+			uint16ToBytes(value[selected[j]].max, code);
+			ainBinToVolts(&header->info.devCal, code, header->info.gainList[selected[j]], &volts);
+			fprintf(out, ",%.6f", volts);
+			meanCodeToVolts(&header->info.devCal, value[selected[j]].mean, header->info.gainList[selected[j]], &volts);
+			fprintf(out, ",%.6f", volts);
+		}
+		fprintf(out, "\n");
+		bins++;
+	}
+	if(fclose(out) != 0)
+	{
+		printf("extractSummary error: Could not write %s\n", outPath);
+		ret = -1;
+	}
+	else
+		printf("Extracted %llu of %llu bins of %u scans, %d channels, to %s\n", bins, numRecords, header->decimation, numSelected, outPath);
+	munmap(data, (size_t)st.st_size);
+	return ret;
+}
+#else
+int RecordingSegment::open(const char *path)
+{
+	printf("RecordingSegment::open error: Reading a recording needs mmap.\n");
+	return -1;
+}
+
+int RecordingSegment::rebuildIndex()
+{
+	return -1;
+}
+
+void RecordingSegment::close()
+{
+}
+
+int extractRecording(const char *path, double fromTime, double toTime, const char *channels, int format, const char *outPath)
+{
+	printf("extractRecording error: Reading a recording needs mmap.\n");
+	return -1;
+}
+
+int extractSummary(const char *path, unsigned int decimation, double fromTime, double toTime, const char *channels, const char *outPath)
+{
+	printf("extractSummary error: Reading a summary needs mmap.\n");
+	return -1;
+}
+#endif
@@ -0,0 +1,102 @@
+#include "startup.h"
+#include "latency.h"
+#include "modbus.h"
+#include "stats.h"
+#include <stdio.h>
+#include <string.h>
+
+void startupBegin(StartupProfile *profile)
+{
+	profile->numPhases = 0;
+	profile->startNs = monotonicNs();
+	profile->markNs = profile->startNs;
+	profile->markRoundTrips = getModbusRoundTrips();
+	profile->failed = 0;
+	profile->complete.store(0);
+}
+
+static void addPhase(StartupProfile *profile, const char *name, int excluded)
+{
+	unsigned long long now = monotonicNs();
+	unsigned int roundTrips = getModbusRoundTrips();
+	StartupPhase *phase = NULL;
+
+	if(profile->complete.load(std::memory_order_relaxed) || profile->numPhases >= STARTUP_MAX_PHASES)
+		return;
+	phase = &profile->phases[profile->numPhases];
+	phase->name = name;
+	phase->durationNs = now - profile->markNs;
+	phase->roundTrips = roundTrips - profile->markRoundTrips;
+	phase->excluded = excluded;
+	profile->numPhases++;
+	profile->markNs = now;
+	profile->markRoundTrips = roundTrips;
+}
+
+void startupPhase(StartupProfile *profile, const char *name)
+{
+	addPhase(profile, name, 0);
+}
+
+void startupWait(StartupProfile *profile, const char *name)
+{
+	addPhase(profile, name, 1);
+}
+
+void startupEnd(StartupProfile *profile, const char *name)
+{
+	addPhase(profile, name, 0);
+	profile->complete.store(1, std::memory_order_release);
+}
+
+int startupFail(StartupProfile *profile, const char *name)
+{
+	if(profile->complete.load(std::memory_order_acquire))
+		return 0;
+	addPhase(profile, name, 0);
+	profile->failed = 1;
+	profile->complete.store(1, std::memory_order_release);
+	return 1;
+}
+
+void printStartupProfile(const StartupProfile *profile, int format)
+{
+	const StartupPhase *phase = NULL;
+	unsigned long long totalNs = 0;
+	unsigned int totalRoundTrips = 0;
+	int i = 0;
+
+	for(i = 0; i < profile->numPhases; i++)
+	{
+		phase = &profile->phases[i];
+		if(!phase->excluded)
+			totalNs += phase->durationNs;
+		totalRoundTrips += phase->roundTrips;
+	}
+
+	if(format == STATS_FORMAT_JSON)
+	{
+		printf("{\"startup\":{\"failed\":%s,\"time_to_first_sample_ms\":%.3f,\"modbus_round_trips\":%u,\"phases\":[",
+		       profile->failed ? "true" : "false", totalNs/1000000.0, totalRoundTrips);
+		for(i = 0; i < profile->numPhases; i++)
+		{
+			phase = &profile->phases[i];
+			printf("%s{\"name\":\"%s\",\"ms\":%.3f,\"modbus_round_trips\":%u,\"excluded\":%s}", i ? "," : "",
+			       phase->name, phase->durationNs/1000000.0, phase->roundTrips, phase->excluded ? "true" : "false");
+		}
+		printf("]}}\n");
+		return;
+	}
+
+	if(profile->failed)
+		printf("\nStartup profile: failed after %.3f ms, before the first sample, %u Modbus round trips\n", totalNs/1000000.0, totalRoundTrips);
+	else
+		printf("\nStartup profile: %.3f ms to the first sample, %u Modbus round trips\n", totalNs/1000000.0, totalRoundTrips);
+	printf("  %-28s %12s %12s\n", "phase", "ms", "round trips");
+	for(i = 0; i < profile->numPhases; i++)
+	{
+		phase = &profile->phases[i];
+		printf("  %-28s %12.3f %12u%s\n", phase->name, phase->durationNs/1000000.0, phase->roundTrips,
+		       phase->excluded ? " (not counted)" : "");
+	}
+}
@@ -0,0 +1,483 @@
+#include "stats.h"
+#include "trace.h"
+#include <chrono>
+#include <exception>
+#include <stdio.h>
+#include <string.h>
+
+void resetStreamStats(StreamStats *stats)
+{
+	unsigned int i = 0;
+
+	stats->packets.store(0);
+	stats->bytes.store(0);
+	stats->scans.store(0);
+	stats->samples.store(0);
+	stats->dummySamples.store(0);
+	stats->midScanDummies.store(0);
+	stats->backlog.store(0);
+	stats->status.store(0);
+	stats->additionalInfo.store(0);
+	stats->autoRecoverActive.store(0);
+	stats->autoRecoverEnd.store(0);
+	stats->scansSkipped.store(0);
+	stats->scanOverlap.store(0);
+	stats->autoRecoverEndOverflow.store(0);
+	stats->burstComplete.store(0);
+	stats->otherStatus.store(0);
+	stats->readErrors.store(0);
+	stats->packetErrors.store(0);
+	stats->transactionIdGaps.store(0);
+	stats->poolExhausted.store(0);
+	stats->scanSeq.store(0);
+	stats->lastScanIndex.store(0);
+	stats->numAddresses.store(0);
+	for(i = 0; i < MAX_NUM_STREAM_ADDR; i++)
+		stats->lastScan[i].store(0.0f);
+	for(i = 0; i < STATS_NUM_SOCKETS; i++)
+	{
+		stats->sockets[i].rxQueueBytes.store(-1);
+		stats->sockets[i].rttUs.store(-1);
+		stats->sockets[i].rttVarUs.store(-1);
+		stats->sockets[i].totalRetrans.store(-1);
+		stats->sockets[i].lost.store(-1);
+		stats->sockets[i].rcvSpace.store(-1);
+	}
+	stats->errorHead.store(0);
+	stats->errorTail.store(0);
+	stats->droppedErrors.store(0);
+}
+
+void statsSetLastScan(StreamStats *stats, const float *scan, unsigned int numAddresses, unsigned long long scanIndex)
+{
+	unsigned int seq = stats->scanSeq.load(std::memory_order_relaxed);
+	unsigned int i = 0;
+
+	stats->scanSeq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	for(i = 0; i < numAddresses; i++)
+		stats->lastScan[i].store(scan[i], std::memory_order_relaxed);
+	stats->numAddresses.store(numAddresses, std::memory_order_relaxed);
+	stats->lastScanIndex.store(scanIndex, std::memory_order_relaxed);
+	stats->scanSeq.store(seq + 2, std::memory_order_release);
+}
+
+//Copies the last complete scan. Returns its number of samples.
+static unsigned int readLastScan(const StreamStats *stats, float *scan, unsigned long long *scanIndex)
+{
+	unsigned int seq = 0;
+	unsigned int n = 0;
+	unsigned int i = 0;
+
+	do
+	{
+		seq = stats->scanSeq.load(std::memory_order_acquire);
+		if(seq & 1)
+			continue;
+		n = stats->numAddresses.load(std::memory_order_relaxed);
+		for(i = 0; i < n && i < MAX_NUM_STREAM_ADDR; i++)
+			scan[i] = stats->lastScan[i].load(std::memory_order_relaxed);
+		*scanIndex = stats->lastScanIndex.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+	} while((seq & 1) || seq != stats->scanSeq.load(std::memory_order_relaxed));
+	return n;
+}
+
+void statsRecordError(StreamStats *stats, int error, const unsigned char *packet, int size)
+{
+	unsigned int head = stats->errorHead.load(std::memory_order_relaxed);
+	StreamErrorRecord *rec = NULL;
+
+	if(head - stats->errorTail.load(std::memory_order_acquire) >= STATS_ERROR_SLOTS)
+	{
+		statsAdd(stats->droppedErrors, 1);
+		return;
+	}
+	rec = &stats->errors[head % STATS_ERROR_SLOTS];
+	rec->error = error;
+	rec->size = size;
+	if(size > TCP_MAX_PACKET_BYTES)
+		size = TCP_MAX_PACKET_BYTES;
+	if(size > 0)
+		memcpy(rec->packet, packet, size);
+	stats->errorHead.store(head + 1, std::memory_order_release);
+}
+
+void statsSampleSocket(StreamStats *stats, int index, TCP_SOCKET sock)
+{
+	SocketStats *s = &stats->sockets[index];
+	TCPSocketInfo info;
+
+	getTCPSocketInfo(sock, &info);
+	s->rxQueueBytes.store(info.rxQueueBytes, std::memory_order_relaxed);
+	s->rttUs.store(info.rttUs, std::memory_order_relaxed);
+	s->rttVarUs.store(info.rttVarUs, std::memory_order_relaxed);
+	s->totalRetrans.store(info.totalRetrans, std::memory_order_relaxed);
+	s->lost.store(info.lost, std::memory_order_relaxed);
+	s->rcvSpace.store(info.rcvSpace, std::memory_order_relaxed);
+}
+
+static const char *SOCKET_NAMES[STATS_NUM_SOCKETS] = {"command", "stream"};
+
+static double nowSec()
+{
+	return monotonicNs()/1000000000.0;
+}
+
+//Prints the counters of a sink that only reports its chunk queue.
+static void printQueue(const char *name, const ChunkQueueStats *queue, int format)
+{
+	if(format == STATS_FORMAT_JSON)
+		printf("\"%s\":{\"queue_depth\":%u,\"max_queue_depth\":%u,\"queue_capacity\":%u,\"dropped_scans\":%llu},",
+		       name, queue->queueDepth.load(), queue->maxQueueDepth.load(), queue->queueCapacity.load(), queue->droppedScans.load());
+	else
+		printf("%s: Queue = %u of %u chunks (max %u), Dropped scans = %llu\n",
+		       name, queue->queueDepth.load(), queue->queueCapacity.load(), queue->maxQueueDepth.load(), queue->droppedScans.load());
+}
+
+StatsReporter::StatsReporter() : mStats(0), mLatencies(0), mPeriodSec(1.0), mLatencyPeriodSec(0), mLatencyReset(0),
+	mFormat(STATS_FORMAT_TEXT), mStartup(0), mRecorder(0), mPgSink(0), mXdf(0), mArrow(0), mRunning(0), mStartTime(0), mLastReport(0), mLastLatencyReport(0), mLastScans(0),
+	mLastAutoRecoverActive(0), mLastAutoRecoverEnd(0), mLastOtherStatus(0), mLastDummySamples(0), mLastMidScanDummies(0),
+	mLastScanOverlap(0), mLastAutoRecoverEndOverflow(0), mLastBurstComplete(0), mLastDroppedErrors(0), mLastRecordedBytes(0), mLastPgRows(0)
+{
+	int i = 0;
+	for(i = 0; i < STATS_NUM_SOCKETS; i++)
+	{
+		mSockets[i] = INVALID_SOCKET;
+		mMaxRxQueue[i] = -1;
+	}
+}
+
+StatsReporter::~StatsReporter()
+{
+	stop();
+}
+
+int StatsReporter::start(StreamStats *stats, StageLatencies *latencies, double periodSec, double latencyPeriodSec, int latencyReset, int format)
+{
+	if(mRunning.load())
+		return -1;
+	if(periodSec <= 0)
+	{
+		printf("StatsReporter::start error: Invalid report period %.3f\n", periodSec);
+		return -1;
+	}
+	mStats = stats;
+	mLatencies = latencies;
+	mPeriodSec = periodSec;
+	mLatencyPeriodSec = latencyPeriodSec;
+	mLatencyReset = latencyReset;
+	mFormat = format;
+	mStartTime = nowSec();
+	mLastReport = mStartTime;
+	mLastLatencyReport = mStartTime;
+
+	mRunning.store(1);
+	try
+	{
+		mThread = std::thread(&StatsReporter::run, this);
+	}
+	catch(std::exception &)
+	{
+		printf("StatsReporter::start error: Could not start the reporter thread\n");
+		mRunning.store(0);
+		return -1;
+	}
+	return 0;
+}
+
+void StatsReporter::watchSockets(TCP_SOCKET commandSock, TCP_SOCKET streamSock)
+{
+	mSockets[STATS_SOCKET_COMMAND] = commandSock;
+	mSockets[STATS_SOCKET_STREAM] = streamSock;
+}
+
+void StatsReporter::watchStartup(const StartupProfile *profile)
+{
+	mStartup = profile;
+}
+
+void StatsReporter::watchRecorder(const RecorderStats *recorder)
+{
+	mRecorder = recorder;
+}
+
+void StatsReporter::watchPgSink(const PgSinkStats *sink)
+{
+	mPgSink = sink;
+}
+
+void StatsReporter::watchXdf(const ChunkQueueStats *queue)
+{
+	mXdf = queue;
+}
+
+void StatsReporter::watchArrow(const ChunkQueueStats *queue)
+{
+	mArrow = queue;
+}
+
+void StatsReporter::sampleSockets()
+{
+	int i = 0;
+	int inq = 0;
+
+	for(i = 0; i < STATS_NUM_SOCKETS; i++)
+	{
+		if(mSockets[i] == INVALID_SOCKET)
+			continue;
+		statsSampleSocket(mStats, i, mSockets[i]);
+		inq = mStats->sockets[i].rxQueueBytes.load(std::memory_order_relaxed);
+		if(inq > mMaxRxQueue[i])
+			mMaxRxQueue[i] = inq;
+	}
+}
+
+void StatsReporter::stop()
+{
+	if(!mThread.joinable())
+		return;
+	mRunning.store(0);
+	mThread.join();
+	report(nowSec(), 1);
+	fflush(stdout);
+}
+
+void StatsReporter::run()
+{
+	double now = 0;
+	unsigned long long t0 = 0;
+
+	traceSetThreadName("stats reporter");
+	while(mRunning.load())
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(STATS_SOCKET_SAMPLE_MS));
+		sampleSockets();
+		if(mStartup && mStartup->complete.load(std::memory_order_acquire))
+		{
+			printStartupProfile(mStartup, mFormat);
+			fflush(stdout);
+			mStartup = NULL;
+		}
+		now = nowSec();
+		if(now - mLastReport >= mPeriodSec)
+		{
+			t0 = monotonicNs();
+			report(now, 0);
+			fflush(stdout);
+			traceSpan(TRACE_REPORT, t0, monotonicNs());
+			mLastReport = now;
+		}
+		traceDumpIfRequested();
+	}
+}
+
+void StatsReporter::report(double now, int final)
+{
+	const StreamStats *s = mStats;
+	float scan[MAX_NUM_STREAM_ADDR];
+	unsigned long long scanIndex = 0;
+	unsigned int n = 0;
+	unsigned int i = 0;
+	unsigned long long scans = s->scans.load(std::memory_order_relaxed);
+	unsigned long long active = s->autoRecoverActive.load(std::memory_order_relaxed);
+	unsigned long long end = s->autoRecoverEnd.load(std::memory_order_relaxed);
+	unsigned long long other = s->otherStatus.load(std::memory_order_relaxed);
+	unsigned long long dummies = s->dummySamples.load(std::memory_order_relaxed);
+	unsigned long long midDummies = s->midScanDummies.load(std::memory_order_relaxed);
+	unsigned long long overlap = s->scanOverlap.load(std::memory_order_relaxed);
+	unsigned long long overflow = s->autoRecoverEndOverflow.load(std::memory_order_relaxed);
+	unsigned long long burst = s->burstComplete.load(std::memory_order_relaxed);
+	unsigned long long droppedErrors = s->droppedErrors.load(std::memory_order_relaxed);
+	double elapsed = now - mLastReport;
+	double scanRate = elapsed > 0 ? (scans - mLastScans)/elapsed : 0;
+	unsigned long long recordedBytes = mRecorder ? mRecorder->bytesWritten.load(std::memory_order_relaxed) : 0;
+	double recordRate = elapsed > 0 ? (recordedBytes - mLastRecordedBytes)/elapsed/(1024.0*1024.0) : 0;
+	unsigned long long encodedBytes = mRecorder ? mRecorder->encodedBytes.load(std::memory_order_relaxed) : 0;
+	double recordRatio = encodedBytes > 0 ? (double)mRecorder->rawBytes.load(std::memory_order_relaxed)/encodedBytes : 1.0;
+	unsigned long long pgRows = mPgSink ? mPgSink->rowsWritten.load(std::memory_order_relaxed) : 0;
+	double pgRate = elapsed > 0 ? (pgRows - mLastPgRows)/elapsed : 0;
+
+	printErrors();
+	n = readLastScan(s, scan, &scanIndex);
+
+	if(mFormat == STATS_FORMAT_JSON)
+	{
+		printf("{\"time\":%.3f,\"final\":%s,\"packets\":%llu,\"bytes\":%llu,\"scans\":%llu,\"scan_rate\":%.3f,\"samples\":%llu,"
+		       "\"backlog\":%u,\"status\":%u,\"additional_info\":%u,\"auto_recover_active\":%llu,\"auto_recover_end\":%llu,"
+		       "\"scans_skipped\":%llu,\"scan_overlap\":%llu,\"auto_recover_end_overflow\":%llu,\"burst_complete\":%llu,"
+		       "\"other_status\":%llu,\"dummy_samples\":%llu,\"mid_scan_dummies\":%llu,\"read_errors\":%llu,"
+		       "\"packet_errors\":%llu,\"transaction_id_gaps\":%llu,\"pool_exhausted\":%llu,\"dropped_errors\":%llu,",
+		       now - mStartTime, final ? "true" : "false", s->packets.load(), s->bytes.load(), scans, scanRate, s->samples.load(),
+		       s->backlog.load(), s->status.load(), s->additionalInfo.load(), active, end,
+		       s->scansSkipped.load(), overlap, overflow, burst,
+		       other, dummies, midDummies, s->readErrors.load(),
+		       s->packetErrors.load(), s->transactionIdGaps.load(), s->poolExhausted.load(), droppedErrors);
+		if(mRecorder)
+		{
+			printf("\"recorder\":{\"bytes\":%llu,\"mb_per_sec\":%.3f,\"ratio\":%.3f,\"chunks\":%llu,\"queue_depth\":%u,\"max_queue_depth\":%u,"
+			       "\"queue_capacity\":%u,\"segment\":%u,\"dropped_scans\":%llu,\"write_errors\":%llu,\"write_sec\":%.3f},",
+			       recordedBytes, recordRate, recordRatio, mRecorder->chunksWritten.load(), mRecorder->queue.queueDepth.load(),
+			       mRecorder->queue.maxQueueDepth.load(), mRecorder->queue.queueCapacity.load(), mRecorder->segment.load(),
+			       mRecorder->queue.droppedScans.load(), mRecorder->writeErrors.load(), mRecorder->writeNs.load()/1e9);
+		}
+		if(mPgSink)
+		{
+			printf("\"postgres\":{\"rows\":%llu,\"rows_per_sec\":%.3f,\"batches\":%llu,\"last_batch_scans\":%u,\"queue_depth\":%u,"
+			       "\"max_queue_depth\":%u,\"queue_capacity\":%u,\"dropped_scans\":%llu,\"failed_scans\":%llu,\"errors\":%llu,"
+			       "\"connected\":%s,\"copy_sec\":%.3f},",
+			       pgRows, pgRate, mPgSink->batches.load(), mPgSink->lastBatchScans.load(), mPgSink->queue.queueDepth.load(),
+			       mPgSink->queue.maxQueueDepth.load(), mPgSink->queue.queueCapacity.load(), mPgSink->queue.droppedScans.load(), mPgSink->failedScans.load(),
+			       mPgSink->errors.load(), mPgSink->connected.load() ? "true" : "false", mPgSink->copyNs.load()/1e9);
+		}
+		if(mXdf)
+			printQueue("xdf", mXdf, mFormat);
+		if(mArrow)
+			printQueue("arrow", mArrow, mFormat);
+		printf("\"sockets\":{");
+		for(i = 0; i < STATS_NUM_SOCKETS; i++)
+		{
+			const SocketStats *sock = &s->sockets[i];
+			printf("%s\"%s\":{\"rx_queue_bytes\":%d,\"max_rx_queue_bytes\":%d,\"rtt_us\":%d,\"rtt_var_us\":%d,"
+			       "\"total_retrans\":%d,\"lost\":%d,\"rcv_space\":%d}", i ? "," : "", SOCKET_NAMES[i],
+			       sock->rxQueueBytes.load(), mMaxRxQueue[i], sock->rttUs.load(), sock->rttVarUs.load(),
+			       sock->totalRetrans.load(), sock->lost.load(), sock->rcvSpace.load());
+		}
+		printf("},\"last_scan_index\":%llu,\"last_scan\":[", scanIndex);
+		for(i = 0; i < n; i++)
+			printf(i ? ",%f" : "%f", scan[i]);
+		printf("]}\n");
+	}
+	else
+	{
+		if(active != mLastAutoRecoverActive)
+		{
+			//Stream buffer overload occured. In auto recovery mode. Reading
+			//existing samples from the T7's stream buffer which is still valid.
+			printf("\nReceived stream status 2940 - STREAM_AUTO_RECOVER_ACTIVE (%llu packets).\n", active - mLastAutoRecoverActive);
+		}
+		if(end != mLastAutoRecoverEnd)
+			printf("\nReceived stream status 2941 - STREAM_AUTO_RECOVER_END. %llu scans were skipped in total.\n", s->scansSkipped.load());
+		if(overlap != mLastScanOverlap)
+			printf("\nReceived stream status error 2942 - STREAM_SCAN_OVERLAP. Stopping stream.\n");
+		if(overflow != mLastAutoRecoverEndOverflow)
+			printf("\nReceived stream status error 2943 - STREAM_AUTO_RECOVER_END_OVERFLOW. Stopping stream.\n");
+		if(burst != mLastBurstComplete)
+			printf("Stream burst has completed\n");
+		if(other != mLastOtherStatus)
+			printf("\nReceived stream status %u (%llu packets)\n", s->status.load(), other - mLastOtherStatus);
+		if(dummies != mLastDummySamples)
+			printf("Dummy samples detected: %llu\n", dummies - mLastDummySamples);
+		if(midDummies != mLastMidScanDummies)
+			printf("\nReceived %llu dummy samples (0xFFFF) in the middle of a scan. Incomplete scans shouldn't happen.\n", midDummies - mLastMidScanDummies);
+		if(droppedErrors != mLastDroppedErrors)
+			printf("%llu stream errors were not printed\n", droppedErrors - mLastDroppedErrors);
+
+		if(n > 0)
+		{
+			printf("\nScan # %llu: ", scanIndex);
+			for(i = 0; i < n; i++)
+				printf("%f ", scan[i]);
+		}
+		printf("\nScan Backlog = %u, Status = %u, Additional Info. = %u, Scan Rate = %.3f\n",
+		       s->backlog.load(), s->status.load(), s->additionalInfo.load(), scanRate);
+		for(i = 0; i < STATS_NUM_SOCKETS; i++)
+		{
+			const SocketStats *sock = &s->sockets[i];
+			if(mSockets[i] == INVALID_SOCKET)
+				continue;
+			printf("Host %s socket: RX Queue = %d bytes (max %d), RTT = %d us (var %d), Retransmits = %d, Lost = %d, RCV Space = %d\n",
+			       SOCKET_NAMES[i], sock->rxQueueBytes.load(), mMaxRxQueue[i], sock->rttUs.load(), sock->rttVarUs.load(),
+			       sock->totalRetrans.load(), sock->lost.load(), sock->rcvSpace.load());
+		}
+		if(mRecorder)
+		{
+			printf("Recorder: %.3f MB/s, Ratio = %.2f, Queue = %u of %u chunks (max %u), Segment = %u, Dropped scans = %llu, Write errors = %llu\n",
+			       recordRate, recordRatio, mRecorder->queue.queueDepth.load(), mRecorder->queue.queueCapacity.load(), mRecorder->queue.maxQueueDepth.load(),
+			       mRecorder->segment.load(), mRecorder->queue.droppedScans.load(), mRecorder->writeErrors.load());
+		}
+		if(mPgSink)
+		{
+			printf("PostgreSQL: %.0f rows/s, Last batch = %u scans, Queue = %u of %u chunks (max %u), Dropped scans = %llu, Failed scans = %llu, Errors = %llu%s\n",
+			       pgRate, mPgSink->lastBatchScans.load(), mPgSink->queue.queueDepth.load(), mPgSink->queue.queueCapacity.load(), mPgSink->queue.maxQueueDepth.load(),
+			       mPgSink->queue.droppedScans.load(), mPgSink->failedScans.load(), mPgSink->errors.load(),
+			       mPgSink->connected.load() ? "" : ", disconnected");
+		}
+		if(mXdf)
+			printQueue("XDF", mXdf, mFormat);
+		if(mArrow)
+			printQueue("Arrow", mArrow, mFormat);
+	}
+
+	mLastScans = scans;
+	mLastAutoRecoverActive = active;
+	mLastAutoRecoverEnd = end;
+	mLastOtherStatus = other;
+	mLastDummySamples = dummies;
+	mLastMidScanDummies = midDummies;
+	mLastScanOverlap = overlap;
+	mLastAutoRecoverEndOverflow = overflow;
+	mLastBurstComplete = burst;
+	mLastDroppedErrors = droppedErrors;
+	mLastRecordedBytes = recordedBytes;
+	mLastPgRows = pgRows;
+	for(i = 0; i < STATS_NUM_SOCKETS; i++)
+		mMaxRxQueue[i] = mStats->sockets[i].rxQueueBytes.load(std::memory_order_relaxed);
+
+	if(mLatencies && (final || (mLatencyPeriodSec > 0 && now - mLastLatencyReport >= mLatencyPeriodSec)))
+	{
+		printLatencies();
+		if(mLatencyReset && !final)
+			requestStageLatenciesReset(mLatencies);
+		mLastLatencyReport = now;
+	}
+}
+
+void StatsReporter::printErrors()
+{
+	unsigned int tail = mStats->errorTail.load(std::memory_order_relaxed);
+	const StreamErrorRecord *rec = NULL;
+	int i = 0;
+
+	while(tail != mStats->errorHead.load(std::memory_order_acquire))
+	{
+		rec = &mStats->errors[tail % STATS_ERROR_SLOTS];
+		if(mFormat == STATS_FORMAT_JSON)
+		{
+			printf("{\"error\":\"%s\",\"size\":%d,\"packet\":\"", rec->error ? streamErrorString(rec->error) : "Stream read error", rec->size);
+			for(i = 0; i < rec->size && i < TCP_MAX_PACKET_BYTES; i++)
+				printf("%02X", rec->packet[i]);
+			printf("\"}\n");
+		}
+		else
+		{
+			printf("\nStream error: %s\n", rec->error ? streamErrorString(rec->error) : "Stream read error");
+			if(rec->size >= 0)
+				printPacket(rec->packet, rec->size < TCP_MAX_PACKET_BYTES ? rec->size : TCP_MAX_PACKET_BYTES);
+		}
+		tail++;
+		mStats->errorTail.store(tail, std::memory_order_release);
+	}
+}
+
+void StatsReporter::printLatencies()
+{
+	int i = 0;
+	const LatencyHistogram *hist = NULL;
+
+	if(mFormat != STATS_FORMAT_JSON)
+	{
+		printStageLatencies(mLatencies);
+		return;
+	}
+	printf("{\"latency_us\":{");
+	for(i = 0; i < LATENCY_NUM_STAGES; i++)
+	{
+		hist = &mLatencies->stages[i];
+		printf("%s\"%s\":{\"count\":%llu,\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}", i ? "," : "",
+		       latencyStageName(i), hist->total.load(std::memory_order_relaxed),
+		       latencyPercentile(hist, 50.0)/1000.0, latencyPercentile(hist, 99.0)/1000.0,
+		       latencyPercentile(hist, 99.9)/1000.0, hist->max.load(std::memory_order_relaxed)/1000.0);
+	}
+	printf("}}\n");
+}
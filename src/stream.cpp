@@ -4,7 +4,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define MAX_NUM_STREAM_ADDR 128
 #define MAX_NUM_STREAM_ADDR_PER_PKT 63  //When using Modbus Write/Read Multiple Registers 
 
 static unsigned short gCurTransID = 0; //The current stream responses transaction ID
@@ -234,11 +233,28 @@ int streamEnable(TCP_SOCKET sock, unsigned int enable)
 
 int streamStart(TCP_SOCKET sock)
 {
-	gCurTransID = 0; //Reset the current stream transaction ID
+	resetStreamTransactionID(); //Reset the current stream transaction ID
 	return streamEnable(sock, 1);
 }
 
 int spontaneousStreamRead(TCP_SOCKET sock, unsigned int samplesPerPacket, unsigned short *backlog, unsigned short *status, unsigned short *additionalInfo, unsigned char *rawData)
+{
+	unsigned char res[TCP_MAX_PACKET_BYTES]; //Max. size 1040
+
+	if(samplesPerPacket > STREAM_MAX_SAMPLES_PER_PACKET_TCP)
+	{
+		printf("spontaneousStreamRead error: Invalid samplesPerPacket (%u)\n", samplesPerPacket);
+		return -1;
+	}
+	if(spontaneousStreamReadPacket(sock, samplesPerPacket, res, backlog, status, additionalInfo) != 0)
+		return -1;
+
+	//streamData
+	memcpy(rawData, &res[STREAM_HEADER_BYTES], samplesPerPacket*STREAM_BYTES_PER_SAMPLE);
+	return 0;
+}
+
+int spontaneousStreamReadPacket(TCP_SOCKET sock, unsigned int samplesPerPacket, unsigned char *packet, unsigned short *backlog, unsigned short *status, unsigned short *additionalInfo)
 {
 	/*
 	Modbus Feedback Response:
@@ -261,51 +277,99 @@ int spontaneousStreamRead(TCP_SOCKET sock, unsigned int samplesPerPacket, unsign
 		2343: Auto Recovery End Overflow
 	*/
 
-	const unsigned char STREAM_TYPE = 16;
-	unsigned char *res;
 	int resSize = 0;
 	int size = 0;
-
 	int ret = 0;
-	resSize = 16+samplesPerPacket*STREAM_BYTES_PER_SAMPLE;
-	res = (unsigned char *)malloc(resSize); //Could also hardcode for max. size 1040
 
-	size = readTCP(sock, res, resSize);
+	resSize = STREAM_HEADER_BYTES+samplesPerPacket*STREAM_BYTES_PER_SAMPLE;
+
+	size = readTCP(sock, packet, resSize);
 	if(size <= 0)
+		return -1;
+
+	if((ret = parseStreamPacket(packet, size, backlog, status, additionalInfo)) != 0)
 	{
-		ret = -1;
-		goto end;
+		printf("arStreamRead error: %s\n", streamErrorString(ret));
+		printPacket(packet, size);
+		return -1;
 	}
+	return 0;
+}
 
-	//Check the response for errors and make sure the transaction ID is the expected one.
-	//The transaction ID increments in the response packets. If a transaction ID is skipped,
-	//that could indicate missing packets.
-	if(checkModbusResponse(res, size, gCurTransID, 76) != 0)
+int parseStreamPacket(const unsigned char *packet, int size, unsigned short *backlog, unsigned short *status, unsigned short *additionalInfo)
+{
+	const unsigned char STREAM_FUNCTION = 76;
+	const unsigned char STREAM_TYPE = 16;
+	unsigned short hLength = 0;
+	unsigned short transID = 0;
+
+	//Same checks as checkModbusResponse, without the printing.
+	if(size < 9)
+		return STREAM_ERROR_INCOMPLETE;
+	if(packet[7] != STREAM_FUNCTION)
 	{
-		ret = -1;
-		goto end;
+		if((STREAM_FUNCTION | 0x80) == packet[7])
+			return STREAM_ERROR_MODBUS_EXCEPTION;
+		return STREAM_ERROR_FUNCTION;
 	}
+	bytesToUint16(&packet[4], &hLength);
+	if(size < hLength + 6)
+		return STREAM_ERROR_LENGTH;
+	if(size < STREAM_HEADER_BYTES)
+		return STREAM_ERROR_INCOMPLETE;
+
+	//Make sure the transaction ID is the expected one. The transaction ID
+	//increments in the response packets. If a transaction ID is skipped,
+	//that could indicate missing packets.
+	bytesToUint16(packet, &transID);
+	if(transID != gCurTransID)
+		return STREAM_ERROR_TRANSACTION_ID;
 	gCurTransID++; //Expected next transaction ID 
 	
-	if(res[8] != STREAM_TYPE)
+	if(packet[8] != STREAM_TYPE)
+		return STREAM_ERROR_TYPE;
+
+	//packet[9]; //reserved
+	bytesToUint16(&packet[10], backlog);
+	bytesToUint16(&packet[12], status);
+	bytesToUint16(&packet[14], additionalInfo);
+	return 0;
+}
+
+const char *streamErrorString(int error)
+{
+	switch(error)
 	{
-		printf("arStreamRead error: Unexpected stream type %u\n", res[8]);
-		printPacket(res, resSize);
-		ret = -1;
-		goto end;
+	case 0: return "No error";
+	case STREAM_ERROR_INCOMPLETE: return "Incomplete stream response";
+	case STREAM_ERROR_FUNCTION: return "Unexpected Modbus response function code";
+	case STREAM_ERROR_MODBUS_EXCEPTION: return "Received Modbus exception";
+	case STREAM_ERROR_LENGTH: return "Packet size is smaller than the Modbus length";
+	case STREAM_ERROR_TRANSACTION_ID: return "Unexpected Modbus response transaction ID";
+	case STREAM_ERROR_TYPE: return "Unexpected stream type";
+	default: return "Unknown stream error";
 	}
+}
 
-	//res[9]; //reserved
-	bytesToUint16(&res[10], backlog);
-	bytesToUint16(&res[12], status);
-	bytesToUint16(&res[14], additionalInfo);
+void resetStreamTransactionID()
+{
+	gCurTransID = 0;
+}
 
-	//streamData
-	memcpy(rawData, &res[16], samplesPerPacket*STREAM_BYTES_PER_SAMPLE);
-	ret = 0;
-end:
-	free(res);
-	return ret;
+void buildStreamPacket(unsigned short transID, unsigned short backlog, unsigned short status, unsigned short additionalInfo, const unsigned char *rawData, unsigned int samplesPerPacket, unsigned char *packet)
+{
+	uint16ToBytes(transID, packet);
+	packet[2] = 0; //Protocol ID (MSB)
+	packet[3] = 0; //Protocol ID (LSB)
+	uint16ToBytes((unsigned short)(STREAM_HEADER_BYTES - 6 + samplesPerPacket*STREAM_BYTES_PER_SAMPLE), &packet[4]); //Bytes after the length field
+	packet[6] = 1; //Unit ID
+	packet[7] = 76; //Function #
+	packet[8] = 16; //Stream type
+	packet[9] = 0; //Reserved
+	uint16ToBytes(backlog, &packet[10]);
+	uint16ToBytes(status, &packet[12]);
+	uint16ToBytes(additionalInfo, &packet[14]);
+	memcpy(&packet[STREAM_HEADER_BYTES], rawData, samplesPerPacket*STREAM_BYTES_PER_SAMPLE);
 }
 
 int streamStop(TCP_SOCKET sock)
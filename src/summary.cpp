@@ -0,0 +1,205 @@
+#include "summary.h"
+#include <string.h>
+
+SummaryPyramid::SummaryPyramid() : mError(0)
+{
+	int i = 0;
+
+	memset(&mInfo, 0, sizeof(RecordingInfo));
+	for(i = 0; i < SUMMARY_LEVELS; i++)
+	{
+		mLevels[i].file = NULL;
+		mLevels[i].buffer = NULL;
+		reset(&mLevels[i]);
+	}
+}
+
+SummaryPyramid::~SummaryPyramid()
+{
+	close();
+}
+
+int SummaryPyramid::open(const char *prefix, const RecordingInfo *info, MemoryBudget *budget)
+{
+	SummaryFileHeader header;
+	char path[1024];
+	unsigned int decimation = SUMMARY_FACTOR;
+	int i = 0;
+
+	if(isOpen())
+		return -1;
+	if(reserveSinkMemory(budget, "Summaries", (unsigned long long)SUMMARY_LEVELS*SUMMARY_WRITE_BUFFER_BYTES) != 0)
+		return -1;
+	mInfo = *info;
+	mError = 0;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SUMMARY_MAGIC, SUMMARY_MAGIC_BYTES);
+	header.version = SUMMARY_VERSION;
+	header.byteOrderMark = SUMMARY_BYTE_ORDER_MARK;
+	header.headerBytes = sizeof(SummaryFileHeader);
+	header.recordBytes = sizeof(SummaryRecord) + info->numAddresses*sizeof(SummaryValue);
+	header.info = *info;
+	for(i = 0; i < SUMMARY_LEVELS; i++, decimation *= SUMMARY_FACTOR)
+	{
+		snprintf(path, sizeof(path), "%s_x%u%s", prefix, decimation, SUMMARY_SUFFIX);
+		mLevels[i].buffer = (char *)allocAligned(SUMMARY_WRITE_BUFFER_BYTES);
+		mLevels[i].file = fopen(path, "wb");
+		if(mLevels[i].buffer == NULL || mLevels[i].file == NULL)
+		{
+			printf("SummaryPyramid::open error: Could not create %s\n", path);
+			close();
+			return -1;
+		}
+		setvbuf(mLevels[i].file, mLevels[i].buffer, _IOFBF, SUMMARY_WRITE_BUFFER_BYTES);
+		header.decimation = decimation;
+		if(fwrite(&header, sizeof(header), 1, mLevels[i].file) != 1)
+		{
+			printf("SummaryPyramid::open error: Could not write %s\n", path);
+			close();
+			return -1;
+		}
+		reset(&mLevels[i]);
+	}
+	return 0;
+}
+
+void SummaryPyramid::reset(Level *level)
+{
+	unsigned int i = 0;
+
+	level->bin = 0;
+	level->lslTime = 0;
+	level->numScans = 0;
+	for(i = 0; i < mInfo.numAddresses; i++)
+	{
+		level->min[i] = 0xFFFF;
+		level->max[i] = 0;
+		level->sum[i] = 0;
+	}
+}
+
+void SummaryPyramid::add(const unsigned char *rawData, unsigned long long firstScan, double lslTime, unsigned int numScans)
+{
+	const unsigned int numAddresses = mInfo.numAddresses;
+	Level *level = &mLevels[0];
+	unsigned long long bin = 0;
+	unsigned short value = 0;
+	unsigned int addr = 0;
+	unsigned int i = 0;
+
+	if(!isOpen())
+		return;
+	for(i = 0; i < numScans; i++)
+	{
+		bin = (firstScan + i)/SUMMARY_FACTOR;
+		if(level->numScans > 0 && level->bin != bin)
+			emit(0);
+		if(level->numScans == 0)
+		{
+			level->bin = bin;
+			level->lslTime = lslTime + i/mInfo.scanRate;
+		}
+		for(addr = 0; addr < numAddresses; addr++, rawData += STREAM_BYTES_PER_SAMPLE)
+		{
+			value = (unsigned short)((rawData[0] << 8) | rawData[1]);
+			if(value < level->min[addr])
+				level->min[addr] = value;
+			if(value > level->max[addr])
+				level->max[addr] = value;
+			level->sum[addr] += value;
+		}
+		level->numScans++;
+	}
+}
+
+//Writes the running bin of a level, merges it into the next level and
+//starts a new one.
+void SummaryPyramid::emit(int index)
+{
+	const unsigned int numAddresses = mInfo.numAddresses;
+	Level *level = &mLevels[index];
+	Level *parent = index + 1 < SUMMARY_LEVELS ? &mLevels[index + 1] : NULL;
+	SummaryRecord record;
+	unsigned long long parentBin = 0;
+	unsigned int addr = 0;
+	int i = 0;
+
+	record.firstScan = level->bin;
+	for(i = 0; i <= index; i++)
+		record.firstScan *= SUMMARY_FACTOR;
+	record.lslTime = level->lslTime;
+	record.numScans = level->numScans;
+	record.reserved = 0;
+	for(addr = 0; addr < numAddresses; addr++)
+	{
+		mValues[addr].min = level->min[addr];
+		mValues[addr].max = level->max[addr];
+		mValues[addr].mean = (float)((double)level->sum[addr]/level->numScans);
+	}
+	if(fwrite(&record, sizeof(record), 1, level->file) != 1 || fwrite(mValues, sizeof(SummaryValue), numAddresses, level->file) != numAddresses)
+	{
+		if(!mError)
+			printf("SummaryPyramid error: The summaries are incomplete from scan %llu\n", record.firstScan);
+		mError = 1;
+	}
+
+	if(parent != NULL)
+	{
+		parentBin = level->bin/SUMMARY_FACTOR;
+		if(parent->numScans > 0 && parent->bin != parentBin)
+			emit(index + 1);
+		if(parent->numScans == 0)
+		{
+			parent->bin = parentBin;
+			parent->lslTime = level->lslTime;
+		}
+		for(addr = 0; addr < numAddresses; addr++)
+		{
+			if(level->min[addr] < parent->min[addr])
+				parent->min[addr] = level->min[addr];
+			if(level->max[addr] > parent->max[addr])
+				parent->max[addr] = level->max[addr];
+			parent->sum[addr] += level->sum[addr];
+		}
+		parent->numScans += level->numScans;
+	}
+	reset(level);
+}
+
+int SummaryPyramid::flush()
+{
+	int ret = 0;
+	int i = 0;
+
+	for(i = 0; i < SUMMARY_LEVELS; i++)
+	{
+		if(mLevels[i].file != NULL && fflush(mLevels[i].file) != 0)
+			ret = -1;
+	}
+	return ret;
+}
+
+void SummaryPyramid::close()
+{
+	int i = 0;
+
+	//Lower levels first, each one completes the next
+	for(i = 0; i < SUMMARY_LEVELS; i++)
+	{
+		if(mLevels[i].file != NULL && mLevels[i].numScans > 0)
+			emit(i);
+	}
+	for(i = 0; i < SUMMARY_LEVELS; i++)
+	{
+		if(mLevels[i].file != NULL && fclose(mLevels[i].file) != 0 && !mError)
+		{
+			printf("SummaryPyramid error: Could not write the summaries\n");
+			mError = 1;
+		}
+		mLevels[i].file = NULL;
+		freeAligned(mLevels[i].buffer);
+		mLevels[i].buffer = NULL;
+		reset(&mLevels[i]);
+	}
+}
@@ -1,6 +1,7 @@
 #include "tcp.h"
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
 
 #ifdef WIN32
 #include <winsock.h>
@@ -13,6 +14,11 @@
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <netdb.h>
+#include <sys/ioctl.h>
+#endif
+#ifdef __linux__
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
 #endif
 
 #define	DEBUG 0
@@ -114,10 +120,28 @@ int writeTCP(TCP_SOCKET sock, const unsigned char *packet, int size)
 	return ret;
 }
 
+//Receives until size bytes are read, the connection is closed or an error
+//occurs, since TCP can deliver a packet in several segments. Returns the
+//bytes read, or the recv result if nothing was read. An interrupted recv is
+//not retried so that Ctrl+C still stops a blocked read.
+static int recvAll(TCP_SOCKET sock, unsigned char *packet, int size)
+{
+	int done = 0;
+	int ret = 0;
+	while(done < size)
+	{
+		ret = recv(sock, (char *)&packet[done], size - done, 0);
+		if(ret <= 0)
+			return done > 0 ? done : ret;
+		done += ret;
+	}
+	return done;
+}
+
 int	readTCP(TCP_SOCKET sock, unsigned char *packet,	int	size)
 {
 	int ret = 0;
-	ret = recv(sock, (char *)packet, size, 0);
+	ret = recvAll(sock, packet, size);
 	if(ret != size)
 	{
         if(ret < 0 && errno == EINTR)
@@ -136,6 +160,62 @@ int	readTCP(TCP_SOCKET sock, unsigned char *packet,	int	size)
 	return ret;
 }
 
+int readTCPNoPrint(TCP_SOCKET sock, unsigned char *packet, int size)
+{
+	return recvAll(sock, packet, size);
+}
+
+int readQueueTCP(TCP_SOCKET sock)
+{
+#ifdef WIN32
+	u_long inq = 0;
+	if(ioctlsocket(sock, FIONREAD, &inq) != 0)
+		return -1;
+#elif defined(__linux__)
+	int inq = 0;
+	if(ioctl(sock, SIOCINQ, &inq) < 0)
+		return -1;
+#else
+	int inq = 0;
+	if(ioctl(sock, FIONREAD, &inq) < 0)
+		return -1;
+#endif
+	return (int)inq;
+}
+
+int getTCPSocketInfo(TCP_SOCKET sock, TCPSocketInfo *info)
+{
+#ifdef __linux__
+	struct tcp_info tcpi;
+	socklen_t tcpiSize = sizeof(tcpi);
+#endif
+
+	info->rxQueueBytes = -1;
+	info->rttUs = -1;
+	info->rttVarUs = -1;
+	info->totalRetrans = -1;
+	info->lost = -1;
+	info->rcvSpace = -1;
+	if(sock == INVALID_SOCKET)
+		return -1;
+
+	info->rxQueueBytes = readQueueTCP(sock);
+	if(info->rxQueueBytes < 0)
+		return -1;
+
+#ifdef __linux__
+	memset(&tcpi, 0, sizeof(tcpi));
+	if(getsockopt(sock, IPPROTO_TCP, TCP_INFO, &tcpi, &tcpiSize) < 0)
+		return -1;
+	info->rttUs = (int)tcpi.tcpi_rtt;
+	info->rttVarUs = (int)tcpi.tcpi_rttvar;
+	info->totalRetrans = (int)tcpi.tcpi_total_retrans;
+	info->lost = (int)tcpi.tcpi_lost;
+	info->rcvSpace = (int)tcpi.tcpi_rcv_space;
+#endif
+	return 0;
+}
+
 int	closeTCP(TCP_SOCKET	sock)
 {
 	int err = 0;
@@ -0,0 +1,187 @@
+#include "trace.h"
+#include "budget.h"
+#include "latency.h"
+#include <stdio.h>
+#include <string.h>
+
+typedef struct
+{
+	unsigned long long begin; //ns
+	unsigned long long end; //ns, begin for instant events
+	int name;
+} TraceSpan;
+
+//Ring of one thread. Only that thread writes it.
+typedef struct
+{
+	TraceSpan *spans;
+	std::atomic<unsigned long long> head; //Spans recorded so far
+	char threadName[TRACE_MAX_THREAD_NAME];
+} TraceRing;
+
+static const char *TRACE_NAMES[TRACE_NUM_NAMES] = {"spontaneousStreamRead", "validate", "convert", "assemble",
+	"push_chunk", "auto recover", "stats report", "metrics scrape", "record chunk"};
+static const char *TRACE_CATEGORIES[TRACE_NUM_NAMES] = {"stream", "stream", "publish", "publish",
+	"publish", "status", "report", "report", "record"};
+
+std::atomic<int> gTraceEnabled(0);
+static TraceRing gRings[TRACE_MAX_THREADS];
+static std::atomic<int> gNumRings(0);
+static unsigned int gRingSize = 0; //Power of 2
+static std::atomic<int> gDumpRequested(0);
+static char gDumpPath[256] = "lslpub_trace.json";
+static thread_local TraceRing *tRing = NULL;
+
+int traceInit(unsigned int eventsPerThread)
+{
+	unsigned int size = 1;
+	int i = 0;
+
+	if(gTraceEnabled.load() || eventsPerThread == 0)
+		return -1;
+	while(size < eventsPerThread)
+		size <<= 1;
+	for(i = 0; i < TRACE_MAX_THREADS; i++)
+	{
+		gRings[i].spans = (TraceSpan *)allocAligned((unsigned long long)size*sizeof(TraceSpan));
+		if(gRings[i].spans == NULL)
+		{
+			printf("traceInit error: Could not allocate the trace rings (%u spans per thread)\n", size);
+			while(--i >= 0)
+			{
+				freeAligned(gRings[i].spans);
+				gRings[i].spans = NULL;
+			}
+			return -1;
+		}
+		gRings[i].head.store(0);
+		gRings[i].threadName[0] = '\0';
+	}
+	gRingSize = size;
+	gTraceEnabled.store(1);
+	return 0;
+}
+
+//Returns the ring of the calling thread, claiming one on first use. NULL if
+//all are taken.
+static TraceRing *threadRing()
+{
+	int index = 0;
+
+	if(tRing)
+		return tRing;
+	index = gNumRings.fetch_add(1);
+	if(index >= TRACE_MAX_THREADS)
+		return NULL;
+	tRing = &gRings[index];
+	if(tRing->threadName[0] == '\0')
+		snprintf(tRing->threadName, TRACE_MAX_THREAD_NAME, "thread %d", index);
+	return tRing;
+}
+
+void traceSetThreadName(const char *name)
+{
+	TraceRing *ring = NULL;
+
+	if(!gTraceEnabled.load())
+		return;
+	ring = threadRing();
+	if(ring == NULL)
+		return;
+	strncpy(ring->threadName, name, TRACE_MAX_THREAD_NAME-1);
+	ring->threadName[TRACE_MAX_THREAD_NAME-1] = '\0';
+}
+
+void traceRecord(int name, unsigned long long beginNs, unsigned long long endNs)
+{
+	TraceRing *ring = threadRing();
+	unsigned long long head = 0;
+	TraceSpan *span = NULL;
+
+	if(ring == NULL)
+		return;
+	head = ring->head.load(std::memory_order_relaxed);
+	span = &ring->spans[head & (gRingSize - 1)];
+	span->begin = beginNs;
+	span->end = endNs;
+	span->name = name;
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+int traceDump(const char *path)
+{
+	FILE *file = NULL;
+	const TraceRing *ring = NULL;
+	const TraceSpan *span = NULL;
+	TraceSpan copy;
+	unsigned long long head = 0, first = 0, i = 0;
+	unsigned long long dumped = 0;
+	int numRings = gNumRings.load();
+	int r = 0;
+
+	if(!gTraceEnabled.load())
+		return -1;
+	file = fopen(path, "w");
+	if(file == NULL)
+	{
+		printf("traceDump error: Could not open %s\n", path);
+		return -1;
+	}
+	if(numRings > TRACE_MAX_THREADS)
+		numRings = TRACE_MAX_THREADS;
+
+	fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"lslpub_LabJack\"}}");
+	for(r = 0; r < numRings; r++)
+	{
+		ring = &gRings[r];
+		fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", r + 1, ring->threadName);
+
+		head = ring->head.load(std::memory_order_acquire);
+		first = head > gRingSize ? head - gRingSize : 0;
+		for(i = first; i < head; i++)
+		{
+			span = &ring->spans[i & (gRingSize - 1)];
+			copy.begin = span->begin;
+			copy.end = span->end;
+			copy.name = span->name;
+			//Skip the spans the thread may have overwritten while copying.
+			if(ring->head.load(std::memory_order_acquire) - i > gRingSize)
+				continue;
+			if(copy.name < 0 || copy.name >= TRACE_NUM_NAMES)
+				continue;
+			if(copy.name == TRACE_AUTO_RECOVER)
+				fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%d}",
+				        TRACE_NAMES[copy.name], TRACE_CATEGORIES[copy.name], copy.begin/1000.0, r + 1);
+			else
+				fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+				        TRACE_NAMES[copy.name], TRACE_CATEGORIES[copy.name], copy.begin/1000.0, (copy.end - copy.begin)/1000.0, r + 1);
+			dumped++;
+		}
+	}
+	fprintf(file, "\n]}\n");
+	if(fclose(file) != 0)
+	{
+		printf("traceDump error: Could not write %s\n", path);
+		return -1;
+	}
+	printf("Wrote %llu trace events of %d threads to %s\n", dumped, numRings, path);
+	return 0;
+}
+
+void traceRequestDump()
+{
+	gDumpRequested.store(1);
+}
+
+void traceSetDumpPath(const char *path)
+{
+	strncpy(gDumpPath, path, sizeof(gDumpPath)-1);
+	gDumpPath[sizeof(gDumpPath)-1] = '\0';
+}
+
+void traceDumpIfRequested()
+{
+	if(gDumpRequested.exchange(0))
+		traceDump(gDumpPath);
+}
@@ -0,0 +1,297 @@
+#include "xdf.h"
+#include <lsl_cpp.h>
+#include <exception>
+#include <string.h>
+#include <time.h>
+
+//Content of the boundary chunks, from the XDF specification.
+static const unsigned char BOUNDARY_UUID[16] = {0x43, 0xA5, 0x46, 0xDC, 0xCB, 0xF5, 0x41, 0x0F,
+                                                0xB3, 0x0E, 0xD5, 0x46, 0x73, 0x83, 0xCB, 0xE4};
+
+//XDF values are little endian, written as is from a little endian host.
+static int isLittleEndian()
+{
+	const unsigned int one = 1;
+	return *(const unsigned char *)&one == 1;
+}
+
+//Writes a variable length integer: its byte count (1, 4 or 8), then its
+//value. Returns the bytes written.
+static unsigned int putLength(unsigned char *out, unsigned long long value)
+{
+	unsigned int bytes = value <= 0xFFULL ? 1 : (value <= 0xFFFFFFFFULL ? 4 : 8);
+	unsigned int i = 0;
+
+	out[0] = (unsigned char)bytes;
+	for(i = 0; i < bytes; i++)
+		out[1 + i] = (unsigned char)(value >> (8*i));
+	return 1 + bytes;
+}
+
+XdfWriter::XdfWriter() : mArena(NULL), mOut(NULL), mOutBytes(0), mScansWritten(0), mFile(NULL), mError(0), mFirstTime(0),
+	mLastTime(0), mNextOffset(0), mNextBoundary(0)
+{
+	mPath[0] = '\0';
+	mQueueStats.droppedScans.store(0);
+}
+
+XdfWriter::~XdfWriter()
+{
+	close();
+}
+
+int XdfWriter::open(const char *path, const std::string &streamXml, float scanRate, unsigned int numAddresses, MemoryBudget *budget)
+{
+	const unsigned int streamId = XDF_STREAM_ID;
+	char datetime[64];
+	std::string fileXml;
+	std::string streamHeader;
+	unsigned long long arenaBytes = 0;
+	time_t now = time(NULL);
+
+	if(isOpen() || numAddresses == 0 || scanRate <= 0)
+	{
+		printf("XdfWriter::open error: Invalid stream configuration.\n");
+		return -1;
+	}
+	if(!isLittleEndian())
+	{
+		printf("XdfWriter::open error: Writing XDF needs a little endian host.\n");
+		return -1;
+	}
+	strncpy(mPath, path, sizeof(mPath) - 1);
+	mPath[sizeof(mPath) - 1] = '\0';
+	mScanRate = scanRate;
+	mNumAddresses = numAddresses;
+	mChunkScans = (unsigned int)(XDF_CHUNK_SEC*scanRate + 0.5);
+	if(mChunkScans == 0)
+		mChunkScans = 1;
+	mChunkBytes = (unsigned int)((sizeof(ScanChunkHeader) + (unsigned long long)mChunkScans*numAddresses*sizeof(float) + 63) & ~63ULL);
+	mNumChunks = (unsigned int)(XDF_QUEUE_SEC/XDF_CHUNK_SEC + 0.5);
+	if(mNumChunks < XDF_MIN_CHUNKS)
+		mNumChunks = XDF_MIN_CHUNKS;
+
+	//Chunk buffers, then the Samples chunk: stream ID, sample count, one
+	//timestamp and a timestamp byte count per sample
+	mOutBytes = 4 + 9 + 8 + (unsigned long long)mChunkScans*(1 + numAddresses*sizeof(float));
+	arenaBytes = (unsigned long long)mNumChunks*mChunkBytes + mOutBytes;
+	if(reserveSinkMemory(budget, "XDF writer", arenaBytes) != 0)
+		return -1;
+	mArena = (unsigned char *)allocAligned((size_t)arenaBytes);
+	if(mArena == NULL)
+		return -1;
+	mChunks = mArena;
+	mOut = mChunks + (size_t)mNumChunks*mChunkBytes;
+
+	mFile = fopen(path, "wb");
+	if(mFile == NULL)
+	{
+		printf("XdfWriter::open error: Could not create %s\n", path);
+		freeAligned(mArena);
+		mArena = NULL;
+		return -1;
+	}
+	strftime(datetime, sizeof(datetime), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+	mError = 0;
+	try
+	{
+		fileXml = std::string("<?xml version=\"1.0\"?><info><version>1.0</version><datetime>") + datetime + "</datetime></info>";
+		streamHeader = streamXml;
+		streamHeader.insert(0, (const char *)&streamId, 4);
+	}
+	catch(std::exception &)
+	{
+		mError = 1;
+	}
+	if(mError || fwrite("XDF:", 4, 1, mFile) != 1 ||
+	   writeChunk(XDF_TAG_FILE_HEADER, (const unsigned char *)fileXml.data(), fileXml.size()) != 0 ||
+	   writeChunk(XDF_TAG_STREAM_HEADER, (const unsigned char *)streamHeader.data(), streamHeader.size()) != 0)
+		mError = 1;
+	if(mError)
+	{
+		printf("XdfWriter::open error: Could not write %s\n", path);
+		fclose(mFile);
+		mFile = NULL;
+		freeAligned(mArena);
+		mArena = NULL;
+		return -1;
+	}
+
+	mScansWritten.store(0);
+	mFirstTime = 0;
+	mLastTime = 0;
+	mNextOffset = 0;
+	mNextBoundary = lsl::local_clock() + XDF_BOUNDARY_SEC;
+	mOffsetTimes.clear();
+	if(openQueue(&mQueueStats, "xdf writer") != 0)
+	{
+		printf("XdfWriter::open error: Could not start the writer thread\n");
+		fclose(mFile);
+		mFile = NULL;
+		freeAligned(mArena);
+		mArena = NULL;
+		return -1;
+	}
+	printf("Writing XDF to %s: %u scans per chunk, %u chunk buffers (%.1f MB)\n",
+	       mPath, mChunkScans, mNumChunks, arenaBytes/(1024.0*1024.0));
+	return 0;
+}
+
+void XdfWriter::write(const float *scans, unsigned int numScans, unsigned long long firstScan, double lastScanTime)
+{
+	if(mArena != NULL)
+		appendScans(scans, numScans, firstScan, lastScanTime);
+}
+
+void XdfWriter::close()
+{
+	if(mArena == NULL)
+		return;
+	closeQueue();
+	printf("XDF: %llu scans written to %s, %llu dropped%s\n", mScansWritten.load(), mPath, mQueueStats.droppedScans.load(),
+	       mError ? ", write errors" : "");
+	freeAligned(mArena);
+	mArena = NULL;
+	mChunks = NULL;
+	mOut = NULL;
+}
+
+int XdfWriter::writeChunk(unsigned short tag, const unsigned char *content, unsigned long long bytes)
+{
+	unsigned char header[11];
+	unsigned int size = putLength(header, bytes + 2);
+
+	header[size++] = (unsigned char)tag;
+	header[size++] = (unsigned char)(tag >> 8);
+	if(fwrite(header, size, 1, mFile) != 1 || (bytes > 0 && fwrite(content, (size_t)bytes, 1, mFile) != 1))
+		return -1;
+	return 0;
+}
+
+//One Samples chunk per chunk buffer: the first sample has a timestamp, the
+//next ones are deduced from the nominal rate.
+int XdfWriter::writeSamples(const ScanChunkHeader *header)
+{
+	const unsigned int streamId = XDF_STREAM_ID;
+	const unsigned int scanBytes = mNumAddresses*sizeof(float);
+	const unsigned char *scan = (const unsigned char *)header + sizeof(ScanChunkHeader);
+	unsigned char *out = mOut;
+	unsigned int i = 0;
+
+	memcpy(out, &streamId, 4);
+	out += 4;
+	out += putLength(out, header->numScans);
+	for(i = 0; i < header->numScans; i++, scan += scanBytes)
+	{
+		if(i == 0)
+		{
+			*out++ = 8;
+			memcpy(out, &header->firstTime, 8);
+			out += 8;
+		}
+		else
+			*out++ = 0;
+		memcpy(out, scan, scanBytes);
+		out += scanBytes;
+	}
+	return writeChunk(XDF_TAG_SAMPLES, mOut, (unsigned long long)(out - mOut));
+}
+
+//The scans are stamped with the clock of this host, the offset is 0.
+int XdfWriter::writeClockOffset(double now)
+{
+	const unsigned int streamId = XDF_STREAM_ID;
+	const double offset = 0.0;
+	unsigned char content[20];
+
+	memcpy(content, &streamId, 4);
+	memcpy(content + 4, &now, 8);
+	memcpy(content + 12, &offset, 8);
+	try
+	{
+		mOffsetTimes.push_back(now);
+	}
+	catch(std::exception &)
+	{
+	}
+	return writeChunk(XDF_TAG_CLOCK_OFFSET, content, sizeof(content));
+}
+
+int XdfWriter::writeBoundary()
+{
+	return writeChunk(XDF_TAG_BOUNDARY, BOUNDARY_UUID, sizeof(BOUNDARY_UUID));
+}
+
+int XdfWriter::writeFooter()
+{
+	const unsigned int streamId = XDF_STREAM_ID;
+	char value[128];
+	std::string xml;
+	size_t i = 0;
+
+	try
+	{
+		snprintf(value, sizeof(value), "<first_timestamp>%.6f</first_timestamp><last_timestamp>%.6f</last_timestamp><sample_count>%llu</sample_count>",
+		         mFirstTime, mLastTime, mScansWritten.load());
+		xml = std::string("<?xml version=\"1.0\"?><info>") + value + "<clock_offsets>";
+		for(i = 0; i < mOffsetTimes.size(); i++)
+		{
+			snprintf(value, sizeof(value), "<offset><time>%.6f</time><value>0</value></offset>", mOffsetTimes[i]);
+			xml += value;
+		}
+		xml += "</clock_offsets></info>";
+		xml.insert(0, (const char *)&streamId, 4);
+	}
+	catch(std::exception &)
+	{
+		return -1;
+	}
+	return writeChunk(XDF_TAG_STREAM_FOOTER, (const unsigned char *)xml.data(), xml.size());
+}
+
+//Clock offsets and boundaries go between the Samples chunks.
+void XdfWriter::poll()
+{
+	double now = lsl::local_clock();
+
+	if(now >= mNextOffset)
+	{
+		if(writeClockOffset(now) != 0)
+			mError = 1;
+		mNextOffset = now + XDF_CLOCK_OFFSET_SEC;
+	}
+	if(now >= mNextBoundary)
+	{
+		if(writeBoundary() != 0)
+			mError = 1;
+		mNextBoundary = now + XDF_BOUNDARY_SEC;
+	}
+}
+
+void XdfWriter::idle()
+{
+	fflush(mFile);
+}
+
+unsigned int XdfWriter::writeChunks(unsigned long long first, unsigned int)
+{
+	const ScanChunkHeader *header = (const ScanChunkHeader *)chunk(first);
+
+	if(writeSamples(header) == 0)
+	{
+		if(mScansWritten.load(std::memory_order_relaxed) == 0)
+			mFirstTime = header->firstTime;
+		mLastTime = header->firstTime + (header->numScans - 1)/mScanRate;
+		mScansWritten.store(mScansWritten.load(std::memory_order_relaxed) + header->numScans, std::memory_order_relaxed);
+	}
+	else
+		mError = 1;
+	return 1;
+}
+
+void XdfWriter::finish()
+{
+	if(writeFooter() != 0 || fclose(mFile) != 0)
+		mError = 1;
+	mFile = NULL;
+}